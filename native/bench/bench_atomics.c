@@ -0,0 +1,202 @@
+// Copyright 2021 Tea Engineering Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <libchronicle.h>
+#include <time.h>
+#include <ftw.h>
+
+// Cost of the entry header protocol: walking a block of headers as parse_queue_block
+// does and publishing entries as the appender does, with a full mfence per header
+// (as libchronicle used to) against __atomic acquire loads and release stores, and
+// the lock cmpxchg asm against __atomic_compare_exchange_n. Then a single-threaded
+// append and tail through the library, for the per-message cost that results.
+//
+//   bench_atomics [-n iterations] [dir]
+//
+// The mfence and asm variants are x86 only. dir defaults to /dev/shm.
+
+#define MSG 64
+#define BLOCK (1 << 20)
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// keeps results live so the compiler cannot drop the work
+volatile uint64_t sink;
+
+#define BENCH(label, ops, body) do { \
+        uint64_t t0_ = now_ns(); \
+        body; \
+        uint64_t t1_ = now_ns(); \
+        printf("%-36s %8.2f ns/op\n", label, (double)(t1_ - t0_) / (ops)); \
+    } while (0)
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint32_t header_load_mfence(unsigned char* p) {
+    uint32_t header;
+    memcpy(&header, p, sizeof(header));
+    asm volatile ("mfence" ::: "memory");
+    return header;
+}
+
+static inline void header_store_mfence(unsigned char* p, uint32_t header) {
+    asm volatile ("mfence" ::: "memory");
+    memcpy(p, &header, sizeof(header));
+}
+
+static inline uint32_t cas_asm(unsigned char *mem, uint32_t newval, uint32_t oldval) {
+    uint32_t ret;
+    __asm __volatile ("lock; cmpxchgl %2, %1"
+    : "=a" (ret), "+m" (*(uint32_t*)mem)
+    : "r" (newval), "0" (oldval)
+    : "memory");
+    return ret;
+}
+#endif
+
+static inline uint32_t header_load_acquire(unsigned char* p) {
+    return __atomic_load_n((uint32_t*)p, __ATOMIC_ACQUIRE);
+}
+
+static inline void header_store_release(unsigned char* p, uint32_t header) {
+    __atomic_store_n((uint32_t*)p, header, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t cas_atomic(unsigned char* mem, uint32_t newval, uint32_t oldval) {
+    __atomic_compare_exchange_n((uint32_t*)mem, &oldval, newval, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return oldval;
+}
+
+// walk the headers of a block of MSG byte entries, touching each payload
+#define WALK(load) do { \
+        for (int i_ = 0; i_ < iters; i_++) { \
+            unsigned char* p_ = block; \
+            while (p_ + MSG <= block + BLOCK) { \
+                uint32_t h_ = load(p_); \
+                acc += h_ + p_[4]; \
+                p_ += 4 + (h_ & 0x3FFFFFFF); \
+            } \
+        } \
+    } while (0)
+
+// write each entry's payload, then publish its header
+#define PUBLISH(store) do { \
+        for (int i_ = 0; i_ < iters; i_++) { \
+            for (unsigned char* p_ = block; p_ + MSG <= block + BLOCK; p_ += MSG) { \
+                memcpy(p_ + 4, &acc, sizeof(acc)); \
+                store(p_, MSG - 4); \
+            } \
+        } \
+    } while (0)
+
+#define CLAIM(cas) do { \
+        for (int i_ = 0; i_ < iters; i_++) { \
+            for (unsigned char* p_ = block; p_ + MSG <= block + BLOCK; p_ += MSG) { \
+                acc += cas(p_, 0x40000000, 0); \
+            } \
+            memset(block, 0, BLOCK); \
+        } \
+    } while (0)
+
+COBJ parse_msg(unsigned char* base, int lim) {
+    return base;
+}
+
+size_t sizeof_msg(COBJ msg) {
+    return MSG - 4;
+}
+
+void write_msg(unsigned char* base, COBJ msg, size_t sz) {
+    memcpy(base, msg, sz);
+}
+
+int count_msg(void* ctx, uint64_t index, COBJ msg) {
+    (*(uint64_t*)ctx)++;
+    return 0;
+}
+
+static int rm_entry(const char *path, const struct stat *sb, int type, struct FTW *ftwb) {
+    return remove(path);
+}
+
+int main(const int argc, char **argv) {
+    int iters = 20;
+    int c;
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+        case 'n': iters = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [dir]\n", argv[0]);
+            exit(1);
+        }
+    }
+    char* dir = optind < argc ? argv[optind] : "/dev/shm";
+    uint64_t entries = (uint64_t)iters * (BLOCK / MSG);
+    uint64_t acc = 0;
+
+    unsigned char* block = aligned_alloc(64, BLOCK);
+    for (unsigned char* p = block; p + MSG <= block + BLOCK; p += MSG) {
+        uint32_t header = MSG - 4;
+        memcpy(p, &header, sizeof(header));
+        memset(p + 4, 0x5A, MSG - 4);
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    BENCH("header read, mfence", entries, WALK(header_load_mfence));
+#endif
+    BENCH("header read, acquire", entries, WALK(header_load_acquire));
+#if defined(__x86_64__) || defined(__i386__)
+    BENCH("header publish, mfence", entries, PUBLISH(header_store_mfence));
+#endif
+    BENCH("header publish, release", entries, PUBLISH(header_store_release));
+    memset(block, 0, BLOCK);
+#if defined(__x86_64__) || defined(__i386__)
+    BENCH("header claim, lock cmpxchg asm", entries, CLAIM(cas_asm));
+#endif
+    BENCH("header claim, __atomic cas", entries, CLAIM(cas_atomic));
+    sink = acc;
+    free(block);
+
+    // through the library: each message appended, then read back by a tailer
+    char* qdir;
+    asprintf(&qdir, "%s/bench_atomics.XXXXXX", dir);
+    if (mkdtemp(qdir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    queue_t* queue = chronicle_init(qdir);
+    chronicle_set_version(queue, 5);
+    chronicle_set_roll_scheme(queue, "FAST_DAILY");
+    chronicle_set_create(queue, 1);
+    chronicle_set_decoder(queue, &parse_msg, NULL);
+    chronicle_set_encoder(queue, &sizeof_msg, &write_msg);
+    if (chronicle_open(queue) != 0) return 1;
+    unsigned char payload[MSG] = {0};
+    tailer_t* appender = chronicle_appender_open(queue);
+    uint64_t start = chronicle_appender_append(appender, payload) + 1;
+    uint64_t seen = 0;
+    tailer_t* tailer = chronicle_tailer(queue, &count_msg, &seen, start);
+    uint64_t n = entries / 4;
+    BENCH("library append", n, for (uint64_t i = 0; i < n; i++) chronicle_appender_append(appender, payload));
+    BENCH("library tail", n, while (seen < n) chronicle_peek_tailer(tailer));
+    chronicle_tailer_close(tailer);
+    chronicle_appender_close(appender);
+    chronicle_cleanup(queue);
+    nftw(qdir, rm_entry, 10, FTW_DEPTH|FTW_PHYS);
+    free(qdir);
+    return 0;
+}
@@ -0,0 +1,173 @@
+// Copyright 2021 Tea Engineering Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <libchronicle.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <ftw.h>
+
+// One-way append to dispatch latency between a writer thread and a busy-polling
+// reactor, pinned to the same numa node and then to different nodes. The queue
+// is created on the writer's node with chronicle_set_numa_node.
+//
+//   bench_numa [-n count] [-w writer_cpu] [-r reader_cpu] [-N] [dir]
+//
+// With no cpus given, runs a same-node pair and (if there is more than one node)
+// a cross-node pair. -N disables numa placement of the queue, for comparison.
+// dir defaults to /dev/shm.
+
+typedef struct {
+    uint64_t* lat;
+    uint64_t  n;
+} latencies_t;
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// zero-copy: the dispatcher reads the stamp straight from the mapped queue
+COBJ parse_stamp(unsigned char* base, int lim) {
+    return base;
+}
+
+size_t sizeof_stamp(COBJ msg) {
+    return sizeof(uint64_t);
+}
+
+void write_stamp(unsigned char* base, COBJ msg, size_t sz) {
+    uint64_t stamp = now_ns();
+    memcpy(base, &stamp, sizeof(stamp));
+}
+
+int record_latency(void* ctx, uint64_t index, COBJ msg) {
+    latencies_t* l = (latencies_t*)ctx;
+    uint64_t stamp;
+    memcpy(&stamp, msg, sizeof(stamp));
+    l->lat[l->n] = now_ns() - stamp;
+    __atomic_store_n(&l->n, l->n + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(uint64_t*)a, y = *(uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int rm_entry(const char *path, const struct stat *sb, int type, struct FTW *ftwb) {
+    return remove(path);
+}
+
+int run(char* dir, int writer_cpu, int reader_cpu, uint64_t count, int numa) {
+    char* qdir;
+    asprintf(&qdir, "%s/bench_numa.XXXXXX", dir);
+    if (mkdtemp(qdir) == NULL) {
+        perror("mkdtemp");
+        return -1;
+    }
+    int writer_node = chronicle_numa_node_of_cpu(writer_cpu);
+
+    queue_t* queue = chronicle_init(qdir);
+    chronicle_set_version(queue, 5);
+    chronicle_set_roll_scheme(queue, "DAILY");
+    chronicle_set_create(queue, 1);
+    chronicle_set_decoder(queue, &parse_stamp, NULL);
+    chronicle_set_encoder(queue, &sizeof_stamp, &write_stamp);
+    if (numa && writer_node >= 0) chronicle_set_numa_node(queue, writer_node);
+    if (chronicle_open(queue) != 0) return -1;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(writer_cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    tailer_t* appender = chronicle_appender_open(queue);
+    uint64_t start = chronicle_appender_append(appender, NULL) + 1; // creates the queuefile
+
+    latencies_t l;
+    l.lat = calloc(count, sizeof(uint64_t));
+    l.n = 0;
+    tailer_t* tailer = chronicle_tailer(queue, &record_latency, &l, start);
+    reactor_t* reactor = chronicle_reactor_init(RW_BUSY_POLL, reader_cpu);
+    chronicle_reactor_add(reactor, tailer);
+    if (chronicle_reactor_start(reactor) != 0) return -1;
+
+    for (uint64_t i = 0; i < count; i++) {
+        chronicle_appender_append(appender, NULL);
+        // wait for delivery, so we measure latency rather than queueing
+        while (__atomic_load_n(&l.n, __ATOMIC_ACQUIRE) <= i) sched_yield();
+    }
+    chronicle_reactor_close(reactor);
+    chronicle_appender_close(appender);
+    chronicle_cleanup(queue);
+
+    qsort(l.lat, count, sizeof(uint64_t), &cmp_u64);
+    printf("writer cpu %3d (node %2d) reader cpu %3d (node %2d) placement %-4s  p50 %6" PRIu64 "ns  p99 %6" PRIu64 "ns  p99.9 %6" PRIu64 "ns  max %8" PRIu64 "ns\n",
+        writer_cpu, writer_node, reader_cpu, chronicle_numa_node_of_cpu(reader_cpu), numa && writer_node >= 0 ? "node" : "none",
+        l.lat[count/2], l.lat[count*99/100], l.lat[count*999/1000], l.lat[count-1]);
+
+    free(l.lat);
+    nftw(qdir, rm_entry, 10, FTW_DEPTH|FTW_PHYS);
+    free(qdir);
+    return 0;
+}
+
+int main(const int argc, char **argv) {
+    uint64_t count = 100000;
+    int writer_cpu = -1;
+    int reader_cpu = -1;
+    int numa = 1;
+    int c;
+    while ((c = getopt(argc, argv, "n:w:r:N")) != -1) {
+        switch (c) {
+        case 'n': count = strtoull(optarg, NULL, 10); break;
+        case 'w': writer_cpu = atoi(optarg); break;
+        case 'r': reader_cpu = atoi(optarg); break;
+        case 'N': numa = 0; break;
+        default:
+            fprintf(stderr, "usage: %s [-n count] [-w writer_cpu] [-r reader_cpu] [-N] [dir]\n", argv[0]);
+            exit(1);
+        }
+    }
+    char* dir = optind < argc ? argv[optind] : "/dev/shm";
+    if (count == 0) count = 1;
+
+    if (writer_cpu >= 0 && reader_cpu >= 0) {
+        return run(dir, writer_cpu, reader_cpu, count, numa) == 0 ? 0 : 1;
+    }
+
+    // same node: the first two cpus of node 0, or one cpu shared if that's all there is
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int first = -1, second = -1, remote = -1;
+    for (int cpu = 0; cpu < ncpu; cpu++) {
+        int node = chronicle_numa_node_of_cpu(cpu);
+        if (node == chronicle_numa_node_of_cpu(0)) {
+            if (first < 0) first = cpu;
+            else if (second < 0) second = cpu;
+        } else if (remote < 0) {
+            remote = cpu;
+        }
+    }
+    if (first < 0) first = 0;
+    if (second < 0) second = first;
+
+    if (run(dir, first, second, count, numa) != 0) return 1;
+    if (remote >= 0) {
+        if (run(dir, first, remote, count, numa) != 0) return 1;
+    } else {
+        printf("single numa node, no cross-node pair to compare\n");
+    }
+    return 0;
+}
@@ -0,0 +1,342 @@
+// Copyright 2021 Tea Engineering Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <libchronicle.h>
+#include <sched.h>
+#include <time.h>
+#include <ftw.h>
+#include <signal.h>
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Round-trip latency between two processes over a pair of queues. The pinger
+// appends a message stamped with the cycle counter to "ping" and waits for the
+// echo process to copy it, byte for byte, onto "pong". Round trips are recorded
+// in a log-linear (HDR style) histogram with under 1% error.
+//
+//   bench_pingpong [-n count] [-w warmup] [-s size] [-W spin|yield|sleep]
+//                  [-c ping_cpu,echo_cpu] [-R roll_scheme] [-H] [dir]
+//
+// Both sides append with chronicle_append and poll with chronicle_peek_tailer, so
+// this measures the append and parse_queue_block paths end to end. -W picks what
+// a side does after a peek finds nothing: spin, sched_yield or usleep(1). -H
+// prints the full percentile distribution. dir defaults to /dev/shm.
+
+typedef struct {
+    uint64_t stamp;
+    uint64_t seq;
+} pingmsg_t;
+
+static size_t msg_size = 64;
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t ticks() {
+    return __rdtsc();
+}
+#else
+static inline uint64_t ticks() {
+    return now_ns();
+}
+#endif
+
+// ticks per ns, timed against the monotonic clock
+double calibrate() {
+    uint64_t n0 = now_ns(), t0 = ticks();
+    usleep(200000);
+    uint64_t n1 = now_ns(), t1 = ticks();
+    return (double)(t1 - t0) / (n1 - n0);
+}
+
+// 2^HIST_SUB_BITS linear buckets per power of two
+#define HIST_SUB_BITS 7
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+} histogram_t;
+
+static inline int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB) return v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) - HIST_SUB);
+}
+
+// highest value that lands in bucket i
+static uint64_t hist_value(int i) {
+    if (i < HIST_SUB) return i;
+    int shift = (i >> HIST_SUB_BITS) - 1;
+    uint64_t lo = (uint64_t)(HIST_SUB + (i & (HIST_SUB - 1))) << shift;
+    return lo + ((uint64_t)1 << shift) - 1;
+}
+
+static inline void hist_record(histogram_t* h, uint64_t v) {
+    h->counts[hist_bucket(v)]++;
+    h->total++;
+    if (v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+}
+
+uint64_t hist_percentile(histogram_t* h, double p) {
+    uint64_t want = (uint64_t)(p / 100.0 * h->total + 0.5);
+    if (want == 0) want = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= want) return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+// side state, shared by the dispatchers and the wait loop
+typedef struct {
+    queue_t*     out;
+    uint64_t     received;
+    uint64_t     seq;
+    uint64_t     stamp;
+    int          stop;
+} side_t;
+
+COBJ parse_msg(unsigned char* base, int lim) {
+    return base;
+}
+
+size_t sizeof_msg(COBJ msg) {
+    return msg_size;
+}
+
+void write_msg(unsigned char* base, COBJ msg, size_t sz) {
+    memcpy(base, msg, sz);
+}
+
+// echo: copy the ping straight from its mapping onto pong, stop after seq 0
+int echo_msg(void* ctx, uint64_t index, COBJ msg) {
+    side_t* s = (side_t*)ctx;
+    pingmsg_t m;
+    memcpy(&m, msg, sizeof(m));
+    chronicle_append(s->out, msg);
+    s->received++;
+    if (m.seq == 0) s->stop = 1;
+    return 0;
+}
+
+int pong_msg(void* ctx, uint64_t index, COBJ msg) {
+    side_t* s = (side_t*)ctx;
+    pingmsg_t m;
+    memcpy(&m, msg, sizeof(m));
+    s->seq = m.seq;
+    s->stamp = m.stamp;
+    s->received++;
+    return 0;
+}
+
+typedef enum {WAIT_SPIN, WAIT_YIELD, WAIT_SLEEP} waitstrategy_t;
+
+static inline void await(tailer_t* tailer, side_t* s, uint64_t n, waitstrategy_t wait) {
+    while (1) {
+        chronicle_peek_tailer(tailer);
+        if (s->received >= n) return;
+        if (wait == WAIT_YIELD) sched_yield();
+        else if (wait == WAIT_SLEEP) usleep(1);
+    }
+}
+
+void pin(int cpu) {
+    if (cpu < 0) return;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) perror("sched_setaffinity");
+}
+
+queue_t* open_queue(char* dir, char* roll_scheme) {
+    queue_t* queue = chronicle_init(dir);
+    if (queue == NULL) return NULL;
+    chronicle_set_version(queue, 5);
+    if (roll_scheme) chronicle_set_roll_scheme(queue, roll_scheme);
+    chronicle_set_create(queue, 1);
+    chronicle_set_decoder(queue, &parse_msg, NULL);
+    chronicle_set_encoder(queue, &sizeof_msg, &write_msg);
+    if (chronicle_open(queue) != 0) {
+        chronicle_cleanup(queue);
+        return NULL;
+    }
+    return queue;
+}
+
+static int rm_entry(const char *path, const struct stat *sb, int type, struct FTW *ftwb) {
+    return remove(path);
+}
+
+int main(const int argc, char **argv) {
+    uint64_t count = 100000;
+    uint64_t warmup = 10000;
+    waitstrategy_t wait = WAIT_SPIN;
+    int ping_cpu = -1, echo_cpu = -1;
+    char* roll_scheme = "FAST_DAILY";
+    int full = 0;
+    int c;
+    while ((c = getopt(argc, argv, "n:w:s:W:c:R:H")) != -1) {
+        switch (c) {
+        case 'n': count = strtoull(optarg, NULL, 10); break;
+        case 'w': warmup = strtoull(optarg, NULL, 10); break;
+        case 's': msg_size = strtoull(optarg, NULL, 10); break;
+        case 'W':
+            if (strcmp(optarg, "spin") == 0) wait = WAIT_SPIN;
+            else if (strcmp(optarg, "yield") == 0) wait = WAIT_YIELD;
+            else if (strcmp(optarg, "sleep") == 0) wait = WAIT_SLEEP;
+            else goto usage;
+            break;
+        case 'c':
+            if (sscanf(optarg, "%d,%d", &ping_cpu, &echo_cpu) != 2) goto usage;
+            break;
+        case 'R': roll_scheme = optarg; break;
+        case 'H': full = 1; break;
+        default:
+        usage:
+            fprintf(stderr, "usage: %s [-n count] [-w warmup] [-s size] [-W spin|yield|sleep] [-c ping_cpu,echo_cpu] [-R roll_scheme] [-H] [dir]\n", argv[0]);
+            exit(1);
+        }
+    }
+    char* dir = optind < argc ? argv[optind] : "/dev/shm";
+    if (count == 0) count = 1;
+    if (msg_size < sizeof(pingmsg_t)) msg_size = sizeof(pingmsg_t);
+
+    char* qdir;
+    asprintf(&qdir, "%s/bench_pingpong.XXXXXX", dir);
+    if (mkdtemp(qdir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char *ping_dir, *pong_dir;
+    asprintf(&ping_dir, "%s/ping", qdir);
+    asprintf(&pong_dir, "%s/pong", qdir);
+    if (mkdir(ping_dir, 0777) != 0 || mkdir(pong_dir, 0777) != 0) {
+        perror("mkdir");
+        return 1;
+    }
+
+    // create both queues and their first queuefiles before forking, so each side
+    // can start its tailer just past a known index
+    unsigned char* buf = calloc(1, msg_size);
+    pingmsg_t m = {0, UINT64_MAX};
+    memcpy(buf, &m, sizeof(m));
+    queue_t* ping = open_queue(ping_dir, roll_scheme);
+    queue_t* pong = open_queue(pong_dir, roll_scheme);
+    if (ping == NULL || pong == NULL) {
+        fprintf(stderr, "open failed: %s\n", chronicle_strerror());
+        nftw(qdir, rm_entry, 10, FTW_DEPTH|FTW_PHYS);
+        return 1;
+    }
+    uint64_t ping_start = chronicle_append(ping, buf) + 1;
+    uint64_t pong_start = chronicle_append(pong, buf) + 1;
+    chronicle_cleanup(ping);
+    chronicle_cleanup(pong);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        pin(echo_cpu);
+        side_t s = {0};
+        ping = open_queue(ping_dir, roll_scheme);
+        s.out = open_queue(pong_dir, roll_scheme);
+        if (ping == NULL || s.out == NULL) _exit(1);
+        tailer_t* tailer = chronicle_tailer(ping, &echo_msg, &s, ping_start);
+        while (!s.stop) await(tailer, &s, s.received + 1, wait);
+        chronicle_tailer_close(tailer);
+        chronicle_cleanup(ping);
+        chronicle_cleanup(s.out);
+        _exit(0);
+    }
+
+    pin(ping_cpu);
+    double tpn = calibrate();
+    side_t s = {0};
+    ping = open_queue(ping_dir, roll_scheme);
+    pong = open_queue(pong_dir, roll_scheme);
+    if (ping == NULL || pong == NULL) {
+        fprintf(stderr, "open failed: %s\n", chronicle_strerror());
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        nftw(qdir, rm_entry, 10, FTW_DEPTH|FTW_PHYS);
+        return 1;
+    }
+    tailer_t* tailer = chronicle_tailer(pong, &pong_msg, &s, pong_start);
+
+    histogram_t* h = calloc(1, sizeof(histogram_t));
+    h->min = UINT64_MAX;
+    uint64_t errors = 0;
+    uint64_t t0 = now_ns();
+    for (uint64_t i = 1; i <= warmup + count; i++) {
+        if (i == warmup + 1) t0 = now_ns();
+        m.seq = i;
+        m.stamp = ticks();
+        memcpy(buf, &m, sizeof(m));
+        chronicle_append(ping, buf);
+        await(tailer, &s, i, wait);
+        uint64_t rtt = ticks() - s.stamp;
+        if (s.seq != i) errors++;
+        if (i > warmup) hist_record(h, rtt);
+    }
+    uint64_t elapsed = now_ns() - t0;
+
+    m.seq = 0;
+    memcpy(buf, &m, sizeof(m));
+    chronicle_append(ping, buf);
+    int status;
+    waitpid(pid, &status, 0);
+    chronicle_tailer_close(tailer);
+    chronicle_cleanup(ping);
+    chronicle_cleanup(pong);
+
+    const char* waits[] = {"spin", "yield", "sleep"};
+    printf("size %5zu wait %-5s cpus %d,%d roll %s: %" PRIu64 " round trips, %.0f/s\n",
+        msg_size, waits[wait], ping_cpu, echo_cpu, roll_scheme, count, count * 1e9 / elapsed);
+    printf("  min %8.0fns  p50 %8.0fns  p99 %8.0fns  p99.9 %8.0fns  p99.99 %8.0fns  max %8.0fns\n",
+        h->min / tpn, hist_percentile(h, 50) / tpn, hist_percentile(h, 99) / tpn,
+        hist_percentile(h, 99.9) / tpn, hist_percentile(h, 99.99) / tpn, h->max / tpn);
+    if (full) {
+        printf("%12s %12s %12s\n", "Value(ns)", "Percentile", "TotalCount");
+        uint64_t seen = 0;
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            if (h->counts[i] == 0) continue;
+            seen += h->counts[i];
+            printf("%12.0f %12.6f %12" PRIu64 "\n", hist_value(i) / tpn, (double)seen / h->total, seen);
+        }
+    }
+    if (errors) printf("  %" PRIu64 " echoes out of sequence\n", errors);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) printf("  echo process failed\n");
+
+    free(h);
+    free(buf);
+    nftw(qdir, rm_entry, 10, FTW_DEPTH|FTW_PHYS);
+    free(ping_dir);
+    free(pong_dir);
+    free(qdir);
+    return errors || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
@@ -0,0 +1,366 @@
+// Copyright 2021 Tea Engineering Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <libchronicle.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/wait.h>
+
+// Sustained throughput, written as CSV for comparing builds and hosts.
+//
+//   bench_throughput [-R scheme,...|all] [-s size,...] [-p appenders,...]
+//                    [-b bytes] [-m max_messages] [-r rolls] [-t tests] [-o file] [dir]
+//
+// For every roll scheme, message size and appender count:
+//   append     appender processes write bytes/size messages (at most max_messages)
+//              into a fresh queue between them, timed from a common start
+//   tail_cold  a new queue handle reads them back, after the queuefiles are synced
+//              and dropped from the page cache (no effect on tmpfs such as /dev/shm)
+//   tail_warm  a second tailer on the same handle reads them again
+// Tails run once per scheme and size, on the queue written by the first appender
+// count, which is also reported in their appenders column. For every scheme and
+// size there is also:
+//   roll       appending the first message of each new cycle, with chronicle_append_ts
+//              stepping one roll length per cycle
+//   roll_steady  the other messages appended to those cycles, for comparison
+//
+// maps is chronicle_map_count() over the test, summed over appender processes.
+// Message counts are capped at half a cycle's index capacity, so the tiny TEST_
+// schemes run fewer messages. Defaults are FAST_DAILY, sizes 8B to 1MB, 1 to 8
+// appenders, 256MB or 2M messages per run, 100 rolls and /dev/shm. -t takes a list of append,tail,roll.
+
+static size_t msg_size;
+static unsigned char* payload;
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+COBJ parse_msg(unsigned char* base, int lim) {
+    return base;
+}
+
+size_t sizeof_msg(COBJ msg) {
+    return msg_size;
+}
+
+void write_msg(unsigned char* base, COBJ msg, size_t sz) {
+    memcpy(base, msg, sz);
+}
+
+int count_msg(void* ctx, uint64_t index, COBJ msg) {
+    (*(uint64_t*)ctx)++;
+    return 0;
+}
+
+queue_t* open_queue(char* dir, char* roll_scheme) {
+    queue_t* queue = chronicle_init(dir);
+    if (queue == NULL) return NULL;
+    chronicle_set_version(queue, 5);
+    chronicle_set_roll_scheme(queue, roll_scheme);
+    chronicle_set_create(queue, 1);
+    chronicle_set_decoder(queue, &parse_msg, NULL);
+    chronicle_set_encoder(queue, &sizeof_msg, &write_msg);
+    if (chronicle_open(queue) != 0) {
+        chronicle_cleanup(queue);
+        return NULL;
+    }
+    return queue;
+}
+
+static int rm_entry(const char *path, const struct stat *sb, int type, struct FTW *ftwb) {
+    return remove(path);
+}
+
+static FILE* out;
+
+void row(const char* test, const char* scheme, int appenders, uint64_t messages, uint64_t ns, uint64_t maps) {
+    double secs = ns / 1e9;
+    fprintf(out, "%s,%s,%zu,%d,%" PRIu64 ",%.6f,%.0f,%.4f,%.1f,%" PRIu64 "\n",
+        test, scheme, msg_size, appenders, messages, secs,
+        messages / secs, messages * (double)msg_size / 1e9 / secs, messages ? (double)ns / messages : 0, maps);
+    fflush(out);
+}
+
+// appenders processes each append count messages, waiting on a pipe so they start together
+int run_append(char* qdir, char* scheme, int appenders, uint64_t count) {
+    int ready[2], start[2], done[2];
+    if (pipe(ready) || pipe(start) || pipe(done)) {
+        perror("pipe");
+        return -1;
+    }
+    pid_t pids[appenders];
+    for (int p = 0; p < appenders; p++) {
+        pids[p] = fork();
+        if (pids[p] < 0) {
+            perror("fork");
+            return -1;
+        }
+        if (pids[p] == 0) {
+            uint64_t result[2] = {0, 0};
+            uint64_t maps = chronicle_map_count(); // inherited from the parent
+            queue_t* queue = open_queue(qdir, scheme);
+            char c = 0;
+            write(ready[1], &c, 1);
+            read(start[0], &c, 1);
+            for (uint64_t i = 0; queue && i < count; i++) {
+                if (chronicle_append(queue, payload) == (uint64_t)-1) break;
+                result[0]++;
+            }
+            result[1] = chronicle_map_count() - maps;
+            write(done[1], result, sizeof(result));
+            if (queue) chronicle_cleanup(queue);
+            _exit(0);
+        }
+    }
+    char c;
+    for (int p = 0; p < appenders; p++) read(ready[0], &c, 1);
+    uint64_t t0 = now_ns();
+    for (int p = 0; p < appenders; p++) write(start[1], &c, 1);
+    uint64_t total = 0, maps = 0;
+    for (int p = 0; p < appenders; p++) {
+        uint64_t result[2];
+        if (read(done[0], result, sizeof(result)) != sizeof(result)) break;
+        total += result[0];
+        maps += result[1];
+    }
+    uint64_t t1 = now_ns();
+    for (int p = 0; p < appenders; p++) waitpid(pids[p], NULL, 0);
+    close(ready[0]); close(ready[1]);
+    close(start[0]); close(start[1]);
+    close(done[0]); close(done[1]);
+
+    row("append", scheme, appenders, total, t1 - t0, maps);
+    if (total < count * appenders) {
+        fprintf(stderr, "%s size %zu: only %" PRIu64 " of %" PRIu64 " appends succeeded\n", scheme, msg_size, total, count * appenders);
+    }
+    return 0;
+}
+
+// read count messages from index on, returning the time taken
+uint64_t tail_pass(queue_t* queue, uint64_t index, uint64_t count) {
+    uint64_t seen = 0;
+    tailer_t* tailer = chronicle_tailer(queue, &count_msg, &seen, index);
+    uint64_t t0 = now_ns();
+    while (seen < count) {
+        int r = chronicle_peek_tailer(tailer);
+        if (r != TS_AWAITING_ENTRY && r != TS_BUSY && r != TS_AWAITING_QUEUEFILE) {
+            fprintf(stderr, "tail stopped after %" PRIu64 " messages: %s\n", seen, chronicle_strerror());
+            break;
+        }
+    }
+    uint64_t t1 = now_ns();
+    chronicle_tailer_close(tailer);
+    return t1 - t0;
+}
+
+void drop_cache(char* qdir) {
+    char* pattern;
+    asprintf(&pattern, "%s/*.cq4", qdir);
+    glob_t g;
+    if (glob(pattern, 0, NULL, &g) == 0) {
+        for (size_t i = 0; i < g.gl_pathc; i++) {
+            int fd = open(g.gl_pathv[i], O_RDONLY);
+            if (fd < 0) continue;
+            fdatasync(fd);
+#ifdef POSIX_FADV_DONTNEED
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+            close(fd);
+        }
+        globfree(&g);
+    }
+    free(pattern);
+}
+
+int run_tail(char* qdir, char* scheme, int appenders, uint64_t index, uint64_t count) {
+    drop_cache(qdir);
+    uint64_t maps = chronicle_map_count();
+    queue_t* queue = open_queue(qdir, scheme);
+    if (queue == NULL) return -1;
+    uint64_t ns = tail_pass(queue, index, count);
+    row("tail_cold", scheme, appenders, count, ns, chronicle_map_count() - maps);
+
+    maps = chronicle_map_count();
+    ns = tail_pass(queue, index, count);
+    row("tail_warm", scheme, appenders, count, ns, chronicle_map_count() - maps);
+    chronicle_cleanup(queue);
+    return 0;
+}
+
+// per_cycle messages into each of rolls consecutive cycles
+int run_roll(char* qdir, struct ROLL_SCHEME* rs, int rolls, int per_cycle) {
+    uint64_t maps = chronicle_map_count();
+    queue_t* queue = open_queue(qdir, rs->name);
+    if (queue == NULL) return -1;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long ms = ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+
+    uint64_t roll_ns = 0, steady_ns = 0;
+    for (int r = 0; r < rolls; r++, ms += rs->roll_length_secs * 1000L) {
+        uint64_t t0 = now_ns();
+        if (chronicle_append_ts(queue, payload, ms) == (uint64_t)-1) break;
+        uint64_t t1 = now_ns();
+        for (int i = 1; i < per_cycle; i++) chronicle_append_ts(queue, payload, ms);
+        uint64_t t2 = now_ns();
+        // the first roll creates the queue's first file, which isn't a roll
+        if (r > 0) {
+            roll_ns += t1 - t0;
+            steady_ns += t2 - t1;
+        }
+    }
+    chronicle_cleanup(queue);
+    row("roll", rs->name, 1, rolls - 1, roll_ns, chronicle_map_count() - maps);
+    row("roll_steady", rs->name, 1, (uint64_t)(rolls - 1) * (per_cycle - 1), steady_ns, 0);
+    return 0;
+}
+
+// fresh queue directory under dir, removed by rm_queue
+char* new_queue(char* dir) {
+    char* qdir;
+    asprintf(&qdir, "%s/bench_throughput.XXXXXX", dir);
+    if (mkdtemp(qdir) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    return qdir;
+}
+
+void rm_queue(char* qdir) {
+    nftw(qdir, rm_entry, 10, FTW_DEPTH|FTW_PHYS);
+    free(qdir);
+}
+
+int parse_list(char* s, uint64_t* v, int max) {
+    int n = 0;
+    for (char* tok = strtok(s, ","); tok && n < max; tok = strtok(NULL, ",")) {
+        char* end;
+        v[n] = strtoull(tok, &end, 10);
+        if (*end == 'k' || *end == 'K') v[n] <<= 10;
+        if (*end == 'm' || *end == 'M') v[n] <<= 20;
+        if (v[n]) n++;
+    }
+    return n;
+}
+
+int main(const int argc, char **argv) {
+    char* schemes = "FAST_DAILY";
+    uint64_t sizes[32] = {8, 64, 512, 4<<10, 32<<10, 256<<10, 1<<20};
+    int nsizes = 7;
+    uint64_t appenders[32] = {1, 2, 4, 8};
+    int nappenders = 4;
+    uint64_t bytes = 256<<20;
+    uint64_t max_messages = 2000000;
+    int rolls = 100;
+    char* tests = "append,tail,roll";
+    out = stdout;
+    int c;
+    while ((c = getopt(argc, argv, "R:s:p:b:m:r:t:o:")) != -1) {
+        switch (c) {
+        case 'R': schemes = optarg; break;
+        case 's': nsizes = parse_list(optarg, sizes, 32); break;
+        case 'p': nappenders = parse_list(optarg, appenders, 32); break;
+        case 'b': parse_list(optarg, &bytes, 1); break;
+        case 'm': max_messages = strtoull(optarg, NULL, 10); break;
+        case 'r': rolls = atoi(optarg); break;
+        case 't': tests = optarg; break;
+        case 'o':
+            if ((out = fopen(optarg, "w")) == NULL) {
+                perror(optarg);
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-R scheme,...|all] [-s size,...] [-p appenders,...] [-b bytes] [-m max_messages] [-r rolls] [-t append,tail,roll] [-o file] [dir]\n", argv[0]);
+            exit(1);
+        }
+    }
+    char* dir = optind < argc ? argv[optind] : "/dev/shm";
+    int do_append = strstr(tests, "append") != NULL;
+    int do_tail = strstr(tests, "tail") != NULL;
+    int do_roll = strstr(tests, "roll") != NULL;
+    if (rolls < 2) rolls = 2;
+
+    payload = malloc(sizes[0]);
+    fprintf(out, "test,scheme,size,appenders,messages,seconds,msgs_per_sec,gb_per_sec,ns_per_msg,maps\n");
+
+    for (int s = 0; s < chronicle_roll_scheme_count; s++) {
+        struct ROLL_SCHEME* rs = &chronicle_roll_schemes[s];
+        if (strcmp(schemes, "all") != 0) {
+            size_t len = strlen(rs->name);
+            char* found = strstr(schemes, rs->name);
+            while (found && ((found != schemes && found[-1] != ',') || (found[len] != ',' && found[len] != 0))) {
+                found = strstr(found + 1, rs->name);
+            }
+            if (found == NULL) continue;
+        }
+        uint64_t capacity = (uint64_t)rs->entries * rs->entries * rs->index;
+
+        for (int z = 0; z < nsizes; z++) {
+            msg_size = sizes[z];
+            payload = realloc(payload, msg_size);
+            for (size_t i = 0; i < msg_size; i++) payload[i] = i;
+
+            uint64_t count = bytes / msg_size;
+            if (count > max_messages) count = max_messages;
+            if (count > capacity / 2) count = capacity / 2;
+            if (count < 1) count = 1;
+
+            char* tail_qdir = NULL;
+            uint64_t tail_index = 0, tail_count = 0;
+            int tail_appenders = 0;
+            for (int a = 0; do_append && a < nappenders; a++) {
+                int n = appenders[a];
+                uint64_t per = count / n ? count / n : 1;
+                char* qdir = new_queue(dir);
+                queue_t* queue = open_queue(qdir, rs->name);
+                if (queue == NULL) {
+                    fprintf(stderr, "%s: %s\n", rs->name, chronicle_strerror());
+                    rm_queue(qdir);
+                    continue;
+                }
+                // the first message creates the queuefile outside the timed section
+                uint64_t index = chronicle_append(queue, payload) + 1;
+                chronicle_cleanup(queue);
+                run_append(qdir, rs->name, n, per);
+                if (do_tail && tail_qdir == NULL) {
+                    tail_qdir = qdir;
+                    tail_index = index;
+                    tail_count = per * n;
+                    tail_appenders = n;
+                } else {
+                    rm_queue(qdir);
+                }
+            }
+            if (tail_qdir) {
+                run_tail(tail_qdir, rs->name, tail_appenders, tail_index, tail_count);
+                rm_queue(tail_qdir);
+            }
+            if (do_roll) {
+                char* qdir = new_queue(dir);
+                int per_cycle = capacity / 2 < 10 ? capacity / 2 : 10;
+                run_roll(qdir, rs, rolls, per_cycle < 2 ? 2 : per_cycle);
+                rm_queue(qdir);
+            }
+        }
+    }
+    free(payload);
+    if (out != stdout) fclose(out);
+    return 0;
+}
@@ -0,0 +1,373 @@
+// Copyright 2021 Tea Engineering Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <wire.h>
+
+// Microbenchmarks for wire decoding: stop-bit values, a metadata header through
+// each of the three parsers, and index page lookups, each against a plain
+// byte-at-a-time or branching reference. Also a 20 field order event encoded and
+// decoded field by field and with a WIRE_LAYOUT, and event messages routed by a
+// callback comparing names and by a wirerouter.
+//
+//   bench_wire [-n iterations]
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// keeps results live so the compiler cannot drop the work
+volatile uint64_t sink;
+
+#define BENCH(label, ops, body) do { \
+        uint64_t t0_ = now_ns(); \
+        body; \
+        uint64_t t1_ = now_ns(); \
+        printf("%-36s %8.2f ns/op\n", label, (double)(t1_ - t0_) / (ops)); \
+    } while (0)
+
+// reference decoder, one byte per iteration
+int stopbit_bytewise(unsigned char* p, unsigned char* end, int64_t* v) {
+    uint64_t l = 0;
+    int n = 0;
+    uint8_t b;
+    do {
+        if (p + n >= end || n == 10) return -1;
+        b = p[n];
+        l |= (uint64_t)(b & 0x7F) << (7*n);
+        n++;
+    } while (b & 0x80);
+    *v = (b == 0 && n > 1) ? (int64_t)~l : (int64_t)l;
+    return n;
+}
+
+unsigned char* put_stopbit(unsigned char* p, uint64_t d) {
+    while (d >= 0x80) {
+        *p++ = 0x80 | (d & 0x7F);
+        d >>= 7;
+    }
+    *p++ = d;
+    return p;
+}
+
+void bench_stopbit(int iterations) {
+    // text lengths as seen in metadata and data pages: mostly 1 or 2 bytes, some 3-5
+    int count = 4096;
+    unsigned char* buf = malloc(count * 10 + 8);
+    unsigned char* p = buf;
+    srand(42);
+    for (int i = 0; i < count; i++) {
+        int bits = 7 * (1 + rand() % 5) - 1;
+        p = put_stopbit(p, (uint64_t)rand() & ((1ULL << bits) - 1));
+    }
+    unsigned char* end = p;
+    uint64_t ops = (uint64_t)iterations * count;
+
+    BENCH("stopbit bytewise", ops, {
+        for (int r = 0; r < iterations; r++) {
+            int64_t v;
+            for (unsigned char* q = buf; q < end; q += stopbit_bytewise(q, end, &v)) sink += v;
+        }
+    });
+    BENCH("stopbit wire_read_stopbit", ops, {
+        for (int r = 0; r < iterations; r++) {
+            int64_t v;
+            for (unsigned char* q = buf; q < end; q += wire_read_stopbit(q, end, &v)) sink += v;
+        }
+    });
+    free(buf);
+}
+
+#define BENCH_HEADER_FIELDS(X, s) \
+    X(s, length,        "length",        WF_INT64) \
+    X(s, epoch,         "epoch",         WF_INT64) \
+    X(s, format,        "format",        WF_TEXT) \
+    X(s, index_count,   "indexCount",    WF_INT64) \
+    X(s, index_spacing, "indexSpacing",  WF_INT64) \
+    X(s, last_index,    "lastIndexReplicated", WF_INT64)
+
+WIRE_SCHEMA(bench_header, BENCH_HEADER_FIELDS)
+
+void count_field(char* name, int sz, uint64_t v, wirecallbacks_t* cbs) {
+    // the comparisons a hand-written callback makes to route each field
+    if (sz == 6 && memcmp(name, "length", 6) == 0) sink += v;
+    else if (sz == 5 && memcmp(name, "epoch", 5) == 0) sink += v;
+    else if (sz == 10 && memcmp(name, "indexCount", 10) == 0) sink += v;
+    else if (sz == 12 && memcmp(name, "indexSpacing", 12) == 0) sink += v;
+    else if (sz == 19 && memcmp(name, "lastIndexReplicated", 19) == 0) sink += v;
+}
+
+void count_text(char* name, int sz, char* text, int tsz, wirecallbacks_t* cbs) {
+    sink += tsz;
+}
+
+void bench_metadata(int iterations) {
+    // a queue header in the shape of metadata.cq4t and queuefile headers
+    wirepad_t* pad = wirepad_init(256);
+    wirepad_event_name(pad, "header");
+    wirepad_type_prefix(pad, "SCQStore");
+    wirepad_nest_enter(pad);
+    wirepad_field_varint(pad, "writePosition", 131328);
+    wirepad_field(pad, "roll");
+    wirepad_type_prefix(pad, "SCQSRoll");
+    wirepad_nest_enter(pad);
+    wirepad_field_varint(pad, "length", 86400000);
+    wirepad_field_text(pad, "format", "yyyyMMdd'T4'");
+    wirepad_field_varint(pad, "epoch", 0);
+    wirepad_nest_exit(pad);
+    wirepad_field_varint(pad, "indexCount", 8192);
+    wirepad_field_varint(pad, "indexSpacing", 64);
+    wirepad_field_varint(pad, "lastIndexReplicated", 1234567);
+    wirepad_field_text(pad, "sourceDescription", "a description long enough for the any-length text code, as tools write");
+    wirepad_nest_exit(pad);
+    unsigned char* base = wirepad_base(pad);
+    int lim = wirepad_sizeof(pad);
+
+    wirecallbacks_t cbs;
+    memset(&cbs, 0, sizeof(cbs));
+    cbs.field_uint64 = &count_field;
+    cbs.field_char = &count_text;
+    BENCH("metadata wire_parse callbacks", iterations, {
+        for (int r = 0; r < iterations; r++) wire_parse(base, lim, &cbs);
+    });
+
+    BENCH("metadata wirecursor", iterations, {
+        for (int r = 0; r < iterations; r++) {
+            wirecursor_t c;
+            wireitem_t it;
+            wirecursor_init(&c, base, lim);
+            while (wirecursor_next(&c, &it) > WK_ERROR) sink += it.kind;
+        }
+    });
+
+    BENCH("metadata wire_schema_decode", iterations, {
+        for (int r = 0; r < iterations; r++) {
+            bench_header_t h;
+            wire_schema_decode(&bench_header_schema, base, lim, &h);
+            sink += h.length + h.index_count;
+        }
+    });
+    wirepad_free(pad);
+}
+
+// a 20 field order event
+#define ORDER_FIELDS(X, s) \
+    X(s, order_id,    "orderId",     WF_INT64,   0)  \
+    X(s, parent_id,   "parentId",    WF_INT64,   0)  \
+    X(s, sym,         "sym",         WF_TEXT,    12) \
+    X(s, venue,       "venue",       WF_TEXT,    8)  \
+    X(s, account,     "account",     WF_TEXT,    16) \
+    X(s, side,        "side",        WF_TEXT,    4)  \
+    X(s, type,        "type",        WF_TEXT,    8)  \
+    X(s, tif,         "tif",         WF_TEXT,    4)  \
+    X(s, price,       "price",       WF_FLOAT64, 0)  \
+    X(s, stop_price,  "stopPrice",   WF_FLOAT64, 0)  \
+    X(s, qty,         "qty",         WF_INT64,   0)  \
+    X(s, filled,      "filled",      WF_INT64,   0)  \
+    X(s, leaves,      "leaves",      WF_INT64,   0)  \
+    X(s, avg_price,   "avgPrice",    WF_FLOAT64, 0)  \
+    X(s, min_qty,     "minQty",      WF_INT64,   0)  \
+    X(s, display_qty, "displayQty",  WF_INT64,   0)  \
+    X(s, created,     "created",     WF_INT64,   0)  \
+    X(s, updated,     "updated",     WF_INT64,   0)  \
+    X(s, status,      "status",      WF_TEXT,    12) \
+    X(s, seq,         "seq",         WF_INT64,   0)
+
+WIRE_LAYOUT(order, ORDER_FIELDS)
+
+void bench_encode(int iterations) {
+    order_t o = { 0, 1000001, 1000000, {"VOD.L", 5}, {"XLON", 4}, {"ACC-00042", 9}, {"BUY", 3},
+        {"LIMIT", 5}, {"DAY", 3}, 101.25, 0.0, 5000, 1200, 3800, 101.2475, 100, 500,
+        1637267400000L, 1637267400123L, {"PARTIAL", 7}, 77 };
+    unsigned char buf[sizeof(order_wire_t)];
+
+    wirepad_t* pad = wirepad_init(1024);
+    BENCH("order encode wirepad_field_*", iterations, {
+        for (int r = 0; r < iterations; r++) {
+            wirepad_clear(pad);
+            wirepad_field_uint64(pad, "orderId", o.order_id + r);
+            wirepad_field_uint64(pad, "parentId", o.parent_id);
+            wirepad_field_text(pad, "sym", "VOD.L");
+            wirepad_field_text(pad, "venue", "XLON");
+            wirepad_field_text(pad, "account", "ACC-00042");
+            wirepad_field_enum(pad, "side", "BUY");
+            wirepad_field_enum(pad, "type", "LIMIT");
+            wirepad_field_enum(pad, "tif", "DAY");
+            wirepad_field_float64(pad, "price", o.price);
+            wirepad_field_float64(pad, "stopPrice", o.stop_price);
+            wirepad_field_uint64(pad, "qty", o.qty);
+            wirepad_field_uint64(pad, "filled", o.filled);
+            wirepad_field_uint64(pad, "leaves", o.leaves);
+            wirepad_field_float64(pad, "avgPrice", o.avg_price);
+            wirepad_field_uint64(pad, "minQty", o.min_qty);
+            wirepad_field_uint64(pad, "displayQty", o.display_qty);
+            wirepad_field_uint64(pad, "created", o.created);
+            wirepad_field_uint64(pad, "updated", o.updated);
+            wirepad_field_enum(pad, "status", "PARTIAL");
+            wirepad_field_uint64(pad, "seq", o.seq);
+            sink += wirepad_sizeof(pad);
+        }
+    });
+    wirepad_free(pad);
+
+    BENCH("order encode WIRE_LAYOUT", iterations, {
+        for (int r = 0; r < iterations; r++) {
+            o.order_id++;
+            sink += order_encode(buf, &o);
+        }
+    });
+
+    BENCH("order decode WIRE_LAYOUT", iterations, {
+        for (int r = 0; r < iterations; r++) {
+            order_t d;
+            order_decode(buf, sizeof(buf), &d);
+            sink += d.qty;
+        }
+    });
+    BENCH("order decode wire_schema_decode", iterations, {
+        for (int r = 0; r < iterations; r++) {
+            order_t d;
+            wire_schema_decode(&order_schema, buf, sizeof(buf), &d);
+            sink += d.qty;
+        }
+    });
+}
+
+#define ROUTE_EVENTS 32
+
+char route_names[ROUTE_EVENTS][32];
+
+int on_route(void* ctx, uint64_t index, wireitem_t* item, wirecursor_t* c) {
+    sink += (uintptr_t)ctx;
+    return 0;
+}
+
+// what an event_name callback does without a router: compare against each name
+void route_by_strcmp(char* name, int sz, wirecallbacks_t* cbs) {
+    for (int i = 0; i < ROUTE_EVENTS; i++) {
+        if (strncmp(name, route_names[i], sz) == 0 && route_names[i][sz] == 0) {
+            sink += i;
+            return;
+        }
+    }
+}
+
+void bench_route(int iterations) {
+    wirerouter_t* router = wirerouter_init();
+    for (int i = 0; i < ROUTE_EVENTS; i++) {
+        sprintf(route_names[i], "onMarketEvent%02d", i);
+        wirerouter_add(router, route_names[i], &on_route, (void*)(uintptr_t)i);
+    }
+    // one message per event, each a call with a small marshallable argument
+    wirepad_t* pads[ROUTE_EVENTS];
+    for (int i = 0; i < ROUTE_EVENTS; i++) {
+        pads[i] = wirepad_init(64);
+        wirepad_event_name(pads[i], route_names[(i * 7) % ROUTE_EVENTS]);
+        wirepad_nest_enter(pads[i]);
+        wirepad_field_varint(pads[i], "qty", 100 + i);
+        wirepad_nest_exit(pads[i]);
+    }
+
+    wirecallbacks_t cbs;
+    memset(&cbs, 0, sizeof(cbs));
+    cbs.event_name = &route_by_strcmp;
+    BENCH("route wire_parse strcmp", iterations, {
+        for (int r = 0; r < iterations; r++) {
+            wirepad_t* pad = pads[r % ROUTE_EVENTS];
+            wire_parse(wirepad_base(pad), wirepad_sizeof(pad), &cbs);
+        }
+    });
+    BENCH("route wirerouter", iterations, {
+        for (int r = 0; r < iterations; r++) {
+            wirepad_t* pad = pads[r % ROUTE_EVENTS];
+            wirerouter_route(router, wirepad_base(pad), wirepad_sizeof(pad), r);
+        }
+    });
+    for (int i = 0; i < ROUTE_EVENTS; i++) wirepad_free(pads[i]);
+    wirerouter_free(router);
+}
+
+uint64_t used_scalar(uint64_t* values, uint64_t capacity) {
+    uint64_t n = capacity;
+    while (n > 0 && values[n-1] == 0) n--;
+    return n;
+}
+
+uint64_t upper_bound_branching(uint64_t* values, uint64_t n, uint64_t key) {
+    uint64_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (values[mid] <= key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+void bench_index(int iterations) {
+    // an index page of 8192 positions, a third written
+    uint64_t capacity = 8192;
+    uint64_t used = capacity / 3;
+    uint64_t* values = calloc(capacity, sizeof(uint64_t));
+    for (uint64_t i = 0; i < used; i++) values[i] = 0x20000 + i * 97 + (i % 7);
+    int lookups = 4096;
+    uint64_t* keys = malloc(lookups * sizeof(uint64_t));
+    srand(7);
+    for (int i = 0; i < lookups; i++) keys[i] = 0x20000 + (uint64_t)rand() % (used * 97);
+
+    BENCH("index used scalar", iterations, {
+        for (int r = 0; r < iterations; r++) sink += used_scalar(values, capacity);
+    });
+    BENCH("index used wire_i64_used", iterations, {
+        for (int r = 0; r < iterations; r++) sink += wire_i64_used((unsigned char*)values, capacity);
+    });
+
+    uint64_t ops = (uint64_t)iterations * lookups;
+    BENCH("index search branching", ops, {
+        for (int r = 0; r < iterations; r++)
+            for (int i = 0; i < lookups; i++) sink += upper_bound_branching(values, used, keys[i]);
+    });
+    BENCH("index search wire_i64_upper_bound", ops, {
+        for (int r = 0; r < iterations; r++)
+            for (int i = 0; i < lookups; i++) sink += wire_i64_upper_bound((unsigned char*)values, used, keys[i]);
+    });
+    free(keys);
+    free(values);
+}
+
+int main(const int argc, char **argv) {
+    int iterations = 10000;
+    int c;
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+        case 'n': iterations = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (iterations < 1) iterations = 1;
+
+    bench_stopbit(iterations / 10 + 1);
+    bench_metadata(iterations * 10);
+    bench_encode(iterations * 10);
+    bench_route(iterations * 10);
+    bench_index(iterations / 10 + 1);
+    return 0;
+}
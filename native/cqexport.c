@@ -0,0 +1,753 @@
+// Copyright 2021 Tea Engineering Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+#include <libchronicle.h>
+#include <wire.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+
+// Stand-alone tool exporting a queue, or a range of it, as JSON lines or CSV for
+// reconciliation and offline analysis. Cycles are exported in parallel by the
+// workers of chronicle_replay_parallel. Unordered replay dispatches each message on
+// its worker while the queuefile is mapped, so with wire_parse_view as the parser
+// messages are formatted straight from the mapping into the worker's output buffer.
+// Nothing is copied or allocated per message, and output leaves in large write()s.
+//
+// Replay hands each worker parts of the range, a whole cycle or a run of one, and a
+// cycle's parts may go to different workers. With one worker, output goes straight to
+// stdout, -o FILE or, with -o DIR, each cycle's file. With more, every part is written
+// to its own file beside the output, named for its first index, and once replay ends
+// the parts are joined in index order with copy_file_range.
+
+#define OUT_BUF_SZ (4*1024*1024)
+
+typedef enum {FMT_JSONL, FMT_CSV} format_t;
+
+typedef struct {
+    char*          path; // part file
+    uint64_t       cycle;
+    uint64_t       first; // index of its first message
+} part_t;
+
+typedef struct exporter {
+    struct exporter* next;
+    int            fd;
+    uint64_t       cycle;
+    uint64_t       last; // index of the last message
+    unsigned char* buf;
+    size_t         n;
+    uint64_t       messages;
+    uint64_t       bytes;
+    int            failed;
+    wireitem_t*    selected; // per message, the item found for each selected field
+    unsigned char* scratch; // csv: nested values formatted as JSON before quoting
+    part_t*        parts;
+    int            nparts;
+} exporter_t;
+
+// options, read-only once the export starts
+queue_t*    queue;
+format_t    format = FMT_JSONL;
+char**      fields; // selected field names, NULL for all
+int*        fields_sz;
+int         nfields;
+char*       outdir;
+int         outfd = 1;
+char*       partdir;
+int         use_parts;
+
+exporter_t*     exporters;
+pthread_mutex_t exporters_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread exporter_t* self;
+
+// output buffer
+
+void out_flush(exporter_t* e) {
+    if (e->fd < 0) {
+        e->n = 0; // scratch output, longer than a buffer is cut short
+        return;
+    }
+    unsigned char* p = e->buf;
+    while (e->n > 0) {
+        ssize_t w = write(e->fd, p, e->n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (!e->failed) fprintf(stderr, "cqexport: write failed: %s\n", strerror(errno));
+            e->failed = 1;
+            break;
+        }
+        e->bytes += w;
+        p += w;
+        e->n -= w;
+    }
+    e->n = 0;
+}
+
+// room for sz contiguous bytes, sz at most OUT_BUF_SZ
+static inline unsigned char* out_reserve(exporter_t* e, size_t sz) {
+    if (e->n + sz > OUT_BUF_SZ) out_flush(e);
+    return e->buf + e->n;
+}
+
+static inline void out_bytes(exporter_t* e, const void* data, size_t sz) {
+    while (sz > 0) {
+        size_t chunk = sz < OUT_BUF_SZ ? sz : OUT_BUF_SZ;
+        memcpy(out_reserve(e, chunk), data, chunk);
+        e->n += chunk;
+        data = (const char*)data + chunk;
+        sz -= chunk;
+    }
+}
+
+static inline void out_char(exporter_t* e, char c) {
+    *out_reserve(e, 1) = c;
+    e->n++;
+}
+
+#define out_lit(e, s) out_bytes(e, s, sizeof(s)-1)
+
+static inline void out_u64(exporter_t* e, uint64_t v) {
+    char tmp[20];
+    int i = sizeof(tmp);
+    do {
+        tmp[--i] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    out_bytes(e, tmp + i, sizeof(tmp) - i);
+}
+
+static inline void out_i64(exporter_t* e, int64_t v) {
+    if (v < 0) {
+        out_char(e, '-');
+        out_u64(e, -(uint64_t)v);
+    } else {
+        out_u64(e, v);
+    }
+}
+
+// Prices and the like are usually m / 10^k for a small k, and then m with k decimals
+// reads back as v (m and 10^k are exact, and division rounds correctly). Those are
+// written as integers, anything else with printf.
+static void out_f64(exporter_t* e, double v) {
+    if (!isfinite(v)) {
+        out_lit(e, "null");
+        return;
+    }
+    if (fabs(v) < 1e15) {
+        double scale = 1;
+        for (int k = 0; k < 10; k++, scale *= 10) {
+            if (fabs(v * scale) >= 0x1p53) break;
+            int64_t m = llround(v * scale);
+            if ((double)m / scale != v) continue;
+            if (m < 0 || (m == 0 && signbit(v))) out_char(e, '-');
+            uint64_t u = m < 0 ? -(uint64_t)m : (uint64_t)m;
+            char tmp[24];
+            int i = sizeof(tmp);
+            for (int d = 0; d < k; d++, u /= 10) tmp[--i] = '0' + u % 10;
+            if (k > 0) tmp[--i] = '.';
+            do tmp[--i] = '0' + u % 10; while (u /= 10);
+            out_bytes(e, tmp + i, sizeof(tmp) - i);
+            return;
+        }
+    }
+    unsigned char* p = out_reserve(e, 32);
+    e->n += snprintf((char*)p, 32, "%.17g", v);
+}
+
+static void out_hex(exporter_t* e, unsigned char* data, int sz) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < sz; i++) {
+        unsigned char* p = out_reserve(e, 2);
+        p[0] = digits[data[i] >> 4];
+        p[1] = digits[data[i] & 0xF];
+        e->n += 2;
+    }
+}
+
+// JSON string body, copying runs that need no escaping in one go
+static void out_json_text(exporter_t* e, const char* text, int sz) {
+    int run = 0;
+    for (int i = 0; i < sz; i++) {
+        unsigned char c = text[i];
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        out_bytes(e, text + run, i - run);
+        run = i + 1;
+        switch (c) {
+            case '"':  out_lit(e, "\\\""); break;
+            case '\\': out_lit(e, "\\\\"); break;
+            case '\n': out_lit(e, "\\n"); break;
+            case '\r': out_lit(e, "\\r"); break;
+            case '\t': out_lit(e, "\\t"); break;
+            default: {
+                unsigned char* p = out_reserve(e, 7);
+                e->n += snprintf((char*)p, 7, "\\u%04x", c);
+            }
+        }
+    }
+    out_bytes(e, text + run, sz - run);
+}
+
+static void out_json_string(exporter_t* e, const char* text, int sz) {
+    out_char(e, '"');
+    out_json_text(e, text, sz);
+    out_char(e, '"');
+}
+
+// JSON formatting of wire values
+
+void out_json_value(exporter_t* e, wireitem_t* it, wirecursor_t* c);
+
+// members of an object or array until the end of the enclosing nest (or message)
+void out_json_members(exporter_t* e, wirecursor_t* c, int array, int first) {
+    wireitem_t it;
+    int unnamed = 0;
+    while (wirecursor_next(c, &it) > WK_ERROR && it.kind != WK_NEST_END) {
+        if (!first) out_char(e, ',');
+        first = 0;
+        if (!array) {
+            out_char(e, '"');
+            if (it.name) {
+                out_json_text(e, it.name, it.name_sz);
+            } else if (it.field_number >= 0) {
+                out_i64(e, it.field_number);
+            } else {
+                out_lit(e, "value");
+                if (unnamed) out_u64(e, unnamed);
+                unnamed++;
+            }
+            out_lit(e, "\":");
+        }
+        out_json_value(e, &it, c);
+    }
+}
+
+void out_json_value(exporter_t* e, wireitem_t* it, wirecursor_t* c) {
+    switch (it->kind) {
+        case WK_NULL: out_lit(e, "null"); break;
+        case WK_BOOL: if (it->v.i64) out_lit(e, "true"); else out_lit(e, "false"); break;
+        case WK_INT: out_i64(e, it->v.i64); break;
+        case WK_FLOAT: out_f64(e, it->v.f64); break;
+        case WK_TEXT:
+        case WK_TIME:
+        case WK_DATE:
+        case WK_DATETIME:
+        case WK_ZONED_DATETIME:
+        case WK_TYPE_LITERAL:
+            out_json_string(e, it->v.text.text, it->v.text.sz);
+            break;
+        case WK_BYTES:
+        case WK_UUID:
+            out_char(e, '"');
+            out_hex(e, it->v.bytes.data, it->v.bytes.sz);
+            out_char(e, '"');
+            break;
+        case WK_I64_ARRAY: {
+            out_char(e, '[');
+            uint64_t used = it->v.arr.used < it->v.arr.capacity ? it->v.arr.used : it->v.arr.capacity;
+            for (uint64_t i = 0; i < used; i++) {
+                int64_t v;
+                memcpy(&v, it->v.arr.values + 8*i, sizeof(v));
+                if (i) out_char(e, ',');
+                out_i64(e, v);
+            }
+            out_char(e, ']');
+            break;
+        }
+        case WK_NEST_BEGIN: {
+            // a sequence if its first item has no key, otherwise a marshallable
+            wirecursor_t peek = *c;
+            wireitem_t first;
+            int array = wirecursor_next(&peek, &first) > WK_ERROR && first.kind != WK_NEST_END &&
+                first.name == NULL && first.field_number < 0;
+            out_char(e, array ? '[' : '{');
+            out_json_members(e, c, array, 1);
+            out_char(e, array ? ']' : '}');
+            break;
+        }
+        default:
+            out_lit(e, "null");
+            break;
+    }
+}
+
+// a selected nested value, formatted from its extent
+void out_json_selected(exporter_t* e, wireitem_t* it) {
+    if (it->kind == WK_NEST_BEGIN) {
+        wirecursor_t c;
+        wirecursor_init(&c, it->v.bytes.data, it->v.bytes.sz);
+        wireitem_t first;
+        wirecursor_t peek = c;
+        int array = wirecursor_next(&peek, &first) > WK_ERROR && first.name == NULL && first.field_number < 0;
+        out_char(e, array ? '[' : '{');
+        out_json_members(e, &c, array, 1);
+        out_char(e, array ? ']' : '}');
+    } else {
+        out_json_value(e, it, NULL);
+    }
+}
+
+// CSV cell: numbers bare, text quoted when it holds a delimiter, nests as JSON
+void out_csv_value(exporter_t* e, wireitem_t* it) {
+    switch (it->kind) {
+        case WK_END: break; // absent
+        case WK_NULL: break;
+        case WK_BOOL: if (it->v.i64) out_lit(e, "true"); else out_lit(e, "false"); break;
+        case WK_INT: out_i64(e, it->v.i64); break;
+        case WK_FLOAT: if (isfinite(it->v.f64)) out_f64(e, it->v.f64); break;
+        case WK_TEXT:
+        case WK_TIME:
+        case WK_DATE:
+        case WK_DATETIME:
+        case WK_ZONED_DATETIME:
+        case WK_TYPE_LITERAL: {
+            char* text = it->v.text.text;
+            int sz = it->v.text.sz;
+            int quote = 0;
+            for (int i = 0; i < sz && !quote; i++) {
+                quote = text[i] == ',' || text[i] == '"' || text[i] == '\n' || text[i] == '\r';
+            }
+            if (!quote) {
+                out_bytes(e, text, sz);
+                break;
+            }
+            out_char(e, '"');
+            int run = 0;
+            for (int i = 0; i < sz; i++) {
+                if (text[i] != '"') continue;
+                out_bytes(e, text + run, i + 1 - run);
+                out_char(e, '"');
+                run = i + 1;
+            }
+            out_bytes(e, text + run, sz - run);
+            out_char(e, '"');
+            break;
+        }
+        default: {
+            // formatted as JSON then quoted, doubling any quotes
+            exporter_t json;
+            memset(&json, 0, sizeof(json));
+            if (e->scratch == NULL) e->scratch = malloc(OUT_BUF_SZ);
+            json.buf = e->scratch;
+            json.fd = -1;
+            out_json_selected(&json, it);
+            wireitem_t text;
+            text.kind = WK_TEXT;
+            text.v.text.text = (char*)json.buf;
+            text.v.text.sz = json.n < OUT_BUF_SZ ? json.n : OUT_BUF_SZ;
+            out_char(e, '"');
+            int run = 0;
+            for (int i = 0; i < text.v.text.sz; i++) {
+                if (text.v.text.text[i] != '"') continue;
+                out_bytes(e, text.v.text.text + run, i + 1 - run);
+                out_char(e, '"');
+                run = i + 1;
+            }
+            out_bytes(e, text.v.text.text + run, text.v.text.sz - run);
+            out_char(e, '"');
+        }
+    }
+}
+
+// find each selected field in a message, at any depth, keeping the first of each.
+// Unnamed top-level values match the names they have in JSON output: value, value1..
+void select_fields(exporter_t* e, unsigned char* base, int lim) {
+    for (int f = 0; f < nfields; f++) e->selected[f].kind = WK_END;
+    wirecursor_t c;
+    wireitem_t it;
+    wirecursor_init(&c, base, lim);
+    int unnamed = 0;
+    char synthetic[32];
+    while (wirecursor_next(&c, &it) > WK_ERROR) {
+        if (it.name == NULL) {
+            if (it.depth > 0 || it.field_number >= 0 || it.kind == WK_NEST_END) continue;
+            it.name = synthetic;
+            it.name_sz = unnamed ? snprintf(synthetic, sizeof(synthetic), "value%d", unnamed) : snprintf(synthetic, sizeof(synthetic), "value");
+            unnamed++;
+        }
+        for (int f = 0; f < nfields; f++) {
+            if (fields_sz[f] != it.name_sz || memcmp(fields[f], it.name, it.name_sz) != 0) continue;
+            if (e->selected[f].kind == WK_END) e->selected[f] = it;
+            break;
+        }
+    }
+}
+
+void out_csv_header(exporter_t* e) {
+    out_lit(e, "index");
+    for (int f = 0; f < nfields; f++) {
+        out_char(e, ',');
+        out_bytes(e, fields[f], fields_sz[f]);
+    }
+    out_char(e, '\n');
+}
+
+// per-cycle output
+
+char* cycle_output_path(uint64_t cycle, char* dir, char* suffix) {
+    char* fn = chronicle_get_cycle_fn(queue, cycle);
+    char* base = strrchr(fn, '/');
+    base = base ? base + 1 : fn;
+    char* dot = strrchr(base, '.');
+    if (dot) *dot = 0;
+    char* path;
+    asprintf(&path, "%s/%s%s", dir, base, suffix);
+    free(fn);
+    return path;
+}
+
+// a worker's messages are in index order within a part, so a new part starts at a
+// change of cycle or a jump in index
+void exporter_begin_part(exporter_t* e, uint64_t cycle, uint64_t index) {
+    out_flush(e);
+    e->cycle = cycle;
+    if (!outdir && !use_parts) return; // one shared output, written in index order
+    if (e->fd >= 0 && e->fd != outfd) close(e->fd);
+
+    char* path;
+    if (use_parts) {
+        asprintf(&path, "%s/cqexport.%d.%" PRIu64 ".part", partdir, (int)getpid(), index);
+        e->fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    } else {
+        path = cycle_output_path(cycle, outdir, format == FMT_CSV ? ".csv" : ".jsonl");
+        e->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (e->fd < 0) {
+        fprintf(stderr, "cqexport: cannot create %s: %s\n", path, strerror(errno));
+        e->failed = 1;
+        free(path);
+        return;
+    }
+    if (use_parts) {
+        part_t* parts = realloc(e->parts, (e->nparts + 1) * sizeof(part_t));
+        if (parts == NULL) {
+            fprintf(stderr, "cqexport: out of memory\n");
+            e->failed = 1;
+            unlink(path);
+            free(path);
+            return;
+        }
+        e->parts = parts;
+        e->parts[e->nparts].path = path;
+        e->parts[e->nparts].cycle = cycle;
+        e->parts[e->nparts].first = index;
+        e->nparts++;
+    } else {
+        free(path);
+        if (format == FMT_CSV) out_csv_header(e);
+    }
+}
+
+exporter_t* exporter_self() {
+    if (self) return self;
+    self = calloc(1, sizeof(exporter_t));
+    self->buf = malloc(OUT_BUF_SZ);
+    self->fd = (outdir || use_parts) ? -1 : outfd; // own files are opened per cycle or part
+    self->cycle = UINT64_MAX;
+    self->selected = calloc(nfields ? nfields : 1, sizeof(wireitem_t));
+    pthread_mutex_lock(&exporters_lock);
+    self->next = exporters;
+    exporters = self;
+    pthread_mutex_unlock(&exporters_lock);
+    return self;
+}
+
+int export_dispatch(void* ctx, uint64_t index, COBJ msg) {
+    exporter_t* e = exporter_self();
+    wireview_t* v = (wireview_t*)msg;
+    uint64_t cycle = chronicle_cycle_of_index(queue, index);
+    if (cycle != e->cycle || (use_parts && index != e->last + 1)) exporter_begin_part(e, cycle, index);
+    e->last = index;
+
+    if (format == FMT_JSONL) {
+        out_lit(e, "{\"index\":");
+        out_u64(e, index);
+        if (nfields == 0) {
+            wirecursor_t c;
+            wirecursor_init(&c, v->base, v->lim);
+            out_json_members(e, &c, 0, 0);
+        } else {
+            select_fields(e, v->base, v->lim);
+            for (int f = 0; f < nfields; f++) {
+                if (e->selected[f].kind == WK_END) continue;
+                out_lit(e, ",\"");
+                out_json_text(e, fields[f], fields_sz[f]);
+                out_lit(e, "\":");
+                out_json_selected(e, &e->selected[f]);
+            }
+        }
+        out_lit(e, "}\n");
+    } else {
+        out_u64(e, index);
+        select_fields(e, v->base, v->lim);
+        for (int f = 0; f < nfields; f++) {
+            out_char(e, ',');
+            out_csv_value(e, &e->selected[f]);
+        }
+        out_char(e, '\n');
+    }
+    e->messages++;
+    return 0;
+}
+
+int cmp_part(const void* a, const void* b) {
+    uint64_t x = ((part_t*)a)->first, y = ((part_t*)b)->first;
+    return x < y ? -1 : x > y;
+}
+
+// append a part file to out, in-kernel where out is a file
+int copy_part(int fd, int out, char* buf) {
+    ssize_t r;
+    while ((r = copy_file_range(fd, NULL, out, NULL, 1L << 30, 0)) > 0);
+    if (r == 0) return 0;
+    while ((r = read(fd, buf, OUT_BUF_SZ)) > 0) {
+        for (char* p = buf; r > 0; ) {
+            ssize_t w = write(out, p, r);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) return -1;
+            p += w;
+            r -= w;
+        }
+    }
+    return r < 0 ? -1 : 0;
+}
+
+// append the part files in index order to the output, or with -o DIR to the file of
+// their cycle, created at its first part. Parts are removed whatever the outcome.
+int join_parts(exporter_t* all) {
+    part_t* parts = NULL;
+    int n = 0;
+    int rc = 0;
+    for (exporter_t* e = all; e; e = e->next) {
+        part_t* grown = realloc(parts, (n + e->nparts) * sizeof(part_t));
+        if (grown == NULL) {
+            fprintf(stderr, "cqexport: out of memory\n");
+            rc = -1;
+            continue;
+        }
+        parts = grown;
+        memcpy(parts + n, e->parts, e->nparts * sizeof(part_t));
+        n += e->nparts;
+    }
+    if (n > 0) qsort(parts, n, sizeof(part_t), &cmp_part);
+    char* buf = malloc(OUT_BUF_SZ);
+    if (buf == NULL) rc = -1;
+    int out = outdir ? -1 : outfd;
+    for (int i = 0; i < n; i++) {
+        if (outdir && (i == 0 || parts[i].cycle != parts[i-1].cycle)) {
+            if (out >= 0) close(out);
+            char* path = cycle_output_path(parts[i].cycle, outdir, format == FMT_CSV ? ".csv" : ".jsonl");
+            out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (out < 0) {
+                fprintf(stderr, "cqexport: cannot create %s: %s\n", path, strerror(errno));
+                rc = -1;
+            } else if (format == FMT_CSV) {
+                exporter_t header;
+                memset(&header, 0, sizeof(header));
+                header.buf = (unsigned char*)buf;
+                header.fd = out;
+                out_csv_header(&header);
+                out_flush(&header);
+                if (header.failed) rc = -1;
+            }
+            free(path);
+        }
+        int fd = open(parts[i].path, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "cqexport: cannot open %s: %s\n", parts[i].path, strerror(errno));
+            rc = -1;
+        } else {
+            if (out < 0 || buf == NULL || copy_part(fd, out, buf) != 0) {
+                if (out >= 0) fprintf(stderr, "cqexport: joining %s failed: %s\n", parts[i].path, strerror(errno));
+                rc = -1;
+            }
+            close(fd);
+        }
+        unlink(parts[i].path);
+        free(parts[i].path);
+    }
+    if (outdir && out >= 0) close(out);
+    free(buf);
+    free(parts);
+    return rc;
+}
+
+// an index, or a time as milliseconds or an ISO date (UTC) for the start of its cycle
+uint64_t parse_position(char* arg, int time) {
+    if (!time) return strtoull(arg, NULL, 0);
+    long ms;
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    char* end = strptime(arg, "%Y-%m-%dT%H:%M:%S", &tm);
+    if (end == NULL) end = strptime(arg, "%Y-%m-%dT%H:%M", &tm);
+    if (end == NULL) end = strptime(arg, "%Y-%m-%d", &tm);
+    if (end != NULL && *end == 0) {
+        ms = (long)timegm(&tm) * 1000;
+    } else {
+        ms = strtol(arg, NULL, 10);
+    }
+    return chronicle_cycle_first_index(queue, chronicle_cycle_from_ms(queue, ms));
+}
+
+int main(const int argc, char **argv) {
+    int c;
+    int nthreads = 1;
+    char* from_arg = NULL;
+    char* to_arg = NULL;
+    int from_time = 0, to_time = 0;
+    char* outfile = NULL;
+    char* field_list = NULL;
+
+    while ((c = getopt(argc, argv, "f:F:i:e:s:t:o:j:")) != -1)
+    switch (c) {
+        case 'f':
+            if (strcmp(optarg, "csv") == 0) format = FMT_CSV;
+            else if (strcmp(optarg, "jsonl") == 0) format = FMT_JSONL;
+            else {
+                fprintf(stderr, "Unknown format '%s'\n", optarg);
+                exit(3);
+            }
+            break;
+        case 'F': field_list = optarg; break;
+        case 'i': from_arg = optarg; from_time = 0; break;
+        case 'e': to_arg = optarg; to_time = 0; break;
+        case 's': from_arg = optarg; from_time = 1; break;
+        case 't': to_arg = optarg; to_time = 1; break;
+        case 'o': outfile = optarg; break;
+        case 'j': nthreads = atoi(optarg); break;
+        case '?':
+            fprintf(stderr, "Option '-%c' missing argument\n", optopt);
+            exit(2);
+        default:
+            fprintf(stderr, "Unknown option '%c'\n", c);
+            exit(3);
+    }
+
+    if (optind + 1 > argc) {
+        printf("Missing mandatory argument.\n Expected: %s [-f jsonl|csv] [-F FIELDS] [-i INDEX] [-e INDEX] [-s TIME] [-t TIME] [-o OUT] [-j THREADS] QUEUE\n", argv[0]);
+        printf("  -f jsonl|csv  output format, default jsonl\n");
+        printf("  -F a,b,c      export only these wire fields (matched at any depth), required for csv\n");
+        printf("  -i INDEX      first index to export\n");
+        printf("  -e INDEX      export up to, not including, INDEX\n");
+        printf("  -s TIME       export from the cycle covering TIME\n");
+        printf("  -t TIME       export up to, not including, the cycle covering TIME\n");
+        printf("  -o OUT        write to file OUT, or to one file per cycle if OUT is a directory\n");
+        printf("  -j THREADS    cycles, or parts of indexed cycles, exported in parallel, default 1\n");
+        printf("\n");
+        printf("cqexport writes each message of QUEUE as a line of JSON, with its index and its wire\n");
+        printf("fields, or as CSV with the selected fields as columns. TIME is milliseconds since the\n");
+        printf("epoch or an ISO date YYYY-MM-DD[THH:MM[:SS]] in UTC.\n");
+        exit(1);
+    }
+    if (nthreads < 1) nthreads = 1;
+
+    if (field_list) {
+        for (char* tok = strtok(field_list, ","); tok; tok = strtok(NULL, ",")) {
+            fields = realloc(fields, (nfields + 1) * sizeof(char*));
+            fields_sz = realloc(fields_sz, (nfields + 1) * sizeof(int));
+            fields[nfields] = tok;
+            fields_sz[nfields] = strlen(tok);
+            nfields++;
+        }
+    }
+    if (format == FMT_CSV && nfields == 0) {
+        fprintf(stderr, "csv output needs fields selected with -F\n");
+        exit(3);
+    }
+
+    queue = chronicle_init(argv[optind]);
+    chronicle_set_decoder(queue, &wire_parse_view, NULL);
+    if (chronicle_open(queue) != 0) {
+        fprintf(stderr, "failed to open %s\n", chronicle_strerror());
+        exit(-1);
+    }
+    uint64_t from_index = from_arg ? parse_position(from_arg, from_time) : 0;
+    uint64_t to_index = to_arg ? parse_position(to_arg, to_time) : UINT64_MAX;
+
+    struct stat st;
+    if (outfile && stat(outfile, &st) == 0 && S_ISDIR(st.st_mode)) {
+        outdir = outfile;
+    } else if (outfile) {
+        outfd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outfd < 0) {
+            fprintf(stderr, "cqexport: cannot create %s: %s\n", outfile, strerror(errno));
+            exit(-1);
+        }
+    }
+    if (nthreads > 1) {
+        use_parts = 1;
+        if (outdir) {
+            partdir = outdir;
+        } else if (outfile) {
+            partdir = strdup(outfile);
+            char* slash = strrchr(partdir, '/');
+            if (slash) *slash = 0; else strcpy(partdir, ".");
+        } else {
+            partdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+        }
+    }
+    if (!outdir && format == FMT_CSV) {
+        // header for the single output, ahead of any worker's lines
+        exporter_t header;
+        memset(&header, 0, sizeof(header));
+        header.buf = malloc(OUT_BUF_SZ);
+        header.fd = outfd;
+        out_csv_header(&header);
+        out_flush(&header);
+        free(header.buf);
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int64_t count = chronicle_replay_parallel(queue, from_index, to_index, nthreads, &export_dispatch, NULL, 0);
+
+    // workers have exited, so flush and close what they left
+    int failed = count < 0;
+    uint64_t bytes = 0;
+    for (exporter_t* e = exporters; e; e = e->next) {
+        out_flush(e);
+        if (e->fd >= 0 && e->fd != outfd) close(e->fd);
+        failed |= e->failed;
+        bytes += e->bytes;
+    }
+    if (use_parts && join_parts(exporters) != 0) failed = 1;
+    if (outfd > 2) close(outfd);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if (count < 0) {
+        fprintf(stderr, "cqexport: %s\n", chronicle_strerror());
+    } else {
+        fprintf(stderr, "cqexport: %" PRId64 " messages, %" PRIu64 " bytes in %.3fs (%.1f MB/s)\n",
+            count, bytes, secs, secs > 0 ? bytes / secs / 1e6 : 0.0);
+    }
+
+    while (exporters) {
+        exporter_t* e = exporters;
+        exporters = e->next;
+        free(e->buf);
+        free(e->selected);
+        free(e->scratch);
+        free(e->parts);
+        free(e);
+    }
+    free(fields);
+    free(fields_sz);
+    chronicle_cleanup(queue);
+    return failed ? 1 : 0;
+}
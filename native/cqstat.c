@@ -0,0 +1,390 @@
+// Copyright 2021 Tea Engineering Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+#include <libchronicle.h>
+#include <wire.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <glob.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Stand-alone tool summarising each cycle file of a queue: message and metadata
+// counts, payload sizes, how far the file is written, its index pages and anything
+// left unfinished (a missing EOF, a working header). Files are mapped read-only.
+//
+// When the queuefile header points at index pages (files written by Java), messages
+// up to the last index entry are counted from the index and only the entries after
+// it are walked, so a file costs a few page reads however large it is. Payload sizes
+// before the last entry are then estimated from the indexed messages, each standing
+// for indexSpacing messages. -f walks every entry instead, and checks that each index
+// entry points at the message it should.
+
+#define SIZE_BUCKETS 32
+
+typedef struct {
+    int64_t        index_count;
+    int64_t        index_spacing;
+    int64_t        index2index;
+    unsigned char* pages[1024]; // values of each index page in use
+    uint64_t       page_pos[1024];
+    uint64_t       page_sz[1024]; // entry size, header included
+    uint64_t       npages;
+    uint64_t       entries;
+} index_t;
+
+typedef struct {
+    uint64_t       file_sz;
+    uint64_t       tip; // offset of the first header not written
+    uint64_t       messages;
+    uint64_t       metadata;
+    uint64_t       payload; // data bytes, less headers and (from the index) with alignment
+    uint64_t       overhead; // data headers and alignment
+    uint64_t       meta_bytes; // metadata entries, headers included
+    uint64_t       min_sz;
+    uint64_t       max_sz;
+    uint64_t       sizes[SIZE_BUCKETS]; // payloads with a bit length of i
+    int            estimated; // counted from the index
+    uint64_t       after_index; // data messages after the last index entry
+    uint64_t       index_errors;
+    int            eof;
+    uint32_t       working; // header at the tip, if it is a working header
+    int            truncated; // an entry runs past the end of the file
+} cyclestat_t;
+
+static int version;
+static int full_scan;
+
+static inline uint32_t read_header(unsigned char* p) {
+    uint32_t header;
+    memcpy(&header, p, sizeof(header));
+    return header;
+}
+
+static inline uint64_t entry_sz(uint32_t header) {
+    uint64_t sz = header & HD_MASK_LENGTH;
+    return 4 + sz + (version < 5 ? 0 : -sz & 0x03);
+}
+
+static inline int bit_length(uint64_t v) {
+    return v ? 64 - __builtin_clzll(v) : 0;
+}
+
+static void record_size(cyclestat_t* s, uint64_t sz, uint64_t weight) {
+    if (sz < s->min_sz) s->min_sz = sz;
+    if (sz > s->max_sz) s->max_sz = sz;
+    int b = bit_length(sz);
+    s->sizes[b < SIZE_BUCKETS ? b : SIZE_BUCKETS - 1] += weight;
+}
+
+// values of the first I64_ARRAY in the metadata entry at pos, NULL if there is none
+static unsigned char* metadata_array(unsigned char* base, uint64_t file_sz, uint64_t pos, uint64_t* capacity) {
+    if (pos == 0 || pos + 4 > file_sz) return NULL;
+    uint32_t header = read_header(base + pos);
+    if ((header & HD_MASK_META) != HD_METADATA) return NULL;
+    uint64_t sz = header & HD_MASK_LENGTH;
+    if (pos + 4 + sz > file_sz) return NULL;
+    return wire_i64_array(base + pos + 4, sz, capacity);
+}
+
+static inline uint64_t index_entry(index_t* ix, uint64_t k) {
+    uint64_t v;
+    memcpy(&v, ix->pages[k / ix->index_count] + (k % ix->index_count) * 8, sizeof(v));
+    return v;
+}
+
+// index settings from the queuefile header, and the index pages it leads to
+static void read_index(unsigned char* base, uint64_t file_sz, index_t* ix) {
+    memset(ix, 0, sizeof(*ix));
+    if (file_sz < 4) return;
+    uint32_t header = read_header(base);
+    if ((header & HD_MASK_META) != HD_METADATA || 4 + (header & HD_MASK_LENGTH) > file_sz) return;
+
+    wirecursor_t c;
+    wireitem_t it;
+    wirecursor_init(&c, base + 4, header & HD_MASK_LENGTH);
+    while (wirecursor_next(&c, &it) > WK_ERROR) {
+        if (it.kind != WK_INT || it.name == NULL) continue;
+        if (it.name_sz == 10 && memcmp(it.name, "indexCount", 10) == 0) ix->index_count = it.v.i64;
+        if (it.name_sz == 12 && memcmp(it.name, "indexSpacing", 12) == 0) ix->index_spacing = it.v.i64;
+        if (it.name_sz == 11 && memcmp(it.name, "index2Index", 11) == 0) ix->index2index = it.v.i64;
+    }
+    if (ix->index_count <= 0 || ix->index_spacing <= 0 || ix->index2index <= 0) return;
+
+    uint64_t capacity;
+    unsigned char* i2i = metadata_array(base, file_sz, ix->index2index, &capacity);
+    if (i2i == NULL) return;
+    uint64_t used = wire_i64_used(i2i, capacity);
+    for (uint64_t p = 0; p < used && p < sizeof(ix->pages)/sizeof(ix->pages[0]); p++) {
+        uint64_t pos;
+        memcpy(&pos, i2i + p * 8, sizeof(pos));
+        uint64_t page_capacity;
+        unsigned char* values = metadata_array(base, file_sz, pos, &page_capacity);
+        if (values == NULL || page_capacity != (uint64_t)ix->index_count) break;
+        uint64_t n = wire_i64_used(values, page_capacity);
+        ix->pages[p] = values;
+        ix->page_pos[p] = pos;
+        ix->page_sz[p] = entry_sz(read_header(base + pos));
+        ix->npages++;
+        ix->entries += n;
+        // only the last page in use may be partly filled
+        if (n < page_capacity) break;
+    }
+}
+
+// walk entries from pos, numbering data messages from n, to the tip, EOF or a working header
+static void walk(cyclestat_t* s, unsigned char* base, uint64_t pos, uint64_t n, index_t* ix) {
+    while (1) {
+        if (pos + 4 > s->file_sz) {
+            s->truncated = 1;
+            break;
+        }
+        uint32_t header = read_header(base + pos);
+        uint64_t sz = header & HD_MASK_LENGTH;
+        if (header == HD_UNALLOCATED) break;
+        if ((header & HD_MASK_META) == HD_WORKING) {
+            s->working = header;
+            break;
+        }
+        if ((header & HD_MASK_META) == HD_EOF) {
+            s->eof = 1;
+            break;
+        }
+        if (pos + 4 + sz > s->file_sz) {
+            s->truncated = 1;
+            break;
+        }
+        if ((header & HD_MASK_META) == HD_METADATA) {
+            s->metadata++;
+            s->meta_bytes += entry_sz(header);
+        } else {
+            if (ix && ix->entries && n % ix->index_spacing == 0) {
+                uint64_t k = n / ix->index_spacing;
+                if (k < ix->entries && index_entry(ix, k) != pos) s->index_errors++;
+            }
+            if (ix && ix->entries && n > (ix->entries - 1) * ix->index_spacing) s->after_index++;
+            s->messages++;
+            s->payload += sz;
+            s->overhead += entry_sz(header) - sz;
+            record_size(s, sz, 1);
+            n++;
+        }
+        pos += entry_sz(header);
+    }
+    s->tip = pos;
+}
+
+static int stat_file(char* fn, cyclestat_t* s, index_t* ix) {
+    memset(s, 0, sizeof(*s));
+    s->min_sz = UINT64_MAX;
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    s->file_sz = st.st_size;
+    if (s->file_sz == 0) {
+        close(fd);
+        return 0;
+    }
+    unsigned char* base = mmap(0, s->file_sz, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+
+    read_index(base, s->file_sz, ix);
+    uint64_t last = ix->entries ? index_entry(ix, ix->entries - 1) : 0;
+    if (!full_scan && ix->entries > 1 && last < s->file_sz) {
+        // counts up to the last entry come from the index: the indexed messages stand
+        // in for the sizes of those around them, and everything not known to be
+        // metadata (the header, index2index and index pages) is data
+        s->estimated = 1;
+        uint64_t n = (ix->entries - 1) * ix->index_spacing;
+        for (uint64_t k = 0; k + 1 < ix->entries; k++) {
+            uint64_t pos = index_entry(ix, k);
+            if (pos + 4 <= s->file_sz) record_size(s, read_header(base + pos) & HD_MASK_LENGTH, ix->index_spacing);
+        }
+        uint64_t meta_before = entry_sz(read_header(base));
+        s->metadata = 1;
+        if ((uint64_t)ix->index2index < last) {
+            meta_before += entry_sz(read_header(base + ix->index2index));
+            s->metadata++;
+        }
+        for (uint64_t p = 0; p < ix->npages; p++) {
+            if (ix->page_pos[p] < last) {
+                meta_before += ix->page_sz[p];
+                s->metadata++;
+            }
+        }
+        s->meta_bytes = meta_before;
+        s->messages = n;
+        s->overhead = 4 * n;
+        s->payload = last > meta_before + 4 * n ? last - meta_before - 4 * n : 0;
+        walk(s, base, last, n, ix);
+    } else {
+        if (full_scan) madvise(base, s->file_sz, MADV_SEQUENTIAL);
+        walk(s, base, 0, 0, ix);
+    }
+    munmap(base, s->file_sz);
+    return 0;
+}
+
+static void print_sizes(uint64_t* sizes) {
+    printf("  sizes      ");
+    int any = 0;
+    for (int b = 0; b < SIZE_BUCKETS; b++) {
+        if (sizes[b] == 0) continue;
+        uint64_t lo = b ? (uint64_t)1 << (b - 1) : 0;
+        uint64_t hi = b ? ((uint64_t)1 << b) - 1 : 0;
+        if (lo == hi) printf(" %" PRIu64 ":%" PRIu64, lo, sizes[b]);
+        else printf(" %" PRIu64 "-%" PRIu64 ":%" PRIu64, lo, hi, sizes[b]);
+        any = 1;
+    }
+    printf("%s\n", any ? "" : " none");
+}
+
+// probes the writer's registration as recovery does, so agrees with it across pid
+// namespaces and pid reuse
+static void print_working(queue_t* queue, uint32_t header) {
+    uint32_t pid = header & (HD_WRITER_PID - 1);
+    if (!(header & HD_WRITER_PID)) {
+        printf("working header, no pid recorded\n");
+        return;
+    }
+    switch (chronicle_writer_dead(queue, pid)) {
+    case 0:
+        printf("working header, pid %u holds its registration (write in progress)\n", pid);
+        break;
+    case 1:
+        printf("working header, pid %u has exited (stale)\n", pid);
+        break;
+    default:
+        printf("working header, pid %u is not registered\n", pid);
+    }
+}
+
+int main(const int argc, char **argv) {
+    int c;
+    int quiet = 0;
+
+    while ((c = getopt(argc, argv, "fq")) != -1)
+    switch (c) {
+        case 'f': full_scan = 1; break;
+        case 'q': quiet = 1; break;
+        case '?':
+            fprintf(stderr, "Option '-%c' missing argument\n", optopt);
+            exit(2);
+        default:
+            fprintf(stderr, "Unknown option '%c'\n", c);
+            exit(3);
+    }
+
+    if (optind + 1 > argc) {
+        printf("Missing mandatory argument.\n Expected: %s [-f] [-q] QUEUE\n", argv[0]);
+        printf("  -f   walk every entry, rather than counting from index pages, and check the index\n");
+        printf("  -q   totals only\n");
+        printf("\n");
+        printf("cqstat reports, for each cycle file of QUEUE: data and metadata counts, payload sizes,\n");
+        printf("the write tip against the file size, index page use, and whether the file ends with an\n");
+        printf("EOF or a working header. Counts from the index are marked as such.\n");
+        exit(1);
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    queue_t* queue = chronicle_init(argv[optind]);
+    if (chronicle_open(queue) != 0) {
+        fprintf(stderr, "failed to open %s\n", chronicle_strerror());
+        exit(-1);
+    }
+    version = chronicle_get_version(queue);
+
+    char* pattern;
+    asprintf(&pattern, "%s/*.cq4", argv[optind]);
+    glob_t g;
+    if (glob(pattern, 0, NULL, &g) != 0) g.gl_pathc = 0;
+
+    cyclestat_t total;
+    memset(&total, 0, sizeof(total));
+    total.min_sz = UINT64_MAX;
+    index_t ix;
+    int problems = 0;
+    for (size_t i = 0; i < g.gl_pathc; i++) {
+        cyclestat_t s;
+        if (stat_file(g.gl_pathv[i], &s, &ix) != 0) {
+            fprintf(stderr, "cqstat: cannot read %s: %s\n", g.gl_pathv[i], strerror(errno));
+            problems++;
+            continue;
+        }
+        int last = i + 1 == g.gl_pathc;
+        int missing_eof = !last && !s.eof;
+        problems += missing_eof + (s.working != 0) + s.truncated + (s.index_errors > 0);
+
+        total.file_sz += s.file_sz;
+        total.messages += s.messages;
+        total.metadata += s.metadata;
+        total.payload += s.payload;
+        total.overhead += s.overhead;
+        total.meta_bytes += s.meta_bytes;
+        total.estimated |= s.estimated;
+        if (s.min_sz < total.min_sz) total.min_sz = s.min_sz;
+        if (s.max_sz > total.max_sz) total.max_sz = s.max_sz;
+        for (int b = 0; b < SIZE_BUCKETS; b++) total.sizes[b] += s.sizes[b];
+        if (quiet) continue;
+
+        char* name = strrchr(g.gl_pathv[i], '/');
+        printf("%s\n", name ? name + 1 : g.gl_pathv[i]);
+        printf("  messages   %" PRIu64 " data, %" PRIu64 " metadata%s\n", s.messages, s.metadata,
+            s.estimated ? " (from index)" : "");
+        if (s.messages) {
+            printf("  payload    %" PRIu64 " bytes%s, sizes %" PRIu64 "..%" PRIu64 ", mean %.1f\n", s.payload,
+                s.estimated ? " with alignment" : "", s.min_sz, s.max_sz, (double)s.payload / s.messages);
+        }
+        printf("  overhead   %" PRIu64 " bytes of headers and alignment, %" PRIu64 " bytes of metadata\n", s.overhead, s.meta_bytes);
+        printf("  written    %" PRIu64 " of %" PRIu64 " bytes (%.2f%%), %" PRIu64 " free\n", s.tip, s.file_sz,
+            s.file_sz ? 100.0 * s.tip / s.file_sz : 0.0, s.file_sz - s.tip);
+        if (ix.entries) {
+            printf("  index      %" PRIu64 " of %" PRId64 " pages, %" PRIu64 " entries every %" PRId64 " messages, %" PRIu64 " messages after the last entry",
+                ix.npages, ix.index_count, ix.entries, ix.index_spacing, s.after_index);
+            if (s.index_errors) printf(", %" PRIu64 " entries misplaced", s.index_errors);
+            printf("\n");
+        } else {
+            printf("  index      none\n");
+        }
+        printf("  end        ");
+        if (s.eof) printf("EOF\n");
+        else if (s.working) print_working(queue, s.working);
+        else if (s.truncated) printf("entry runs past the end of the file\n");
+        else if (missing_eof) printf("missing EOF, a later cycle exists\n");
+        else printf("open for writing\n");
+        if (s.working && missing_eof) printf("             missing EOF, a later cycle exists\n");
+        print_sizes(s.sizes);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+
+    printf("total: %zu cycle files, %" PRIu64 " data, %" PRIu64 " metadata%s, %" PRIu64 " payload bytes",
+        g.gl_pathc, total.messages, total.metadata, total.estimated ? " (partly from index)" : "", total.payload);
+    if (total.messages) printf(", sizes %" PRIu64 "..%" PRIu64, total.min_sz, total.max_sz);
+    printf(", %" PRIu64 " bytes of cycle files, %d problems, in %.1fms\n", total.file_sz, problems, ms);
+    if (quiet) print_sizes(total.sizes);
+
+    globfree(&g);
+    free(pattern);
+    chronicle_cleanup(queue);
+    return problems ? 1 : 0;
+}
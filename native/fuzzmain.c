@@ -27,6 +27,7 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <time.h>
 #include "k.h"
 #include "mock_k.h"
 #include "serdes_k.h"
@@ -67,9 +68,15 @@ uint32_t xorshift128(uint32_t state[static 4]) {
 // Due to the fail the random number generator leaks a tonne of malloc() mem.
 // Reported but unresolved https://www.mail-archive.com/kde-bugs-dist@kde.org/msg209613.html
 static inline uint64_t rdtsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
     uint32_t a, d;
     __asm__ __volatile__("rdtscp" : "=a" (a), "=d" (d));
     return (((uint64_t) d << 32) | a);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000L + ts.tv_nsec;
+#endif
 }
 int c_mkstemp(char* pattern) {
     uint32_t xor_state[4];
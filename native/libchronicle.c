@@ -26,20 +26,50 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <sys/time.h>
+#include <signal.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
 #include <libchronicle.h>
 
 #include "wire.h"
 #include "buffer.h"
+#include "log.h"
 
 /**
  * Implementation notes
- * This code is not reentrant, nor does it create any threads, so this is not a problem.
- * Should not be used by additional threads without external locking.
  * Multiple processes can append and tail from a queue concurrently, and one process
  * may read or write from multiple queues.
  *
+ * Threading model: a tailer belongs to one thread at a time, and different threads may
+ * peek different tailers of the same queue concurrently without any global lock. Errors
+ * are reported per-thread (cerr_msg is thread-local). Four kinds of lock exist:
+ *  - queues_lock (recursive, process-wide) guards membership of the queue list and of
+ *    each queue's tailer list: init/cleanup, tailer open/close, and walks over them by
+ *    chronicle_peek, chronicle_peek_queue and chronicle_debug.
+ *  - evict_lock (process-wide) serialises mapping eviction, and is also taken inside
+ *    queues_lock wherever the queue or tailer lists change, so eviction can walk them
+ *    without queues_lock. A peek holds its tailer->lock when it evicts, and chronicle_peek
+ *    takes tailer locks inside queues_lock, so eviction must not wait for queues_lock.
+ *  - queue->lock guards the shared queuefile and mapping caches, their refcounts, the
+ *    slow-path refresh of queuefile sizes and of the directory-listing values. Held
+ *    briefly, and never while calling user code or taking another lock.
+ *  - tailer->lock is held for the duration of a peek (and by the appender across a
+ *    whole append), so that eviction from another thread can skip a tailer whose window
+ *    is in use. Eviction only ever trylocks tailers, so it cannot deadlock with a peek.
+ * Peeking the same tailer from two threads at once, or from within its own callback,
+ * is not supported. chronicle_peek() and chronicle_peek_queue() peek every tailer, so
+ * should not be mixed with threads that own tailers of the same queue.
+ * Global counters (mapped_bytes, peek_clock, blocksize) are updated with __atomic builtins,
+ * and patch_cycles/qf_disk_sz/replay_readahead/replay_pending_max are treated as read-only,
+ * as are debug and wire_trace once the first chronicle_init has read them.
+ *
  * TODO: current iteration requires a Java Chronicle-Queues appender to be writing to the same
  * queue on a periodic timer to roll over the log files correctly and maintain the index structures.
  *
@@ -47,7 +77,7 @@
  * and mmaps used for writing are separate to those used in recovery.
  *
  * Most of the appender logic is actually just the tailer logic, followed by cas write-lock.
- * For interesting concurrency parts search 'lock_cmpxchgl' and 'mfence'.
+ * For interesting concurrency parts search 'header_cas', 'header_load' and 'header_store'.
  *
  * To gurantee we can read and write payloads of 'blocksize' length we map
  * 2x blocksize each time, aligning the map offset to be a multiple of blocksize from
@@ -65,6 +95,10 @@
  * in the debug output. shmipc_peek_tailer_r re-uses existing generated filenames, fids
  * and maps from previous invocations as much as possible.
  *
+ * Open queuefiles and mapped windows are held in per-queue refcounted lists (queue->queuefiles,
+ * queue->mappings) so that many tailers following the same cycle share one fid and one mmap,
+ * and only the first tailer to reach a new cycle or window pays for the open/fstat/mmap.
+ *
  * patch_cycles is a variable that controls compatability with Java and is only relevant
  * when opening an old queue that may not have been written to recently. When an appender is
  * started, it starts seeking for the write position from (highetCycle-patch_cycles),
@@ -80,10 +114,10 @@
 // MetaDataKeys `header`index2index`index`roll
 
 // error handling
-const char* cerr_msg;
+__thread const char* cerr_msg;
 // error handling - trigger
 int chronicle_err(const char* msg) {
-    printf("chronicle error: '%s\n", msg);
+    CLOG(LL_ERROR, "%s", msg);
     errno = -1;
     cerr_msg = msg;
     return -1;
@@ -101,11 +135,44 @@ const char* tailer_state_messages[] = {"AWAITING_ENTRY", "BUSY", "AWAITING_QUEUE
 
 // structures
 
-typedef struct {
-    unsigned char *highest_cycle;
-    unsigned char *lowest_cycle;
-    unsigned char *modcount;
-} dirlist_fields_t;
+// roll and index settings from the header metadata of directory-listing.cq4t (v5)
+// or the queuefile (v4)
+#define HEADER_FIELDS(X, s) \
+    X(s, length,        "length",        WF_INT64) \
+    X(s, epoch,         "epoch",         WF_INT64) \
+    X(s, format,        "format",        WF_TEXT)  \
+    X(s, index_count,   "indexCount",    WF_INT64) \
+    X(s, index_spacing, "indexSpacing",  WF_INT64)
+WIRE_SCHEMA(header, HEADER_FIELDS)
+
+// values polled and updated in place within the directory-listing mmap
+#define DIRLIST_FIELDS(X, s) \
+    X(s, highest_cycle, "listing.highestCycle", WF_PTR) \
+    X(s, lowest_cycle,  "listing.lowestCycle",  WF_PTR) \
+    X(s, modcount,      "listing.modCount",     WF_PTR)
+WIRE_SCHEMA(dirlist_fields, DIRLIST_FIELDS)
+
+// queuefile and mapping handles are shared between all tailers (and the appender) of
+// a queue, keyed by (cycle, protection) and (queuefile, window) respectively. Each is
+// refcounted and closed or unmapped when the last tailer lets go of it.
+typedef struct queuefile {
+    uint64_t          cycle;
+    int               mmap_protection; // PROT_READ, or PROT_READ|PROT_WRITE for appenders
+    char*             fn;
+    int               fd;
+    uint64_t          size; // st_size at the last refresh, read with __atomic outside queue->lock
+    int               refcount;
+    struct queuefile* next;
+} queuefile_t;
+
+typedef struct mapping {
+    queuefile_t*      qf;
+    uint64_t          mmapoff;
+    uint64_t          mmapsz;
+    unsigned char*    buf;
+    int               refcount;
+    struct mapping*   next;
+} mapping_t;
 
 struct tailer {
     uint64_t          dispatch_after; // for resume support
@@ -115,18 +182,45 @@ struct tailer {
     // to support the 'collect' operation to wait and return next item, ignoring callback
     collected_t*      collect;
 
+    // raw filter stage ahead of parse and dispatch, as a callback and/or as a
+    // mask/compare of up to 16 bytes at filter_offset
+    cfilter_f         filter;
+    void*             filter_ctx;
+    int               filter_offset;
+    int               filter_len;
+    uint64_t          filter_mask[2];
+    uint64_t          filter_value[2];
+    uint64_t          filtered; // count of messages rejected
+
+    pthread_mutex_t   lock; // held while peeking, see threading model
     int               mmap_protection; // PROT_READ etc.
+    uint64_t          last_peek; // peek_clock at last peek, for LRU eviction of the mapping
+    uint64_t          evict_pass; // eviction pass that found this tailer locked
+
+    // historical replay: readahead of the window and drop-behind of the page cache
+    int               replay;
+    uint64_t          replay_dropped; // file offset below which we've dropped the page cache
 
-    // currently open queue file
-    uint64_t          qf_cycle_open;
+    // currently open queue file (shared via. queue->queuefiles)
     char*             qf_fn;
-    struct stat       qf_statbuf;
-    int               qf_fd;
+    queuefile_t*      qf;
 
     uint64_t          qf_tip; // byte position of the next header, or zero if unknown
     uint64_t          qf_index; // seqnum of the header pointed to by qf_tip
 
-    // currently mapped region: buffer, offset (from 0 in file), size
+    // appender only: entry held between reserve and commit, by reserver. reserved is
+    // read by other threads to find they are not the reserver, so is set atomically
+    unsigned char*    reserved;
+    size_t            reserved_sz;
+    pthread_t         reserver;
+
+    // appender only: working header last seen at busy_tip and when, for dead-writer recovery
+    uint32_t          busy_header;
+    uint64_t          busy_tip;
+    long              busy_since;
+
+    // currently mapped region (shared via. queue->mappings): buffer, offset (from 0 in file), size
+    mapping_t*        qf_map;
     unsigned char*    qf_buf;
     uint64_t          qf_mmapoff;
     uint64_t          qf_mmapsz;
@@ -137,7 +231,15 @@ struct tailer {
     struct tailer*    prev;
 };
 
+// a directory-listing mapping replaced while pollers may still hold pointers into it
+typedef struct retired {
+    unsigned char*    buf;
+    size_t            sz;
+    struct retired*   next;
+} retired_t;
+
 struct queue {
+    pthread_mutex_t   lock; // queuefiles, mappings, stat and directory-listing refresh
     char*             dirname;
     uint              blocksize;
     uint8_t           version;
@@ -148,7 +250,8 @@ struct queue {
     int               dirlist_fd;
     struct stat       dirlist_statbuf;
     unsigned char*    dirlist; // mmap base
-    dirlist_fields_t  dirlist_fields;
+    dirlist_fields_t  dirlist_fields; // pointers into dirlist, read with __atomic by pollers
+    struct retired*   dirlist_retired; // earlier mappings other threads may still poll through
 
     char*             queuefile_pattern;
     glob_t            queuefile_glob; // last glob of data files, refreshed by poll on modcount
@@ -176,16 +279,30 @@ struct queue {
     cappend_f         append_write;
 
     tailer_t*         tailers;
-
-    // the appender is a shared tailer, polled by append[], with writing logic
-    // and no callback to user code for events
+    tailer_t*         appenders; // opened with chronicle_appender_open, including appender
+    int               dirlist_rw; // directory-listing re-opened for writing
+
+    // open queuefiles and mapped windows, shared by tailers and appender
+    queuefile_t*      queuefiles;
+    mapping_t*        mappings;
+    uint64_t          mapped_bytes; // updated under lock, read without, so __atomic
+    int               numa_node; // preferred node for mapped windows, -1 for none
+
+    // dead-writer recovery, see appender_recover_working
+    long              recovery_ms; // age of a working header before its writer is checked, 0 disables
+    uint64_t          recoveries;
+    int               writer_fd; // shared-locked registration of this process, see writer_register
+    char*             writer_fn;
+
+    // the appender is a shared tailer, polled by chronicle_append[_ts], with writing
+    // logic and no callback to user code for events
     tailer_t*         appender;
 
     struct queue*     next;
 };
 
 
-typedef enum {QB_AWAITING_ENTRY, QB_BUSY, QB_REACHED_EOF, QB_NEED_EXTEND, QB_NULL_ITEM, QB_COLLECTED} parseqb_state_t;
+typedef enum {QB_AWAITING_ENTRY, QB_BUSY, QB_REACHED_EOF, QB_NEED_EXTEND, QB_NULL_ITEM, QB_COLLECTED, QB_RETRY} parseqb_state_t;
 
 typedef parseqb_state_t (*datacallback_f)(unsigned char*,int,uint64_t,void* userdata);
 
@@ -193,41 +310,75 @@ typedef parseqb_state_t (*datacallback_f)(unsigned char*,int,uint64_t,void* user
 // paramaters that control behavior, not exposed for modification
 uint32_t patch_cycles = 3;
 long int qf_disk_sz = 83754496L;
+uint64_t replay_readahead = 16L*1024*1024;
+size_t replay_pending_max = 64*1024; // messages an ordered replay worker buffers ahead of its turn
 
 // globals
-int debug = 0;
+int debug = 0; // SHMIPC_DEBUG, also dumps message bytes
+uint64_t mapping_budget = 0; // process-wide ceiling on mapped queuefile bytes, 0 unlimited
+uint64_t mapped_bytes = 0;
+uint64_t map_count = 0;    // queuefile windows mmap()ed, including re-maps
+uint64_t peek_clock = 0;
 uint32_t pid_header = 0;
 queue_t* queue_head = NULL;
+pthread_mutex_t queues_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+pthread_mutex_t evict_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t evict_pass = 0; // under evict_lock, marks tailers found locked in this pass
 
 
 // forward declarations that are not part of the public api
-void parse_dirlist(queue_t*);
+void parse_dirlist(queue_t*, unsigned char*, int, dirlist_fields_t*);
 void parse_queuefile_meta(unsigned char*, int, queue_t*);
 void parse_queuefile_data(unsigned char*, int, queue_t*, tailer_t*, uint64_t);
 int queuefile_init(char*, queue_t*);
 int directory_listing_reopen(queue_t*, int, int);
 int directory_listing_init(queue_t*, uint64_t cycle);
+void writer_register(queue_t*);
 
 long       chronicle_clock_ms(queue_t*);
 uint64_t   chronicle_cycle_from_ms(queue_t*, long);
 int        chronicle_peek_queue_tailer(queue_t*, tailer_t*);
+void       tailer_release_mapping(tailer_t*);
+uint64_t   chronicle_append_locked(queue_t*, tailer_t*, COBJ, size_t, long);
+int        appender_prepare(queue_t*, size_t);
+unsigned char* appender_claim_locked(queue_t*, tailer_t*, size_t, long);
+uint64_t   appender_publish(tailer_t*, unsigned char*, size_t);
+
+// Entry headers are the only synchronisation between writers and readers. A reader
+// acquires the header before looking at the payload, and a writer releases the header
+// only once the payload is in place, so neither needs a full fence: on x86 both are
+// plain moves. v4 headers need not be 4-byte aligned, and are read with a fence
+// instead, as some platforms cannot atomically load an unaligned word.
+static inline uint32_t header_load(unsigned char* mem) {
+    uint32_t header;
+    if (((uintptr_t)mem & 3) == 0) return __atomic_load_n((uint32_t*)mem, __ATOMIC_ACQUIRE);
+    memcpy(&header, mem, sizeof(header));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return header;
+}
+
+static inline void header_store(unsigned char* mem, uint32_t header) {
+    if (((uintptr_t)mem & 3) == 0) {
+        __atomic_store_n((uint32_t*)mem, header, __ATOMIC_RELEASE);
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(mem, &header, sizeof(header));
+}
 
-// compare and swap, 32 bits, addressed by a 64bit pointer
-static inline uint32_t lock_cmpxchgl(unsigned char *mem, uint32_t newval, uint32_t oldval) {
-    __typeof (*mem) ret;
-    __asm __volatile ("lock; cmpxchgl %2, %1"
-    : "=a" (ret), "=m" (*mem)
-    : "r" (newval), "m" (*mem), "0" (oldval));
-    return (uint32_t) ret;
+// compare and swap, 32 bits, returns the value found at mem, which equals oldval if
+// newval was stored. Taking the header orders our payload writes after it.
+static inline uint32_t header_cas(unsigned char* mem, uint32_t newval, uint32_t oldval) {
+    __atomic_compare_exchange_n((uint32_t*)mem, &oldval, newval, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return oldval;
 }
 
-static inline uint32_t lock_xadd(unsigned char* mem, uint32_t val) {
-    __asm__ volatile("lock; xaddl %0, %1"
-    : "+r" (val), "+m" (*mem) // input+output
-    : // No input-only
-    : "memory"
-    );
-    return (uint32_t)val;
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile ("yield" ::: "memory");
+#endif
 }
 
 char* chronicle_get_cycle_fn(queue_t* queue, int cycle) {
@@ -249,25 +400,39 @@ char* chronicle_get_cycle_fn(queue_t* queue, int cycle) {
     return fnbuf;
 }
 
-void queue_double_blocksize(queue_t* queue) {
-    uint new_blocksize = queue->blocksize << 1;
-    printf("shmipc:  doubling blocksize from %x to %x\n", queue->blocksize, new_blocksize);
-    queue->blocksize = new_blocksize;
+// double from the blocksize the caller observed, so racing threads only double once
+void queue_double_blocksize(queue_t* queue, uint blocksize) {
+    uint new_blocksize = blocksize << 1;
+    if (__atomic_compare_exchange_n(&queue->blocksize, &blocksize, new_blocksize, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        CLOG(LL_INFO, "shmipc:  doubling blocksize from %x to %x\n", blocksize, new_blocksize);
+    }
 }
 
 
-queue_t* chronicle_init(char* dir) {
+// environment switches are read by the first chronicle_init only, so the globals they
+// set are never written while other threads peek
+static pthread_once_t env_once = PTHREAD_ONCE_INIT;
+
+static void chronicle_read_env() {
     char* debug_env = getenv("SHMIPC_DEBUG");
     debug = (debug_env == NULL) ? 0 : strcmp(debug_env, "1") == 0;
+    if (debug) chronicle_set_log_level(LL_DEBUG);
     char* wiretrace_env = getenv("SHMIPC_WIRETRACE");
     wire_trace = (wiretrace_env == NULL) ? 0 : strcmp(wiretrace_env, "1") == 0;
+}
 
-    pid_header = (getpid() & HD_MASK_LENGTH);
+queue_t* chronicle_init(char* dir) {
+    pthread_once(&env_once, &chronicle_read_env);
+    pthread_mutex_lock(&queues_lock);
+    pid_header = HD_WRITER_PID | (getpid() & (HD_WRITER_PID - 1));
 
     // allocate struct, we'll link if all checks pass
+    pthread_mutex_unlock(&queues_lock);
+
     queue_t* queue = malloc(sizeof(queue_t));
     if (queue == NULL) return chronicle_perr("m fail");
     bzero(queue, sizeof(queue_t));
+    pthread_mutex_init(&queue->lock, NULL);
 
     // wire up default 'text' parsers for data segments
     queue->parser = &chronicle_decoder_default_parse;
@@ -278,10 +443,16 @@ queue_t* chronicle_init(char* dir) {
     queue->dirname = strdup(dir);
     queue->blocksize = 1024*1024; // must be a power of two (single 1 bit)
     queue->roll_epoch = -1;
+    queue->numa_node = -1;
+    queue->writer_fd = -1;
 
     // Good to use
+    pthread_mutex_lock(&queues_lock);
+    pthread_mutex_lock(&evict_lock);
     queue->next = queue_head;
     queue_head = queue;
+    pthread_mutex_unlock(&evict_lock);
+    pthread_mutex_unlock(&queues_lock);
 
     return queue;
 }
@@ -309,7 +480,7 @@ int chronicle_version_detect(queue_t* queue) {
 
 int chronicle_open(queue_t* queue) {
 
-    if (debug) printf("shmipc: opening dir %s\n", queue->dirname);
+    CLOG(LL_DEBUG, "shmipc: opening dir %s\n", queue->dirname);
 
     // Is this a directory
     struct stat statbuf;
@@ -318,7 +489,7 @@ int chronicle_open(queue_t* queue) {
 
     // autodetect version
     int auto_version = chronicle_version_detect(queue);
-    printf("chronicle: detected version v%d\n", auto_version);
+    CLOG(LL_INFO, "chronicle: detected version v%d\n", auto_version);
 
     // Does queue dir contain some .cq4 files?
     // for V5 it is OK to have empty directory
@@ -327,11 +498,9 @@ int chronicle_open(queue_t* queue) {
 
     asprintf(&queue->queuefile_pattern, "%s/*.cq4", queue->dirname);
     glob(queue->queuefile_pattern, GLOB_ERR, NULL, g);
-    if (debug) {
-        printf("shmipc: glob %zu queue files found\n", g->gl_pathc);
-        for (int i = 0; i < g->gl_pathc;i++) {
-            printf("   %s\n", g->gl_pathv[i]);
-        }
+    CLOG(LL_DEBUG, "shmipc: glob %zu queue files found\n", g->gl_pathc);
+    for (int i = 0; i < g->gl_pathc;i++) {
+        CLOG(LL_DEBUG, "   %s\n", g->gl_pathv[i]);
     }
 
     if (auto_version == 0) {
@@ -387,7 +556,7 @@ int chronicle_open(queue_t* queue) {
             return chronicle_err("qfi mmap fail");
 
         // we don't need a data-parser at this stage as only need values from the header
-        if (debug) printf("shmipc: parsing queuefile %s 0..%" PRIu64 "\n", fn, queuefile_extent);
+        CLOG(LL_DEBUG, "shmipc: parsing queuefile %s 0..%" PRIu64 "\n", fn, queuefile_extent);
         parse_queuefile_meta(queuefile_buf, queuefile_extent, queue);
 
         // close queuefile
@@ -401,7 +570,7 @@ int chronicle_open(queue_t* queue) {
     if (queue->roll_length == 0) return chronicle_err("qfi roll_length fail");
     if (queue->roll_epoch == -1) return chronicle_err("qfi roll_epoch fail");
     if (chronicle_set_roll_dateformat(queue, queue->roll_format) != 0) {
-        printf("roll format detected %s\n", queue->roll_format);
+        CLOG(LL_ERROR, "roll format detected %s\n", queue->roll_format);
         return chronicle_err("detected roll_format is not recognised");
     }
     //if (queue->index_count == 0) return chronicle_err("qfi index_count fail");
@@ -415,20 +584,20 @@ int chronicle_open(queue_t* queue) {
 
     // avoids a tailer registration before we have a minimum cycle
     chronicle_peek_queue(queue);
-    if (debug) printf("shmipc: chronicle_open() OK\n");
+    CLOG(LL_DEBUG, "shmipc: chronicle_open() OK\n");
 
     return 0;
 }
 
 void chronicle_set_decoder(queue_t *queue, cparse_f parser, cparsefree_f parser_free) {
-    if (debug & !parser) printf("chronicle: setting NULL parser");
+    if (!parser) CLOG(LL_DEBUG, "chronicle: setting NULL parser");
     queue->parser = parser;
     queue->parser_free = parser_free;
 }
 
 void chronicle_set_encoder(queue_t *queue, csizeof_f append_sizeof, cappend_f append_write) {
-    if (debug & !append_sizeof) printf("chronicle: setting NULL append_sizeof");
-    if (debug & !append_write) printf("chronicle: setting NULL append_write");
+    if (!append_sizeof) CLOG(LL_DEBUG, "chronicle: setting NULL append_sizeof");
+    if (!append_write) CLOG(LL_DEBUG, "chronicle: setting NULL append_write");
     queue->append_sizeof = append_sizeof;
     queue->append_write = append_write;
 }
@@ -467,9 +636,10 @@ struct ROLL_SCHEME chronicle_roll_schemes[] = {
     {"TEST4_DAILY",          "yyyyMMdd'T4'",        24*60*60,     32,     4},
     {"TEST8_DAILY",          "yyyyMMdd'T8'",        24*60*60,    128,     8},
 };
+int chronicle_roll_scheme_count = sizeof(chronicle_roll_schemes)/sizeof(chronicle_roll_schemes[0]);
 
 void chronicle_apply_roll_scheme(queue_t* queue, struct ROLL_SCHEME x) {
-    if (debug) printf("chronicle: chronicle_set_roll_scheme applying %s\n", x.name);
+    CLOG(LL_DEBUG, "chronicle: chronicle_set_roll_scheme applying %s\n", x.name);
     free(queue->roll_name);
     free(queue->roll_format);
     free(queue->roll_strftime);
@@ -485,9 +655,7 @@ void chronicle_apply_roll_scheme(queue_t* queue, struct ROLL_SCHEME x) {
     int fi = 0;
     int inquote = 0;
     while (fi < strlen(queue->roll_format)) {
-        if (debug) {
-            printf(" rs parser fi=%d px=%d inquote=%d buffer='%s'\n", fi, px, inquote, p);
-        }
+        CLOG(LL_DEBUG, " rs parser fi=%d px=%d inquote=%d buffer='%s'\n", fi, px, inquote, p);
         if (inquote == 1 && f[fi] != '\'') {
             // copy quoted literal
             p[px++] = f[fi++];
@@ -523,14 +691,12 @@ void chronicle_apply_roll_scheme(queue_t* queue, struct ROLL_SCHEME x) {
             p[px++] = 'S';
             fi += 2;
         } else {
-            printf("chronicle: parser conversion of %s exploded at fi=%d px=%d inquote=%d buffer='%s'\n", queue->roll_format, fi, px, inquote, p);
+            CLOG(LL_ERROR, "chronicle: parser conversion of %s exploded at fi=%d px=%d inquote=%d buffer='%s'\n", queue->roll_format, fi, px, inquote, p);
             return;
         }
     }
     p[px++] = 0;
-    if (debug) {
-        printf(" rs parser result='%s'\n", p);
-    }
+    CLOG(LL_DEBUG, " rs parser result='%s'\n", p);
     queue->roll_strftime = p;
 }
 
@@ -591,18 +757,28 @@ uint64_t chronicle_cycle_from_ms(queue_t* queue, long ms) {
     return (ms - queue->roll_epoch) / queue->roll_length;
 }
 
+uint64_t chronicle_cycle_of_index(queue_t* queue, uint64_t index) {
+    return index >> queue->cycle_shift;
+}
+
+uint64_t chronicle_cycle_first_index(queue_t* queue, uint64_t cycle) {
+    return cycle << queue->cycle_shift;
+}
+
 // return codes
 //    0  awaiting at &base
 //    1  we hit working
 //    2  we hit EOF
 //    3  data extent will cross base+limit
 //    4  hit data with no data parser
-//   (7  collected value - from parse_data)
+//   (5  collected value - from parse_data)
+//   (6  retry the current item - from parse_data)
 // if any entries are read the values at basep and indexp are updated
-// if parse_data returns non-zero, we pause parsing after the current item
-// typedef enum {QB_AWAITING_ENTRY, QB_BUSY, QB_REACHED_EOF, QB_NEED_EXTEND, QB_NULL_ITEM, QB_COLLECTED} parseqb_state_t;
+// if parse_data returns non-zero, we pause parsing after the current item, or before it
+// for QB_RETRY
+// typedef enum {QB_AWAITING_ENTRY, QB_BUSY, QB_REACHED_EOF, QB_NEED_EXTEND, QB_NULL_ITEM, QB_COLLECTED, QB_RETRY} parseqb_state_t;
 
-parseqb_state_t parse_queue_block(queue_t *queue, unsigned char** basep, uint64_t *indexp, unsigned char* extent, wirecallbacks_t* hcbs, datacallback_f parse_data, void* userdata) {
+parseqb_state_t parse_queue_block(queue_t *queue, unsigned char** basep, uint64_t *indexp, unsigned char* extent, datacallback_f parse_meta, datacallback_f parse_data, void* userdata) {
     uint32_t header;
     int sz;
     unsigned char* base = *basep;
@@ -610,32 +786,29 @@ parseqb_state_t parse_queue_block(queue_t *queue, unsigned char** basep, uint64_
     parseqb_state_t pd = QB_AWAITING_ENTRY;
     while (pd == QB_AWAITING_ENTRY) {
         if (base+4 >= extent) return 3;
-        memcpy(&header, base, sizeof(header)); // relax, fn optimised away
-        // no speculative fetches before the header is read
-        asm volatile ("mfence" ::: "memory");
+        header = header_load(base);
 
         if (header == HD_UNALLOCATED) {
-            if (debug) printf(" %" PRIu64 " @%p unallocated\n", index, base);
+            CLOG(LL_DEBUG, " %" PRIu64 " @%p unallocated\n", index, base);
             return QB_AWAITING_ENTRY;
         } else if ((header & HD_MASK_META) == HD_WORKING) {
-            if (debug) printf(" @%p locked for writing by pid %d\n", base, header & HD_MASK_LENGTH);
+            CLOG(LL_DEBUG, " @%p locked for writing by pid %d\n", base, header & (HD_WRITER_PID - 1));
             return QB_BUSY;
         } else if ((header & HD_MASK_META) == HD_METADATA) {
             sz = (header & HD_MASK_LENGTH);
-            if (debug) printf(" @%p metadata size %x\n", base, sz);
+            CLOG(LL_DEBUG, " @%p metadata size %x\n", base, sz);
             if (base+4+sz >= extent) return QB_NEED_EXTEND;
-            wire_parse(base+4, sz, hcbs);
-            // EventName  header
-            //   switch to header parser
+            if (parse_meta) parse_meta(base+4, sz, index, userdata);
         } else if ((header & HD_MASK_META) == HD_EOF) {
-            if (debug) printf(" @%p EOF\n", base);
+            CLOG(LL_DEBUG, " @%p EOF\n", base);
             return QB_REACHED_EOF;
         } else {
             sz = (header & HD_MASK_LENGTH);
-            if (debug) printf(" %" PRIu64 " @%p data size %x\n", index, base, sz);
+            CLOG(LL_DEBUG, " %" PRIu64 " @%p data size %x\n", index, base, sz);
             if (parse_data) {
                 if (base+4+sz >= extent) return QB_NEED_EXTEND;
                 pd = parse_data(base+4, sz, index, userdata);
+                if (pd == QB_RETRY) return pd;
             } else {
                 // bail at first data message
                 return QB_NULL_ITEM;
@@ -650,23 +823,31 @@ parseqb_state_t parse_queue_block(queue_t *queue, unsigned char** basep, uint64_
     return pd;
 }
 
-// parse data callback dispatching to wire.h parser
-parseqb_state_t parse_wire_data(unsigned char* base, int lim, uint64_t index, void* cbs) {
-    wire_parse(base, lim, (wirecallbacks_t*)cbs);
-    return QB_AWAITING_ENTRY;
+// compare leading bytes a word at a time, bytes beyond filter_len have a zero mask
+static inline int filter_mask_match(tailer_t* tailer, unsigned char* base, int lim) {
+    if (lim < tailer->filter_offset + tailer->filter_len) return 0;
+    uint64_t w[2] = {0, 0};
+    memcpy(w, base + tailer->filter_offset, tailer->filter_len);
+    return ((w[0] & tailer->filter_mask[0]) == tailer->filter_value[0]) &
+           ((w[1] & tailer->filter_mask[1]) == tailer->filter_value[1]);
 }
 
-
 // return AWAITING_ENTRY to continue dispaching, COLLECTED to signal collected item
 parseqb_state_t parse_data_cb(unsigned char* base, int lim, uint64_t index, void* userdata) {
     tailer_t* tailer = (tailer_t*)userdata;
     if (debug) printbuf((char*)base, lim);
     // prep args and fire callback
     if (index > tailer->dispatch_after) {
+        // rejected messages skip parse and dispatch, the index still advances
+        if ((tailer->filter_len && !filter_mask_match(tailer, base, lim)) ||
+            (tailer->filter && !tailer->filter(tailer->filter_ctx, base, lim))) {
+            tailer->filtered++;
+            return QB_AWAITING_ENTRY;
+        }
 
         COBJ msg = tailer->queue->parser(base, lim);
         if (msg == NULL) {
-            if (debug) printf("chronicle: caution at index %" PRIu64 " parse function returned NULL, skipping\n", index);
+            CLOG(LL_DEBUG, "chronicle: caution at index %" PRIu64 " parse function returned NULL, skipping\n", index);
             return QB_AWAITING_ENTRY;
         }
         // if asked to return inline, we skip dispatcher callback, user
@@ -677,125 +858,103 @@ parseqb_state_t parse_data_cb(unsigned char* base, int lim, uint64_t index, void
             tailer->collect->sz = lim;
             return QB_COLLECTED;
         }
-        if (tailer->dispatcher) {
-            tailer->dispatcher(tailer->dispatch_ctx, index, msg);
+        // a dispatcher may keep the object (e.g. to hand to another thread) and free it later
+        int r = tailer->dispatcher ? tailer->dispatcher(tailer->dispatch_ctx, index, msg) : 0;
+        if (r == DISPATCH_RETAIN) {
+            return QB_AWAITING_ENTRY;
         }
         if (tailer->queue->parser_free) {
             tailer->queue->parser_free(msg);
         }
+        if (r == DISPATCH_RETRY) return QB_RETRY;
     }
     return QB_AWAITING_ENTRY;
 }
 
 
-void handle_dirlist_ptr(char* buf, int sz, unsigned char *dptr, wirecallbacks_t* cbs) {
-    // we are preserving *pointers* within the shared directory data page
-    // we keep the underlying mmap for life of queue
-    queue_t* queue = (queue_t*)cbs->userdata;
-    if (strncmp(buf, "listing.highestCycle", sz) == 0) {
-        queue->dirlist_fields.highest_cycle = dptr;
-    } else if (strncmp(buf, "listing.lowestCycle", sz) == 0) {
-        queue->dirlist_fields.lowest_cycle = dptr;
-    } else if (strncmp(buf, "listing.modCount", sz) == 0) {
-        queue->dirlist_fields.modcount = dptr;
+// metadata callback applying roll settings to the queue
+parseqb_state_t parse_header_meta(unsigned char* base, int lim, uint64_t index, void* userdata) {
+    queue_t* queue = (queue_t*)userdata;
+    header_t h;
+    h.present = 0;
+    wire_schema_decode(&header_schema, base, lim, &h);
+    if (WIRE_HAS(h, header, length)) {
+        CLOG(LL_DEBUG, "  roll_length set to %" PRId64 "\n", h.length);
+        queue->roll_length = h.length;
     }
-}
-
-void handle_dirlist_uint64(char* buf, int sz, uint64_t data, wirecallbacks_t* cbs){
-    queue_t* queue = (queue_t*)cbs->userdata;
-    if (strncmp(buf, "length", sz) == 0) {
-        if (debug) printf("  v5 roll_length set to %" PRIu64 "\n", data);
-        queue->roll_length = data;
-    } else if (strncmp(buf, "epoch", sz) == 0) {
-        if (debug) printf("  v5 roll_epoch set to %" PRIu64 "\n", data);
-        queue->roll_epoch = data;
+    if (WIRE_HAS(h, header, epoch)) {
+        CLOG(LL_DEBUG, "  roll_epoch set to %" PRId64 "\n", h.epoch);
+        queue->roll_epoch = h.epoch;
     }
-}
-
-void handle_dirlist_text(char* buf, int sz, char* data, int dsz, wirecallbacks_t* cbs) {
-    queue_t* queue = (queue_t*)cbs->userdata;
-    if (strncmp(buf, "format", sz) == 0) {
-        if (debug) printf("  v5 roll_format set to %.*s\n", dsz, data);
+    if (WIRE_HAS(h, header, format)) {
+        CLOG(LL_DEBUG, "  roll_format set to %.*s\n", h.format.sz, h.format.text);
         free(queue->roll_format);
-        queue->roll_format = strndup(data, dsz);
+        queue->roll_format = strndup(h.format.text, h.format.sz);
     }
+    if (WIRE_HAS(h, header, index_count)) queue->index_count = h.index_count;
+    if (WIRE_HAS(h, header, index_spacing)) queue->index_spacing = h.index_spacing;
+    return QB_AWAITING_ENTRY;
 }
 
-void handle_qf_uint64(char* buf, int sz, uint64_t data, wirecallbacks_t* cbs){
-    queue_t* queue = (queue_t*)cbs->userdata;
-    if (strncmp(buf, "length", sz) == 0) {
-        if (debug) printf(" v4 roll_length set to %" PRIu64 "\n", data);
-        queue->roll_length = data;
-    } else if (strncmp(buf, "indexCount", sz) == 0) {
-        queue->index_count = data;
-    } else if (strncmp(buf, "indexSpacing", sz) == 0) {
-        queue->index_spacing = data;
-    } else if (strncmp(buf, "epoch", sz) == 0) {
-        if (debug) printf(" v4 roll_epoch set to %" PRIu64 "\n", data);
-        queue->roll_epoch = data;
-    }
+typedef struct {
+    queue_t*          queue; // NULL once open, as other threads may be using the roll settings
+    dirlist_fields_t* fields;
+} dirlist_parse_t;
+
+parseqb_state_t parse_dirlist_meta(unsigned char* base, int lim, uint64_t index, void* userdata) {
+    dirlist_parse_t* p = (dirlist_parse_t*)userdata;
+    return p->queue ? parse_header_meta(base, lim, index, p->queue) : QB_AWAITING_ENTRY;
 }
 
-void handle_qf_text(char* buf, int sz, char* data, int dsz, wirecallbacks_t* cbs) {
-    queue_t* queue = (queue_t*)cbs->userdata;
-    if (strncmp(buf, "format", sz) == 0) {
-        if (debug) printf("  v4 roll_format qf set to %.*s\n", dsz, data);
-        free(queue->roll_format);
-        queue->roll_format = strndup(data, dsz);
-    }
+// we are preserving *pointers* within the shared directory data page
+// we keep the underlying mmap for life of queue
+parseqb_state_t parse_dirlist_data(unsigned char* base, int lim, uint64_t index, void* userdata) {
+    dirlist_parse_t* p = (dirlist_parse_t*)userdata;
+    wire_schema_decode(&dirlist_fields_schema, base, lim, p->fields);
+    return QB_AWAITING_ENTRY;
 }
 
-void parse_dirlist(queue_t* queue) {
-    // dirlist mmap is the size of the fstat
-    int lim = queue->dirlist_statbuf.st_size;
-    unsigned char* base = queue->dirlist;
+// resolve the polled fields of a dirlist mapping of lim bytes (the size of the fstat),
+// applying the header's roll settings to the queue on first open only
+void parse_dirlist(queue_t* queue, unsigned char* buf, int lim, dirlist_fields_t* fields) {
+    dirlist_parse_t p = {queue->dirlist ? NULL : queue, fields};
+    unsigned char* base = buf;
     uint64_t index = 0;
     // used to dump out the test data for test_wire.c
     // printbuf((char*)base, lim);
-
-    wirecallbacks_t cbs;
-    bzero(&cbs, sizeof(cbs));
-    cbs.ptr_uint64 = &handle_dirlist_ptr;
-    cbs.userdata = queue;
-
-    wirecallbacks_t hcbs;
-    bzero(&hcbs, sizeof(hcbs));
-    hcbs.field_uint64 = &handle_dirlist_uint64;
-    hcbs.field_char = &handle_dirlist_text;
-    hcbs.userdata = queue;
-    parse_queue_block(queue, &base, &index, base+lim, &hcbs, &parse_wire_data, &cbs);
+    parse_queue_block(queue, &base, &index, buf+lim, &parse_dirlist_meta, &parse_dirlist_data, &p);
 }
 
 void parse_queuefile_meta(unsigned char* base, int limit, queue_t* queue) {
     uint64_t index = 0;
-
-    wirecallbacks_t hcbs;
-    bzero(&hcbs, sizeof(hcbs));
-    hcbs.field_uint64 = &handle_qf_uint64;
-    hcbs.field_char = &handle_qf_text;
-    hcbs.userdata = queue;
-    parse_queue_block(queue, &base, &index, base+limit, &hcbs, NULL, NULL);
+    parse_queue_block(queue, &base, &index, base+limit, &parse_header_meta, NULL, queue);
 }
 
 void chronicle_peek() {
+    pthread_mutex_lock(&queues_lock);
     queue_t *queue = queue_head;
     while (queue != NULL) {
         chronicle_peek_queue(queue);
         queue = queue->next;
     }
+    pthread_mutex_unlock(&queues_lock);
 }
 
 void peek_queue_modcount(queue_t* queue) {
     // poll shared directory for modcount
-    uint64_t modcount;
-    memcpy(&modcount, queue->dirlist_fields.modcount, sizeof(modcount));
-
-    if (queue->modcount != modcount) {
-        printf("shmipc: %s modcount changed from %" PRIu64 " to %" PRIu64 "\n", queue->dirname, queue->modcount, modcount);
-        // slowpath poll
-        memcpy(&queue->modcount, queue->dirlist_fields.modcount, sizeof(modcount));
-        memcpy(&queue->lowest_cycle, queue->dirlist_fields.lowest_cycle, sizeof(modcount));
-        memcpy(&queue->highest_cycle, queue->dirlist_fields.highest_cycle, sizeof(modcount));
+    uint64_t* modcountp = (uint64_t*)__atomic_load_n(&queue->dirlist_fields.modcount, __ATOMIC_ACQUIRE);
+    uint64_t modcount = __atomic_load_n(modcountp, __ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&queue->modcount, __ATOMIC_RELAXED) != modcount) {
+        // slowpath poll, once per change however many threads notice it
+        pthread_mutex_lock(&queue->lock);
+        if (queue->modcount != modcount) {
+            CLOG(LL_INFO, "shmipc: %s modcount changed from %" PRIu64 " to %" PRIu64 "\n", queue->dirname, queue->modcount, modcount);
+            memcpy(&queue->lowest_cycle, queue->dirlist_fields.lowest_cycle, sizeof(modcount));
+            memcpy(&queue->highest_cycle, queue->dirlist_fields.highest_cycle, sizeof(modcount));
+            __atomic_store_n(&queue->modcount, modcount, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&queue->lock);
     }
 }
 
@@ -805,66 +964,378 @@ void poke_queue_modcount(queue_t* queue) {
     uint64_t modcount;
     memcpy(queue->dirlist_fields.highest_cycle, &queue->highest_cycle, sizeof(modcount));
     memcpy(queue->dirlist_fields.lowest_cycle, &queue->lowest_cycle, sizeof(modcount));
-    lock_xadd(queue->dirlist_fields.modcount, 1);
-    printf("shmipc: bumped modcount\n");
+    __atomic_add_fetch((uint64_t*)queue->dirlist_fields.modcount, 1, __ATOMIC_RELEASE);
+    CLOG(LL_INFO, "shmipc: bumped modcount\n");
 }
 
 void chronicle_peek_queue(queue_t *queue) {
-    if (debug) printf("peeking at %s\n", queue->dirname);
+    CLOG(LL_DEBUG, "peeking at %s\n", queue->dirname);
     peek_queue_modcount(queue);
 
+    pthread_mutex_lock(&queues_lock);
     tailer_t *tailer = queue->tailers;
     while (tailer != NULL) {
         chronicle_peek_queue_tailer(queue, tailer);
 
         tailer = tailer->next;
     }
+    pthread_mutex_unlock(&queues_lock);
+}
+
+// NUMA placement, using the raw syscalls so we don't depend on libnuma. Shared mappings
+// of tmpfs files (/dev/shm) follow the mbind policy of the mapping, while page cache of
+// other files is placed by the memory policy of the thread that faults it in, so
+// appenders also pre-fault each new window with their thread policy set to the node.
+#ifdef __linux__
+#define NUMA_MASK_WORDS 16 // nodes 0..1023
+
+int numa_node_exists(int node) {
+    char* path;
+    asprintf(&path, "/sys/devices/system/node/node%d", node);
+    int r = access(path, F_OK) == 0;
+    free(path);
+    return r;
+}
+
+// parse the node's cpulist ("0-3,8-11") into cpus, returns the number of cpus
+int numa_node_cpus(int node, cpu_set_t* cpus) {
+    char* path;
+    asprintf(&path, "/sys/devices/system/node/node%d/cpulist", node);
+    FILE* f = fopen(path, "r");
+    free(path);
+    if (f == NULL) return 0;
+    CPU_ZERO(cpus);
+    int lo, hi, n = 0;
+    char sep;
+    while (fscanf(f, "%d", &lo) == 1) {
+        hi = lo;
+        if (fscanf(f, "%c", &sep) == 1 && sep == '-') {
+            if (fscanf(f, "%d", &hi) != 1) break;
+            if (fscanf(f, "%c", &sep) != 1) sep = 0;
+        }
+        for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++, n++) CPU_SET(cpu, cpus);
+        if (sep != ',') break;
+    }
+    fclose(f);
+    return n;
+}
+
+void numa_place(queue_t* queue, queuefile_t* qf, unsigned char* buf, uint64_t sz) {
+    unsigned long mask[NUMA_MASK_WORDS];
+    bzero(mask, sizeof(mask));
+    mask[queue->numa_node / 64] = 1UL << (queue->numa_node % 64);
+    if (syscall(SYS_mbind, buf, sz, MPOL_PREFERRED, mask, NUMA_MASK_WORDS * 64, 0) != 0) {
+        CLOG(LL_DEBUG, "shmipc: mbind node %d failed: %s\n", queue->numa_node, strerror(errno));
+    }
+    if (qf->mmap_protection == PROT_READ) return;
+
+    // writer: fault the window in from this thread with its policy set to the node
+    int old_mode;
+    unsigned long old_mask[NUMA_MASK_WORDS];
+    if (syscall(SYS_get_mempolicy, &old_mode, old_mask, NUMA_MASK_WORDS * 64, NULL, 0) != 0) return;
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, NUMA_MASK_WORDS * 64) != 0) return;
+    long pagesz = sysconf(_SC_PAGESIZE);
+    for (uint64_t off = 0; off < sz; off += pagesz) {
+        (void)*(volatile unsigned char*)(buf + off);
+    }
+    syscall(SYS_set_mempolicy, old_mode, old_mode == MPOL_DEFAULT ? NULL : old_mask, NUMA_MASK_WORDS * 64);
+}
+#endif
+
+int chronicle_set_numa_node(queue_t* queue, int node) {
+#ifdef __linux__
+    if (node >= NUMA_MASK_WORDS * 64 || (node >= 0 && !numa_node_exists(node))) return chronicle_err("no such numa node");
+    queue->numa_node = node < 0 ? -1 : node;
+    return 0;
+#else
+    if (node < 0) return 0;
+    return chronicle_err("numa placement not supported on this platform");
+#endif
+}
+
+int chronicle_get_numa_node(queue_t* queue) {
+    return queue->numa_node;
+}
+
+// node of the cpu, or -1 if unknown
+int chronicle_numa_node_of_cpu(int cpu) {
+#ifdef __linux__
+    cpu_set_t cpus;
+    for (int node = 0; numa_node_exists(node); node++) {
+        if (numa_node_cpus(node, &cpus) && cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &cpus)) return node;
+    }
+#endif
+    return -1;
+}
+
+queuefile_t* queuefile_acquire(queue_t* queue, uint64_t cycle, int mmap_protection, char* fn) {
+    pthread_mutex_lock(&queue->lock);
+    // re-use an open queuefile if another tailer has one for this cycle
+    queuefile_t* qf = queue->queuefiles;
+    while (qf != NULL) {
+        if (qf->cycle == cycle && qf->mmap_protection == mmap_protection) {
+            qf->refcount++;
+            pthread_mutex_unlock(&queue->lock);
+            return qf;
+        }
+        qf = qf->next;
+    }
+
+    CLOG(LL_INFO, "shmipc: opening cycle %" PRIu64 " filename %s (highest_cycle %" PRIu64 ")\n", cycle, fn, queue->highest_cycle);
+    int fopen_flags = O_RDONLY;
+    if (mmap_protection != PROT_READ) fopen_flags = O_RDWR;
+    int fd = open(fn, fopen_flags);
+    if (fd < 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return NULL;
+    }
+
+    qf = malloc(sizeof(queuefile_t));
+    if (qf == NULL) {
+        close(fd);
+        pthread_mutex_unlock(&queue->lock);
+        return chronicle_perr("qf fail");
+    }
+    bzero(qf, sizeof(queuefile_t));
+    qf->cycle = cycle;
+    qf->mmap_protection = mmap_protection;
+    qf->fn = strdup(fn);
+    qf->fd = fd;
+    qf->refcount = 1;
+    struct stat statbuf;
+    qf->size = fstat(qf->fd, &statbuf) < 0 ? 0 : statbuf.st_size;
+
+    qf->next = queue->queuefiles;
+    queue->queuefiles = qf;
+    pthread_mutex_unlock(&queue->lock);
+    return qf;
+}
+
+// drop a reference with queue->lock held
+void queuefile_unref(queue_t* queue, queuefile_t* qf) {
+    if (--qf->refcount > 0) return;
+
+    queuefile_t** parent = &queue->queuefiles;
+    while (*parent != NULL) {
+        if (*parent == qf) {
+            *parent = qf->next;
+            break;
+        }
+        parent = &(*parent)->next;
+    }
+    CLOG(LL_DEBUG, "shmipc: closing queuefile %s\n", qf->fn);
+    close(qf->fd);
+    free(qf->fn);
+    free(qf);
+}
+
+void queuefile_release(queue_t* queue, queuefile_t* qf) {
+    pthread_mutex_lock(&queue->lock);
+    queuefile_unref(queue, qf);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// refresh the shared size of a queuefile, returning it or -1 on error. Refreshes are
+// serialised by queue->lock so the published size never goes backwards
+off_t queuefile_refresh_size(queue_t* queue, queuefile_t* qf) {
+    struct stat statbuf;
+    pthread_mutex_lock(&queue->lock);
+    off_t sz = fstat(qf->fd, &statbuf) < 0 ? -1 : statbuf.st_size;
+    if (sz >= 0) __atomic_store_n(&qf->size, sz, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&queue->lock);
+    return sz;
+}
+
+// Release the mappings of the least recently peeked tailers, from any queue, until
+// mapping another sz bytes would fit within mapping_budget. Evicted tailers re-map
+// lazily on their next peek. The caller is never evicted, nor are appenders, and we
+// exceed the budget only by the mappings still in use. Tailers being peeked by any
+// thread (including ours, further up the stack) are locked, so are passed over for the
+// next oldest.
+void mapping_evict(tailer_t* keep, uint64_t sz) {
+    pthread_mutex_lock(&evict_lock);
+    uint64_t pass = ++evict_pass;
+    while (__atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED) + sz > __atomic_load_n(&mapping_budget, __ATOMIC_RELAXED)) {
+        tailer_t* lru = NULL;
+        for (queue_t* queue = queue_head; queue != NULL; queue = queue->next) {
+            for (tailer_t* tailer = queue->tailers; tailer != NULL; tailer = tailer->next) {
+                if (tailer == keep || tailer->evict_pass == pass || tailer->qf_map == NULL) continue;
+                if (lru == NULL || tailer->last_peek < lru->last_peek) lru = tailer;
+            }
+        }
+        if (lru == NULL) break;
+        if (pthread_mutex_trylock(&lru->lock) != 0) {
+            lru->evict_pass = pass;
+            continue;
+        }
+        CLOG(LL_DEBUG, "shmipc: evicting idle tailer %p mapping %" PRIx64 " bytes\n", lru, lru->qf_mmapsz);
+        tailer_release_mapping(lru);
+        pthread_mutex_unlock(&lru->lock);
+    }
+    pthread_mutex_unlock(&evict_lock);
+}
+
+mapping_t* mapping_find(queue_t* queue, queuefile_t* qf, uint64_t mmapoff, uint64_t mmapsz) {
+    mapping_t* map = queue->mappings;
+    while (map != NULL) {
+        if (map->qf == qf && map->mmapoff == mmapoff && map->mmapsz == mmapsz) {
+            map->refcount++;
+            return map;
+        }
+        map = map->next;
+    }
+    return NULL;
+}
+
+mapping_t* mapping_acquire(queue_t* queue, tailer_t* tailer, queuefile_t* qf, uint64_t mmapoff, uint64_t mmapsz) {
+    pthread_mutex_lock(&queue->lock);
+    mapping_t* map = mapping_find(queue, qf, mmapoff, mmapsz);
+    pthread_mutex_unlock(&queue->lock);
+    if (map) return map;
+
+    // evict and mmap outside the lock, as eviction releases mappings of any queue
+    if (__atomic_load_n(&mapping_budget, __ATOMIC_RELAXED)) mapping_evict(tailer, mmapsz);
+
+    unsigned char* buf = mmap(0, mmapsz, qf->mmap_protection, MAP_SHARED, qf->fd, mmapoff);
+    if (buf == MAP_FAILED) {
+        CLOG(LL_ERROR, "shmipc:  mmap failed %s %" PRIx64 " size %" PRIx64 " error=%s\n", qf->fn, mmapoff, mmapsz, strerror(errno));
+        return NULL;
+    }
+    CLOG(LL_DEBUG, "shmipc:  mmap offset %" PRIx64 " size %" PRIx64 " base=%p extent=%p\n", mmapoff, mmapsz, buf, buf+mmapsz);
+    __atomic_add_fetch(&map_count, 1, __ATOMIC_RELAXED);
+#ifdef __linux__
+    if (queue->numa_node >= 0) numa_place(queue, qf, buf, mmapsz);
+#endif
+
+    pthread_mutex_lock(&queue->lock);
+    // another thread may have mapped the same window while we were unlocked
+    mapping_t* raced = mapping_find(queue, qf, mmapoff, mmapsz);
+    if (raced) {
+        pthread_mutex_unlock(&queue->lock);
+        munmap(buf, mmapsz);
+        return raced;
+    }
+    map = malloc(sizeof(mapping_t));
+    if (map == NULL) {
+        pthread_mutex_unlock(&queue->lock);
+        munmap(buf, mmapsz);
+        return chronicle_perr("map fail");
+    }
+    map->qf = qf;
+    map->mmapoff = mmapoff;
+    map->mmapsz = mmapsz;
+    map->buf = buf;
+    map->refcount = 1;
+    qf->refcount++; // mapping holds the queuefile open
+    __atomic_add_fetch(&queue->mapped_bytes, mmapsz, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mapped_bytes, mmapsz, __ATOMIC_RELAXED);
+
+    map->next = queue->mappings;
+    queue->mappings = map;
+    pthread_mutex_unlock(&queue->lock);
+    return map;
+}
+
+void mapping_release(queue_t* queue, mapping_t* map) {
+    pthread_mutex_lock(&queue->lock);
+    if (--map->refcount > 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return;
+    }
+
+    mapping_t** parent = &queue->mappings;
+    while (*parent != NULL) {
+        if (*parent == map) {
+            *parent = map->next;
+            break;
+        }
+        parent = &(*parent)->next;
+    }
+    __atomic_sub_fetch(&queue->mapped_bytes, map->mmapsz, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&mapped_bytes, map->mmapsz, __ATOMIC_RELAXED);
+    queuefile_unref(queue, map->qf);
+    pthread_mutex_unlock(&queue->lock);
+    munmap(map->buf, map->mmapsz);
+    free(map);
+}
+
+// drop the tailer's references to the shared mapping and queuefile
+void tailer_release_mapping(tailer_t* tailer) {
+    if (tailer->qf_map) {
+        mapping_release(tailer->queue, tailer->qf_map);
+        tailer->qf_map = NULL;
+        tailer->qf_buf = NULL;
+    }
+}
+
+// Replay tailers stream through historical cycles, so ask for the file beyond our window
+// to be read ahead, and let go of page cache behind us so we don't evict the hot pages
+// that live tailers depend on. The current cycle is never dropped, in case we catch up.
+void tailer_replay_advise(tailer_t* tailer) {
+    queuefile_t* qf = tailer->qf;
+    madvise(tailer->qf_buf, tailer->qf_mmapsz, MADV_SEQUENTIAL);
+#ifdef __linux__
+    readahead(qf->fd, tailer->qf_mmapoff + tailer->qf_mmapsz, replay_readahead);
+#endif
+    if (qf->cycle >= tailer->queue->highest_cycle) return;
+    if (tailer->qf_mmapoff > tailer->replay_dropped) {
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(qf->fd, tailer->replay_dropped, tailer->qf_mmapoff - tailer->replay_dropped, POSIX_FADV_DONTNEED);
+#endif
+        tailer->replay_dropped = tailer->qf_mmapoff;
+    }
+}
+
+// on leaving a historical cycle, drop whatever remains of it from the page cache
+void tailer_replay_finish(tailer_t* tailer) {
+    queuefile_t* qf = tailer->qf;
+    if (qf == NULL || qf->cycle >= tailer->queue->highest_cycle) return;
+    CLOG(LL_DEBUG, "shmipc: replay dropping cached pages of %s\n", qf->fn);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(qf->fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+void tailer_release_queuefile(tailer_t* tailer) {
+    tailer_release_mapping(tailer);
+    if (tailer->qf) {
+        queuefile_release(tailer->queue, tailer->qf);
+        tailer->qf = NULL;
+    }
 }
 
 tailstate_t chronicle_peek_queue_tailer_r(queue_t *queue, tailer_t *tailer) {
     // for each cycle file { for each block { for each entry { emit }}}
     // this method runs like a generator, suspended in the innermost
     // iteration when we hit the end of the file and pick up at the next peek()
-    wirecallbacks_t hcbs;
-    bzero(&hcbs, sizeof(hcbs));
+    tailer->last_peek = __atomic_add_fetch(&peek_clock, 1, __ATOMIC_RELAXED);
 
     while (1) {
 
         uint64_t cycle = tailer->qf_index >> queue->cycle_shift;
-        if (cycle != tailer->qf_cycle_open || tailer->qf_fn == NULL) {
-            // free fn, mmap and fid
+        if (tailer->qf == NULL || cycle != tailer->qf->cycle) {
+            // release fn, mmap and fid, which are closed if we were the last user
+            if (tailer->replay) tailer_replay_finish(tailer);
+            tailer_release_queuefile(tailer);
+            tailer->replay_dropped = 0;
             if (tailer->qf_fn) {
                 free(tailer->qf_fn);
             }
-            if (tailer->qf_buf) {
-                munmap(tailer->qf_buf, tailer->qf_mmapsz);
-                tailer->qf_buf = NULL;
-            }
-            if (tailer->qf_fd > 0) { // close the fid if open
-                close(tailer->qf_fd);
-            }
             tailer->qf_fn = chronicle_get_cycle_fn(queue, cycle);
             tailer->qf_tip = 0;
 
-            printf("shmipc: opening cycle %" PRIu64 " filename %s (highest_cycle %" PRIu64 ")\n", cycle, tailer->qf_fn, queue->highest_cycle);
-            int fopen_flags = O_RDONLY;
-            if (tailer->mmap_protection != PROT_READ) fopen_flags = O_RDWR;
-            if ((tailer->qf_fd = open(tailer->qf_fn, fopen_flags)) < 0) {
-                printf("shmipc:  awaiting queuefile for %s open errno=%d %s\n", tailer->qf_fn, errno, strerror(errno));
+            if ((tailer->qf = queuefile_acquire(queue, cycle, tailer->mmap_protection, tailer->qf_fn)) == NULL) {
+                CLOG(LL_DEBUG, "shmipc:  awaiting queuefile for %s open errno=%d %s\n", tailer->qf_fn, errno, strerror(errno));
 
                 // if our cycle < highCycle, permitted to skip a missing file rather than wait
                 if (cycle < queue->highest_cycle) {
                     uint64_t skip_to_index = (cycle + 1) << queue->cycle_shift;
-                    printf("shmipc:  skipping queuefile (cycle < highest_cycle), bumping next_index from %" PRIu64 " to %" PRIu64 "\n", tailer->qf_index, skip_to_index);
+                    CLOG(LL_INFO, "shmipc:  skipping queuefile (cycle < highest_cycle), bumping next_index from %" PRIu64 " to %" PRIu64 "\n", tailer->qf_index, skip_to_index);
                     tailer->qf_index = skip_to_index;
                     continue;
                 }
                 return TS_AWAITING_QUEUEFILE;
             }
-            tailer->qf_cycle_open = cycle;
-
-            // renew the stat
-            if (fstat(tailer->qf_fd, &tailer->qf_statbuf) < 0) return 3;
         }
 
         // assert: we have open fid
@@ -879,40 +1350,40 @@ tailstate_t chronicle_peek_queue_tailer_r(queue_t *queue, tailer_t *tailer) {
         //  addr               qf_buf
         // assign mmap limit and offset from tip and blocksize
 
-        // note: blocksize may have changed, unroll this to a constant with care
-        uint64_t blocksize_mask = ~(queue->blocksize-1);
+        // note: blocksize may be doubled by another thread, so take one copy per pass
+        uint blocksize = __atomic_load_n(&queue->blocksize, __ATOMIC_RELAXED);
+        uint64_t blocksize_mask = ~((uint64_t)blocksize-1);
         uint64_t mmapoff = tailer->qf_tip & blocksize_mask;
 
         // renew stat if we would otherwise map less than 2* blocksize
         // TODO: write needs to extend file here!
-        if (tailer->qf_statbuf.st_size - mmapoff < 2*queue->blocksize) {
-            if (debug) printf("shmmain: approaching file size limit, less than two blocks remain\n");
-            if (fstat(tailer->qf_fd, &tailer->qf_statbuf) < 0)
+        // the size is shared, so one tailer noticing the file grow re-windows the others
+        off_t st_size = __atomic_load_n(&tailer->qf->size, __ATOMIC_ACQUIRE);
+        if (st_size - mmapoff < 2*blocksize) {
+            CLOG(LL_DEBUG, "shmmain: approaching file size limit, less than two blocks remain\n");
+            if ((st_size = queuefile_refresh_size(queue, tailer->qf)) < 0)
                 return TS_E_STAT;
             // signal to extend queuefile iff we are an appending tailer
-            if (tailer->qf_statbuf.st_size - mmapoff < 2*queue->blocksize && tailer->mmap_protection != PROT_READ) {
+            if (st_size - mmapoff < 2*blocksize && tailer->mmap_protection != PROT_READ) {
                 return TS_EXTEND_FAIL;
             }
         }
 
-        int limit = tailer->qf_statbuf.st_size - mmapoff > 2*queue->blocksize ? 2*queue->blocksize : tailer->qf_statbuf.st_size - mmapoff;
-        if (debug) printf("shmipc:  tip %" PRIu64 " -> mmapoff %" PRIu64 " size 0x%x  blocksize_mask 0x%" PRIx64 "\n", tailer->qf_tip, mmapoff, limit, blocksize_mask);
+        int limit = st_size - mmapoff > 2*blocksize ? 2*blocksize : st_size - mmapoff;
+        CLOG(LL_DEBUG, "shmipc:  tip %" PRIu64 " -> mmapoff %" PRIu64 " size 0x%x  blocksize_mask 0x%" PRIx64 "\n", tailer->qf_tip, mmapoff, limit, blocksize_mask);
 
-        // only re-mmap if desired window has changed since last scan
-        if (tailer->qf_buf == NULL || mmapoff != tailer->qf_mmapoff || limit != tailer->qf_mmapsz) {
-            if ((tailer->qf_buf)) {
-                munmap(tailer->qf_buf, tailer->qf_mmapsz);
-                tailer->qf_buf = NULL;
-            }
+        // only re-mmap if desired window has changed since last scan, and then prefer
+        // a window already mapped by another tailer
+        if (tailer->qf_map == NULL || mmapoff != tailer->qf_mmapoff || limit != tailer->qf_mmapsz) {
+            tailer_release_mapping(tailer);
 
-            tailer->qf_mmapsz = limit;
-            tailer->qf_mmapoff = mmapoff;
-            if ((tailer->qf_buf = mmap(0, tailer->qf_mmapsz, tailer->mmap_protection, MAP_SHARED, tailer->qf_fd, tailer->qf_mmapoff)) == MAP_FAILED) {
-                printf("shmipc:  mmap failed %s %" PRIx64 " size %" PRIx64 " error=%s\n", tailer->qf_fn, tailer->qf_mmapoff, tailer->qf_mmapsz, strerror(errno));
-                tailer->qf_buf = NULL;
+            if ((tailer->qf_map = mapping_acquire(queue, tailer, tailer->qf, mmapoff, limit)) == NULL) {
                 return TS_E_MMAP;
             }
-            printf("shmipc:  mmap offset %" PRIx64 " size %" PRIx64 " base=%p extent=%p\n", tailer->qf_mmapoff, tailer->qf_mmapsz, tailer->qf_buf, tailer->qf_buf+tailer->qf_mmapsz);
+            tailer->qf_buf = tailer->qf_map->buf;
+            tailer->qf_mmapsz = limit;
+            tailer->qf_mmapoff = mmapoff;
+            if (tailer->replay) tailer_replay_advise(tailer);
         }
 
         unsigned char* basep = (tailer->qf_tip - tailer->qf_mmapoff) + tailer->qf_buf; // basep within mmap
@@ -925,30 +1396,31 @@ tailstate_t chronicle_peek_queue_tailer_r(queue_t *queue, tailer_t *tailer) {
         //    2  we hit EOF         (handle)
         //    3  data extent will cross base+limit (handle)
         //    4  hit data with no data parser (won't happen)
-        //    7  collected item
+        //    5  collected item
+        //    6  dispatcher refused the item, we stop before it
         // if any entries are read the values at basep and indexp are updated
-        parseqb_state_t s = parse_queue_block(queue, &basep, &index, extent, &hcbs, parse_data_cb, tailer);
+        parseqb_state_t s = parse_queue_block(queue, &basep, &index, extent, NULL, parse_data_cb, tailer);
         //printf("shmipc: block parser result %d, shm %p to %p\n", s, basep_old, basep);
 
         if (s == QB_NEED_EXTEND && basep == basep_old) {
-            queue_double_blocksize(queue);
+            queue_double_blocksize(queue, blocksize);
         }
 
         if (basep != basep_old) {
             // commit result of parsing to the tailer, adjusting for the window
             uint64_t new_tip = basep-tailer->qf_buf + tailer->qf_mmapoff;
-            if (debug) printf("shmipc:  parser moved shm %p to %p, file %" PRIu64 " -> %" PRIu64 ", index %" PRIu64 " to %" PRIu64 "\n", basep_old, basep, tailer->qf_tip, new_tip, tailer->qf_index, index);
+            CLOG(LL_DEBUG, "shmipc:  parser moved shm %p to %p, file %" PRIu64 " -> %" PRIu64 ", index %" PRIu64 " to %" PRIu64 "\n", basep_old, basep, tailer->qf_tip, new_tip, tailer->qf_index, index);
             tailer->qf_tip = new_tip;
             tailer->qf_index = index;
         }
 
-        if (s == QB_BUSY) return TS_BUSY;
+        if (s == QB_BUSY || s == QB_RETRY) return TS_BUSY;
         if (s == QB_COLLECTED) return TS_COLLECTED;
 
         if (s == QB_AWAITING_ENTRY) { // awaiting at end of queuefile
             if (cycle < queue->highest_cycle-patch_cycles) { // allowed to fast-forward
                 uint64_t skip_to_index = (cycle + 1) << queue->cycle_shift;
-                printf("shmipc:  missing EOF for queuefile (cycle < highest_cycle-patch_cycles), bumping next_index from %" PRIu64 " to %" PRIu64 "\n", tailer->qf_index, skip_to_index);
+                CLOG(LL_WARN, "shmipc:  missing EOF for queuefile (cycle < highest_cycle-patch_cycles), bumping next_index from %" PRIu64 " to %" PRIu64 "\n", tailer->qf_index, skip_to_index);
                 tailer->qf_index = skip_to_index;
                 continue;
             }
@@ -958,7 +1430,7 @@ tailstate_t chronicle_peek_queue_tailer_r(queue_t *queue, tailer_t *tailer) {
         if (s == QB_REACHED_EOF) {
             // we've read an EOF marker, so the next expected index is cycle++, seqnum=0
             uint64_t eof_cycle = ((tailer->qf_index >> queue->cycle_shift) + 1) << queue->cycle_shift;
-            printf("shmipc:  hit EOF marker, setting next_index from %" PRIu64 " to %" PRIu64 "\n", tailer->qf_index, eof_cycle);
+            CLOG(LL_INFO, "shmipc:  hit EOF marker, setting next_index from %" PRIu64 " to %" PRIu64 "\n", tailer->qf_index, eof_cycle);
             tailer->qf_index = eof_cycle;
         }
     }
@@ -969,11 +1441,15 @@ int chronicle_peek_tailer(tailer_t *tailer) {
 }
 
 int chronicle_peek_queue_tailer(queue_t *queue, tailer_t *tailer) {
-    return tailer->state = chronicle_peek_queue_tailer_r(queue, tailer);
+    pthread_mutex_lock(&tailer->lock);
+    int r = tailer->state = chronicle_peek_queue_tailer_r(queue, tailer);
+    pthread_mutex_unlock(&tailer->lock);
+    return r;
 }
 
 void chronicle_debug() {
     printf("shmipc: open handles\n");
+    pthread_mutex_lock(&queues_lock);
 
     queue_t *current = queue_head;
     while (current != NULL) {
@@ -989,6 +1465,8 @@ void chronicle_debug() {
         printf("    cycle-low        %" PRIu64 "\n", current->lowest_cycle);
         printf("    cycle-high       %" PRIu64 "\n", current->highest_cycle);
         printf("    modcount         %" PRIu64 "\n", current->modcount);
+        printf("  mapped_bytes       %" PRIu64 "\n", __atomic_load_n(&current->mapped_bytes, __ATOMIC_RELAXED));
+        printf("  recoveries         %" PRIu64 "\n", current->recoveries);
         printf("  queuefile_pattern  %s\n",   current->queuefile_pattern);
         printf("    cycle_shift      %d\n",   current->cycle_shift);
         printf("    roll_epoch       %d\n",   current->roll_epoch);
@@ -1005,12 +1483,29 @@ void chronicle_debug() {
             chronicle_debug_tailer(current, tailer);
             tailer = tailer->next;
         }
-        printf("  appender:\n");
-        if (current->appender)
-            chronicle_debug_tailer(current, current->appender);
+        printf("  appenders:\n");
+        tailer = current->appenders;
+        while (tailer != NULL) {
+            chronicle_debug_tailer(current, tailer);
+            tailer = tailer->next;
+        }
+
+        printf("  queuefiles:\n");
+        queuefile_t *qf = current->queuefiles;
+        while (qf != NULL) {
+            printf("    %s fd %d prot %d refs %d\n", qf->fn, qf->fd, qf->mmap_protection, qf->refcount);
+            qf = qf->next;
+        }
+        printf("  mappings:\n");
+        mapping_t *map = current->mappings;
+        while (map != NULL) {
+            printf("    %p offset %" PRIx64 " size %" PRIx64 " fd %d refs %d\n", map->buf, map->mmapoff, map->mmapsz, map->qf->fd, map->refcount);
+            map = map->next;
+        }
 
         current = current->next;
     }
+    pthread_mutex_unlock(&queues_lock);
 }
 
 void chronicle_debug_tailer(queue_t* queue, tailer_t* tailer) {
@@ -1020,9 +1515,10 @@ void chronicle_debug_tailer(queue_t* queue, tailer_t* tailer) {
     uint seqnum = tailer->dispatch_after & queue->seqnum_mask;
     printf("    dispatch_after   %" PRIu64 " (cycle %u, seqnum %u)\n", tailer->dispatch_after, cycle, seqnum);
     printf("    state            %d - %s\n", tailer->state, state_text);
+    printf("    filtered         %" PRIu64 "\n", tailer->filtered);
     printf("    qf_fn            %s\n",   tailer->qf_fn);
-    printf("    qf_fd            %d\n",   tailer->qf_fd);
-    printf("    qf_statbuf_sz    %" PRIu64 "\n", (uint64_t)tailer->qf_statbuf.st_size);
+    printf("    qf_fd            %d\n",   tailer->qf ? tailer->qf->fd : -1);
+    printf("    qf_size          %" PRIu64 "\n", tailer->qf ? __atomic_load_n(&tailer->qf->size, __ATOMIC_RELAXED) : 0);
     printf("    qf_tip           %" PRIu64 "\n", tailer->qf_tip);
     cycle = tailer->qf_index >> queue->cycle_shift;
     seqnum = tailer->qf_index & queue->seqnum_mask;
@@ -1031,6 +1527,8 @@ void chronicle_debug_tailer(queue_t* queue, tailer_t* tailer) {
     printf("      extent         %p\n",   tailer->qf_buf+tailer->qf_mmapsz);
     printf("    qf_mmapsz        %" PRIx64 "\n", tailer->qf_mmapsz);
     printf("    qf_mmapoff       %" PRIx64 "\n", tailer->qf_mmapoff);
+    printf("    last_peek        %" PRIu64 "\n", tailer->last_peek);
+    printf("    replay           %d (dropped to %" PRIx64 ")\n", tailer->replay, tailer->replay_dropped);
 }
 
 uint64_t chronicle_append(queue_t *queue, COBJ msg) {
@@ -1038,8 +1536,84 @@ uint64_t chronicle_append(queue_t *queue, COBJ msg) {
     return chronicle_append_ts(queue, msg, ms);
 }
 
+// the shared appender is created on first use, threads appending through it take turns
+tailer_t* queue_shared_appender(queue_t* queue) {
+    tailer_t* appender = __atomic_load_n(&queue->appender, __ATOMIC_ACQUIRE);
+    if (appender == NULL) {
+        pthread_mutex_lock(&queues_lock);
+        if ((appender = queue->appender) == NULL) {
+            appender = chronicle_appender_open(queue);
+            __atomic_store_n(&queue->appender, appender, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&queues_lock);
+    }
+    return appender;
+}
+
 uint64_t chronicle_append_ts(queue_t *queue, COBJ msg, long ms) {
     if (queue == NULL) return chronicle_err("queue is NULL");
+    tailer_t* appender = queue_shared_appender(queue);
+    if (appender == NULL) return -1;
+    return chronicle_appender_append_ts(appender, msg, ms);
+}
+
+// build a special tailer with the protection bits and file descriptor set to allow
+// writing. Each appender has its own cursor and lock, so threads with their own
+// appenders only contend on the header CAS, as separate processes would.
+tailer_t* chronicle_appender_open(queue_t* queue) {
+    if (queue == NULL) return chronicle_perr("queue is NULL");
+
+    // re-open directory-listing mapping in read-write mode, once per queue
+    pthread_mutex_lock(&queue->lock);
+    if (!queue->dirlist_rw) {
+        int x = directory_listing_reopen(queue, O_RDWR, PROT_READ | PROT_WRITE);
+        if (x != 0) {
+            pthread_mutex_unlock(&queue->lock);
+            CLOG(LL_ERROR, "shmipc: rw dir listing %d %s\n", x, cerr_msg);
+            return NULL;
+        }
+        queue->dirlist_rw = 1;
+    }
+    if (queue->writer_fd < 0) writer_register(queue);
+    pthread_mutex_unlock(&queue->lock);
+
+    tailer_t* appender = malloc(sizeof(tailer_t));
+    if (appender == NULL) return chronicle_perr("am fail");
+    bzero(appender, sizeof(tailer_t));
+    pthread_mutex_init(&appender->lock, NULL);
+
+    // compat: writers do an extended lookback to patch missing EOFs
+    peek_queue_modcount(queue);
+    appender->qf_index = (queue->highest_cycle - patch_cycles) << queue->cycle_shift;
+    appender->dispatcher = NULL;
+    appender->state = 5;
+    appender->mmap_protection = PROT_READ | PROT_WRITE;
+    appender->queue = queue;
+
+    pthread_mutex_lock(&queues_lock);
+    appender->next = queue->appenders;
+    appender->prev = NULL;
+    if (queue->appenders) queue->appenders->prev = appender;
+    queue->appenders = appender;
+    pthread_mutex_unlock(&queues_lock);
+
+    CLOG(LL_DEBUG, "shmipc: appender created\n");
+    return appender;
+}
+
+void chronicle_appender_close(tailer_t* appender) {
+    chronicle_tailer_close(appender);
+}
+
+uint64_t chronicle_appender_append(tailer_t* appender, COBJ msg) {
+    if (appender == NULL) return chronicle_err("appender is NULL");
+    long ms = chronicle_clock_ms(appender->queue);
+    return chronicle_appender_append_ts(appender, msg, ms);
+}
+
+uint64_t chronicle_appender_append_ts(tailer_t* appender, COBJ msg, long ms) {
+    if (appender == NULL) return chronicle_err("appender is NULL");
+    queue_t* queue = appender->queue;
 
     // Appending logic
     // 0) catch up to the end of the current file.
@@ -1067,105 +1641,319 @@ uint64_t chronicle_append_ts(queue_t *queue, COBJ msg, long ms) {
     // caution: encodecheck may tweak blocksize, do not redorder below shmipc_peek_tailer
     size_t write_sz = queue->append_sizeof(msg);
     if (write_sz < 0) return 0;
+    if (appender_prepare(queue, write_sz) != 0) return -1;
+
+    pthread_mutex_lock(&appender->lock);
+    uint64_t index = chronicle_append_locked(queue, appender, msg, write_sz, ms);
+    pthread_mutex_unlock(&appender->lock);
+    return index;
+}
+
+// size checks ahead of taking the appender lock
+int appender_prepare(queue_t* queue, size_t write_sz) {
     if (write_sz > HD_MASK_META) return chronicle_err("`shm msg sz > 30bit");
-    while (write_sz > queue->blocksize)
-        queue_double_blocksize(queue);
+    uint blocksize;
+    while (write_sz > (blocksize = __atomic_load_n(&queue->blocksize, __ATOMIC_RELAXED)))
+        queue_double_blocksize(queue, blocksize);
 
     // refresh highest and lowest, allowing our appender to follow another appender
     peek_queue_modcount(queue);
+    return 0;
+}
 
-    // build a special tailer with the protection bits and file descriptor set to allow
-    // writing.
-    if (queue->appender == NULL) {
-        tailer_t* tailer = malloc(sizeof(tailer_t));
-        if (tailer == NULL) return chronicle_err("am fail");
-        bzero(tailer, sizeof(tailer_t));
-
-        // compat: writers do an extended lookback to patch missing EOFs
-        tailer->qf_index = (queue->highest_cycle - patch_cycles) << queue->cycle_shift;
-        tailer->dispatcher = NULL;
-        tailer->state = 5;
-        tailer->mmap_protection = PROT_READ | PROT_WRITE;
-        tailer->queue = queue;
-        queue->appender = tailer;
-
-        // re-open directory-listing mapping in read-write mode
-        int x = directory_listing_reopen(queue, O_RDWR, PROT_READ | PROT_WRITE);
-        if (x != 0) {
-            printf("shmipc: rw dir listing %d %s\n", x, cerr_msg);
-            return -1;
+// Zero-copy appends: the entry is claimed by reserve and published by commit, with
+// the appender locked in between
+unsigned char* chronicle_appender_reserve(tailer_t* appender, size_t sz) {
+    if (appender == NULL) return chronicle_perr("appender is NULL");
+    queue_t* queue = appender->queue;
+    if (appender_prepare(queue, sz) != 0) return NULL;
+
+    pthread_mutex_lock(&appender->lock);
+    unsigned char* ptr = appender_claim_locked(queue, appender, sz, chronicle_clock_ms(queue));
+    if (ptr == NULL) {
+        pthread_mutex_unlock(&appender->lock);
+        return NULL;
+    }
+    appender->reserved_sz = sz;
+    appender->reserver = pthread_self();
+    __atomic_store_n(&appender->reserved, ptr, __ATOMIC_RELEASE);
+    return ptr + 4;
+}
+
+// the entry reserved by the calling thread, which holds the appender lock, or NULL
+static unsigned char* appender_reserved_by_caller(tailer_t* appender) {
+    unsigned char* ptr = __atomic_load_n(&appender->reserved, __ATOMIC_ACQUIRE);
+    if (ptr == NULL || !pthread_equal(appender->reserver, pthread_self())) return NULL;
+    return ptr;
+}
+
+uint64_t chronicle_appender_commit(tailer_t* appender, size_t sz) {
+    unsigned char* ptr = appender ? appender_reserved_by_caller(appender) : NULL;
+    if (ptr == NULL) return chronicle_err("nothing reserved");
+    if (sz > appender->reserved_sz) return chronicle_err("commit exceeds reservation");
+    // the next header lands in any unused part of the reservation, which must read unallocated
+    memset(ptr + 4 + sz, 0, appender->reserved_sz - sz);
+    uint64_t index = appender_publish(appender, ptr, sz);
+    __atomic_store_n(&appender->reserved, NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&appender->lock);
+    return index;
+}
+
+void chronicle_appender_abort(tailer_t* appender) {
+    unsigned char* ptr = appender ? appender_reserved_by_caller(appender) : NULL;
+    if (ptr == NULL) return;
+    memset(ptr + 4, 0, appender->reserved_sz);
+    header_store(ptr, HD_UNALLOCATED);
+    CLOG(LL_DEBUG, "shmipc: aborted reservation at index %" PRIu64 "\n", appender->qf_index);
+    __atomic_store_n(&appender->reserved, NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&appender->lock);
+}
+
+unsigned char* chronicle_reserve(queue_t* queue, size_t sz) {
+    if (queue == NULL) return chronicle_perr("queue is NULL");
+    tailer_t* appender = queue_shared_appender(queue);
+    if (appender == NULL) return NULL;
+    return chronicle_appender_reserve(appender, sz);
+}
+
+uint64_t chronicle_commit(queue_t* queue, size_t sz) {
+    if (queue == NULL || queue->appender == NULL) return chronicle_err("nothing reserved");
+    return chronicle_appender_commit(queue->appender, sz);
+}
+
+void chronicle_abort(queue_t* queue) {
+    if (queue == NULL || queue->appender == NULL) return;
+    chronicle_appender_abort(queue->appender);
+}
+
+// Writers register in the queue directory with a file named for their pid and pid
+// namespace, held under a shared flock while the queue is open. The kernel drops the
+// lock when its holder exits, so a pid is provably dead if files for it exist and none
+// is still locked, whichever namespace the checker runs in. Files of crashed writers
+// are left behind; a later writer reusing the pid in the same namespace re-locks one and
+// keeps the earlier writer's entries from being recovered, which errs on the safe side.
+// Called with queue->lock held, failure leaves this process's entries unrecoverable.
+void writer_register(queue_t* queue) {
+    struct stat ns;
+    unsigned long nsid = stat("/proc/self/ns/pid", &ns) == 0 ? (unsigned long)ns.st_ino : 0;
+    char* fn;
+    if (asprintf(&fn, "%s/.chronicle-writer.%u.%lu", queue->dirname, pid_header & (HD_WRITER_PID - 1), nsid) < 0) return;
+    int fd = open(fn, O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || flock(fd, LOCK_SH) != 0) {
+        CLOG(LL_WARN, "shmipc: writer registration %s failed, entries left working will not be recovered: %s\n", fn, strerror(errno));
+        if (fd >= 0) close(fd);
+        free(fn);
+        return;
+    }
+    queue->writer_fd = fd;
+    queue->writer_fn = fn;
+}
+
+// returns 1 if every registration of pid can be locked exclusively, ie. no live process
+// holds it, 0 if one is held and -1 if the pid never registered
+int chronicle_writer_dead(queue_t* queue, uint32_t pid) {
+    char* pattern;
+    if (asprintf(&pattern, "%s/.chronicle-writer.%u.*", queue->dirname, pid) < 0) return chronicle_err("asprintf fail");
+    glob_t g;
+    if (glob(pattern, 0, NULL, &g) != 0 || g.gl_pathc == 0) {
+        globfree(&g);
+        free(pattern);
+        return -1;
+    }
+    int dead = 1;
+    for (size_t i = 0; dead && i < g.gl_pathc; i++) {
+        int fd = open(g.gl_pathv[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) != 0) dead = 0;
+        if (fd >= 0) close(fd); // drops the probe lock
+    }
+    globfree(&g);
+    free(pattern);
+    return dead;
+}
+
+// An appender killed between the CAS of its working header and the final publish
+// leaves the header as HD_WORKING | pid forever, stalling every tailer and appender.
+// When recovery is enabled and the appender has seen the same working header for
+// recovery_ms, and the header is tagged HD_WRITER_PID by a writer whose registration
+// is no longer held, claim the entry and publish it as metadata padding spanning
+// whatever partial payload the dead writer left. Untagged headers (Java, older
+// versions) and our own pid are never recovered.
+// Returns 1 if the entry was recovered, called with appender->lock held.
+int appender_recover_working(queue_t* queue, tailer_t* appender) {
+    if (queue->recovery_ms <= 0 || appender->qf_buf == NULL) return 0;
+    unsigned char* ptr = (appender->qf_tip - appender->qf_mmapoff) + appender->qf_buf;
+    uint32_t header = header_load(ptr);
+    if ((header & HD_MASK_META) != HD_WORKING) return 0;
+
+    long now = chronicle_clock_ms(queue);
+    if (header != appender->busy_header || appender->qf_tip != appender->busy_tip) {
+        appender->busy_header = header;
+        appender->busy_tip = appender->qf_tip;
+        appender->busy_since = now;
+        return 0;
+    }
+    if (now - appender->busy_since < queue->recovery_ms) return 0;
+
+    if (!(header & HD_WRITER_PID) || header == (HD_WORKING | pid_header)) return 0;
+    uint32_t pid = header & (HD_WRITER_PID - 1);
+    if (chronicle_writer_dead(queue, pid) != 1) return 0;
+
+    // the file is zero-filled beyond the stalled header, so the dead writer's payload
+    // ends at the last non-zero byte of our window: skip the zero tail in words back
+    // from the extent, then settle the bytes of the partial and last non-zero words
+    unsigned char* extent = appender->qf_buf + appender->qf_mmapsz;
+    uint64_t words = (extent - (ptr + 4)) / 8;
+    uint64_t used = wire_i64_used(ptr + 4, words);
+    unsigned char* end = ptr + 4 + 8 * used;
+    if (used == words) {
+        for (unsigned char* p = end; p < extent; p++) {
+            if (*p) end = p + 1;
         }
-        if (debug) printf("shmipc: appender created\n");
     }
-    tailer_t* appender = queue->appender;
+    while (end > ptr + 4 && end[-1] == 0) end--;
+
+    // a payload running into the last word of the window may continue beyond it, so
+    // unless the window ends the file, widen it and look again on the next attempt
+    if (extent - end < 8) {
+        off_t st_size = queuefile_refresh_size(queue, appender->qf);
+        if (st_size < 0) return 0;
+        if (appender->qf_mmapoff + appender->qf_mmapsz < (uint64_t)st_size) {
+            queue_double_blocksize(queue, __atomic_load_n(&queue->blocksize, __ATOMIC_RELAXED));
+            return 0;
+        }
+    }
+
+    // claim the entry as ours, so racing recoveries in other processes back off
+    if (header_cas(ptr, HD_WORKING | pid_header, header) != header) return 0;
+
+    uint32_t sz = (end - (ptr + 4) + 3) & ~3;
+    if (ptr + 4 + sz > extent) sz = (extent - (ptr + 4)) & ~3;
+    memset(ptr + 4, 0x8F, sz); // wire PADDING
+    header_store(ptr, HD_METADATA | sz);
+
+    __atomic_add_fetch(&queue->recoveries, 1, __ATOMIC_RELAXED);
+    CLOG(LL_WARN, "shmipc: recovered entry %" PRIu64 " left working by dead pid %u, padded %u bytes\n", appender->qf_index, pid, sz);
+    return 1;
+}
+
+uint64_t chronicle_get_recoveries(queue_t* queue) {
+    return __atomic_load_n(&queue->recoveries, __ATOMIC_RELAXED);
+}
+
+void chronicle_set_recovery_timeout(queue_t* queue, long ms) {
+    queue->recovery_ms = ms;
+}
+
+// append with appender->lock held
+uint64_t chronicle_append_locked(queue_t* queue, tailer_t* appender, COBJ msg, size_t write_sz, long ms) {
+    unsigned char* ptr = appender_claim_locked(queue, appender, write_sz, ms);
+    if (ptr == NULL) return -1;
+    queue->append_write(ptr+4, msg, write_sz);
+    return appender_publish(appender, ptr, write_sz);
+}
+
+// the payload is in place, set the header length, clearing the working bit
+uint64_t appender_publish(tailer_t* appender, unsigned char* ptr, size_t write_sz) {
+    header_store(ptr, write_sz & HD_MASK_LENGTH);
+
+    CLOG(LL_DEBUG, "shmipc: wrote %zu bytes as index %" PRIu64 "\n", write_sz, appender->qf_index);
+    return appender->qf_index;
+}
+
+// wait for a competing writer to publish: spin, then yield, then sleep for up to 1ms
+static void appender_backoff(unsigned* waits) {
+    unsigned n = (*waits)++;
+    if (n < 100) {
+        cpu_relax();
+    } else if (n < 200) {
+        sched_yield();
+    } else {
+        usleep(n < 1200 ? n - 199 : 1000);
+    }
+}
 
+// take the working header of the next entry for write_sz bytes, rolling and extending
+// queuefiles as needed, with appender->lock held. Returns the header address.
+unsigned char* appender_claim_locked(queue_t* queue, tailer_t* appender, size_t write_sz, long ms) {
+    unsigned waits = 0;
     // poll the appender
     while (1) {
-        int r = chronicle_peek_queue_tailer(queue, appender);
+        int r = appender->state = chronicle_peek_queue_tailer_r(queue, appender);
         // TODO: 2nd call defensive to ensure 1 whole blocksize is available to put
-        r = chronicle_peek_queue_tailer(queue, appender);
-        if (debug) printf("shmipc: writeloop appender in state %d\n", r);
+        r = appender->state = chronicle_peek_queue_tailer_r(queue, appender);
+        CLOG(LL_DEBUG, "shmipc: writeloop appender in state %d\n", r);
 
         if (r == TS_AWAITING_QUEUEFILE) {
             // our cycle is pointing to a queuefile that does not exist
-            // as we are writer, create it with temporary filename, atomically
-            // move it to the desired name, then bump the global highest_cycle
-            // value if rename succeeded
+            // as we are writer, create it with temporary filename (unique to this appender,
+            // as other threads may be doing the same), atomically link it to the desired
+            // name, then bump the global highest_cycle value. link fails if another writer
+            // got there first, where rename would have replaced their file.
             char* fn_buf;
-            asprintf(&fn_buf, "%s.%d.tmp", appender->qf_fn, pid_header);
+            asprintf(&fn_buf, "%s.%d.%p.tmp", appender->qf_fn, pid_header, (void*)appender);
 
             // if queuefile_init fails, re-throw the error and abort the write
-            if (queuefile_init(fn_buf, queue) != 0) return -1;
+            if (queuefile_init(fn_buf, queue) != 0) {
+                free(fn_buf);
+                return NULL;
+            }
 
-            if (rename(fn_buf, appender->qf_fn) != 0) {
-                // rename failed, maybe raced with another writer, delay and try again
-                printf("shmipc: create queuefile %s failed at rename, errno %d\n", fn_buf, errno);
+            int linked = link(fn_buf, appender->qf_fn);
+            int link_errno = errno;
+            unlink(fn_buf);
+            if (linked != 0 && link_errno != EEXIST) {
+                // disk trouble, delay and try again
+                CLOG(LL_WARN, "shmipc: create queuefile %s failed at link, errno %d\n", fn_buf, link_errno);
+                free(fn_buf);
                 sleep(1);
                 continue;
             }
-            printf("renamed %s to %s\n", fn_buf, appender->qf_fn);
+            if (linked == 0) CLOG(LL_INFO, "linked %s to %s\n", fn_buf, appender->qf_fn);
             free(fn_buf);
 
             // if our new file higher than highest_cycle, inform listeners by bumping modcount
             uint64_t cyc = appender->qf_index >> queue->cycle_shift;
+            pthread_mutex_lock(&queue->lock);
             if (cyc > queue->highest_cycle) {
                 queue->highest_cycle = cyc;
                 poke_queue_modcount(queue);
             }
+            pthread_mutex_unlock(&queue->lock);
 
-            // rename worked, we can now re-try the peek_tailer
+            // file exists, we can now re-try the peek_tailer
             continue;
         }
 
         if (r == TS_EXTEND_FAIL) {
             // current queuefile has less than two blocks remaining, needs extending
             // should the extend fail, we are having disk issues, wait until fixed
-            uint64_t extend_to = appender->qf_statbuf.st_size + qf_disk_sz;
-            if (lseek(appender->qf_fd, extend_to - 1, SEEK_SET) == -1) {
-                printf("shmmain: extend queuefile %s failed at lseek: %s\n", appender->qf_fn, strerror(errno));
-                sleep(1);
-                continue;
-            }
-            if (write(appender->qf_fd, "", 1) != 1) {
-                printf("shmmain: extend queuefile %s failed at write: %s\n", appender->qf_fn, strerror(errno));
+            uint64_t extend_to = __atomic_load_n(&appender->qf->size, __ATOMIC_ACQUIRE) + qf_disk_sz;
+            // positioned write, as the fd is shared with other appenders in this process
+            if (pwrite(appender->qf->fd, "", 1, extend_to - 1) != 1) {
+                CLOG(LL_ERROR, "shmmain: extend queuefile %s failed at write: %s\n", appender->qf_fn, strerror(errno));
                 sleep(1);
                 continue;
             }
-            printf("shmmain: extended queuefile %s to %" PRIu64 " bytes\n", appender->qf_fn, extend_to);
+            CLOG(LL_INFO, "shmmain: extended queuefile %s to %" PRIu64 " bytes\n", appender->qf_fn, extend_to);
             continue;
         }
 
         // If the tailer returns 0, we are all set pointing to the next unwritten entry.
         // if we write to qf_buf and the state is not zero we'll hit sigbus etc, so sleep
         // and wait for availability.
+        if (r == TS_BUSY) {
+            // another writer holds the entry, typically for well under a microsecond
+            if (!appender_recover_working(queue, appender)) appender_backoff(&waits);
+            continue;
+        }
         if (r != TS_AWAITING_ENTRY) {
-            printf("shmipc: Cannot write in state %d, sleeping\n", r);
+            CLOG(LL_WARN, "shmipc: Cannot write in state %d, sleeping\n", r);
             sleep(1);
             continue;
         }
 
         if ((appender->qf_tip - appender->qf_mmapoff) + write_sz > appender->qf_mmapsz) {
-            printf("aborting on bug: write would segfault buffer!\n");
+            CLOG(LL_ERROR, "aborting on bug: write would segfault buffer!\n");
             abort();
         }
 
@@ -1179,23 +1967,21 @@ uint64_t chronicle_append_ts(queue_t *queue, COBJ msg, long ms) {
         // tailer log handle the entry we've just written in the normal way, since that will
         // adjust the buffer window/mmap for us.
         unsigned char* ptr = (appender->qf_tip - appender->qf_mmapoff) + appender->qf_buf;
-        uint32_t ret = lock_cmpxchgl(ptr, HD_UNALLOCATED, HD_WORKING);
+        // the working header records our pid, so a stalled entry can be traced to its writer
+        uint32_t ret = header_cas(ptr, HD_WORKING | pid_header, HD_UNALLOCATED);
 
         // cmpxchg returns the original value in memory, so we can tell if we succeeded
         // by looking for HD_UNALLOCATED. If we read a working bit or finished size, we lost.
         if (ret == HD_UNALLOCATED) {
-            asm volatile ("mfence" ::: "memory");
-
             // if given a clock, test if we should write EOF and advance cycle
             if (ms > 0) {
                 uint64_t cyc = chronicle_cycle_from_ms(queue, ms);
                 if (cyc > appender->qf_index >> queue->cycle_shift) {
-                    printf("shmipc: appender setting cycle from timestamp: current %" PRIu64 " proposed %" PRIu64 "\n", appender->qf_index >> queue->cycle_shift, cyc);
+                    CLOG(LL_INFO, "shmipc: appender setting cycle from timestamp: current %" PRIu64 " proposed %" PRIu64 "\n", appender->qf_index >> queue->cycle_shift, cyc);
                     appender->qf_index = cyc << queue->cycle_shift;
 
-                    printf("shmipc: got write lock, writing EOF to start roll\n");
-                    uint32_t header = HD_EOF;
-                    memcpy(ptr, &header, sizeof(header));
+                    CLOG(LL_INFO, "shmipc: got write lock, writing EOF to start roll\n");
+                    header_store(ptr, HD_EOF);
                     continue; // retry write in next queuefile
                 }
             }
@@ -1206,28 +1992,17 @@ uint64_t chronicle_append_ts(queue_t *queue, COBJ msg, long ms) {
             // we'll patch missing EOFs during our writes if we hold the lock. This will nudge on any
             // readers who haven't noticed the roll.
             if (appender->qf_index < queue->highest_cycle << queue->cycle_shift) {
-                printf("shmipc: got write lock, but about to write to queuefile < maxcycle, writing EOF\n");
-                uint32_t header = HD_EOF;
-                memcpy(ptr, &header, sizeof(header));
+                CLOG(LL_INFO, "shmipc: got write lock, but about to write to queuefile < maxcycle, writing EOF\n");
+                header_store(ptr, HD_EOF);
                 continue; // retry write in next queuefile
             }
 
-            queue->append_write(ptr+4, msg, write_sz);
-
-            asm volatile ("mfence" ::: "memory");
-            uint32_t header = write_sz & HD_MASK_LENGTH;
-            memcpy(ptr, &header, sizeof(header));
-
-            if (debug) printf("shmipc: wrote %zu bytes as index %" PRIu64 "\n", write_sz, appender->qf_index);
-
-            break;
+            return ptr;
         }
 
-        printf("shmipc: write lock failed, peeking again\n");
-        sleep(1);
+        CLOG(LL_DEBUG, "shmipc: write lock failed, peeking again\n");
+        appender_backoff(&waits);
     }
-
-    return appender->qf_index;
 }
 
 tailer_t* chronicle_tailer(queue_t *queue, cdispatch_f dispatcher, void* dispatch_ctx, uint64_t index) {
@@ -1237,7 +2012,7 @@ tailer_t* chronicle_tailer(queue_t *queue, cdispatch_f dispatcher, void* dispatc
     int cycle = index >> queue->cycle_shift;
     int seqnum = index & queue->seqnum_mask;
 
-    printf("shmipc: tailer added index=%" PRIu64 " (cycle=%d seqnum=%d) cb=%p\n", index, cycle, seqnum, dispatcher);
+    CLOG(LL_INFO, "shmipc: tailer added index=%" PRIu64 " (cycle=%d seqnum=%d) cb=%p\n", index, cycle, seqnum, dispatcher);
     if (cycle < queue->lowest_cycle) {
         index = queue->lowest_cycle << queue->cycle_shift;
     }
@@ -1256,13 +2031,18 @@ tailer_t* chronicle_tailer(queue_t *queue, cdispatch_f dispatcher, void* dispatc
     tailer->dispatch_ctx = dispatch_ctx;
     tailer->state = 5;
     tailer->mmap_protection = PROT_READ;
+    tailer->queue = queue; // parent pointer
+    pthread_mutex_init(&tailer->lock, NULL);
 
+    pthread_mutex_lock(&queues_lock);
+    pthread_mutex_lock(&evict_lock);
     tailer->next = queue->tailers; // linked list
     tailer->prev = NULL;
     if (queue->tailers) queue->tailers->prev = tailer;
     queue->tailers = tailer;
+    pthread_mutex_unlock(&evict_lock);
+    pthread_mutex_unlock(&queues_lock);
 
-    tailer->queue = queue; // parent pointer
     return tailer;
 }
 
@@ -1274,7 +2054,7 @@ COBJ chronicle_collect(tailer_t *tailer, collected_t *collected) {
     uint64_t delaycount = 0;
     while (1) {
         int r = chronicle_peek_tailer(tailer);
-        if (debug) printf("collect value returns %d into object %p\n", r, tailer->collect);
+        CLOG(LL_DEBUG, "collect value returns %d into object %p\n", r, tailer->collect);
         if (r == TS_COLLECTED) {
             break;
         }
@@ -1293,6 +2073,54 @@ void chronicle_return(tailer_t *tailer, collected_t *collected) {
     }
 }
 
+void chronicle_set_mapping_budget(uint64_t bytes) {
+    __atomic_store_n(&mapping_budget, bytes, __ATOMIC_RELAXED);
+    if (bytes) mapping_evict(NULL, 0);
+}
+
+uint64_t chronicle_mapped_bytes() {
+    return __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+}
+
+uint64_t chronicle_map_count() {
+    return __atomic_load_n(&map_count, __ATOMIC_RELAXED);
+}
+
+uint64_t chronicle_queue_mapped_bytes(queue_t* queue) {
+    return __atomic_load_n(&queue->mapped_bytes, __ATOMIC_RELAXED);
+}
+
+uint64_t chronicle_tailer_mapped_bytes(tailer_t* tailer) {
+    return tailer->qf_map ? tailer->qf_mmapsz : 0;
+}
+
+void chronicle_tailer_set_filter(tailer_t* tailer, cfilter_f filter, void* filter_ctx) {
+    tailer->filter = filter;
+    tailer->filter_ctx = filter_ctx;
+}
+
+int chronicle_tailer_set_filter_mask(tailer_t* tailer, int offset, const unsigned char* mask, const unsigned char* value, int len) {
+    if (offset < 0 || len < 0 || len > sizeof(tailer->filter_mask)) return chronicle_err("filter mask length must be 0..16");
+    bzero(tailer->filter_mask, sizeof(tailer->filter_mask));
+    bzero(tailer->filter_value, sizeof(tailer->filter_value));
+    memcpy(tailer->filter_mask, mask, len);
+    memcpy(tailer->filter_value, value, len);
+    // pre-mask the value so a byte that can never match is rejected, not ignored
+    tailer->filter_value[0] &= tailer->filter_mask[0];
+    tailer->filter_value[1] &= tailer->filter_mask[1];
+    tailer->filter_offset = offset;
+    tailer->filter_len = len;
+    return 0;
+}
+
+uint64_t chronicle_tailer_filtered(tailer_t* tailer) {
+    return tailer->filtered;
+}
+
+void chronicle_tailer_set_replay(tailer_t* tailer, int replay) {
+    tailer->replay = replay;
+}
+
 tailstate_t chronicle_tailer_state(tailer_t* tailer) {
     return tailer->state;
 }
@@ -1302,16 +2130,10 @@ uint64_t chronicle_tailer_index(tailer_t* tailer) {
 }
 
 void chronicle_tailer_close(tailer_t* tailer) {
-    if (tailer->qf_fn) { // if next filename cached...
-        free(tailer->qf_fn);
-    }
-    if (tailer->qf_buf) { // if mmap() open...
-        munmap(tailer->qf_buf, tailer->qf_mmapsz);
-    }
-    if (tailer->qf_fd) { // if open() open...
-        close(tailer->qf_fd);
-    }
-    // unlink ourselves from doubly-linked chain and update parent pointer if we were first
+    // unlink ourselves from doubly-linked chain and update parent pointer if we were first,
+    // after which no other thread can find us to evict
+    pthread_mutex_lock(&queues_lock);
+    pthread_mutex_lock(&evict_lock);
     if (tailer->next) {
         tailer->next->prev = tailer->prev;
     }
@@ -1319,7 +2141,19 @@ void chronicle_tailer_close(tailer_t* tailer) {
         tailer->prev->next = tailer->next;
     } else if (tailer->queue->tailers == tailer) {
         tailer->queue->tailers = tailer->next;
+    } else if (tailer->queue->appenders == tailer) {
+        tailer->queue->appenders = tailer->next;
     }
+    if (tailer->queue->appender == tailer) tailer->queue->appender = NULL;
+    pthread_mutex_unlock(&evict_lock);
+    pthread_mutex_unlock(&queues_lock);
+
+    if (tailer->qf_fn) { // if next filename cached...
+        free(tailer->qf_fn);
+    }
+    // drop our share of the mmap() and open() handles
+    tailer_release_queuefile(tailer);
+    pthread_mutex_destroy(&tailer->lock);
     free(tailer);
 }
 
@@ -1327,12 +2161,15 @@ int chronicle_cleanup(queue_t* queue_delete) {
     if (queue_delete == NULL) return chronicle_err("queue is NULL");
 
     // check if queue already open
+    pthread_mutex_lock(&queues_lock);
     queue_t **parent = &queue_head; // pointer to a queue_t pointer
     queue_t *queue = queue_head;
 
     while (queue != NULL) {
         if (queue == queue_delete) {
-            *parent = queue->next; // unlink
+            pthread_mutex_lock(&evict_lock);
+            *parent = queue->next; // unlink, after which eviction cannot reach our tailers
+            pthread_mutex_unlock(&evict_lock);
 
             // delete tailers
             tailer_t *tailer = queue->tailers; // shortcut to save both collections
@@ -1343,13 +2180,27 @@ int chronicle_cleanup(queue_t* queue_delete) {
             }
             queue->tailers = NULL;
 
-            if (queue->appender) chronicle_tailer_close(queue->appender);
+            while (queue->appenders != NULL) {
+                chronicle_tailer_close(queue->appenders);
+            }
 
             // kill queue
             munmap(queue->dirlist, queue->dirlist_statbuf.st_size);
+            while (queue->dirlist_retired) {
+                retired_t* retired = queue->dirlist_retired;
+                queue->dirlist_retired = retired->next;
+                munmap(retired->buf, retired->sz);
+                free(retired);
+            }
             if (queue->dirlist_fd > 0) {
                 close(queue->dirlist_fd);
             }
+            if (queue->writer_fd >= 0) {
+                // leave the registration to any other handle of ours still holding it
+                if (flock(queue->writer_fd, LOCK_EX | LOCK_NB) == 0) unlink(queue->writer_fn);
+                close(queue->writer_fd);
+            }
+            free(queue->writer_fn);
             free(queue->dirlist_name);
             free(queue->dirname);
             free(queue->queuefile_pattern);
@@ -1357,25 +2208,1131 @@ int chronicle_cleanup(queue_t* queue_delete) {
             free(queue->roll_format);
             free(queue->roll_name);
             globfree(&queue->queuefile_glob);
+            pthread_mutex_destroy(&queue->lock);
             free(queue);
 
+            pthread_mutex_unlock(&queues_lock);
             return 0;
         }
         parent = &queue->next;
         queue = queue->next;
     }
+    pthread_mutex_unlock(&queues_lock);
     return chronicle_err("chronicle_cleanup: queue not found");
 }
 
+// map a whole queuefile read-only for a one-off scan, NULL if missing or unmappable
+unsigned char* queuefile_map_whole(queue_t* queue, uint64_t cycle, size_t* sz) {
+    char* fn = chronicle_get_cycle_fn(queue, cycle);
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0) {
+        CLOG(LL_DEBUG, "shmipc: scan skipping missing queuefile %s\n", fn);
+        free(fn);
+        return NULL;
+    }
+    struct stat statbuf;
+    unsigned char* buf = MAP_FAILED;
+    if (fstat(fd, &statbuf) == 0 && statbuf.st_size > 0) {
+        buf = mmap(0, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (buf == MAP_FAILED) {
+        CLOG(LL_WARN, "shmipc: scan cannot map %s: %s\n", fn, strerror(errno));
+        buf = NULL;
+    }
+    *sz = statbuf.st_size;
+    close(fd); // the mapping stays valid
+    free(fn);
+    return buf;
+}
+
+int cycle_cmp(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Cycles lo <= cycle <= hi that have a queuefile, ascending, from a fresh listing of the
+// queue directory, so a range with gaps costs one glob rather than an open per missing
+// cycle. Names are parsed with the roll format and kept only if they round-trip through
+// chronicle_get_cycle_fn. Returns the count with *cycles malloc'd, or -1 on error.
+int queue_cycles(queue_t* queue, uint64_t lo, uint64_t hi, uint64_t** cycles) {
+    *cycles = NULL;
+    glob_t g;
+    int rc = glob(queue->queuefile_pattern, 0, NULL, &g);
+    if (rc == GLOB_NOMATCH) return 0;
+    if (rc != 0) return chronicle_err("queue cycles glob fail");
+
+    char* pattern;
+    uint64_t* out = malloc(g.gl_pathc * sizeof(uint64_t));
+    if (out == NULL || asprintf(&pattern, "%s/%s.cq4", queue->dirname, queue->roll_strftime) < 0) {
+        free(out);
+        globfree(&g);
+        return chronicle_err("queue cycles malloc fail");
+    }
+    int n = 0;
+    for (size_t i = 0; i < g.gl_pathc; i++) {
+        struct tm info;
+        bzero(&info, sizeof(info));
+        char* end = strptime(g.gl_pathv[i], pattern, &info);
+        if (end == NULL || *end != 0) continue;
+        time_t rawtime = timegm(&info);
+        if (rawtime < 0) continue;
+        uint64_t cycle = rawtime / (queue->roll_length / 1000);
+        if (cycle < lo || cycle > hi) continue;
+        char* fn = chronicle_get_cycle_fn(queue, cycle);
+        if (fn && strcmp(fn, g.gl_pathv[i]) == 0) out[n++] = cycle;
+        free(fn);
+    }
+    free(pattern);
+    globfree(&g);
+    qsort(out, n, sizeof(uint64_t), &cycle_cmp);
+    *cycles = out;
+    return n;
+}
+
+// Index pages
+// Queuefiles written by Java open with a header metadata entry giving indexCount,
+// indexSpacing and the position of index2index, whose I64_ARRAY lists the positions
+// of the index pages. Entry k across the pages is the header position of message
+// k*indexSpacing of the cycle, so a reader can start part way through a file without
+// walking every header before it. libchronicle does not write index pages, so callers
+// fall back to walking from the start of files it created.
+#define QFHEADER_FIELDS(X, s) \
+    X(s, index_count,   "indexCount",   WF_INT64) \
+    X(s, index_spacing, "indexSpacing", WF_INT64) \
+    X(s, index2index,   "index2Index",  WF_INT64)
+WIRE_SCHEMA(qfheader, QFHEADER_FIELDS)
+
+typedef struct {
+    uint64_t          count;   // entries per page
+    uint64_t          spacing; // messages per entry
+    unsigned char**   pages;   // values of each page in use, within the mapped queuefile
+    uint64_t          entries;
+} qfindex_t;
+
+// values of the I64_ARRAY in the metadata entry at pos, NULL if there is none
+unsigned char* queuefile_meta_array(unsigned char* buf, size_t sz, uint64_t pos, uint64_t* capacity) {
+    if (pos == 0 || pos + 4 > sz) return NULL;
+    uint32_t header = header_load(buf + pos);
+    uint64_t len = header & HD_MASK_LENGTH;
+    if ((header & HD_MASK_META) != HD_METADATA || pos + 4 + len > sz) return NULL;
+    return wire_i64_array(buf + pos + 4, len, capacity);
+}
+
+// read the index pages of a queuefile mapped whole, returning the entries in use
+uint64_t queuefile_index(unsigned char* buf, size_t sz, qfindex_t* ix) {
+    bzero(ix, sizeof(qfindex_t));
+    if (sz < 4) return 0;
+    uint32_t header = header_load(buf);
+    uint64_t len = header & HD_MASK_LENGTH;
+    if ((header & HD_MASK_META) != HD_METADATA || 4 + len > sz) return 0;
+
+    qfheader_t h;
+    h.present = 0;
+    wire_schema_decode(&qfheader_schema, buf + 4, len, &h);
+    if (!WIRE_HAS(h, qfheader, index_count) || !WIRE_HAS(h, qfheader, index_spacing) ||
+        !WIRE_HAS(h, qfheader, index2index) || h.index_count <= 0 || h.index_spacing <= 0) return 0;
+
+    uint64_t capacity;
+    unsigned char* i2i = queuefile_meta_array(buf, sz, h.index2index, &capacity);
+    uint64_t npages = i2i ? wire_i64_used(i2i, capacity) : 0;
+    if (npages == 0 || (ix->pages = malloc(npages * sizeof(unsigned char*))) == NULL) return 0;
+    ix->count = h.index_count;
+    ix->spacing = h.index_spacing;
+    for (uint64_t p = 0; p < npages; p++) {
+        uint64_t pos;
+        memcpy(&pos, i2i + 8*p, sizeof(pos));
+        uint64_t page_capacity;
+        unsigned char* values = queuefile_meta_array(buf, sz, pos, &page_capacity);
+        if (values == NULL || page_capacity != ix->count) break;
+        uint64_t n = wire_i64_used(values, page_capacity);
+        ix->pages[p] = values;
+        ix->entries += n;
+        if (n < page_capacity) break; // only the last page in use may be partly filled
+    }
+    return ix->entries;
+}
+
+// The latest index entry at or before seqnum that points at a published data entry
+// (Java may be part way through writing), returning its header position and setting
+// *seqp to the message's seqnum. Returns 0, the start of the file, if there is none.
+uint64_t qfindex_seek(qfindex_t* ix, unsigned char* buf, size_t sz, uint64_t seqnum, uint64_t* seqp) {
+    *seqp = 0;
+    if (ix->entries == 0) return 0;
+    uint64_t k = seqnum / ix->spacing;
+    if (k >= ix->entries) k = ix->entries - 1;
+    while (1) {
+        uint64_t pos;
+        memcpy(&pos, ix->pages[k / ix->count] + 8 * (k % ix->count), sizeof(pos));
+        if (pos > 0 && pos + 4 <= sz) {
+            uint32_t header = header_load(buf + pos);
+            if (header != HD_UNALLOCATED && (header & HD_MASK_META) == 0) {
+                *seqp = k * ix->spacing;
+                return pos;
+            }
+        }
+        if (k-- == 0) return 0;
+    }
+}
+
+void qfindex_free(qfindex_t* ix) {
+    free(ix->pages);
+    bzero(ix, sizeof(qfindex_t));
+}
+
+// Parallel replay
+// The range is cut into parts: whole cycles, and where a cycle has index pages, runs of
+// index entries within it, so that a single large cycle still spreads over the workers.
+// Workers take parts in ascending order, and map and parse each queuefile without
+// touching any tailer or shared mapping state, so they need no locking against each
+// other. In ordered mode each worker buffers parsed messages until all earlier parts
+// have been delivered, then dispatches inline for the remainder of its part. A worker
+// holding replay_pending_max messages stops parsing to wait for its turn instead, so
+// memory is bounded per worker however large the cycles are.
+typedef struct {
+    uint64_t          cycle;
+    uint64_t          from_seq;  // seqnum of the message at from_pos
+    uint64_t          from_pos;  // header position to parse from, 0 for the start of the file
+    uint64_t          to_index;  // first index of the next part
+} replaypart_t;
+
+typedef struct {
+    queue_t*          queue;
+    uint64_t          from_index;
+    uint64_t          to_index;
+    cdispatch_f       dispatcher;
+    DISPATCH_CTX      dispatch_ctx;
+    int               ordered;
+
+    replaypart_t*     parts;
+    size_t            nparts;
+    size_t            parts_sz;
+
+    pthread_mutex_t   lock;
+    pthread_cond_t    turn;
+    size_t            next_part; // next part to hand to a worker
+    size_t            deliver_part; // ordered: the part currently allowed to dispatch
+    int64_t           count;
+} replay_t;
+
+typedef struct {
+    replay_t*         replay;
+    size_t            part;
+    uint64_t          to_index; // end of the part within the range
+    int               inline_dispatch;
+    collected_t*      pending; // ordered: parsed but not yet dispatched
+    size_t            pending_n;
+    size_t            pending_sz;
+    int64_t           count;
+} replay_worker_t;
+
+// a dispatcher may keep the object, as for tailers
+void replay_dispatch(replay_t* replay, uint64_t index, COBJ msg) {
+    if (replay->dispatcher(replay->dispatch_ctx, index, msg) != DISPATCH_RETAIN && replay->queue->parser_free) {
+        replay->queue->parser_free(msg);
+    }
+}
+
+// ordered: wait until every earlier part is delivered, flush what we buffered, and
+// dispatch the rest of the part inline
+void replay_take_turn(replay_worker_t* worker) {
+    replay_t* replay = worker->replay;
+    pthread_mutex_lock(&replay->lock);
+    while (replay->deliver_part != worker->part) {
+        pthread_cond_wait(&replay->turn, &replay->lock);
+    }
+    pthread_mutex_unlock(&replay->lock);
+    for (size_t i = 0; i < worker->pending_n; i++) {
+        replay_dispatch(replay, worker->pending[i].index, worker->pending[i].msg);
+    }
+    worker->pending_n = 0;
+    worker->inline_dispatch = 1;
+}
+
+parseqb_state_t parse_replay_cb(unsigned char* base, int lim, uint64_t index, void* userdata) {
+    replay_worker_t* worker = (replay_worker_t*)userdata;
+    replay_t* replay = worker->replay;
+    if (index >= worker->to_index) return QB_COLLECTED; // stop parsing this part
+    if (index < replay->from_index) return QB_AWAITING_ENTRY;
+
+    COBJ msg = replay->queue->parser(base, lim);
+    if (msg == NULL) return QB_AWAITING_ENTRY;
+    worker->count++;
+
+    // our turn arrived mid-part, or we have buffered as much as we may
+    if (!worker->inline_dispatch && (worker->pending_n >= replay_pending_max ||
+        __atomic_load_n(&replay->deliver_part, __ATOMIC_ACQUIRE) == worker->part)) {
+        replay_take_turn(worker);
+    }
+    if (!worker->inline_dispatch && worker->pending_n == worker->pending_sz) {
+        size_t sz = worker->pending_sz ? worker->pending_sz * 2 : 1024;
+        if (sz > replay_pending_max) sz = replay_pending_max;
+        collected_t* pending = realloc(worker->pending, sz * sizeof(collected_t));
+        if (pending == NULL) {
+            replay_take_turn(worker);
+        } else {
+            worker->pending = pending;
+            worker->pending_sz = sz;
+        }
+    }
+    if (worker->inline_dispatch) {
+        replay_dispatch(replay, index, msg);
+        return QB_AWAITING_ENTRY;
+    }
+
+    worker->pending[worker->pending_n].msg = msg;
+    worker->pending[worker->pending_n].index = index;
+    worker->pending[worker->pending_n].sz = lim;
+    worker->pending_n++;
+    return QB_AWAITING_ENTRY;
+}
+
+int replay_add_part(replay_t* replay, uint64_t cycle, uint64_t from_seq, uint64_t from_pos) {
+    if (replay->nparts == replay->parts_sz) {
+        size_t sz = replay->parts_sz ? replay->parts_sz * 2 : 64;
+        replaypart_t* parts = realloc(replay->parts, sz * sizeof(replaypart_t));
+        if (parts == NULL) return chronicle_err("replay parts realloc failed");
+        replay->parts = parts;
+        replay->parts_sz = sz;
+    }
+    queue_t* queue = replay->queue;
+    replaypart_t* part = &replay->parts[replay->nparts++];
+    part->cycle = cycle;
+    part->from_seq = from_seq;
+    part->from_pos = from_pos;
+    part->to_index = (cycle + 1) << queue->cycle_shift;
+    // the previous part of the same cycle now ends where this one starts
+    if (replay->nparts > 1 && part[-1].cycle == cycle) part[-1].to_index = (cycle << queue->cycle_shift) + from_seq;
+    return 0;
+}
+
+// Cut each cycle in range into up to nthreads parts at index entries, starting the
+// first cycle at the entry before from_index. Cycles without index pages are one part.
+int replay_plan(replay_t* replay, uint64_t first_cycle, uint64_t last_cycle, int nthreads) {
+    queue_t* queue = replay->queue;
+    for (uint64_t cycle = first_cycle; cycle <= last_cycle; cycle++) {
+        size_t sz;
+        unsigned char* buf = queuefile_map_whole(queue, cycle, &sz);
+        if (buf == NULL) continue;
+        qfindex_t ix;
+        uint64_t entries = queuefile_index(buf, sz, &ix);
+
+        uint64_t cycle_index = cycle << queue->cycle_shift;
+        uint64_t from_seq = 0;
+        uint64_t from_pos = 0;
+        if (replay->from_index > cycle_index) {
+            from_pos = qfindex_seek(&ix, buf, sz, replay->from_index - cycle_index, &from_seq);
+        }
+        int rc = replay_add_part(replay, cycle, from_seq, from_pos);
+
+        // split the entries from where we start to the end of the range evenly
+        if (entries > 0 && rc == 0) {
+            uint64_t k0 = from_seq / ix.spacing;
+            uint64_t k1 = entries;
+            if (replay->to_index - cycle_index < k1 * ix.spacing) k1 = (replay->to_index - cycle_index + ix.spacing - 1) / ix.spacing;
+            uint64_t n = k1 > k0 + nthreads ? nthreads : k1 - k0;
+            for (uint64_t i = 1; i < n && rc == 0; i++) {
+                uint64_t seq;
+                uint64_t pos = qfindex_seek(&ix, buf, sz, (k0 + i * (k1 - k0) / n) * ix.spacing, &seq);
+                if (seq > from_seq) rc = replay_add_part(replay, cycle, from_seq = seq, pos);
+            }
+        }
+        qfindex_free(&ix);
+        munmap(buf, sz);
+        if (rc != 0) return rc;
+    }
+    CLOG(LL_DEBUG, "shmipc: replay cycles %" PRIu64 " to %" PRIu64 " in %zu parts\n", first_cycle, last_cycle, replay->nparts);
+    return 0;
+}
+
+void replay_part(replay_worker_t* worker) {
+    replay_t* replay = worker->replay;
+    queue_t* queue = replay->queue;
+    replaypart_t* part = &replay->parts[worker->part];
+    worker->to_index = part->to_index < replay->to_index ? part->to_index : replay->to_index;
+
+    size_t sz;
+    unsigned char* buf = queuefile_map_whole(queue, part->cycle, &sz);
+    if (buf == NULL) return;
+    madvise(buf, sz, MADV_SEQUENTIAL);
+
+    unsigned char* base = buf + part->from_pos;
+    uint64_t index = (part->cycle << queue->cycle_shift) + part->from_seq;
+    // runs to the end of the part or the written data in a single call
+    parse_queue_block(queue, &base, &index, buf+sz, NULL, &parse_replay_cb, worker);
+    munmap(buf, sz);
+}
+
+void* replay_worker_main(void* arg) {
+    replay_t* replay = (replay_t*)arg;
+    replay_worker_t worker;
+    bzero(&worker, sizeof(worker));
+    worker.replay = replay;
+
+    while (1) {
+        pthread_mutex_lock(&replay->lock);
+        if (replay->next_part >= replay->nparts) {
+            pthread_mutex_unlock(&replay->lock);
+            break;
+        }
+        worker.part = replay->next_part++;
+        pthread_mutex_unlock(&replay->lock);
+
+        worker.inline_dispatch = !replay->ordered;
+        worker.pending_n = 0;
+        replay_part(&worker);
+
+        if (replay->ordered) {
+            if (!worker.inline_dispatch) replay_take_turn(&worker);
+            pthread_mutex_lock(&replay->lock);
+            __atomic_store_n(&replay->deliver_part, worker.part + 1, __ATOMIC_RELEASE);
+            pthread_cond_broadcast(&replay->turn);
+            pthread_mutex_unlock(&replay->lock);
+        }
+    }
+
+    pthread_mutex_lock(&replay->lock);
+    replay->count += worker.count;
+    pthread_mutex_unlock(&replay->lock);
+    free(worker.pending);
+    return NULL;
+}
+
+int64_t chronicle_replay_parallel(queue_t* queue, uint64_t from_index, uint64_t to_index, int nthreads, cdispatch_f dispatcher, DISPATCH_CTX dispatch_ctx, int ordered) {
+    if (queue == NULL) return chronicle_err("queue is NULL");
+    if (dispatcher == NULL) return chronicle_err("replay requires a dispatcher");
+    if (queue->parser == NULL) return chronicle_err("replay requires a parser");
+    if (nthreads < 1) return chronicle_err("replay requires at least one thread");
+
+    peek_queue_modcount(queue);
+
+    replay_t replay;
+    bzero(&replay, sizeof(replay));
+    replay.queue = queue;
+    replay.from_index = from_index;
+    replay.to_index = to_index;
+    replay.dispatcher = dispatcher;
+    replay.dispatch_ctx = dispatch_ctx;
+    replay.ordered = ordered;
+
+    uint64_t first_cycle = from_index >> queue->cycle_shift;
+    if (first_cycle < queue->lowest_cycle) first_cycle = queue->lowest_cycle;
+    uint64_t last_cycle = (to_index - 1) >> queue->cycle_shift;
+    if (last_cycle > queue->highest_cycle) last_cycle = queue->highest_cycle;
+    if (first_cycle > last_cycle || from_index >= to_index) return 0;
+
+    if (replay_plan(&replay, first_cycle, last_cycle, nthreads) != 0) {
+        free(replay.parts);
+        return -1;
+    }
+    if (nthreads > replay.nparts) nthreads = replay.nparts;
+
+    pthread_mutex_init(&replay.lock, NULL);
+    pthread_cond_init(&replay.turn, NULL);
+    pthread_t* threads = malloc(nthreads * sizeof(pthread_t));
+    int started = 0;
+    for (; threads && started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, &replay_worker_main, &replay) != 0) break;
+    }
+    if (started == 0) replay_worker_main(&replay); // no threads available, replay inline
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(replay.parts);
+    pthread_cond_destroy(&replay.turn);
+    pthread_mutex_destroy(&replay.lock);
+
+    return replay.count;
+}
+
+// Reverse iteration
+// Walking backwards needs to know where each message starts, which the headers only
+// tell us going forwards. We scan forward without parsing any payloads to record
+// message positions, then step back through them. Where a cycle has index pages each
+// scan covers one run of index entries, starting from the last, so reaching the tip
+// of a large cycle costs one run rather than the whole file. Cycles are stepped using
+// a listing of the queuefiles that exist.
+typedef struct {
+    unsigned char**   msgs;  // payload pointers into buf
+    int*              sizes;
+    size_t            n;
+    size_t            sz;
+    uint64_t          to_index; // stop before this index
+    int               failed;
+} scan_t;
+
+struct reverse {
+    queue_t*          queue;
+    uint64_t*         cycles; // existing cycles, ascending
+    int               ncycles; // cycles not yet loaded
+    uint64_t          cycle;
+    unsigned char*    buf;
+    size_t            buf_sz;
+    qfindex_t         ix;
+    uint64_t          chunk_seq; // seqnum of the first message of scan, 0 once the cycle is done
+    scan_t            scan;
+    size_t            pos;   // messages of scan yet to be returned
+};
+
+parseqb_state_t parse_scan_cb(unsigned char* base, int lim, uint64_t index, void* userdata) {
+    scan_t* scan = (scan_t*)userdata;
+    if (index >= scan->to_index) return QB_COLLECTED;
+    if (scan->msgs) {
+        if (scan->n == scan->sz) {
+            unsigned char** msgs = realloc(scan->msgs, scan->sz * 2 * sizeof(unsigned char*));
+            if (msgs) scan->msgs = msgs;
+            int* sizes = msgs ? realloc(scan->sizes, scan->sz * 2 * sizeof(int)) : NULL;
+            if (sizes == NULL) {
+                scan->failed = 1;
+                return QB_COLLECTED;
+            }
+            scan->sizes = sizes;
+            scan->sz = scan->sz * 2;
+        }
+        scan->msgs[scan->n] = base;
+        scan->sizes[scan->n] = lim;
+    }
+    scan->n++;
+    return QB_AWAITING_ENTRY;
+}
+
+// Count the messages of a cycle with seqnum < before, recording their positions if
+// scan->msgs is allocated. Scanning starts at the last usable index entry before them,
+// or the start of the file without index pages, and its seqnum is returned.
+uint64_t scan_cycle(queue_t* queue, unsigned char* buf, size_t sz, uint64_t cycle, qfindex_t* ix, uint64_t before, scan_t* scan) {
+    uint64_t seq;
+    uint64_t pos = qfindex_seek(ix, buf, sz, before - 1, &seq);
+    unsigned char* base = buf + pos;
+    uint64_t index = (cycle << queue->cycle_shift) + seq;
+    scan->n = 0;
+    scan->to_index = before == UINT64_MAX ? UINT64_MAX : (cycle << queue->cycle_shift) + before;
+    parse_queue_block(queue, &base, &index, buf+sz, NULL, &parse_scan_cb, scan);
+    return seq;
+}
+
+uint64_t chronicle_index_from_end(queue_t* queue, uint64_t n) {
+    peek_queue_modcount(queue);
+    scan_t scan;
+    bzero(&scan, sizeof(scan));
+
+    uint64_t* cycles;
+    int i = queue_cycles(queue, queue->lowest_cycle, queue->highest_cycle, &cycles);
+    while (i-- > 0) {
+        size_t sz;
+        unsigned char* buf = queuefile_map_whole(queue, cycles[i], &sz);
+        if (buf == NULL) continue;
+        qfindex_t ix;
+        queuefile_index(buf, sz, &ix);
+        uint64_t count = scan_cycle(queue, buf, sz, cycles[i], &ix, UINT64_MAX, &scan) + scan.n;
+        qfindex_free(&ix);
+        munmap(buf, sz);
+        if (count >= n) {
+            uint64_t index = (cycles[i] << queue->cycle_shift) + count - n;
+            free(cycles);
+            return index;
+        }
+        n -= count;
+    }
+    free(cycles);
+    return queue->lowest_cycle << queue->cycle_shift;
+}
+
+tailer_t* chronicle_tailer_from_end(queue_t* queue, cdispatch_f dispatcher, DISPATCH_CTX dispatch_ctx, uint64_t n) {
+    if (queue == NULL) return chronicle_perr("queue is not valid");
+    return chronicle_tailer(queue, dispatcher, dispatch_ctx, chronicle_index_from_end(queue, n));
+}
+
+reverse_t* chronicle_reverse(queue_t* queue) {
+    if (queue == NULL) return chronicle_perr("queue is not valid");
+    peek_queue_modcount(queue);
+
+    reverse_t* reverse = malloc(sizeof(reverse_t));
+    if (reverse == NULL) return chronicle_perr("rm fail");
+    bzero(reverse, sizeof(reverse_t));
+    reverse->queue = queue;
+    reverse->ncycles = queue_cycles(queue, queue->lowest_cycle, queue->highest_cycle, &reverse->cycles);
+    reverse->scan.sz = 1024;
+    reverse->scan.msgs = malloc(reverse->scan.sz * sizeof(unsigned char*));
+    reverse->scan.sizes = malloc(reverse->scan.sz * sizeof(int));
+    if (reverse->ncycles < 0 || reverse->scan.msgs == NULL || reverse->scan.sizes == NULL) {
+        chronicle_reverse_close(reverse);
+        return chronicle_perr("rm fail");
+    }
+    return reverse;
+}
+
+COBJ chronicle_reverse_collect(reverse_t* reverse, collected_t* collected) {
+    queue_t* queue = reverse->queue;
+    while (1) {
+        while (reverse->pos == 0) {
+            if (reverse->buf && reverse->chunk_seq > 0) {
+                // the previous run of index entries in this cycle
+                reverse->chunk_seq = scan_cycle(queue, reverse->buf, reverse->buf_sz, reverse->cycle, &reverse->ix, reverse->chunk_seq, &reverse->scan);
+                reverse->pos = reverse->scan.n;
+            } else {
+                if (reverse->buf) {
+                    munmap(reverse->buf, reverse->buf_sz);
+                    qfindex_free(&reverse->ix);
+                    reverse->buf = NULL;
+                }
+                if (reverse->ncycles == 0) return NULL; // exhausted
+                reverse->cycle = reverse->cycles[--reverse->ncycles];
+                reverse->buf = queuefile_map_whole(queue, reverse->cycle, &reverse->buf_sz);
+                if (reverse->buf == NULL) continue;
+                queuefile_index(reverse->buf, reverse->buf_sz, &reverse->ix);
+                reverse->chunk_seq = scan_cycle(queue, reverse->buf, reverse->buf_sz, reverse->cycle, &reverse->ix, UINT64_MAX, &reverse->scan);
+                reverse->pos = reverse->scan.n;
+            }
+            if (reverse->scan.failed) return chronicle_perr("reverse scan realloc failed");
+        }
+        reverse->pos--;
+        collected->index = (reverse->cycle << queue->cycle_shift) + reverse->chunk_seq + reverse->pos;
+        collected->sz = reverse->scan.sizes[reverse->pos];
+        collected->msg = queue->parser(reverse->scan.msgs[reverse->pos], collected->sz);
+        if (collected->msg) return collected->msg;
+        CLOG(LL_DEBUG, "chronicle: caution at index %" PRIu64 " parse function returned NULL, skipping\n", collected->index);
+    }
+}
+
+void chronicle_reverse_return(reverse_t* reverse, collected_t* collected) {
+    if (reverse->queue->parser_free) {
+        reverse->queue->parser_free(collected->msg);
+    }
+}
+
+void chronicle_reverse_close(reverse_t* reverse) {
+    if (reverse->buf) munmap(reverse->buf, reverse->buf_sz);
+    qfindex_free(&reverse->ix);
+    free(reverse->cycles);
+    free(reverse->scan.msgs);
+    free(reverse->scan.sizes);
+    free(reverse);
+}
+
+// Reactor
+// A thread repeatedly peeks a set of tailers under r->lock (recursive, so callbacks may
+// add and remove tailers), and between passes that found nothing applies the wait
+// strategy. In handoff mode each tailer's dispatcher is swapped for one that pushes onto
+// a single-producer single-consumer ring, and the original dispatcher runs on whichever
+// thread calls chronicle_reactor_drain.
+typedef struct {
+    cdispatch_f       dispatcher;
+    DISPATCH_CTX      dispatch_ctx;
+    cparsefree_f      parser_free;
+    uint64_t          index;
+    COBJ              msg;
+} handoff_t;
+
+typedef struct {
+    reactor_t*        reactor;
+    tailer_t*         tailer;
+    cdispatch_f       dispatcher; // as set by the user, restored on removal
+    DISPATCH_CTX      dispatch_ctx;
+} reactor_slot_t;
+
+struct reactor {
+    pthread_mutex_t   lock;
+    pthread_t         thread;
+    int               running;
+    int               started;
+    reactorwait_t     wait;
+    int               cpu;
+    int               numa_node;
+    int               timing;
+    void              (*idle)(void*);
+    void*             idle_ctx;
+
+    reactor_slot_t**  slots;
+    int               nslots;
+    int               slots_sz;
+
+    handoff_t*        ring; // NULL when dispatching inline
+    uint64_t          ring_mask;
+    uint64_t          ring_head; // written by reactor thread
+    uint64_t          ring_tail; // written by drain
+
+    reactorstats_t    stats;
+};
+
+static inline uint64_t reactor_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int reactor_handoff_cb(void* ctx, uint64_t index, COBJ msg) {
+    reactor_slot_t* slot = (reactor_slot_t*)ctx;
+    reactor_t* reactor = slot->reactor;
+    uint64_t head = reactor->ring_head;
+    // ring full: back-pressure the tailer, which stops before this message and offers it
+    // again on the next pass. We never wait here, as the pass holds reactor->lock
+    if (head - __atomic_load_n(&reactor->ring_tail, __ATOMIC_ACQUIRE) > reactor->ring_mask) {
+        return DISPATCH_RETRY;
+    }
+    handoff_t* h = &reactor->ring[head & reactor->ring_mask];
+    h->dispatcher = slot->dispatcher;
+    h->dispatch_ctx = slot->dispatch_ctx;
+    h->parser_free = slot->tailer->queue->parser_free;
+    h->index = index;
+    h->msg = msg;
+    __atomic_store_n(&reactor->ring_head, head + 1, __ATOMIC_RELEASE);
+    return DISPATCH_RETAIN;
+}
+
+// one pass over the tailers, returns non-zero if any advanced
+int reactor_pass(reactor_t* reactor) {
+    int work = 0;
+    for (int i = 0; i < reactor->nslots; i++) {
+        tailer_t* tailer = reactor->slots[i]->tailer;
+        peek_queue_modcount(tailer->queue);
+        uint64_t before = tailer->qf_index;
+        chronicle_peek_queue_tailer(tailer->queue, tailer);
+        work |= tailer->qf_index != before;
+    }
+    return work;
+}
+
+// after idle fruitless polls, spin briefly, then yield, then sleep for longer each time
+// up to 1ms. Returns 1 if we slept
+int idle_backoff(uint64_t idle) {
+    if (idle < 100) {
+        cpu_relax();
+    } else if (idle < 200) {
+        sched_yield();
+    } else {
+        uint64_t us = idle - 200 < 1000 ? idle - 200 + 1 : 1000;
+        usleep(us);
+        return 1;
+    }
+    return 0;
+}
+
+void reactor_backoff(reactor_t* reactor, uint64_t idle, uint64_t* sleeps) {
+    switch (reactor->wait) {
+    case RW_BUSY_POLL:
+        cpu_relax();
+        break;
+    case RW_YIELD:
+        sched_yield();
+        break;
+    case RW_BACKOFF:
+        *sleeps += idle_backoff(idle);
+        break;
+    }
+}
+
+void* reactor_main(void* arg) {
+    reactor_t* reactor = (reactor_t*)arg;
+    uint64_t idle = 0;
+    uint64_t sleeps = 0;
+    while (__atomic_load_n(&reactor->running, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&reactor->lock);
+        uint64_t t0 = reactor->timing ? reactor_now_ns() : 0;
+        int work = reactor_pass(reactor);
+
+        reactorstats_t* stats = &reactor->stats;
+        stats->iterations++;
+        stats->sleeps += sleeps;
+        sleeps = 0;
+        if (work) {
+            stats->work_iterations++;
+            if (reactor->timing) {
+                uint64_t ns = reactor_now_ns() - t0;
+                stats->work_ns += ns;
+                if (ns > stats->max_work_ns) stats->max_work_ns = ns;
+                int bucket = ns ? 63 - __builtin_clzl(ns) : 0;
+                stats->work_ns_log2[bucket < 32 ? bucket : 31]++;
+            }
+        }
+        pthread_mutex_unlock(&reactor->lock);
+
+        if (work) {
+            idle = 0;
+        } else {
+            if (reactor->idle) reactor->idle(reactor->idle_ctx);
+            reactor_backoff(reactor, idle++, &sleeps);
+        }
+    }
+    return NULL;
+}
+
+reactor_t* chronicle_reactor_init(reactorwait_t wait, int cpu) {
+    reactor_t* reactor = malloc(sizeof(reactor_t));
+    if (reactor == NULL) return chronicle_perr("rm fail");
+    bzero(reactor, sizeof(reactor_t));
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&reactor->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    reactor->wait = wait;
+    reactor->cpu = cpu;
+    reactor->numa_node = -1;
+    return reactor;
+}
+
+int chronicle_reactor_set_handoff(reactor_t* reactor, int slots) {
+    if (reactor->nslots > 0 || reactor->started) return chronicle_err("reactor handoff must be set before adding tailers");
+    if (slots <= 0 || (slots & (slots - 1))) return chronicle_err("reactor handoff slots must be a power of two");
+    free(reactor->ring);
+    reactor->ring = calloc(slots, sizeof(handoff_t));
+    if (reactor->ring == NULL) return chronicle_err("rr fail");
+    reactor->ring_mask = slots - 1;
+    return 0;
+}
+
+void chronicle_reactor_set_timing(reactor_t* reactor, int timing) {
+    reactor->timing = timing;
+}
+
+void chronicle_reactor_set_idle(reactor_t* reactor, void (*idle)(void*), void* idle_ctx) {
+    pthread_mutex_lock(&reactor->lock);
+    reactor->idle = idle;
+    reactor->idle_ctx = idle_ctx;
+    pthread_mutex_unlock(&reactor->lock);
+}
+
+int chronicle_reactor_add(reactor_t* reactor, tailer_t* tailer) {
+    if (tailer == NULL) return chronicle_err("null tailer");
+    reactor_slot_t* slot = malloc(sizeof(reactor_slot_t));
+    if (slot == NULL) return chronicle_err("rs fail");
+    slot->reactor = reactor;
+    slot->tailer = tailer;
+    slot->dispatcher = tailer->dispatcher;
+    slot->dispatch_ctx = tailer->dispatch_ctx;
+
+    pthread_mutex_lock(&reactor->lock);
+    if (reactor->nslots == reactor->slots_sz) {
+        int sz = reactor->slots_sz ? reactor->slots_sz * 2 : 8;
+        reactor_slot_t** slots = realloc(reactor->slots, sz * sizeof(reactor_slot_t*));
+        if (slots == NULL) {
+            pthread_mutex_unlock(&reactor->lock);
+            free(slot);
+            return chronicle_err("rs fail");
+        }
+        reactor->slots = slots;
+        reactor->slots_sz = sz;
+    }
+    if (reactor->ring) {
+        tailer->dispatcher = &reactor_handoff_cb;
+        tailer->dispatch_ctx = slot;
+    }
+    reactor->slots[reactor->nslots++] = slot;
+    pthread_mutex_unlock(&reactor->lock);
+    return 0;
+}
+
+// once removed, the reactor thread will not touch the tailer again
+int chronicle_reactor_remove(reactor_t* reactor, tailer_t* tailer) {
+    pthread_mutex_lock(&reactor->lock);
+    for (int i = 0; i < reactor->nslots; i++) {
+        reactor_slot_t* slot = reactor->slots[i];
+        if (slot->tailer == tailer) {
+            tailer->dispatcher = slot->dispatcher;
+            tailer->dispatch_ctx = slot->dispatch_ctx;
+            memmove(&reactor->slots[i], &reactor->slots[i+1], (reactor->nslots - i - 1) * sizeof(reactor_slot_t*));
+            reactor->nslots--;
+            free(slot);
+            pthread_mutex_unlock(&reactor->lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&reactor->lock);
+    return chronicle_err("tailer not in reactor");
+}
+
+// pin the reactor to any cpu of the node, unless pinned to a single cpu
+int chronicle_reactor_set_numa_node(reactor_t* reactor, int node) {
+#ifdef __linux__
+    cpu_set_t cpus;
+    if (node >= 0 && numa_node_cpus(node, &cpus) == 0) return chronicle_err("no cpus for numa node");
+    reactor->numa_node = node < 0 ? -1 : node;
+    return 0;
+#else
+    if (node < 0) return 0;
+    return chronicle_err("numa placement not supported on this platform");
+#endif
+}
+
+int chronicle_reactor_start(reactor_t* reactor) {
+    if (reactor->started) return chronicle_err("reactor already started");
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (reactor->cpu >= 0) {
+        CPU_SET(reactor->cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    } else if (reactor->numa_node >= 0 && numa_node_cpus(reactor->numa_node, &cpus)) {
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+#endif
+    __atomic_store_n(&reactor->running, 1, __ATOMIC_RELEASE);
+    int rc = pthread_create(&reactor->thread, &attr, &reactor_main, reactor);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        reactor->running = 0;
+        return chronicle_err("reactor thread create failed (bad cpu?)");
+    }
+    reactor->started = 1;
+    return 0;
+}
+
+void chronicle_reactor_stop(reactor_t* reactor) {
+    if (!reactor->started) return;
+    __atomic_store_n(&reactor->running, 0, __ATOMIC_RELEASE);
+    pthread_join(reactor->thread, NULL);
+    reactor->started = 0;
+}
+
+// dispatch up to max handed-off messages on the calling thread (one consumer at a time)
+int chronicle_reactor_drain(reactor_t* reactor, int max) {
+    if (reactor->ring == NULL) return 0;
+    uint64_t tail = reactor->ring_tail;
+    uint64_t head = __atomic_load_n(&reactor->ring_head, __ATOMIC_ACQUIRE);
+    int n = 0;
+    while (tail != head && n < max) {
+        handoff_t* h = &reactor->ring[tail & reactor->ring_mask];
+        int r = h->dispatcher ? h->dispatcher(h->dispatch_ctx, h->index, h->msg) : 0;
+        if (r != DISPATCH_RETAIN && h->parser_free) h->parser_free(h->msg);
+        tail++;
+        n++;
+        __atomic_store_n(&reactor->ring_tail, tail, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+void chronicle_reactor_stats(reactor_t* reactor, reactorstats_t* stats) {
+    pthread_mutex_lock(&reactor->lock);
+    memcpy(stats, &reactor->stats, sizeof(reactorstats_t));
+    pthread_mutex_unlock(&reactor->lock);
+}
+
+// stops the thread and gives the tailers back, undrained messages are freed undelivered
+void chronicle_reactor_close(reactor_t* reactor) {
+    chronicle_reactor_stop(reactor);
+    while (reactor->nslots > 0) {
+        chronicle_reactor_remove(reactor, reactor->slots[0]->tailer);
+    }
+    if (reactor->ring) {
+        for (uint64_t i = reactor->ring_tail; i != reactor->ring_head; i++) {
+            handoff_t* h = &reactor->ring[i & reactor->ring_mask];
+            if (h->parser_free) h->parser_free(h->msg);
+        }
+    }
+    free(reactor->ring);
+    free(reactor->slots);
+    pthread_mutex_destroy(&reactor->lock);
+    free(reactor);
+}
+
+// Worker pool
+// The tailer's dispatcher is swapped for pool_dispatch_cb, which hashes the message key
+// into one of POOL_PARTITIONS partitions and pushes it onto that partition's worker's
+// SPSC ring. A partition stays with its worker while any of its messages are queued or
+// running, which keeps each key in order; once it has drained it goes to whichever
+// worker then has the shortest queue, so idle workers pick up the next unpinned keys.
+// The low watermark is one less than the oldest index still queued or running.
+#define POOL_PARTITIONS 1024
+
+typedef struct {
+    uint64_t          index;
+    COBJ              msg;
+    int               partition;
+} poolitem_t;
+
+typedef struct {
+    pool_t*           pool;
+    pthread_t         thread;
+    poolitem_t*       ring;
+    uint64_t          head; // written by the tailer thread
+    uint64_t          tail; // written by the worker, after the item is done
+    uint64_t          processed;
+} poolworker_t;
+
+struct pool {
+    tailer_t*         tailer;
+    cdispatch_f       dispatcher; // as set by the user, restored on close
+    DISPATCH_CTX      dispatch_ctx;
+    cparsefree_f      parser_free;
+    ckey_f            key;
+    void*             key_ctx;
+
+    int               running;
+    int               nworkers;
+    uint64_t          ring_mask;
+    poolworker_t*     workers;
+    int               owner[POOL_PARTITIONS];
+    uint32_t          inflight[POOL_PARTITIONS];
+    uint64_t          dispatched_index; // last index handed to a worker
+};
+
+static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+int pool_dispatch_cb(void* ctx, uint64_t index, COBJ msg) {
+    pool_t* pool = (pool_t*)ctx;
+    int partition = mix64(pool->key(pool->key_ctx, msg)) & (POOL_PARTITIONS - 1);
+
+    if (__atomic_load_n(&pool->inflight[partition], __ATOMIC_ACQUIRE) == 0) {
+        int best = 0;
+        uint64_t best_depth = UINT64_MAX;
+        for (int i = 0; i < pool->nworkers; i++) {
+            poolworker_t* w = &pool->workers[i];
+            uint64_t depth = w->head - __atomic_load_n(&w->tail, __ATOMIC_RELAXED);
+            if (depth < best_depth) {
+                best = i;
+                best_depth = depth;
+            }
+        }
+        pool->owner[partition] = best;
+    }
+    poolworker_t* w = &pool->workers[pool->owner[partition]];
+
+    // ring full: back-pressure the tailer
+    uint64_t idle = 0;
+    while (w->head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) > pool->ring_mask) {
+        idle_backoff(idle++);
+    }
+    __atomic_add_fetch(&pool->inflight[partition], 1, __ATOMIC_RELAXED);
+    poolitem_t* item = &w->ring[w->head & pool->ring_mask];
+    item->index = index;
+    item->msg = msg;
+    item->partition = partition;
+    __atomic_store_n(&w->head, w->head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&pool->dispatched_index, index, __ATOMIC_RELEASE);
+    return DISPATCH_RETAIN;
+}
+
+void* pool_worker_main(void* arg) {
+    poolworker_t* w = (poolworker_t*)arg;
+    pool_t* pool = w->pool;
+    uint64_t idle = 0;
+    while (1) {
+        uint64_t tail = w->tail;
+        if (tail == __atomic_load_n(&w->head, __ATOMIC_ACQUIRE)) {
+            // only stop once drained
+            if (!__atomic_load_n(&pool->running, __ATOMIC_ACQUIRE)) break;
+            idle_backoff(idle++);
+            continue;
+        }
+        idle = 0;
+        poolitem_t* item = &w->ring[tail & pool->ring_mask];
+        int r = pool->dispatcher ? pool->dispatcher(pool->dispatch_ctx, item->index, item->msg) : 0;
+        if (r != DISPATCH_RETAIN && pool->parser_free) pool->parser_free(item->msg);
+        __atomic_sub_fetch(&pool->inflight[item->partition], 1, __ATOMIC_RELEASE);
+        w->processed++;
+        __atomic_store_n(&w->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+pool_t* chronicle_pool_init(tailer_t* tailer, int nworkers, int slots, ckey_f key, void* key_ctx) {
+    if (tailer == NULL) return chronicle_perr("null tailer");
+    if (key == NULL) return chronicle_perr("pool requires a key function");
+    if (nworkers <= 0) return chronicle_perr("pool requires workers");
+    if (slots <= 0 || (slots & (slots - 1))) return chronicle_perr("pool slots must be a power of two");
+
+    pool_t* pool = malloc(sizeof(pool_t));
+    if (pool == NULL) return chronicle_perr("pm fail");
+    bzero(pool, sizeof(pool_t));
+    pool->tailer = tailer;
+    pool->dispatcher = tailer->dispatcher;
+    pool->dispatch_ctx = tailer->dispatch_ctx;
+    pool->parser_free = tailer->queue->parser_free;
+    pool->key = key;
+    pool->key_ctx = key_ctx;
+    pool->nworkers = nworkers;
+    pool->ring_mask = slots - 1;
+    pool->dispatched_index = tailer->dispatch_after;
+    pool->running = 1;
+
+    pool->workers = calloc(nworkers, sizeof(poolworker_t));
+    if (pool->workers == NULL) {
+        free(pool);
+        return chronicle_perr("pm fail");
+    }
+    int started = 0;
+    for (; started < nworkers; started++) {
+        poolworker_t* w = &pool->workers[started];
+        w->pool = pool;
+        w->ring = calloc(slots, sizeof(poolitem_t));
+        if (w->ring == NULL || pthread_create(&w->thread, NULL, &pool_worker_main, w) != 0) {
+            free(w->ring);
+            break;
+        }
+    }
+    if (started < nworkers) {
+        __atomic_store_n(&pool->running, 0, __ATOMIC_RELEASE);
+        for (int i = 0; i < started; i++) {
+            pthread_join(pool->workers[i].thread, NULL);
+            free(pool->workers[i].ring);
+        }
+        free(pool->workers);
+        free(pool);
+        return chronicle_perr("pool worker start failed");
+    }
+
+    tailer->dispatcher = &pool_dispatch_cb;
+    tailer->dispatch_ctx = pool;
+    return pool;
+}
+
+uint64_t chronicle_pool_watermark(pool_t* pool) {
+    // read before the rings, so anything dispatched later is still seen as queued
+    uint64_t mark = __atomic_load_n(&pool->dispatched_index, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < pool->nworkers; i++) {
+        poolworker_t* w = &pool->workers[i];
+        while (1) {
+            uint64_t tail = __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE);
+            if (tail == __atomic_load_n(&w->head, __ATOMIC_ACQUIRE)) break;
+            uint64_t oldest = w->ring[tail & pool->ring_mask].index;
+            // the slot cannot be reused until the tail moves past it
+            if (__atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) != tail) continue;
+            if (oldest - 1 < mark) mark = oldest - 1;
+            break;
+        }
+    }
+    return mark;
+}
+
+uint64_t chronicle_pool_processed(pool_t* pool, int worker) {
+    if (worker < 0 || worker >= pool->nworkers) return 0;
+    return __atomic_load_n(&pool->workers[worker].processed, __ATOMIC_RELAXED);
+}
+
+// finishes everything queued, stops the workers and gives the tailer its dispatcher back
+void chronicle_pool_close(pool_t* pool) {
+    __atomic_store_n(&pool->running, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < pool->nworkers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        free(pool->workers[i].ring);
+    }
+    pool->tailer->dispatcher = pool->dispatcher;
+    pool->tailer->dispatch_ctx = pool->dispatch_ctx;
+    free(pool->workers);
+    free(pool);
+}
+
 int queuefile_init(char* fn, queue_t* queue) {
     int fd;
     int mode = 0777;
 
-    printf("Creating %s\n", fn);
+    CLOG(LL_INFO, "Creating %s\n", fn);
 
     // open/create the output file
     if ((fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, mode)) < 0) {
-        printf("can't create %s for writing", fn);
+        CLOG(LL_ERROR, "can't create %s for writing", fn);
         return chronicle_err("shmipc: create tmp queuefile err");
     }
 
@@ -1391,7 +3348,7 @@ int queuefile_init(char* fn, queue_t* queue) {
 
     // TODO: write header
     // TODO: write index2index
-    printf("Created %s\n", fn);
+    CLOG(LL_INFO, "Created %s\n", fn);
 
     close(fd);
     return 0;
@@ -1402,7 +3359,7 @@ int directory_listing_init(queue_t* queue, uint64_t cycle) {
     int mode = 0777;
 
     if ((fd = open(queue->dirlist_name, O_RDWR | O_CREAT | O_TRUNC, mode)) < 0) {
-        printf("can't create %s for writing", queue->dirlist_name);
+        CLOG(LL_ERROR, "can't create %s for writing", queue->dirlist_name);
         return chronicle_err("shmipc: directory_listing_init open failed");
     }
 
@@ -1476,24 +3433,70 @@ int directory_listing_init(queue_t* queue, uint64_t cycle) {
 }
 
 int directory_listing_reopen(queue_t* queue, int open_flags, int mmap_prot) {
-    if ((queue->dirlist_fd = open(queue->dirlist_name, open_flags)) < 0) {
+    int fd;
+    if ((fd = open(queue->dirlist_name, open_flags)) < 0) {
         return chronicle_err("directory_listing_reopen open failed");
     }
 
     // find size of dirlist and mmap
-    if (fstat(queue->dirlist_fd, &queue->dirlist_statbuf) < 0)
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) < 0) {
+        close(fd);
         return chronicle_err("dirlist fstat");
-    if ((queue->dirlist = mmap(0, queue->dirlist_statbuf.st_size, mmap_prot, MAP_SHARED, queue->dirlist_fd, 0)) == MAP_FAILED)
+    }
+
+    // re-opening for write: replace the existing mapping in place, so that other threads
+    // polling through dirlist_fields never see the pointers move or the pages vanish
+    if (queue->dirlist && statbuf.st_size == queue->dirlist_statbuf.st_size) {
+        if (mmap(queue->dirlist, statbuf.st_size, mmap_prot, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED) {
+            close(fd);
+            return chronicle_err("dirlist mmap fail");
+        }
+        close(queue->dirlist_fd);
+        queue->dirlist_fd = fd;
+        return 0;
+    }
+
+    // first open, or the file changed size: map afresh and republish the field pointers.
+    // Pollers may still be reading through the old mapping, which shows the same file,
+    // so it is retired rather than unmapped, and released with the queue
+    unsigned char* buf = mmap(0, statbuf.st_size, mmap_prot, MAP_SHARED, fd, 0);
+    if (buf == MAP_FAILED) {
+        close(fd);
         return chronicle_err("dirlist mmap fail");
+    }
 
-    if (debug) printf("shmipc: parsing dirlist %s\n", queue->dirlist_name);
-    parse_dirlist(queue);
+    CLOG(LL_DEBUG, "shmipc: parsing dirlist %s\n", queue->dirlist_name);
+    dirlist_fields_t fields;
+    bzero(&fields, sizeof(fields));
+    parse_dirlist(queue, buf, statbuf.st_size, &fields);
 
     // check the polled fields in header section were all resolved to pointers within the map
-    if (queue->dirlist_fields.highest_cycle == NULL || queue->dirlist_fields.lowest_cycle == NULL ||
-        queue->dirlist_fields.modcount == NULL) {
+    if (fields.highest_cycle == NULL || fields.lowest_cycle == NULL || fields.modcount == NULL) {
+        munmap(buf, statbuf.st_size);
+        close(fd);
         return chronicle_err("dirlist parse hdr ptr fail");
     }
+    if (queue->dirlist) {
+        retired_t* retired = malloc(sizeof(retired_t));
+        if (retired == NULL) {
+            munmap(buf, statbuf.st_size);
+            close(fd);
+            return chronicle_err("dirlist retire fail");
+        }
+        retired->buf = queue->dirlist;
+        retired->sz = queue->dirlist_statbuf.st_size;
+        retired->next = queue->dirlist_retired;
+        queue->dirlist_retired = retired;
+        close(queue->dirlist_fd);
+    }
+    __atomic_store_n(&queue->dirlist_fields.highest_cycle, fields.highest_cycle, __ATOMIC_RELEASE);
+    __atomic_store_n(&queue->dirlist_fields.lowest_cycle, fields.lowest_cycle, __ATOMIC_RELEASE);
+    __atomic_store_n(&queue->dirlist_fields.modcount, fields.modcount, __ATOMIC_RELEASE);
+    queue->dirlist_fields.present = fields.present;
+    queue->dirlist = buf;
+    queue->dirlist_fd = fd;
+    queue->dirlist_statbuf = statbuf;
     return 0;
 }
 
@@ -39,6 +39,7 @@
 #define HD_EOF         0xC0000000
 #define HD_MASK_LENGTH 0x3FFFFFFF
 #define HD_MASK_META   HD_EOF
+#define HD_WRITER_PID  0x20000000 // in a working header: low bits are a registered writer's pid
 
 // chronicle_init flags values (OR values together)
 #define CHRONICLE_FLAGS_ANY
@@ -61,15 +62,29 @@ typedef void* DISPATCH_CTX;
 // csizeof_f    tells library how many bytes required to serialise user object
 // cappend_f    takes custom object and writes bytes to void*
 // cdispatch_f  takes custom object and index, delivers to application with user data
+// cfilter_f    optional, sees raw message bytes before cparse_f, returns 0 to skip message
+// ckey_f       for worker pools, extracts the ordering key of a parsed message
 typedef COBJ   (*cparse_f)    (unsigned char*, int);
 typedef void   (*cparsefree_f)(COBJ);
 typedef size_t (*csizeof_f)   (COBJ);
 typedef void   (*cappend_f)   (unsigned char*,COBJ,size_t);
 typedef int    (*cdispatch_f) (DISPATCH_CTX,uint64_t,COBJ);
+typedef int    (*cfilter_f)   (void*,unsigned char*,int);
+typedef uint64_t (*ckey_f)    (void*,COBJ);
+
+// cdispatch_f returns 0 once done with the object, which the library then frees with
+// cparsefree_f, or DISPATCH_RETAIN to take ownership and free it later itself. A tailer's
+// dispatcher may return DISPATCH_RETRY to refuse the message: it is freed, the tailer
+// stops before it, and the next peek delivers the same index again
+#define DISPATCH_RETAIN 2
+#define DISPATCH_RETRY  3
 
 // forward definition of queue
 typedef struct queue queue_t;
 typedef struct tailer tailer_t;
+typedef struct reverse reverse_t;
+typedef struct reactor reactor_t;
+typedef struct pool pool_t;
 
 // return codes exposed via. chronicle_tailer_state
 //     0   awaiting next entry
@@ -82,6 +97,23 @@ typedef struct tailer tailer_t;
 //     7   a value was collected
 typedef enum {TS_AWAITING_ENTRY, TS_BUSY, TS_AWAITING_QUEUEFILE, TS_E_STAT, TS_E_MMAP, TS_PEEK, TS_EXTEND_FAIL, TS_COLLECTED} tailstate_t;
 
+// logging, records at or above the level are formatted and passed to the sink, which
+// defaults to stderr. In async mode the caller queues the format and its arguments to a
+// background thread that formats them and calls the sink, so logging never formats or
+// blocks on the sink's I/O. Records are dropped (and counted) if the queue is full.
+// Once chronicle_set_log_sink returns no thread is still calling the previous sink, and
+// turning async off returns after everything queued has been delivered. Neither may be
+// called from inside a sink, and both return -1 if they are.
+// SHMIPC_DEBUG=1 sets LL_DEBUG.
+typedef enum {LL_DEBUG, LL_INFO, LL_WARN, LL_ERROR, LL_NONE} loglevel_t;
+typedef void (*clog_f)(void* ctx, loglevel_t level, const char* msg, int len);
+
+void        chronicle_set_log_level(loglevel_t level);
+loglevel_t  chronicle_get_log_level();
+int         chronicle_set_log_sink(clog_f sink, void* ctx);
+int         chronicle_set_log_async(int async);
+uint64_t    chronicle_log_dropped();
+
 // collect structure - we complete values for the caller
 typedef struct {
     COBJ msg;
@@ -107,15 +139,47 @@ int         chronicle_get_version(queue_t* queue);
 char*       chronicle_get_roll_scheme(queue_t* queue);
 char*       chronicle_get_roll_format(queue_t* queue);
 char*       chronicle_get_cycle_fn(queue_t* queue, int cycle);
+// cycles are the roll periods, one queuefile each: the cycle holding an index, the
+// first index of a cycle, and the cycle covering a wall-clock time
+uint64_t    chronicle_cycle_of_index(queue_t* queue, uint64_t index);
+uint64_t    chronicle_cycle_first_index(queue_t* queue, uint64_t cycle);
+uint64_t    chronicle_cycle_from_ms(queue_t* queue, long ms);
 
 
 const char* chronicle_strerror();
 
 tailer_t*   chronicle_tailer(queue_t *queue, cdispatch_f dispatcher, DISPATCH_CTX dispatch_ctx, uint64_t index);
+tailer_t*   chronicle_tailer_from_end(queue_t *queue, cdispatch_f dispatcher, DISPATCH_CTX dispatch_ctx, uint64_t n);
+uint64_t    chronicle_index_from_end(queue_t* queue, uint64_t n);
 void        chronicle_tailer_close(tailer_t* tailer);
+// filters run on raw message bytes before parse and dispatch. A mask filter accepts a
+// message when (msg[offset+i] & mask[i]) == value[i] for i < len (len <= 16)
+void        chronicle_tailer_set_filter(tailer_t* tailer, cfilter_f filter, void* filter_ctx);
+int         chronicle_tailer_set_filter_mask(tailer_t* tailer, int offset, const unsigned char* mask, const unsigned char* value, int len);
+uint64_t    chronicle_tailer_filtered(tailer_t* tailer);
+// replay mode for tailers reading historical cycles: reads ahead of the tailer and
+// drops page cache behind it, leaving the cache to live tailers
+void        chronicle_tailer_set_replay(tailer_t* tailer, int replay);
 tailstate_t chronicle_tailer_state(tailer_t* tailer);
 uint64_t    chronicle_tailer_index(tailer_t* tailer);
 
+// mapping budget: a process-wide ceiling on bytes of queuefile mapped by all tailers.
+// When exceeded the least recently peeked tailers give up their mapping, re-mapping
+// on their next peek. 0 (default) is unlimited.
+void        chronicle_set_mapping_budget(uint64_t bytes);
+// numa placement (Linux): prefer memory on node for the queue's mapped windows, with
+// appenders pre-faulting each new window onto the node. -1 (default) leaves placement
+// to the kernel. Pair with chronicle_reactor_set_numa_node to keep tailers local.
+int         chronicle_set_numa_node(queue_t* queue, int node);
+int         chronicle_get_numa_node(queue_t* queue);
+int         chronicle_numa_node_of_cpu(int cpu);
+uint64_t    chronicle_mapped_bytes();
+// windows mapped by this process so far, counting each re-map as a tailer or appender
+// moves along a queuefile or is evicted
+uint64_t    chronicle_map_count();
+uint64_t    chronicle_queue_mapped_bytes(queue_t* queue);
+uint64_t    chronicle_tailer_mapped_bytes(tailer_t* tailer);
+
 void        chronicle_peek();
 void        chronicle_peek_queue(queue_t *queue);
 int         chronicle_peek_tailer(tailer_t *tailer);
@@ -125,10 +189,100 @@ void        chronicle_debug_tailer(queue_t* queue, tailer_t* tailer);
 
 uint64_t    chronicle_append(queue_t *queue, COBJ msg);
 uint64_t    chronicle_append_ts(queue_t *queue, COBJ msg, long ms);
+// appender handles for one thread each: independent cursors that arbitrate with other
+// appenders (in this or other processes) only through the header CAS. chronicle_append
+// uses a single appender shared by all threads, which take turns.
+tailer_t*   chronicle_appender_open(queue_t *queue);
+uint64_t    chronicle_appender_append(tailer_t *appender, COBJ msg);
+uint64_t    chronicle_appender_append_ts(tailer_t *appender, COBJ msg, long ms);
+void        chronicle_appender_close(tailer_t *appender);
+// zero-copy appends: reserve sz bytes at the end of the queue, write the message
+// straight into them (e.g. with wirepad_wrap) then commit the bytes used, or abort.
+// The appender stays locked and tailers wait at the entry until then, so keep it
+// brief, and reserve close to the size needed as the unused part is zeroed. Only the
+// reserving thread may commit or abort, other threads find nothing reserved.
+unsigned char* chronicle_appender_reserve(tailer_t* appender, size_t sz);
+uint64_t    chronicle_appender_commit(tailer_t* appender, size_t sz);
+void        chronicle_appender_abort(tailer_t* appender);
+unsigned char* chronicle_reserve(queue_t* queue, size_t sz);
+uint64_t    chronicle_commit(queue_t* queue, size_t sz);
+void        chronicle_abort(queue_t* queue);
+// dead-writer recovery: appenders stalled behind an entry left working for longer than
+// ms (default 0, disabled) by a libchronicle writer that no longer holds its registration
+// in the queue directory pad it out as metadata and continue. Entries of unregistered
+// writers (Java, older versions) are never recovered.
+// chronicle_writer_dead returns 1 if no live process holds a registration of pid (as
+// recorded in a working header under HD_WRITER_PID), 0 if one does and -1 if none exists.
+void        chronicle_set_recovery_timeout(queue_t* queue, long ms);
+uint64_t    chronicle_get_recoveries(queue_t* queue);
+int         chronicle_writer_dead(queue_t* queue, uint32_t pid);
 
 COBJ        chronicle_collect(tailer_t *tailer, collected_t *collect);
 void        chronicle_return(tailer_t *tailer, collected_t *collect);
 
+// reverse iteration from the write tip (as of chronicle_reverse) towards older messages,
+// crossing into earlier cycles. collect returns NULL once the oldest message is passed.
+reverse_t*  chronicle_reverse(queue_t* queue);
+COBJ        chronicle_reverse_collect(reverse_t* reverse, collected_t *collect);
+void        chronicle_reverse_return(reverse_t* reverse, collected_t *collect);
+void        chronicle_reverse_close(reverse_t* reverse);
+
+// replay messages from_index <= index < to_index using nthreads workers. The range is
+// split into parts, taken by the workers in index order: whole cycles, and with more
+// than one worker, runs of index entries within cycles that have Java index pages. A
+// worker delivers each part in index order, but the parts of one cycle may be on
+// different workers at once, so a dispatcher must not assume a worker sees all of a
+// cycle, nor that consecutive messages on a worker are adjacent in the queue.
+// Unordered delivery calls dispatcher concurrently from the workers, so both it and the
+// queue's parser must be thread-safe. Ordered delivery calls dispatcher from one worker
+// at a time in index order, buffering a bounded number of parsed messages per worker.
+// Returns the number of messages dispatched, or -1 on error.
+int64_t     chronicle_replay_parallel(queue_t* queue, uint64_t from_index, uint64_t to_index, int nthreads, cdispatch_f dispatcher, DISPATCH_CTX dispatch_ctx, int ordered);
+
+// reactor: a managed thread polling a set of tailers, so applications need not write
+// their own peek loop. Callbacks run inline on the reactor thread, or in handoff mode
+// are queued (up to slots, after which each tailer waits at its next message) for
+// another thread to run with chronicle_reactor_drain. Between passes that find no new messages the
+// thread spins (RW_BUSY_POLL), yields (RW_YIELD) or spins, yields then sleeps for up to
+// 1ms (RW_BACKOFF). cpu >= 0 pins the thread. Tailers added must not be peeked by any
+// other thread until removed; chronicle_reactor_close removes them all but does not
+// close them.
+typedef enum {RW_BUSY_POLL, RW_YIELD, RW_BACKOFF} reactorwait_t;
+typedef struct {
+    uint64_t iterations;         // passes over all tailers
+    uint64_t work_iterations;    // passes in which at least one tailer advanced
+    uint64_t sleeps;             // RW_BACKOFF sleeps while idle
+    uint64_t work_ns;            // following require chronicle_reactor_set_timing
+    uint64_t max_work_ns;
+    uint64_t work_ns_log2[32];   // work passes taking [2^i, 2^(i+1)) ns
+} reactorstats_t;
+
+reactor_t*  chronicle_reactor_init(reactorwait_t wait, int cpu);
+int         chronicle_reactor_set_handoff(reactor_t* reactor, int slots);
+void        chronicle_reactor_set_timing(reactor_t* reactor, int timing);
+void        chronicle_reactor_set_idle(reactor_t* reactor, void (*idle)(void*), void* idle_ctx);
+int         chronicle_reactor_set_numa_node(reactor_t* reactor, int node);
+int         chronicle_reactor_add(reactor_t* reactor, tailer_t* tailer);
+int         chronicle_reactor_remove(reactor_t* reactor, tailer_t* tailer);
+int         chronicle_reactor_start(reactor_t* reactor);
+void        chronicle_reactor_stop(reactor_t* reactor);
+int         chronicle_reactor_drain(reactor_t* reactor, int max);
+void        chronicle_reactor_stats(reactor_t* reactor, reactorstats_t* stats);
+void        chronicle_reactor_close(reactor_t* reactor);
+
+// worker pool: spreads a tailer's messages over nworkers threads, each with a ring of
+// slots, calling the tailer's dispatcher from the workers. Messages with the same key
+// (as returned by key) are dispatched in order and never concurrently; other keys run in
+// parallel, and a key with nothing outstanding goes to the least busy worker. The
+// watermark is the highest index at or below which every message has been dispatched,
+// suitable for checkpointing. The dispatcher and the queue's parser_free must be
+// thread-safe. The tailer is peeked as usual (e.g. by a reactor) and back-pressured
+// when a worker's ring is full. close waits for queued messages to be dispatched.
+pool_t*     chronicle_pool_init(tailer_t* tailer, int nworkers, int slots, ckey_f key, void* key_ctx);
+uint64_t    chronicle_pool_watermark(pool_t* pool);
+uint64_t    chronicle_pool_processed(pool_t* pool, int worker);
+void        chronicle_pool_close(pool_t* pool);
+
 struct ROLL_SCHEME {
     char*    name;
     char*    formatstr;
@@ -138,5 +292,6 @@ struct ROLL_SCHEME {
 };
 
 extern struct ROLL_SCHEME chronicle_roll_schemes[];
+extern int chronicle_roll_scheme_count;
 
 #endif
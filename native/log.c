@@ -0,0 +1,434 @@
+// Copyright 2021 Tea Engineering Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include <libchronicle.h>
+#include "log.h"
+
+/**
+ * In synchronous mode records are formatted by the caller and handed straight to the
+ * sink. In async mode the caller only copies the format pointer, its arguments and any
+ * %s strings into a slot of a bounded lock-free ring (Vyukov's MPMC array queue), and
+ * the background thread formats and delivers them, so an appender logging in async mode
+ * never formats, takes a lock or makes a syscall. If the ring is full the record is
+ * dropped and counted. Formats are expected to be literals, as at every CLOG site;
+ * conversions the record cannot carry (%n, long double, too many arguments) are
+ * formatted by the caller instead.
+ *
+ * Callers between reading log_async or the sink and finishing with them are counted in
+ * log_inflight, under the parity of the log_epoch they entered in. Switching either
+ * advances the epoch and waits only for the previous epoch's count to drain before
+ * stopping the thread or freeing the previous sink, so steady logging cannot hold it
+ * up. A sink is itself counted, and so may not switch either: both are refused from a
+ * thread inside a sink.
+ */
+
+loglevel_t log_level = LL_WARN;
+
+const char* log_level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+// a single write(2), so stderr's stdio lock is never taken
+void log_sink_stderr(void* ctx, loglevel_t level, const char* msg, int len) {
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf), "chronicle %s: %.*s\n", log_level_names[level], len, msg);
+    if (n >= (int)sizeof(buf)) {
+        n = sizeof(buf);
+        buf[n-1] = '\n';
+    }
+    if (n > 0 && write(STDERR_FILENO, buf, n) < 0) return;
+}
+
+typedef struct {
+    clog_f            sink;
+    void*             ctx;
+} logsink_t;
+
+logsink_t   log_sink_default = {&log_sink_stderr, NULL};
+logsink_t*  log_sink = &log_sink_default; // replaced whole, never modified in place
+uint64_t    log_epoch = 0;
+uint64_t    log_inflight[2] = {0, 0};
+static __thread int log_in_sink = 0;
+
+#define LOG_RING_SLOTS  1024 // power of two
+#define LOG_RECORD_SZ   240  // longest record delivered to the sink
+#define LOG_MAX_ARGS    8
+#define LOG_STRINGS_SZ  200  // copies of %s arguments, or a record formatted by the caller
+
+typedef union {
+    int64_t           i;
+    uint64_t          u;
+    double            d;
+    void*             p;
+} logarg_t;
+
+typedef struct {
+    uint64_t          seq;
+    loglevel_t        level;
+    int               len;   // of strings, when fmt is NULL
+    const char*       fmt;   // NULL if formatted by the caller into strings
+    logarg_t          args[LOG_MAX_ARGS]; // '*' values then the argument, per conversion
+    char              strings[LOG_STRINGS_SZ];
+} logrecord_t;
+
+logrecord_t log_ring[LOG_RING_SLOTS];
+uint64_t    log_ring_head = 0; // next slot to write, shared by producers
+uint64_t    log_ring_tail = 0; // next slot to read, drain thread only
+uint64_t    log_dropped = 0;
+
+int         log_async = 0;
+int         log_async_running = 0;
+pthread_t   log_async_thread;
+pthread_mutex_t log_config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// format a record, dropping any trailing newline as the sink adds its own
+static int log_format(char* buf, int sz, const char* fmt, va_list ap) {
+    int len = vsnprintf(buf, sz, fmt, ap);
+    if (len < 0) return 0;
+    if (len >= sz) len = sz - 1;
+    while (len > 0 && buf[len-1] == '\n') len--;
+    return len;
+}
+
+// one printf conversion
+typedef struct {
+    const char*       mods;  // first length modifier, or conv
+    const char*       end;   // past conv
+    char              conv;
+    char              length; // 'H' hh, 'h', 'l', 'q' ll, 'z', 'j', 't', 'L', or 0
+    int               star_width;
+    int               star_precision;
+    int               precision; // literal precision, -1 if none or '*'
+} logspec_t;
+
+// parse the conversion starting at p[0] == '%', 0 if the record cannot carry it
+static int log_spec(const char* p, logspec_t* s) {
+    const char* q = p + 1;
+    s->star_width = 0;
+    s->star_precision = 0;
+    s->precision = -1;
+    s->length = 0;
+    while (*q && strchr("-+ #0'", *q)) q++;
+    if (*q == '*') {
+        s->star_width = 1;
+        q++;
+    }
+    while (*q >= '0' && *q <= '9') q++;
+    if (*q == '.') {
+        q++;
+        if (*q == '*') {
+            s->star_precision = 1;
+            q++;
+        } else {
+            s->precision = 0;
+            while (*q >= '0' && *q <= '9') s->precision = s->precision * 10 + (*q++ - '0');
+        }
+    }
+    s->mods = q;
+    if (q[0] == 'h' && q[1] == 'h') { s->length = 'H'; q += 2; }
+    else if (q[0] == 'l' && q[1] == 'l') { s->length = 'q'; q += 2; }
+    else if (*q && strchr("hlzjtL", *q)) s->length = *q++;
+    s->conv = *q;
+    s->end = q + 1;
+    if (s->conv == 0 || !strchr("diouxXceEfFgGaAps", s->conv)) return 0;
+    if (s->length == 'L' || q - p > 24) return 0;
+    return 1;
+}
+
+// copy the arguments of fmt into rec, 0 if it has conversions the record cannot carry
+static int log_record_args(logrecord_t* rec, const char* fmt, va_list ap) {
+    int n = 0;
+    size_t spos = 0;
+    logspec_t s;
+    for (const char* p = fmt; (p = strchr(p, '%')); p = s.end) {
+        if (p[1] == '%') {
+            s.end = p + 2;
+            continue;
+        }
+        if (!log_spec(p, &s) || n + s.star_width + s.star_precision + 1 > LOG_MAX_ARGS) return 0;
+        int precision = s.precision;
+        if (s.star_width) rec->args[n++].i = va_arg(ap, int);
+        if (s.star_precision) rec->args[n++].i = precision = va_arg(ap, int);
+        logarg_t* a = &rec->args[n++];
+        switch (s.conv) {
+        case 'd': case 'i':
+            switch (s.length) {
+            case 'H': a->i = (signed char)va_arg(ap, int); break;
+            case 'h': a->i = (short)va_arg(ap, int); break;
+            case 'l': a->i = va_arg(ap, long); break;
+            case 'q': a->i = va_arg(ap, long long); break;
+            case 'z': a->i = va_arg(ap, ssize_t); break;
+            case 'j': a->i = va_arg(ap, intmax_t); break;
+            case 't': a->i = va_arg(ap, ptrdiff_t); break;
+            default:  a->i = va_arg(ap, int);
+            }
+            break;
+        case 'o': case 'u': case 'x': case 'X':
+            switch (s.length) {
+            case 'H': a->u = (unsigned char)va_arg(ap, unsigned int); break;
+            case 'h': a->u = (unsigned short)va_arg(ap, unsigned int); break;
+            case 'l': a->u = va_arg(ap, unsigned long); break;
+            case 'q': a->u = va_arg(ap, unsigned long long); break;
+            case 'z': a->u = va_arg(ap, size_t); break;
+            case 'j': a->u = va_arg(ap, uintmax_t); break;
+            case 't': a->u = va_arg(ap, ptrdiff_t); break;
+            default:  a->u = va_arg(ap, unsigned int);
+            }
+            break;
+        case 'c':
+            a->i = va_arg(ap, int);
+            break;
+        case 'p':
+            a->p = va_arg(ap, void*);
+            break;
+        case 's': {
+            // the caller may free or reuse the string as soon as we return
+            const char* str = va_arg(ap, const char*);
+            if (str == NULL) str = "(null)";
+            size_t room = LOG_STRINGS_SZ - spos - 1;
+            size_t len = strnlen(str, precision >= 0 && precision < room ? precision : room);
+            memcpy(rec->strings + spos, str, len);
+            rec->strings[spos + len] = 0;
+            a->u = spos;
+            // once full, later strings are empty and share the last terminator
+            spos += len + (spos + len + 1 < LOG_STRINGS_SZ);
+            break;
+        }
+        default:
+            a->d = va_arg(ap, double);
+        }
+    }
+    return 1;
+}
+
+// format a record queued by log_record_args
+static int log_render(logrecord_t* rec, char* buf, int sz) {
+    int len = 0;
+    int n = 0;
+    logspec_t s;
+    const char* p = rec->fmt;
+    while (*p && len < sz - 1) {
+        const char* pct = strchr(p, '%');
+        int lit = pct ? pct - p : strlen(p);
+        if (pct && pct[1] == '%') lit++;
+        if (lit > sz - 1 - len) lit = sz - 1 - len;
+        memcpy(buf + len, p, lit);
+        len += lit;
+        if (pct == NULL) break;
+        if (pct[1] == '%') {
+            p = pct + 2;
+            continue;
+        }
+        log_spec(pct, &s);
+        p = s.end;
+
+        // rebuild the conversion with '*' values inlined, and integers widened to ll
+        char spec[64];
+        int k = 0;
+        for (const char* q = pct; q < s.mods; q++) {
+            if (*q != '*') {
+                spec[k++] = *q;
+            } else if (q[-1] == '.' && rec->args[n].i < 0) {
+                k--; // a negative precision is taken as omitted
+                n++;
+            } else {
+                k += snprintf(spec + k, sizeof(spec) - k, "%d", (int)rec->args[n++].i);
+            }
+        }
+        if (strchr("dioxXu", s.conv)) {
+            spec[k++] = 'l';
+            spec[k++] = 'l';
+        }
+        spec[k++] = s.conv;
+        spec[k] = 0;
+
+        logarg_t* a = &rec->args[n++];
+        int w;
+        switch (s.conv) {
+        case 'd': case 'i': w = snprintf(buf + len, sz - len, spec, (long long)a->i); break;
+        case 'o': case 'u': case 'x': case 'X': w = snprintf(buf + len, sz - len, spec, (unsigned long long)a->u); break;
+        case 'c': w = snprintf(buf + len, sz - len, spec, (int)a->i); break;
+        case 'p': w = snprintf(buf + len, sz - len, spec, a->p); break;
+        case 's': w = snprintf(buf + len, sz - len, spec, rec->strings + a->u); break;
+        default:  w = snprintf(buf + len, sz - len, spec, a->d);
+        }
+        if (w > 0) len += w < sz - len ? w : sz - 1 - len;
+    }
+    while (len > 0 && buf[len-1] == '\n') len--;
+    return len;
+}
+
+static int log_ring_put(loglevel_t level, const char* fmt, va_list ap) {
+    uint64_t pos = __atomic_load_n(&log_ring_head, __ATOMIC_RELAXED);
+    while (1) {
+        logrecord_t* rec = &log_ring[pos & (LOG_RING_SLOTS-1)];
+        int64_t dif = (int64_t)__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) - (int64_t)pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&log_ring_head, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                rec->level = level;
+                rec->fmt = fmt;
+                va_list aq;
+                va_copy(aq, ap);
+                if (!log_record_args(rec, fmt, aq)) {
+                    rec->fmt = NULL;
+                    rec->len = log_format(rec->strings, LOG_STRINGS_SZ, fmt, ap);
+                }
+                va_end(aq);
+                __atomic_store_n(&rec->seq, pos+1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (dif < 0) {
+            return -1; // full
+        } else {
+            pos = __atomic_load_n(&log_ring_head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// count the caller in as using log_async and log_sink, returning the count to leave.
+// Rechecking the epoch once counted means any switch that has not seen us began after
+// we entered, so its new settings are what we read
+static inline uint64_t* log_enter() {
+    while (1) {
+        uint64_t epoch = __atomic_load_n(&log_epoch, __ATOMIC_SEQ_CST);
+        uint64_t* inflight = &log_inflight[epoch & 1];
+        __atomic_add_fetch(inflight, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&log_epoch, __ATOMIC_SEQ_CST) == epoch) return inflight;
+        __atomic_sub_fetch(inflight, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static int log_ring_drain() {
+    int n = 0;
+    char buf[LOG_RECORD_SZ];
+    while (1) {
+        logrecord_t* rec = &log_ring[log_ring_tail & (LOG_RING_SLOTS-1)];
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != log_ring_tail+1) return n;
+        uint64_t* inflight = log_enter();
+        logsink_t* sink = __atomic_load_n(&log_sink, __ATOMIC_SEQ_CST);
+        log_in_sink++;
+        if (rec->fmt) {
+            sink->sink(sink->ctx, rec->level, buf, log_render(rec, buf, sizeof(buf)));
+        } else {
+            sink->sink(sink->ctx, rec->level, rec->strings, rec->len);
+        }
+        log_in_sink--;
+        __atomic_sub_fetch(inflight, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&rec->seq, log_ring_tail + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+        log_ring_tail++;
+        n++;
+    }
+}
+
+static void* log_async_main(void* arg) {
+    struct timespec idle = {0, 1000000}; // 1ms
+    while (__atomic_load_n(&log_async_running, __ATOMIC_ACQUIRE)) {
+        if (log_ring_drain() == 0) nanosleep(&idle, NULL);
+    }
+    log_ring_drain();
+    return NULL;
+}
+
+// wait for callers that may have seen the previous log_async or log_sink, those that
+// entered before the epoch advanced. Called with log_config_lock held
+static void log_quiesce() {
+    uint64_t epoch = __atomic_fetch_add(&log_epoch, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&log_inflight[epoch & 1], __ATOMIC_SEQ_CST) != 0) sched_yield();
+}
+
+void log_write(loglevel_t level, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    uint64_t* inflight = log_enter();
+    if (__atomic_load_n(&log_async, __ATOMIC_SEQ_CST)) {
+        if (log_ring_put(level, fmt, ap) != 0) {
+            __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        char buf[LOG_RECORD_SZ];
+        int len = log_format(buf, sizeof(buf), fmt, ap);
+        logsink_t* sink = __atomic_load_n(&log_sink, __ATOMIC_SEQ_CST);
+        log_in_sink++;
+        sink->sink(sink->ctx, level, buf, len);
+        log_in_sink--;
+    }
+    __atomic_sub_fetch(inflight, 1, __ATOMIC_SEQ_CST);
+    va_end(ap);
+}
+
+void chronicle_set_log_level(loglevel_t level) {
+    log_level = level;
+}
+
+loglevel_t chronicle_get_log_level() {
+    return log_level;
+}
+
+int chronicle_set_log_sink(clog_f sink, void* ctx) {
+    if (log_in_sink) return -1;
+    logsink_t* next = &log_sink_default;
+    if (sink) {
+        next = malloc(sizeof(logsink_t));
+        if (next == NULL) return -1;
+        next->sink = sink;
+        next->ctx = ctx;
+    }
+    pthread_mutex_lock(&log_config_lock);
+    logsink_t* prev = __atomic_exchange_n(&log_sink, next, __ATOMIC_SEQ_CST);
+    log_quiesce();
+    if (prev != &log_sink_default) free(prev);
+    pthread_mutex_unlock(&log_config_lock);
+    return 0;
+}
+
+int chronicle_set_log_async(int async) {
+    if (log_in_sink) return -1;
+    int rc = 0;
+    pthread_mutex_lock(&log_config_lock);
+    if (async && !log_async) {
+        // the ring is empty and no producer is inside it, see below
+        for (uint64_t i = 0; i < LOG_RING_SLOTS; i++) {
+            log_ring[(log_ring_tail + i) & (LOG_RING_SLOTS-1)].seq = log_ring_tail + i;
+        }
+        log_ring_head = log_ring_tail;
+        log_async_running = 1;
+        if (pthread_create(&log_async_thread, NULL, &log_async_main, NULL) != 0) {
+            log_async_running = 0;
+            rc = -1;
+        } else {
+            __atomic_store_n(&log_async, 1, __ATOMIC_SEQ_CST);
+        }
+    } else if (!async && log_async) {
+        // new records go direct to the sink; once producers already in the ring have
+        // published, stop the drain thread, which flushes everything queued
+        __atomic_store_n(&log_async, 0, __ATOMIC_SEQ_CST);
+        log_quiesce();
+        __atomic_store_n(&log_async_running, 0, __ATOMIC_RELEASE);
+        pthread_join(log_async_thread, NULL);
+    }
+    pthread_mutex_unlock(&log_config_lock);
+    return rc;
+}
+
+uint64_t chronicle_log_dropped() {
+    return __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,28 @@
+// Copyright 2021 Tea Engineering Ltd.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FILE_LOG_SEEN
+#define FILE_LOG_SEEN
+
+#include <libchronicle.h>
+
+// leveled logging used inside the library, see chronicle_set_log_* for the public
+// interface. Records below log_level cost a single compare, arguments are not evaluated.
+extern loglevel_t log_level;
+
+void log_write(loglevel_t level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define CLOG(level, ...) do { if ((level) >= log_level) log_write((level), __VA_ARGS__); } while (0)
+
+#endif
@@ -30,13 +30,18 @@ int main(const int argc, char **argv) {
     queue_t* queue = chronicle_init(argv[1]);
     chronicle_set_decoder(queue, &parse_msg, &free_msg);
     if (chronicle_open(queue) != 0) exit(-1);
-    chronicle_tailer(queue, &print_msg, NULL, 0);
+    tailer_t* tailer = chronicle_tailer(queue, &print_msg, NULL, 0);
+
+    // poll on a managed thread, dispatching print_msg from there
+    reactor_t* reactor = chronicle_reactor_init(RW_BACKOFF, -1);
+    chronicle_reactor_add(reactor, tailer);
+    if (chronicle_reactor_start(reactor) != 0) exit(-1);
 
     while (keepRunning) {
         usleep(500*1000);
-        chronicle_peek();
     }
     printf("exiting\n");
+    chronicle_reactor_close(reactor);
     chronicle_cleanup(queue);
 }
 
@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include "testdata.h"
+
+// the tool is built in, its main renamed, and run in a child for fresh globals
+#define main cqexport_main
+#include "../cqexport.c"
+#undef main
+
+char* argv0;
+
+int run_cqexport(char* a, ...) {
+    char* args[16] = {"cqexport", a};
+    int n = 2;
+    va_list ap;
+    va_start(ap, a);
+    while (n < 15 && (args[n] = va_arg(ap, char*)) != NULL) n++;
+    va_end(ap);
+    args[n] = NULL;
+
+    pid_t child = fork();
+    assert_true(child >= 0);
+    if (child == 0) _exit(cqexport_main(n, args));
+    int status;
+    assert_int_equal(waitpid(child, &status, 0), child);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+char* read_file(char* fn, size_t* sz) {
+    FILE* f = fopen(fn, "r");
+    assert_non_null(f);
+    fseek(f, 0, SEEK_END);
+    *sz = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* data = malloc(*sz + 1);
+    assert_int_equal(fread(data, 1, *sz, f), *sz);
+    data[*sz] = 0;
+    fclose(f);
+    return data;
+}
+
+// the same bytes in both files, returning the number of lines
+int same_output(char* a, char* b) {
+    size_t asz, bsz;
+    char* x = read_file(a, &asz);
+    char* y = read_file(b, &bsz);
+    assert_int_equal(asz, bsz);
+    assert_memory_equal(x, y, asz);
+    int lines = 0;
+    for (size_t i = 0; i < asz; i++) lines += x[i] == '\n';
+    free(x);
+    free(y);
+    return lines;
+}
+
+// index the sample cycle as Java would: one index page at 0x80e8 with indexSpacing 256,
+// and the first data message at 0x10108
+uint64_t index_sample_cycle(char* queuedir) {
+    char* fn;
+    asprintf(&fn, "%s/20211118F.cq4", queuedir);
+    int fd = open(fn, O_RDWR);
+    free(fn);
+    assert_true(fd >= 0);
+    struct stat statbuf;
+    assert_int_equal(fstat(fd, &statbuf), 0);
+    unsigned char* buf = mmap(0, statbuf.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    assert_true(buf != MAP_FAILED);
+    uint64_t capacity;
+    uint32_t page_header;
+    memcpy(&page_header, buf + 0x80e8, 4);
+    unsigned char* values = wire_i64_array(buf + 0x80e8 + 4, page_header & 0x3FFFFFFF, &capacity);
+    assert_non_null(values);
+    uint64_t seq = 0;
+    for (uint64_t pos = 0x10108; pos + 4 <= statbuf.st_size; ) {
+        uint32_t header;
+        memcpy(&header, buf + pos, 4);
+        if (header == 0) break;
+        uint32_t len = header & 0x3FFFFFFF;
+        if ((header & 0xC0000000) == 0) {
+            if (seq % 256 == 0) memcpy(values + 8 * (seq / 256), &pos, 8);
+            seq++;
+        }
+        pos += 4 + len + (-len & 3);
+    }
+    munmap(buf, statbuf.st_size);
+    close(fd);
+    return seq;
+}
+
+// an indexed cycle is split between workers, and the output matches a single worker's
+static void cqexport_parallel_indexed(void **state) {
+    char* test_queuedir = unpack_test_data("cqv5-sample-input.tar.bz2", argv0);
+    assert_non_null(test_queuedir);
+
+    char* queuedir;
+    asprintf(&queuedir, "%s/qv5", test_queuedir);
+    queue_t* q = chronicle_init(queuedir);
+    assert_non_null(q);
+    chronicle_set_encoder(q, &wirepad_sizeof, &wirepad_write);
+    assert_int_equal(chronicle_open(q), 0);
+    wirepad_t* pad = wirepad_init(64);
+    for (int i = 1; i <= 1000; i++) {
+        wirepad_clear(pad);
+        wirepad_field_varint(pad, "n", i);
+        chronicle_append_ts(q, pad, 1637267400000L);
+    }
+    wirepad_free(pad);
+    chronicle_cleanup(q);
+    assert_int_equal(index_sample_cycle(queuedir), 1004);
+
+    char *one, *many, *dir_one, *dir_many, *cycle_one, *cycle_many;
+    asprintf(&one, "%s/one.jsonl", test_queuedir);
+    asprintf(&many, "%s/many.jsonl", test_queuedir);
+    asprintf(&dir_one, "%s/one", test_queuedir);
+    asprintf(&dir_many, "%s/many", test_queuedir);
+    asprintf(&cycle_one, "%s/20211118F.csv", dir_one);
+    asprintf(&cycle_many, "%s/20211118F.csv", dir_many);
+
+    assert_int_equal(run_cqexport("-j", "1", "-o", one, queuedir, NULL), 0);
+    assert_int_equal(run_cqexport("-j", "3", "-o", many, queuedir, NULL), 0);
+    assert_int_equal(same_output(one, many), 1004);
+
+    assert_int_equal(mkdir(dir_one, 0755), 0);
+    assert_int_equal(mkdir(dir_many, 0755), 0);
+    assert_int_equal(run_cqexport("-f", "csv", "-F", "n", "-j", "1", "-o", dir_one, queuedir, NULL), 0);
+    assert_int_equal(run_cqexport("-f", "csv", "-F", "n", "-j", "4", "-o", dir_many, queuedir, NULL), 0);
+    assert_int_equal(same_output(cycle_one, cycle_many), 1005); // and a header
+
+    // no part files are left behind
+    DIR* d = opendir(dir_many);
+    assert_non_null(d);
+    int entries = 0;
+    for (struct dirent* de = readdir(d); de; de = readdir(d)) entries += de->d_name[0] != '.';
+    closedir(d);
+    assert_int_equal(entries, 1);
+
+    // a part that cannot be written fails the run
+    assert_int_equal(chmod(dir_many, 0555), 0);
+    if (access(dir_many, W_OK) != 0) { // not as root
+        assert_int_not_equal(run_cqexport("-j", "3", "-o", dir_many, queuedir, NULL), 0);
+    }
+    chmod(dir_many, 0755);
+
+    free(one);
+    free(many);
+    free(dir_one);
+    free(dir_many);
+    free(cycle_one);
+    free(cycle_many);
+    delete_test_data(test_queuedir);
+    free(test_queuedir);
+    free(queuedir);
+}
+
+int main(int argc, char* argv[]) {
+    argv0 = argv[0];
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(cqexport_parallel_indexed),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
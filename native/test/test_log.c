@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+
+#include <libchronicle.h>
+#include <log.h>
+
+typedef struct {
+    int  n;
+    loglevel_t level;
+    char last[256];
+} captured_t;
+
+void capture_sink(void* ctx, loglevel_t level, const char* msg, int len) {
+    captured_t* c = (captured_t*)ctx;
+    c->level = level;
+    snprintf(c->last, sizeof(c->last), "%.*s", len, msg);
+    __atomic_fetch_add(&c->n, 1, __ATOMIC_SEQ_CST);
+}
+
+static void test_log_levels(void **state) {
+    captured_t c;
+    bzero(&c, sizeof(c));
+    chronicle_set_log_sink(&capture_sink, &c);
+    chronicle_set_log_level(LL_WARN);
+
+    CLOG(LL_INFO, "not shown %d\n", 1);
+    assert_int_equal(c.n, 0);
+
+    CLOG(LL_WARN, "shown %d\n", 2);
+    assert_int_equal(c.n, 1);
+    assert_int_equal(c.level, LL_WARN);
+    assert_string_equal(c.last, "shown 2"); // trailing newline removed
+
+    chronicle_set_log_level(LL_DEBUG);
+    CLOG(LL_DEBUG, "debug");
+    assert_int_equal(c.n, 2);
+
+    // errors raised by the library reach the sink
+    queue_t* queue = chronicle_init("q2");
+    assert_int_not_equal(chronicle_open(queue), 0);
+    assert_int_equal(c.level, LL_ERROR);
+    assert_string_equal(c.last, "dir stat fail");
+    chronicle_cleanup(queue);
+
+    chronicle_set_log_level(LL_WARN);
+    chronicle_set_log_sink(NULL, NULL);
+}
+
+static void test_log_async(void **state) {
+    captured_t c;
+    bzero(&c, sizeof(c));
+    chronicle_set_log_sink(&capture_sink, &c);
+    chronicle_set_log_level(LL_INFO);
+
+    assert_int_equal(chronicle_set_log_async(1), 0);
+    for (int i = 0; i < 100; i++) {
+        CLOG(LL_INFO, "record %d", i);
+    }
+    // disabling async flushes everything queued to the sink
+    chronicle_set_log_async(0);
+    assert_int_equal(c.n + chronicle_log_dropped(), 100);
+    assert_string_equal(c.last, "record 99");
+
+    // back to synchronous delivery
+    CLOG(LL_INFO, "sync");
+    assert_string_equal(c.last, "sync");
+
+    chronicle_set_log_level(LL_WARN);
+    chronicle_set_log_sink(NULL, NULL);
+}
+
+typedef struct {
+    int  n;
+    char lines[8][256];
+} lines_t;
+
+void lines_sink(void* ctx, loglevel_t level, const char* msg, int len) {
+    lines_t* l = (lines_t*)ctx;
+    if (l->n < 8) snprintf(l->lines[l->n], sizeof(l->lines[0]), "%.*s", len, msg);
+    l->n++;
+}
+
+static void test_log_async_format(void **state) {
+    lines_t l;
+    bzero(&l, sizeof(l));
+    chronicle_set_log_sink(&lines_sink, &l);
+    chronicle_set_log_level(LL_INFO);
+
+    char transient[32];
+    char expected[8][256];
+    uint64_t big = 0x4A0500000003;
+    assert_int_equal(chronicle_set_log_async(1), 0);
+
+    // arguments are captured at the call, strings copied before the caller reuses them
+    strcpy(transient, "queuefile");
+    CLOG(LL_INFO, "open %s at %" PRIu64 " (%" PRIx64 ")\n", transient, big, big);
+    snprintf(expected[0], 256, "open %s at %" PRIu64 " (%" PRIx64 ")", transient, big, big);
+    strcpy(transient, "overwritten");
+
+    CLOG(LL_INFO, "%.*s|%-5d|%5.2f|%zu|%c|100%%", 4, "abcdefgh", -3, 2.5, (size_t)7, 'z');
+    snprintf(expected[1], 256, "%.*s|%-5d|%5.2f|%zu|%c|100%%", 4, "abcdefgh", -3, 2.5, (size_t)7, 'z');
+
+    CLOG(LL_INFO, "ptr %p null %s", (void*)transient, (char*)NULL);
+    snprintf(expected[2], 256, "ptr %p null %s", (void*)transient, "(null)");
+
+    // conversions a record cannot carry are formatted by the caller
+    CLOG(LL_INFO, "long double %.1Lf", (long double)1.5);
+    snprintf(expected[3], 256, "long double %.1Lf", (long double)1.5);
+
+    chronicle_set_log_async(0);
+    assert_int_equal(l.n, 4);
+    for (int i = 0; i < 4; i++) {
+        assert_string_equal(expected[i], l.lines[i]);
+    }
+
+    chronicle_set_log_level(LL_WARN);
+    chronicle_set_log_sink(NULL, NULL);
+}
+
+int stop_logging = 0;
+
+void count_sink(void* ctx, loglevel_t level, const char* msg, int len) {
+    __atomic_fetch_add((int*)ctx, 1, __ATOMIC_SEQ_CST);
+}
+
+void* log_worker(void* arg) {
+    int n = 0;
+    while (!__atomic_load_n(&stop_logging, __ATOMIC_ACQUIRE)) {
+        CLOG(LL_INFO, "worker %d", n++);
+    }
+    return (void*)(intptr_t)n;
+}
+
+static void test_log_async_toggle(void **state) {
+    int delivered = 0;
+    chronicle_set_log_sink(&count_sink, &delivered);
+    chronicle_set_log_level(LL_INFO);
+    uint64_t dropped = chronicle_log_dropped();
+
+    // every record is delivered or counted as dropped however the mode flips under load
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) pthread_create(&threads[i], NULL, &log_worker, NULL);
+    for (int i = 0; i < 20; i++) {
+        assert_int_equal(chronicle_set_log_async(1), 0);
+        usleep(500);
+        chronicle_set_log_async(0);
+    }
+    __atomic_store_n(&stop_logging, 1, __ATOMIC_RELEASE);
+    int64_t total = 0;
+    for (int i = 0; i < 2; i++) {
+        void* n;
+        pthread_join(threads[i], &n);
+        total += (intptr_t)n;
+    }
+    assert_int_equal(delivered + chronicle_log_dropped() - dropped, total);
+
+    chronicle_set_log_level(LL_WARN);
+    chronicle_set_log_sink(NULL, NULL);
+}
+
+// a sink may log, but not switch the sink or the mode
+typedef struct {
+    int  n;
+    int  set_sink_rc;
+    int  set_async_rc;
+} reentrant_t;
+
+void reentrant_sink(void* ctx, loglevel_t level, const char* msg, int len) {
+    reentrant_t* r = (reentrant_t*)ctx;
+    if (r->n++ > 0) return;
+    CLOG(LL_INFO, "from the sink");
+    r->set_sink_rc = chronicle_set_log_sink(NULL, NULL);
+    r->set_async_rc = chronicle_set_log_async(0);
+}
+
+static void test_log_sink_reentrant(void **state) {
+    reentrant_t r;
+    chronicle_set_log_level(LL_INFO);
+    for (int async = 0; async < 2; async++) {
+        bzero(&r, sizeof(r));
+        assert_int_equal(chronicle_set_log_sink(&reentrant_sink, &r), 0);
+        assert_int_equal(chronicle_set_log_async(async), 0);
+        CLOG(LL_INFO, "record");
+        assert_int_equal(chronicle_set_log_async(0), 0);
+        assert_int_equal(r.n, 2);
+        assert_int_equal(r.set_sink_rc, -1);
+        assert_int_equal(r.set_async_rc, -1);
+    }
+    chronicle_set_log_level(LL_WARN);
+    assert_int_equal(chronicle_set_log_sink(NULL, NULL), 0);
+}
+
+static void test_log_sink_swap(void **state) {
+    int delivered[2] = {0, 0};
+    chronicle_set_log_sink(&count_sink, &delivered[1]);
+    chronicle_set_log_level(LL_INFO);
+    __atomic_store_n(&stop_logging, 0, __ATOMIC_RELEASE);
+
+    // swapping the sink waits only for callers already using the previous one, however
+    // steadily others log
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) pthread_create(&threads[i], NULL, &log_worker, NULL);
+    for (int i = 0; i < 50; i++) {
+        assert_int_equal(chronicle_set_log_sink(&count_sink, &delivered[i & 1]), 0);
+    }
+    __atomic_store_n(&stop_logging, 1, __ATOMIC_RELEASE);
+    int64_t total = 0;
+    for (int i = 0; i < 2; i++) {
+        void* n;
+        pthread_join(threads[i], &n);
+        total += (intptr_t)n;
+    }
+    assert_int_equal(delivered[0] + delivered[1], total);
+
+    chronicle_set_log_level(LL_WARN);
+    chronicle_set_log_sink(NULL, NULL);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_log_levels),
+        cmocka_unit_test(test_log_async),
+        cmocka_unit_test(test_log_async_format),
+        cmocka_unit_test(test_log_async_toggle),
+        cmocka_unit_test(test_log_sink_reentrant),
+        cmocka_unit_test(test_log_sink_swap),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -5,6 +5,9 @@
 #include <setjmp.h>
 #include <cmocka.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <dirent.h>
 
 #include <libchronicle.h>
 #include <wire.h>
@@ -165,6 +168,909 @@ static void queue_cqv5_sample_input(void **state) {
     wirepad_free(pad);
 }
 
+static void queue_cqv5_shared_tailers(void **state) {
+    collected_t result;
+
+    char* test_queuedir = unpack_test_data("cqv5-sample-input.tar.bz2", argv0);
+    assert_non_null(test_queuedir);
+
+    char* queuedir;
+    asprintf(&queuedir, "%s/qv5", test_queuedir);
+    queue_t* queue = chronicle_init(queuedir);
+    assert_non_null(queue);
+    chronicle_set_decoder(queue, &wire_parse_textonly, &free);
+    assert_int_equal(chronicle_open(queue), 0);
+
+    // tailers at the same position share queuefile and mapping, check they
+    // still step independently and survive each other being closed
+    tailer_t* tailers[3];
+    for (int i = 0; i < 3; i++) {
+        tailers[i] = chronicle_tailer(queue, NULL, NULL, 0);
+        assert_non_null(tailers[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        chronicle_collect(tailers[i], &result);
+        assert_string_equal("one", result.msg);
+        chronicle_return(tailers[i], &result);
+    }
+    chronicle_collect(tailers[0], &result);
+    assert_string_equal("two", result.msg);
+    chronicle_return(tailers[0], &result);
+
+    chronicle_tailer_close(tailers[0]);
+
+    chronicle_collect(tailers[1], &result);
+    assert_string_equal("two", result.msg);
+    chronicle_return(tailers[1], &result);
+
+    chronicle_tailer_close(tailers[1]);
+
+    chronicle_collect(tailers[2], &result);
+    assert_string_equal("two", result.msg);
+    chronicle_return(tailers[2], &result);
+    chronicle_collect(tailers[2], &result);
+    assert_string_equal("three", result.msg);
+    chronicle_return(tailers[2], &result);
+
+    chronicle_cleanup(queue);
+
+    delete_test_data(test_queuedir);
+    free(queuedir);
+    free(test_queuedir);
+}
+
+static void queue_cqv5_mapping_budget(void **state) {
+    collected_t result;
+
+    char* test_queuedir = unpack_test_data("cqv5-sample-input.tar.bz2", argv0);
+    assert_non_null(test_queuedir);
+
+    char* queuedir;
+    asprintf(&queuedir, "%s/qv5", test_queuedir);
+    queue_t* queue = chronicle_init(queuedir);
+    assert_non_null(queue);
+    chronicle_set_decoder(queue, &wire_parse_textonly, &free);
+    assert_int_equal(chronicle_open(queue), 0);
+
+    tailer_t* t1 = chronicle_tailer(queue, NULL, NULL, 0);
+    tailer_t* t2 = chronicle_tailer(queue, NULL, NULL, 0);
+    assert_int_equal(chronicle_tailer_mapped_bytes(t1), 0);
+    uint64_t maps = chronicle_map_count();
+
+    chronicle_collect(t1, &result);
+    chronicle_return(t1, &result);
+    chronicle_collect(t2, &result);
+    chronicle_return(t2, &result);
+
+    // both tailers see the same window, which is only mapped once
+    uint64_t window = chronicle_tailer_mapped_bytes(t1);
+    assert_true(window > 0);
+    assert_int_equal(chronicle_tailer_mapped_bytes(t2), window);
+    assert_int_equal(chronicle_queue_mapped_bytes(queue), window);
+    assert_int_equal(chronicle_mapped_bytes(), window);
+    assert_int_equal(chronicle_map_count(), maps + 1);
+
+    // with a budget below one window, only the last tailer to peek keeps a mapping
+    chronicle_set_mapping_budget(1);
+    assert_int_equal(chronicle_mapped_bytes(), 0);
+
+    chronicle_collect(t1, &result);
+    assert_string_equal("two", result.msg);
+    chronicle_return(t1, &result);
+    assert_int_equal(chronicle_tailer_mapped_bytes(t1), window);
+    assert_int_equal(chronicle_tailer_mapped_bytes(t2), 0);
+    assert_int_equal(chronicle_map_count(), maps + 2);
+
+    // joining an already mapped window costs nothing, so evicts nobody
+    chronicle_collect(t2, &result);
+    chronicle_return(t2, &result);
+    assert_int_equal(chronicle_tailer_mapped_bytes(t1), window);
+    assert_int_equal(chronicle_tailer_mapped_bytes(t2), window);
+    assert_int_equal(chronicle_mapped_bytes(), window);
+
+    // a second handle on the queue maps separately, evicting the idle tailers
+    queue_t* queue2 = chronicle_init(queuedir);
+    chronicle_set_decoder(queue2, &wire_parse_textonly, &free);
+    assert_int_equal(chronicle_open(queue2), 0);
+    tailer_t* t3 = chronicle_tailer(queue2, NULL, NULL, 0);
+    chronicle_collect(t3, &result);
+    assert_string_equal("one", result.msg);
+    chronicle_return(t3, &result);
+    assert_int_equal(chronicle_tailer_mapped_bytes(t1), 0);
+    assert_int_equal(chronicle_tailer_mapped_bytes(t2), 0);
+    assert_int_equal(chronicle_queue_mapped_bytes(queue), 0);
+    assert_int_equal(chronicle_queue_mapped_bytes(queue2), window);
+
+    // evicted tailers re-map on demand and carry on where they were
+    chronicle_collect(t1, &result);
+    assert_string_equal("three", result.msg);
+    chronicle_return(t1, &result);
+    assert_int_equal(chronicle_queue_mapped_bytes(queue), window);
+    assert_int_equal(chronicle_queue_mapped_bytes(queue2), 0);
+    chronicle_cleanup(queue2);
+
+    chronicle_set_mapping_budget(0);
+    chronicle_cleanup(queue);
+    assert_int_equal(chronicle_mapped_bytes(), 0);
+
+    delete_test_data(test_queuedir);
+    free(queuedir);
+    free(test_queuedir);
+}
+
+typedef struct {
+    int entered;
+    int release;
+} gate_t;
+
+// holds the tailer being peeked, and so its lock and window, until released
+int gate_msg(void* ctx, uint64_t index, COBJ y) {
+    gate_t* g = (gate_t*)ctx;
+    __atomic_store_n(&g->entered, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&g->release, __ATOMIC_SEQ_CST)) usleep(100);
+    return 0;
+}
+
+void* gate_worker(void* arg) {
+    chronicle_peek_tailer((tailer_t*)arg);
+    return NULL;
+}
+
+static void queue_cqv5_mapping_budget_busy(void **state) {
+    collected_t result;
+
+    char* test_queuedir = unpack_test_data("cqv5-sample-input.tar.bz2", argv0);
+    assert_non_null(test_queuedir);
+
+    char* queuedir;
+    asprintf(&queuedir, "%s/qv5", test_queuedir);
+    // separate handles map the same window separately
+    queue_t* queues[3];
+    for (int i = 0; i < 3; i++) {
+        queues[i] = chronicle_init(queuedir);
+        assert_non_null(queues[i]);
+        chronicle_set_decoder(queues[i], &wire_parse_textonly, &free);
+        assert_int_equal(chronicle_open(queues[i]), 0);
+    }
+
+    tailer_t* probe = chronicle_tailer(queues[0], NULL, NULL, 0);
+    chronicle_collect(probe, &result);
+    chronicle_return(probe, &result);
+    uint64_t window = chronicle_tailer_mapped_bytes(probe);
+    chronicle_tailer_close(probe);
+    assert_int_equal(chronicle_mapped_bytes(), 0);
+    chronicle_set_mapping_budget(window);
+
+    // the least recently peeked tailer is busy in another thread
+    gate_t g;
+    bzero(&g, sizeof(g));
+    tailer_t* busy = chronicle_tailer(queues[0], &gate_msg, &g, 0);
+    pthread_t thread;
+    pthread_create(&thread, NULL, &gate_worker, busy);
+    while (!__atomic_load_n(&g.entered, __ATOMIC_SEQ_CST)) usleep(100);
+    assert_int_equal(chronicle_mapped_bytes(), window);
+
+    tailer_t* t1 = chronicle_tailer(queues[1], NULL, NULL, 0);
+    chronicle_collect(t1, &result);
+    chronicle_return(t1, &result);
+    assert_true(chronicle_mapped_bytes() <= window + window);
+
+    // so eviction passes over it to the next oldest, rather than giving up
+    tailer_t* t2 = chronicle_tailer(queues[2], NULL, NULL, 0);
+    chronicle_collect(t2, &result);
+    chronicle_return(t2, &result);
+    assert_true(chronicle_mapped_bytes() <= window + window);
+    assert_int_equal(chronicle_tailer_mapped_bytes(busy), window);
+    assert_int_equal(chronicle_tailer_mapped_bytes(t1), 0);
+    assert_int_equal(chronicle_tailer_mapped_bytes(t2), window);
+
+    __atomic_store_n(&g.release, 1, __ATOMIC_SEQ_CST);
+    pthread_join(thread, NULL);
+
+    chronicle_set_mapping_budget(0);
+    for (int i = 0; i < 3; i++) chronicle_cleanup(queues[i]);
+    assert_int_equal(chronicle_mapped_bytes(), 0);
+
+    delete_test_data(test_queuedir);
+    free(queuedir);
+    free(test_queuedir);
+}
+
+int count_fds() {
+    int n = 0;
+    DIR* d = opendir("/proc/self/fd");
+    if (d == NULL) return -1;
+    while (readdir(d)) n++;
+    closedir(d);
+    return n;
+}
+
+static void queue_cqv5_dirlist_resized(void **state) {
+    collected_t result;
+
+    char* test_queuedir = unpack_test_data("cqv5-sample-input.tar.bz2", argv0);
+    assert_non_null(test_queuedir);
+
+    char* queuedir;
+    asprintf(&queuedir, "%s/qv5", test_queuedir);
+    int fds = count_fds();
+    queue_t* queue = chronicle_init(queuedir);
+    assert_non_null(queue);
+    chronicle_set_decoder(queue, &wire_parse_textonly, &free);
+    chronicle_set_encoder(queue, &wirepad_sizeof, &wirepad_write);
+    assert_int_equal(chronicle_open(queue), 0);
+    tailer_t* tailer = chronicle_tailer(queue, NULL, NULL, 0);
+
+    // the directory listing grows between opening the queue and the first append, so
+    // the read-write reopen maps it afresh
+    char* fn;
+    asprintf(&fn, "%s/metadata.cq4t", queuedir);
+    struct stat statbuf;
+    assert_int_equal(stat(fn, &statbuf), 0);
+    assert_int_equal(truncate(fn, statbuf.st_size + 4096), 0);
+    free(fn);
+
+    wirepad_t* pad = wirepad_init(64);
+    wirepad_text(pad, "resized");
+    uint64_t index = chronicle_append_ts(queue, pad, 1637267400000L);
+    wirepad_free(pad);
+    assert_int_equal(chronicle_tailer_index(tailer), 0x4A0500000000);
+    for (int i = 0; i < 4; i++) {
+        chronicle_collect(tailer, &result);
+        chronicle_return(tailer, &result);
+    }
+    assert_string_equal("resized", chronicle_collect(tailer, &result));
+    assert_int_equal(result.index, index);
+    chronicle_return(tailer, &result);
+    chronicle_tailer_close(tailer);
+
+    // the replaced descriptor was closed, not leaked
+    chronicle_cleanup(queue);
+    assert_int_equal(count_fds(), fds);
+
+    delete_test_data(test_queuedir);
+    free(queuedir);
+    free(test_queuedir);
+}
+
+static void queue_cqv5_replay_tailer(void **state) {
+    collected_t result;
+
+    char* test_queuedir = unpack_test_data("cqv5-sample-input.tar.bz2", argv0);
+    assert_non_null(test_queuedir);
+
+    char* queuedir;
+    asprintf(&queuedir, "%s/qv5", test_queuedir);
+    queue_t* queue = chronicle_init(queuedir);
+    assert_non_null(queue);
+    chronicle_set_decoder(queue, &wire_parse_textonly, &free);
+    chronicle_set_encoder(queue, &wirepad_sizeof, &wirepad_write);
+    assert_int_equal(chronicle_open(queue), 0);
+
+    // roll the queue so the sample cycle becomes historical
+    wirepad_t* pad = wirepad_init(1024);
+    wirepad_text(pad, "seven");
+    assert_int_equal(chronicle_append_ts(queue, pad, 1637308800000L), 0x4a0600000000);
+    wirepad_free(pad);
+
+    tailer_t* tailer = chronicle_tailer(queue, NULL, NULL, 0);
+    chronicle_tailer_set_replay(tailer, 1);
+
+    char* expected[] = {"one", "two", "three", "a much longer item that will need encoding as variable length text", "seven"};
+    for (int i = 0; i < 5; i++) {
+        chronicle_collect(tailer, &result);
+        assert_string_equal(expected[i], result.msg);
+        chronicle_return(tailer, &result);
+    }
+    assert_int_equal(result.index, 0x4a0600000000);
+
+    chronicle_cleanup(queue);
+
+    delete_test_data(test_queuedir);
+    free(queuedir);
+    free(test_queuedir);
+}
+
+typedef struct {
+    int      n;
+    uint64_t index[16];
+    char*    msg[16];
+} replayed_t;
+
+int record_msg(void* ctx, uint64_t index, COBJ y) {
+    replayed_t* r = (replayed_t*)ctx;
+    int n = __atomic_fetch_add(&r->n, 1, __ATOMIC_SEQ_CST);
+    if (n < 16) {
+        r->index[n] = index;
+        r->msg[n] = strdup((char*)y);
+    }
+    return 0;
+}
+
+// keeps every message, which the test frees
+int retain_msg(void* ctx, uint64_t index, COBJ y) {
+    replayed_t* r = (replayed_t*)ctx;
+    int n = __atomic_fetch_add(&r->n, 1, __ATOMIC_SEQ_CST);
+    r->index[n] = index;
+    r->msg[n] = (char*)y;
+    return DISPATCH_RETAIN;
+}
+
+static void queue_cqv5_replay_parallel(void **state) {
+    char* test_queuedir = unpack_test_data("cqv5-sample-input.tar.bz2", argv0);
+    assert_non_null(test_queuedir);
+
+    char* queuedir;
+    asprintf(&queuedir, "%s/qv5", test_queuedir);
+    queue_t* queue = chronicle_init(queuedir);
+    assert_non_null(queue);
+    chronicle_set_decoder(queue, &wire_parse_textonly, &free);
+    chronicle_set_encoder(queue, &wirepad_sizeof, &wirepad_write);
+    assert_int_equal(chronicle_open(queue), 0);
+
+    // roll to a second cycle, leaving one missing cycle between
+    wirepad_t* pad = wirepad_init(1024);
+    wirepad_text(pad, "seven");
+    chronicle_append_ts(queue, pad, 1637308800000L + 86400000L);
+    wirepad_clear(pad);
+    wirepad_text(pad, "eight");
+    chronicle_append_ts(queue, pad, 1637308800000L + 86400000L);
+    wirepad_free(pad);
+
+    replayed_t r;
+    bzero(&r, sizeof(r));
+    assert_int_equal(chronicle_replay_parallel(queue, 0, UINT64_MAX, 3, &record_msg, &r, 1), 6);
+    assert_int_equal(r.n, 6);
+    char* expected[] = {"one", "two", "three", "a much longer item that will need encoding as variable length text", "seven", "eight"};
+    for (int i = 0; i < 6; i++) {
+        assert_string_equal(expected[i], r.msg[i]);
+        free(r.msg[i]);
+    }
+    assert_int_equal(r.index[0], 0x4A0500000000);
+    assert_int_equal(r.index[4], 0x4A0700000000);
+    assert_int_equal(r.index[5], 0x4A0700000001);
+
+    // sub-range, unordered
+    bzero(&r, sizeof(r));
+    assert_int_equal(chronicle_replay_parallel(queue, 0x4A0500000002, 0x4A0700000001, 2, &record_msg, &r, 0), 3);
+    for (int i = 0; i < r.n; i++) free(r.msg[i]);
+
+    // retained messages are not freed by the replay
+    bzero(&r, sizeof(r));
+    assert_int_equal(chronicle_replay_parallel(queue, 0, UINT64_MAX, 2, &retain_msg, &r, 1), 6);
+    for (int i = 0; i < 6; i++) {
+        assert_string_equal(expected[i], r.msg[i]);
+        free(r.msg[i]);
+    }
+
+    chronicle_cleanup(queue);
+
+    delete_test_data(test_queuedir);
+    free(queuedir);
+    free(test_queuedir);
+}
+
+typedef struct {
+    int      total;
+    int      out_of_order;
+    uint64_t first_index;
+    uint64_t last_index;
+} sequenced_t;
+
+int check_sequence(void* ctx, uint64_t index, COBJ msg) {
+    sequenced_t* s = (sequenced_t*)ctx;
+    int n = __atomic_fetch_add(&s->total, 1, __ATOMIC_SEQ_CST);
+    if (n == 0) s->first_index = index;
+    if (n > 0 && index != s->last_index + 1) __atomic_add_fetch(&s->out_of_order, 1, __ATOMIC_SEQ_CST);
+    s->last_index = index;
+    return 0;
+}
+
+// index the sample cycle as Java would, returning the number of messages: the sample
+// has one index page at 0x80e8 with indexSpacing 256, and its first data message at 0x10108
+uint64_t index_sample_cycle(char* queuedir) {
+    char* fn;
+    asprintf(&fn, "%s/20211118F.cq4", queuedir);
+    int fd = open(fn, O_RDWR);
+    free(fn);
+    assert_true(fd >= 0);
+    struct stat statbuf;
+    assert_int_equal(fstat(fd, &statbuf), 0);
+    unsigned char* buf = mmap(0, statbuf.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    assert_true(buf != MAP_FAILED);
+    uint64_t capacity;
+    uint32_t page_header;
+    memcpy(&page_header, buf + 0x80e8, 4);
+    unsigned char* values = wire_i64_array(buf + 0x80e8 + 4, page_header & 0x3FFFFFFF, &capacity);
+    assert_non_null(values);
+    uint64_t seq = 0;
+    for (uint64_t pos = 0x10108; pos + 4 <= statbuf.st_size; ) {
+        uint32_t header;
+        memcpy(&header, buf + pos, 4);
+        if (header == 0) break;
+        uint32_t len = header & 0x3FFFFFFF;
+        if ((header & 0xC0000000) == 0) {
+            if (seq % 256 == 0) memcpy(values + 8 * (seq / 256), &pos, 8);
+            seq++;
+        }
+        pos += 4 + len + (-len & 3);
+    }
+    munmap(buf, statbuf.st_size);
+    close(fd);
+    return seq;
+}
+
+extern size_t replay_pending_max;
+
+static void queue_cqv5_replay_indexed(void **state) {
+    char* test_queuedir = unpack_test_data("cqv5-sample-input.tar.bz2", argv0);
+    assert_non_null(test_queuedir);
+
+    char* queuedir;
+    asprintf(&queuedir, "%s/qv5", test_queuedir);
+    queue_t* queue = chronicle_init(queuedir);
+    assert_non_null(queue);
+    chronicle_set_decoder(queue, &wire_parse_textonly, &free);
+    chronicle_set_encoder(queue, &wirepad_sizeof, &wirepad_write);
+    assert_int_equal(chronicle_open(queue), 0);
+
+    wirepad_t* pad = wirepad_init(64);
+    for (int i = 1; i <= 1000; i++) {
+        char text[16];
+        sprintf(text, "n%d", i);
+        wirepad_clear(pad);
+        wirepad_text(pad, text);
+        chronicle_append_ts(queue, pad, 1637267400000L);
+    }
+    wirepad_free(pad);
+
+    assert_int_equal(index_sample_cycle(queuedir), 1004);
+
+    // the cycle splits at its index entries, and a tiny buffer cap makes later parts
+    // wait for their turn part way through
+    replay_pending_max = 16;
+    sequenced_t s;
+    bzero(&s, sizeof(s));
+    assert_int_equal(chronicle_replay_parallel(queue, 0, UINT64_MAX, 3, &check_sequence, &s, 1), 1004);
+    assert_int_equal(s.total, 1004);
+    assert_int_equal(s.out_of_order, 0);
+    assert_int_equal(s.first_index, 0x4A0500000000);
+    assert_int_equal(s.last_index, 0x4A0500000000 + 1003);
+
+    // a sub-range seeks to the entry before its start
+    bzero(&s, sizeof(s));
+    assert_int_equal(chronicle_replay_parallel(queue, 0x4A0500000000 + 300, 0x4A0500000000 + 900, 4, &check_sequence, &s, 1), 600);
+    assert_int_equal(s.out_of_order, 0);
+    assert_int_equal(s.first_index, 0x4A0500000000 + 300);
+    assert_int_equal(s.last_index, 0x4A0500000000 + 899);
+    replay_pending_max = 64*1024;
+
+    bzero(&s, sizeof(s));
+    assert_int_equal(chronicle_replay_parallel(queue, 0, UINT64_MAX, 3, &check_sequence, &s, 0), 1004);
+    assert_int_equal(s.total, 1004);
+
+    chronicle_cleanup(queue);
+
+    delete_test_data(test_queuedir);
+    free(queuedir);
+    free(test_queuedir);
+}
+
+static void queue_cqv5_reverse(void **state) {
+    collected_t result;
+
+    char* test_queuedir = unpack_test_data("cqv5-sample-input.tar.bz2", argv0);
+    assert_non_null(test_queuedir);
+
+    char* queuedir;
+    asprintf(&queuedir, "%s/qv5", test_queuedir);
+    queue_t* queue = chronicle_init(queuedir);
+    assert_non_null(queue);
+    chronicle_set_decoder(queue, &wire_parse_textonly, &free);
+    chronicle_set_encoder(queue, &wirepad_sizeof, &wirepad_write);
+    assert_int_equal(chronicle_open(queue), 0);
+
+    wirepad_t* pad = wirepad_init(1024);
+    wirepad_text(pad, "seven");
+    chronicle_append_ts(queue, pad, 1637308800000L + 86400000L);
+    wirepad_free(pad);
+
+    // walk back from the tip, across the missing cycle into the sample cycle
+    reverse_t* reverse = chronicle_reverse(queue);
+    assert_non_null(reverse);
+    char* expected[] = {"seven", "a much longer item that will need encoding as variable length text", "three", "two", "one"};
+    uint64_t expected_index[] = {0x4A0700000000, 0x4A0500000003, 0x4A0500000002, 0x4A0500000001, 0x4A0500000000};
+    for (int i = 0; i < 5; i++) {
+        assert_non_null(chronicle_reverse_collect(reverse, &result));
+        assert_string_equal(expected[i], result.msg);
+        assert_int_equal(expected_index[i], result.index);
+        chronicle_reverse_return(reverse, &result);
+    }
+    assert_null(chronicle_reverse_collect(reverse, &result));
+    chronicle_reverse_close(reverse);
+
+    assert_int_equal(chronicle_index_from_end(queue, 0), 0x4A0700000001);
+    assert_int_equal(chronicle_index_from_end(queue, 2), 0x4A0500000003);
+    assert_int_equal(chronicle_index_from_end(queue, 100), 0x4A0500000000);
+
+    tailer_t* tailer = chronicle_tailer_from_end(queue, NULL, NULL, 3);
+    chronicle_collect(tailer, &result);
+    assert_string_equal("three", result.msg);
+    chronicle_return(tailer, &result);
+
+    chronicle_cleanup(queue);
+
+    delete_test_data(test_queuedir);
+    free(queuedir);
+    free(test_queuedir);
+}
+
+static void queue_cqv5_reverse_indexed(void **state) {
+    collected_t result;
+
+    char* test_queuedir = unpack_test_data("cqv5-sample-input.tar.bz2", argv0);
+    assert_non_null(test_queuedir);
+
+    char* queuedir;
+    asprintf(&queuedir, "%s/qv5", test_queuedir);
+    queue_t* queue = chronicle_init(queuedir);
+    assert_non_null(queue);
+    chronicle_set_decoder(queue, &wire_parse_textonly, &free);
+    chronicle_set_encoder(queue, &wirepad_sizeof, &wirepad_write);
+    assert_int_equal(chronicle_open(queue), 0);
+
+    wirepad_t* pad = wirepad_init(64);
+    for (int i = 1; i <= 1000; i++) {
+        char text[16];
+        sprintf(text, "n%d", i);
+        wirepad_clear(pad);
+        wirepad_text(pad, text);
+        chronicle_append_ts(queue, pad, 1637267400000L);
+    }
+    wirepad_clear(pad);
+    wirepad_text(pad, "seven");
+    chronicle_append_ts(queue, pad, 1637308800000L + 86400000L);
+    wirepad_free(pad);
+    assert_int_equal(index_sample_cycle(queuedir), 1004);
+
+    // counts from the last index entry, then steps over the missing cycle
+    assert_int_equal(chronicle_index_from_end(queue, 1), 0x4A0700000000);
+    assert_int_equal(chronicle_index_from_end(queue, 2), 0x4A0500000000 + 1003);
+    assert_int_equal(chronicle_index_from_end(queue, 1000), 0x4A0500000000 + 5);
+    assert_int_equal(chronicle_index_from_end(queue, 2000), 0x4A0500000000);
+
+    // each run of index entries is scanned as the walk reaches it
+    reverse_t* reverse = chronicle_reverse(queue);
+    assert_non_null(reverse);
+    assert_non_null(chronicle_reverse_collect(reverse, &result));
+    assert_string_equal("seven", result.msg);
+    chronicle_reverse_return(reverse, &result);
+    for (int i = 1000; i >= 1; i--) {
+        char text[16];
+        sprintf(text, "n%d", i);
+        assert_non_null(chronicle_reverse_collect(reverse, &result));
+        assert_string_equal(text, result.msg);
+        assert_int_equal(result.index, 0x4A0500000000 + 3 + i);
+        chronicle_reverse_return(reverse, &result);
+    }
+    for (int i = 3; i >= 0; i--) {
+        assert_non_null(chronicle_reverse_collect(reverse, &result));
+        assert_int_equal(result.index, 0x4A0500000000 + i);
+        chronicle_reverse_return(reverse, &result);
+    }
+    assert_null(chronicle_reverse_collect(reverse, &result));
+    chronicle_reverse_close(reverse);
+
+    chronicle_cleanup(queue);
+
+    delete_test_data(test_queuedir);
+    free(queuedir);
+    free(test_queuedir);
+}
+
+int reject_long(void* ctx, unsigned char* base, int lim) {
+    return lim < *(int*)ctx;
+}
+
+static void queue_cqv5_filter(void **state) {
+    char* test_queuedir = unpack_test_data("cqv5-sample-input.tar.bz2", argv0);
+    assert_non_null(test_queuedir);
+
+    char* queuedir;
+    asprintf(&queuedir, "%s/qv5", test_queuedir);
+    queue_t* queue = chronicle_init(queuedir);
+    assert_non_null(queue);
+    chronicle_set_decoder(queue, &wire_parse_textonly, &free);
+    assert_int_equal(chronicle_open(queue), 0);
+
+    // the wire control byte of short text is 0xE0 + length, so select 3 character texts
+    replayed_t r;
+    bzero(&r, sizeof(r));
+    tailer_t* tailer = chronicle_tailer(queue, &record_msg, &r, 0);
+    unsigned char mask[] = {0xFF};
+    unsigned char value[] = {0xE3};
+    assert_int_equal(chronicle_tailer_set_filter_mask(tailer, 0, mask, value, 1), 0);
+    chronicle_peek_tailer(tailer);
+    assert_int_equal(r.n, 2);
+    assert_string_equal("one", r.msg[0]);
+    assert_string_equal("two", r.msg[1]);
+    assert_int_equal(chronicle_tailer_filtered(tailer), 2);
+    assert_int_equal(chronicle_tailer_index(tailer), 0x4A0500000004);
+    for (int i = 0; i < r.n; i++) free(r.msg[i]);
+
+    // callback filter on length
+    bzero(&r, sizeof(r));
+    int maxlen = 10;
+    tailer_t* tailer2 = chronicle_tailer(queue, &record_msg, &r, 0);
+    chronicle_tailer_set_filter(tailer2, &reject_long, &maxlen);
+    chronicle_peek_tailer(tailer2);
+    assert_int_equal(r.n, 3);
+    assert_string_equal("three", r.msg[2]);
+    for (int i = 0; i < r.n; i++) free(r.msg[i]);
+
+    assert_int_not_equal(chronicle_tailer_set_filter_mask(tailer2, 0, mask, value, 17), 0);
+
+    chronicle_cleanup(queue);
+
+    delete_test_data(test_queuedir);
+    free(queuedir);
+    free(test_queuedir);
+}
+
+typedef struct {
+    queue_t*  queue;
+    int       count;
+    int       want;
+    int       appends;
+    int       own_appender;
+    uint64_t  index[50];
+} worker_arg_t;
+
+int count_msg(void* ctx, uint64_t index, COBJ y) {
+    ((worker_arg_t*)ctx)->count++;
+    return 0;
+}
+
+void* tail_worker(void* arg) {
+    worker_arg_t* w = (worker_arg_t*)arg;
+    tailer_t* tailer = chronicle_tailer(w->queue, &count_msg, w, 0);
+    while (w->count < w->want) {
+        chronicle_peek_tailer(tailer);
+    }
+    chronicle_tailer_close(tailer);
+    return NULL;
+}
+
+void* append_worker(void* arg) {
+    worker_arg_t* w = (worker_arg_t*)arg;
+    wirepad_t* pad = wirepad_init(64);
+    wirepad_text(pad, "threaded");
+    tailer_t* appender = w->own_appender ? chronicle_appender_open(w->queue) : NULL;
+    for (int i = 0; i < w->appends; i++) {
+        if (appender) {
+            w->index[i] = chronicle_appender_append_ts(appender, pad, 1637267400000L);
+        } else {
+            w->index[i] = chronicle_append_ts(w->queue, pad, 1637267400000L);
+        }
+    }
+    if (appender) chronicle_appender_close(appender);
+    wirepad_free(pad);
+    // errors are per-thread
+    chronicle_tailer(NULL, NULL, NULL, 0);
+    return (void*)chronicle_strerror();
+}
+
+static void queue_cqv5_threads(void **state) {
+    char* test_queuedir = unpack_test_data("cqv5-sample-input.tar.bz2", argv0);
+    assert_non_null(test_queuedir);
+
+    char* queuedir;
+    asprintf(&queuedir, "%s/qv5", test_queuedir);
+    queue_t* queue = chronicle_init(queuedir);
+    assert_non_null(queue);
+    chronicle_set_decoder(queue, &wire_parse_textonly, &free);
+    chronicle_set_encoder(queue, &wirepad_sizeof, &wirepad_write);
+    assert_int_equal(chronicle_open(queue), 0);
+
+    // tailers owned by their own threads race against two appending threads, one with
+    // its own appender and one on the shared appender, with a budget small enough that
+    // every fresh window evicts someone else's
+    chronicle_set_mapping_budget(1);
+    chronicle_cleanup(NULL);
+    worker_arg_t w[6];
+    pthread_t threads[6];
+    for (int i = 0; i < 6; i++) {
+        bzero(&w[i], sizeof(worker_arg_t));
+        w[i].queue = queue;
+        w[i].want = 4 + 2*50;
+        w[i].appends = 50;
+        w[i].own_appender = (i == 1);
+        pthread_create(&threads[i], NULL, i < 2 ? &append_worker : &tail_worker, &w[i]);
+    }
+    for (int i = 0; i < 6; i++) {
+        void* ret;
+        pthread_join(threads[i], &ret);
+        if (i < 2) assert_string_equal(ret, "queue is not valid");
+        else assert_int_equal(w[i].count, 4 + 2*50);
+    }
+    assert_string_equal(chronicle_strerror(), "queue is NULL");
+    // the appenders never handed out the same index twice
+    for (int i = 0; i < 50; i++) {
+        for (int j = 0; j < 50; j++) {
+            assert_int_not_equal(w[0].index[i], w[1].index[j]);
+        }
+        if (i > 0) assert_true(w[1].index[i] > w[1].index[i-1]);
+    }
+    chronicle_set_mapping_budget(0);
+
+    chronicle_cleanup(queue);
+
+    delete_test_data(test_queuedir);
+    free(queuedir);
+    free(test_queuedir);
+}
+
+static void queue_cqv5_reactor(void **state) {
+    char* test_queuedir = unpack_test_data("cqv5-sample-input.tar.bz2", argv0);
+    assert_non_null(test_queuedir);
+
+    char* queuedir;
+    asprintf(&queuedir, "%s/qv5", test_queuedir);
+    queue_t* queue = chronicle_init(queuedir);
+    assert_non_null(queue);
+    chronicle_set_decoder(queue, &wire_parse_textonly, &free);
+    assert_int_equal(chronicle_open(queue), 0);
+
+    // inline dispatch from the reactor thread
+    replayed_t r;
+    bzero(&r, sizeof(r));
+    tailer_t* tailer = chronicle_tailer(queue, &record_msg, &r, 0);
+    reactor_t* reactor = chronicle_reactor_init(RW_BACKOFF, -1);
+    chronicle_reactor_set_timing(reactor, 1);
+    assert_int_equal(chronicle_reactor_add(reactor, tailer), 0);
+    assert_int_equal(chronicle_reactor_start(reactor), 0);
+    while (__atomic_load_n(&r.n, __ATOMIC_SEQ_CST) < 4) usleep(1000);
+    usleep(50*1000); // long enough to back off into sleeping
+    chronicle_reactor_stop(reactor);
+
+    assert_string_equal("one", r.msg[0]);
+    assert_string_equal("three", r.msg[2]);
+    reactorstats_t stats;
+    chronicle_reactor_stats(reactor, &stats);
+    assert_true(stats.work_iterations >= 1);
+    assert_true(stats.iterations > stats.work_iterations);
+    assert_true(stats.sleeps > 0);
+    assert_true(stats.max_work_ns > 0);
+    chronicle_reactor_close(reactor);
+    for (int i = 0; i < r.n; i++) free(r.msg[i]);
+
+    // handoff: the reactor parses, we dispatch from this thread in order
+    bzero(&r, sizeof(r));
+    tailer_t* tailer2 = chronicle_tailer(queue, &record_msg, &r, 0);
+    reactor = chronicle_reactor_init(RW_BUSY_POLL, 0);
+    assert_int_not_equal(chronicle_reactor_set_handoff(reactor, 3), 0);
+    assert_int_equal(chronicle_reactor_set_handoff(reactor, 2), 0);
+    chronicle_reactor_add(reactor, tailer2);
+    assert_int_equal(chronicle_reactor_start(reactor), 0);
+    while (r.n < 4) {
+        chronicle_reactor_drain(reactor, 16);
+    }
+    chronicle_reactor_close(reactor);
+    assert_string_equal("one", r.msg[0]);
+    assert_string_equal("two", r.msg[1]);
+    assert_string_equal("three", r.msg[2]);
+    assert_int_equal(r.index[3], 0x4A0500000003);
+    for (int i = 0; i < r.n; i++) free(r.msg[i]);
+
+    // tailers are handed back as they were
+    chronicle_peek_tailer(tailer2);
+
+    // a full ring holds the tailer at the next message without blocking the reactor,
+    // and nothing is lost when it stops full
+    bzero(&r, sizeof(r));
+    tailer_t* tailer3 = chronicle_tailer(queue, &record_msg, &r, 0);
+    reactor = chronicle_reactor_init(RW_BACKOFF, -1);
+    assert_int_equal(chronicle_reactor_set_handoff(reactor, 2), 0);
+    chronicle_reactor_add(reactor, tailer3);
+    assert_int_equal(chronicle_reactor_start(reactor), 0);
+    for (int i = 0; i < 20; i++) {
+        chronicle_reactor_stats(reactor, &stats); // takes reactor->lock
+        usleep(1000);
+    }
+    chronicle_reactor_stop(reactor);
+    assert_int_equal(chronicle_reactor_drain(reactor, 16), 2);
+    assert_int_equal(chronicle_reactor_remove(reactor, tailer3), 0);
+    chronicle_peek_tailer(tailer3);
+    chronicle_reactor_close(reactor);
+    assert_int_equal(r.n, 4);
+    assert_string_equal("one", r.msg[0]);
+    assert_string_equal("three", r.msg[2]);
+    assert_int_equal(r.index[3], 0x4A0500000003);
+    for (int i = 0; i < r.n; i++) free(r.msg[i]);
+
+    chronicle_cleanup(queue);
+
+    delete_test_data(test_queuedir);
+    free(queuedir);
+    free(test_queuedir);
+}
+
+typedef struct {
+    int      total;
+    int      out_of_order;
+    int      last_seq[8];
+    uint64_t last_index;
+} keyed_t;
+
+// messages are "k<key>-<seq>", the sample data has no '-' and maps to key 0
+uint64_t key_of(void* ctx, COBJ msg) {
+    char* text = (char*)msg;
+    return text[0] == 'k' ? text[1] - '0' : 0;
+}
+
+int check_order(void* ctx, uint64_t index, COBJ msg) {
+    keyed_t* k = (keyed_t*)ctx;
+    char* text = (char*)msg;
+    if (text[0] == 'k') {
+        int key = text[1] - '0';
+        int seq = atoi(text + 3);
+        // a key is only ever running on one worker, so no atomics needed per key
+        if (seq != k->last_seq[key] + 1) __atomic_add_fetch(&k->out_of_order, 1, __ATOMIC_SEQ_CST);
+        k->last_seq[key] = seq;
+        usleep(seq % 7 == 0 ? 100 : 0);
+    }
+    __atomic_add_fetch(&k->total, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+static void queue_cqv5_pool(void **state) {
+    char* test_queuedir = unpack_test_data("cqv5-sample-input.tar.bz2", argv0);
+    assert_non_null(test_queuedir);
+
+    char* queuedir;
+    asprintf(&queuedir, "%s/qv5", test_queuedir);
+    queue_t* queue = chronicle_init(queuedir);
+    assert_non_null(queue);
+    chronicle_set_decoder(queue, &wire_parse_textonly, &free);
+    chronicle_set_encoder(queue, &wirepad_sizeof, &wirepad_write);
+    assert_int_equal(chronicle_open(queue), 0);
+
+    wirepad_t* pad = wirepad_init(64);
+    uint64_t last = 0;
+    for (int i = 1; i <= 200; i++) {
+        char text[16];
+        sprintf(text, "k%d-%d", i % 8, (i + 7) / 8);
+        wirepad_clear(pad);
+        wirepad_text(pad, text);
+        last = chronicle_append_ts(queue, pad, 1637267400000L);
+    }
+    wirepad_free(pad);
+
+    keyed_t k;
+    bzero(&k, sizeof(k));
+    tailer_t* tailer = chronicle_tailer(queue, &check_order, &k, 0);
+    assert_null(chronicle_pool_init(tailer, 4, 6, &key_of, NULL));
+    pool_t* pool = chronicle_pool_init(tailer, 4, 8, &key_of, NULL);
+    assert_non_null(pool);
+
+    while (chronicle_tailer_index(tailer) <= last) {
+        chronicle_peek_tailer(tailer);
+    }
+    while (chronicle_pool_watermark(pool) != last) usleep(1000);
+    assert_int_equal(k.total, 204);
+    assert_int_equal(k.out_of_order, 0);
+    uint64_t processed = 0;
+    for (int i = 0; i < 4; i++) processed += chronicle_pool_processed(pool, i);
+    assert_int_equal(processed, 204);
+    chronicle_pool_close(pool);
+
+    chronicle_cleanup(queue);
+
+    delete_test_data(test_queuedir);
+    free(queuedir);
+    free(test_queuedir);
+}
+
 void* parse_cqv4_textonly(unsigned char* base, int lim) {
     char* text_result = strndup((const char*) base, lim);
     return text_result;
@@ -274,6 +1180,213 @@ static void queue_init_rollscheme(void **state) {
     chronicle_cleanup(queue);
 }
 
+static void queue_cqv5_numa(void **state) {
+    char* test_queuedir = unpack_test_data("cqv5-sample-input.tar.bz2", argv0);
+    assert_non_null(test_queuedir);
+
+    char* queuedir;
+    asprintf(&queuedir, "%s/qv5", test_queuedir);
+    queue_t* queue = chronicle_init(queuedir);
+    assert_non_null(queue);
+    chronicle_set_decoder(queue, &wire_parse_textonly, &free);
+    chronicle_set_encoder(queue, &wirepad_sizeof, &wirepad_write);
+
+    assert_int_equal(chronicle_get_numa_node(queue), -1);
+    assert_int_equal(chronicle_set_numa_node(queue, 4096), -1);
+    assert_string_equal(chronicle_strerror(), "no such numa node");
+    int node = chronicle_numa_node_of_cpu(0);
+    if (node >= 0) {
+        // placement is advisory, but queue access must be unaffected
+        assert_int_equal(chronicle_set_numa_node(queue, node), 0);
+        assert_int_equal(chronicle_get_numa_node(queue), node);
+    }
+    assert_int_equal(chronicle_open(queue), 0);
+
+    wirepad_t* pad = wirepad_init(64);
+    wirepad_text(pad, "four");
+    uint64_t last = chronicle_append_ts(queue, pad, 1637267400000L);
+    wirepad_free(pad);
+
+    worker_arg_t w;
+    bzero(&w, sizeof(w));
+    tailer_t* tailer = chronicle_tailer(queue, &count_msg, &w, 0);
+    while (chronicle_tailer_index(tailer) <= last) {
+        chronicle_peek_tailer(tailer);
+    }
+    assert_int_equal(w.count, 5);
+    chronicle_tailer_close(tailer);
+
+    chronicle_cleanup(queue);
+
+    delete_test_data(test_queuedir);
+    free(test_queuedir);
+    free(queuedir);
+}
+
+// encoder for a writer that dies between taking the working header and publishing
+void write_and_die(unsigned char* base, COBJ msg, size_t sz) {
+    memcpy(base, "partial", 7);
+    _exit(0);
+}
+
+// a payload far longer than a reader's window, cut off by the writer's death
+size_t three_blocks(COBJ msg) {
+    return 3*1024*1024;
+}
+
+void write_long_and_die(unsigned char* base, COBJ msg, size_t sz) {
+    memset(base, 0x01, sz - 16); // read as headers, entries of 16MB
+    _exit(0);
+}
+
+static queue_t* dead_queue;
+
+static void* append_five(void* arg) {
+    wirepad_t* pad = wirepad_init(64);
+    wirepad_text(pad, "five");
+    *(uint64_t*)arg = chronicle_append_ts(dead_queue, pad, 1637267400000L);
+    wirepad_free(pad);
+    return NULL;
+}
+
+static void queue_cqv5_dead_writer(void **state) {
+    char* test_queuedir = unpack_test_data("cqv5-sample-input.tar.bz2", argv0);
+    assert_non_null(test_queuedir);
+
+    char* queuedir;
+    asprintf(&queuedir, "%s/qv5", test_queuedir);
+
+    pid_t child = fork();
+    assert_true(child >= 0);
+    if (child == 0) {
+        queue_t* queue = chronicle_init(queuedir);
+        chronicle_set_encoder(queue, &wirepad_sizeof, &write_and_die);
+        if (chronicle_open(queue) != 0) _exit(1);
+        wirepad_t* pad = wirepad_init(64);
+        wirepad_text(pad, "never published");
+        chronicle_append_ts(queue, pad, 1637267400000L);
+        _exit(2);
+    }
+    int status;
+    assert_int_equal(waitpid(child, &status, 0), child);
+    assert_true(WIFEXITED(status));
+    assert_int_equal(WEXITSTATUS(status), 0);
+
+    queue_t* queue = chronicle_init(queuedir);
+    assert_non_null(queue);
+    chronicle_set_decoder(queue, &wire_parse_textonly, &free);
+    chronicle_set_encoder(queue, &wirepad_sizeof, &wirepad_write);
+    assert_int_equal(chronicle_open(queue), 0);
+    chronicle_set_recovery_timeout(queue, 10);
+
+    // the dead writer's entry stalls tailers
+    worker_arg_t w;
+    bzero(&w, sizeof(w));
+    tailer_t* tailer = chronicle_tailer(queue, &count_msg, &w, 0);
+    assert_int_equal(chronicle_peek_tailer(tailer), TS_BUSY);
+    assert_int_equal(w.count, 4);
+
+    // the dead writer registered, but without its registration the entry is not
+    // provably ours and the appender waits
+    char* pattern;
+    asprintf(&pattern, "%s/.chronicle-writer.%d.*", queuedir, child);
+    glob_t g;
+    assert_int_equal(glob(pattern, 0, NULL, &g), 0);
+    assert_int_equal(g.gl_pathc, 1);
+    char* hidden;
+    asprintf(&hidden, "%s/hidden-writer", queuedir);
+    assert_int_equal(rename(g.gl_pathv[0], hidden), 0);
+    assert_int_equal(chronicle_writer_dead(queue, child), -1);
+
+    uint64_t last = 0;
+    pthread_t appending;
+    dead_queue = queue;
+    assert_int_equal(pthread_create(&appending, NULL, &append_five, &last), 0);
+    usleep(200*1000);
+    assert_int_equal(chronicle_get_recoveries(queue), 0);
+    assert_int_equal(chronicle_writer_dead(queue, getpid()), 0);
+
+    assert_int_equal(rename(hidden, g.gl_pathv[0]), 0);
+    assert_int_equal(chronicle_writer_dead(queue, child), 1);
+    assert_int_equal(pthread_join(appending, NULL), 0);
+    assert_int_equal(chronicle_get_recoveries(queue), 1);
+    globfree(&g);
+    free(hidden);
+    free(pattern);
+
+    // the recovered entry is padding, so carries no index
+    while (chronicle_tailer_index(tailer) <= last) {
+        chronicle_peek_tailer(tailer);
+    }
+    assert_int_equal(w.count, 5);
+    collected_t result;
+    tailer_t* from_end = chronicle_tailer_from_end(queue, NULL, NULL, 1);
+    assert_string_equal((char*)chronicle_collect(from_end, &result), "five");
+    assert_int_equal(result.index, last);
+    chronicle_return(from_end, &result);
+    chronicle_tailer_close(from_end);
+    chronicle_tailer_close(tailer);
+
+    chronicle_cleanup(queue);
+
+    delete_test_data(test_queuedir);
+    free(test_queuedir);
+    free(queuedir);
+}
+
+// recovery must pad the whole of a payload that runs past the appender's window, or
+// its tail would be read as entries
+static void queue_cqv5_dead_writer_long(void **state) {
+    char* test_queuedir = unpack_test_data("cqv5-sample-input.tar.bz2", argv0);
+    assert_non_null(test_queuedir);
+
+    char* queuedir;
+    asprintf(&queuedir, "%s/qv5", test_queuedir);
+
+    pid_t child = fork();
+    assert_true(child >= 0);
+    if (child == 0) {
+        queue_t* queue = chronicle_init(queuedir);
+        chronicle_set_encoder(queue, &three_blocks, &write_long_and_die);
+        if (chronicle_open(queue) != 0) _exit(1);
+        chronicle_append_ts(queue, "", 1637267400000L);
+        _exit(2);
+    }
+    int status;
+    assert_int_equal(waitpid(child, &status, 0), child);
+    assert_true(WIFEXITED(status));
+    assert_int_equal(WEXITSTATUS(status), 0);
+
+    queue_t* queue = chronicle_init(queuedir);
+    assert_non_null(queue);
+    chronicle_set_decoder(queue, &wire_parse_textonly, &free);
+    chronicle_set_encoder(queue, &wirepad_sizeof, &wirepad_write);
+    assert_int_equal(chronicle_open(queue), 0);
+    chronicle_set_recovery_timeout(queue, 10);
+
+    uint64_t last = 0;
+    dead_queue = queue;
+    append_five(&last);
+    assert_int_equal(chronicle_get_recoveries(queue), 1);
+    assert_int_equal(last, 0x4A0500000004);
+
+    worker_arg_t w;
+    bzero(&w, sizeof(w));
+    tailer_t* tailer = chronicle_tailer(queue, &count_msg, &w, 0);
+    while (chronicle_tailer_index(tailer) <= last) {
+        assert_int_not_equal(chronicle_peek_tailer(tailer), TS_BUSY);
+    }
+    assert_int_equal(w.count, 5);
+    assert_int_equal(chronicle_peek_tailer(tailer), TS_AWAITING_ENTRY);
+    chronicle_tailer_close(tailer);
+
+    chronicle_cleanup(queue);
+
+    delete_test_data(test_queuedir);
+    free(test_queuedir);
+    free(queuedir);
+}
+
 static void queue_cqv5_new_queue(void **state) {
 
     // create queue in an empty directory
@@ -321,6 +1434,74 @@ static void queue_cqv5_new_queue(void **state) {
     free(temp_dir);
 }
 
+// another thread can neither commit nor abort our reservation
+static void* commit_other(void* arg) {
+    queue_t* queue = (queue_t*)arg;
+    chronicle_abort(queue);
+    return (void*)(intptr_t)chronicle_commit(queue, 8);
+}
+
+static void queue_cqv5_reserve_commit(void **state) {
+    char* temp_dir;
+    asprintf(&temp_dir, "%s/chronicle.test.XXXXXX", P_tmpdir);
+    temp_dir = mkdtemp(temp_dir);
+    queue_t* queue = chronicle_init(temp_dir);
+    assert_non_null(queue);
+    chronicle_set_version(queue, 5);
+    chronicle_set_roll_scheme(queue, "DAILY");
+    chronicle_set_decoder(queue, &wire_parse_textonly, &free);
+    chronicle_set_encoder(queue, &wirepad_sizeof, &wirepad_write);
+    chronicle_set_create(queue, 1);
+    assert_int_equal(chronicle_open(queue), 0);
+
+    assert_int_equal(chronicle_commit(queue, 8), -1);
+    assert_string_equal(chronicle_strerror(), "nothing reserved");
+
+    // encode straight into the queue, committing less than reserved
+    unsigned char* buf = chronicle_reserve(queue, 64);
+    assert_non_null(buf);
+    wirepad_t* pad = wirepad_wrap(NULL, buf, 64);
+    wirepad_text(pad, "zero copy");
+    assert_false(wirepad_overflow(pad));
+    assert_int_equal(chronicle_commit(queue, 65), -1);
+    assert_string_equal(chronicle_strerror(), "commit exceeds reservation");
+    pthread_t other;
+    void* rc;
+    assert_int_equal(pthread_create(&other, NULL, &commit_other, queue), 0);
+    assert_int_equal(pthread_join(other, &rc), 0);
+    assert_int_equal((intptr_t)rc, -1);
+    uint64_t first = chronicle_commit(queue, wirepad_sizeof(pad));
+
+    // an aborted reservation leaves nothing behind, the next append takes its place
+    buf = chronicle_reserve(queue, 64);
+    assert_non_null(buf);
+    wirepad_wrap(pad, buf, 64);
+    wirepad_text(pad, "discarded");
+    chronicle_abort(queue);
+
+    wirepad_t* copied = wirepad_init(64);
+    wirepad_text(copied, "copied");
+    uint64_t second = chronicle_append(queue, copied);
+    wirepad_free(copied);
+    assert_int_equal(second, first + 1);
+
+    collected_t result;
+    tailer_t* tailer = chronicle_tailer(queue, NULL, NULL, first);
+    assert_string_equal((char*)chronicle_collect(tailer, &result), "zero copy");
+    assert_int_equal(result.index, first);
+    chronicle_return(tailer, &result);
+    assert_string_equal((char*)chronicle_collect(tailer, &result), "copied");
+    assert_int_equal(result.index, second);
+    chronicle_return(tailer, &result);
+    assert_int_equal(chronicle_peek_tailer(tailer), TS_AWAITING_ENTRY);
+    chronicle_tailer_close(tailer);
+
+    wirepad_free(pad);
+    chronicle_cleanup(queue);
+    delete_test_data(temp_dir);
+    free(temp_dir);
+}
+
 static void queue_cqv5_new_test4_queue_nodata(void **state) {
     // create queue in an empty directory
     char* temp_dir;
@@ -358,7 +1539,24 @@ int main(int argc, char* argv[]) {
         cmocka_unit_test(queue_init_rollscheme),
         cmocka_unit_test(queue_cqv4_sample_input),
         cmocka_unit_test(queue_cqv5_sample_input),
+        cmocka_unit_test(queue_cqv5_shared_tailers),
+        cmocka_unit_test(queue_cqv5_mapping_budget),
+        cmocka_unit_test(queue_cqv5_mapping_budget_busy),
+        cmocka_unit_test(queue_cqv5_dirlist_resized),
+        cmocka_unit_test(queue_cqv5_replay_tailer),
+        cmocka_unit_test(queue_cqv5_replay_parallel),
+        cmocka_unit_test(queue_cqv5_replay_indexed),
+        cmocka_unit_test(queue_cqv5_reverse),
+        cmocka_unit_test(queue_cqv5_reverse_indexed),
+        cmocka_unit_test(queue_cqv5_filter),
+        cmocka_unit_test(queue_cqv5_threads),
+        cmocka_unit_test(queue_cqv5_reactor),
+        cmocka_unit_test(queue_cqv5_pool),
+        cmocka_unit_test(queue_cqv5_numa),
+        cmocka_unit_test(queue_cqv5_dead_writer),
+        cmocka_unit_test(queue_cqv5_dead_writer_long),
         cmocka_unit_test(queue_cqv5_new_queue),
+        cmocka_unit_test(queue_cqv5_reserve_commit),
         cmocka_unit_test(queue_cqv5_new_test4_queue_nodata),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
@@ -7,8 +7,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
 
 #include <wire.h>
+#include <buffer.h>
 
 void handle_text(char* buf, int sz, char* data, int dsz, wirecallbacks_t* cbs) {
     int* res = (int*)cbs->userdata;
@@ -72,6 +74,41 @@ static void test_wirepad_fields(void **state) {
 };
 
 
+static void test_wirepad_wrap(void **state) {
+    // same encoding as test_wirepad_fields, written into caller memory
+    unsigned char buf[64];
+    memset(buf, 0xAA, sizeof(buf));
+    wirepad_t* pad = wirepad_wrap(NULL, buf, 0x38);
+    wirepad_field_text(pad,    "message", "Hello World");
+    wirepad_field_varint(pad,  "number",  1234567890L);
+    wirepad_field_enum(pad,    "code",    "SECONDS");
+    wirepad_field_float64(pad, "price",   10.50);
+    assert_false(wirepad_overflow(pad));
+    assert_true(wirepad_base(pad) == buf);
+    assert_int_equal(wirepad_sizeof(pad), 0x38);
+    assert_int_equal(buf[0], 0xc7);
+    assert_int_equal(buf[0x37], 0x41);
+
+    // no room for more, the write is dropped rather than reallocating
+    wirepad_field_varint(pad, "more", 1);
+    assert_true(wirepad_overflow(pad));
+    assert_int_equal(wirepad_sizeof(pad), 0x38);
+    assert_int_equal(buf[0x38], 0xAA);
+
+    wirepad_clear(pad);
+    assert_false(wirepad_overflow(pad));
+    assert_int_equal(wirepad_sizeof(pad), 0);
+
+    // retargeting an allocating pad releases its own buffer
+    wirepad_t* owned = wirepad_init(16);
+    assert_true(wirepad_wrap(owned, buf, sizeof(buf)) == owned);
+    wirepad_text(owned, "hello");
+    assert_int_equal(buf[0], 0xe5);
+
+    wirepad_free(owned);
+    wirepad_free(pad);
+}
+
 static void test_wirepad_metadata(void **state) {
     wire_trace = 0;
     // extract of the data written to metadata.cq4t (v5) up to the last non-zero byte
@@ -183,11 +220,513 @@ static void test_wirepad_metadata(void **state) {
 
 }
 
+#define PRICE_FIELDS(X, s) \
+    X(s, message, "message", WF_TEXT)    \
+    X(s, number,  "number",  WF_INT64)   \
+    X(s, price,   "price",   WF_FLOAT64) \
+    X(s, num,     "num",     WF_INT64)   \
+    X(s, lock,    "chronicle.write.lock", WF_PTR) \
+    X(s, last,    "chronicle.write.last", WF_INT64)
+WIRE_SCHEMA(price, PRICE_FIELDS)
+
+static void test_wire_schema(void **state) {
+    wirepad_t* pad = wirepad_init(1024);
+    wirepad_field_text(pad,    "message", "Hello World");
+    wirepad_field_varint(pad,  "number",  1234567890L);
+    wirepad_field_enum(pad,    "code",    "SECONDS");
+    wirepad_field_float64(pad, "price",   10.50);
+
+    price_t p;
+    bzero(&p, sizeof(p));
+    assert_int_equal(wire_schema_decode(&price_schema, wirepad_base(pad), wirepad_sizeof(pad), &p), 0);
+    assert_true(WIRE_HAS(p, price, message));
+    assert_int_equal(p.message.sz, 11);
+    assert_memory_equal(p.message.text, "Hello World", 11);
+    assert_true(WIRE_HAS(p, price, number));
+    assert_int_equal(p.number, 1234567890L);
+    assert_true(WIRE_HAS(p, price, price));
+    assert_true(p.price == 10.5);
+    // names match whole, "num" is not a prefix match for "number"
+    assert_false(WIRE_HAS(p, price, num));
+    assert_false(WIRE_HAS(p, price, lock));
+
+    // event names key the value that follows, pointers address it in place
+    wirepad_clear(pad);
+    wirepad_qc_start(pad, 0);
+    wirepad_event_name(pad, "chronicle.write.lock");
+    wirepad_uint64_aligned(pad, 42);
+    wirepad_qc_finish(pad);
+    assert_int_equal(wire_schema_decode(&price_schema, wirepad_base(pad)+4, wirepad_sizeof(pad)-4, &p), 0);
+    assert_true(WIRE_HAS(p, price, lock));
+    assert_true(WIRE_HAS(p, price, number)); // kept from the first message
+    uint64_t v;
+    memcpy(&v, p.lock, sizeof(v));
+    assert_int_equal(v, 42);
+    assert_int_equal((p.lock - wirepad_base(pad)) % 8, 0);
+
+    // unknown control codes stop the decode
+    unsigned char bad[] = {0xC3, 'n', 'u', 'm', 0x05, 0x87, 0xC6, 'n', 'u', 'm', 'b', 'e', 'r', 0x01};
+    bzero(&p, sizeof(p));
+    assert_int_equal(wire_schema_decode(&price_schema, bad, sizeof(bad), &p), -1);
+    assert_true(WIRE_HAS(p, price, num));
+    assert_int_equal(p.num, 5);
+    assert_false(WIRE_HAS(p, price, number));
+
+    // nested blocks without a schema name are skipped unvisited, values of a code the
+    // field type does not take are ignored
+    unsigned char nested[] = {
+        0xC2, 'z', 'z', 0x82, 0x04, 0x00, 0x00, 0x00, 0xC1, 'q', 0x87, 0x00,
+        0xC2, 'y', 'y', 0x82, 0x05, 0x00, 0x00, 0x00, 0xC3, 'n', 'u', 'm', 0x07,
+        0xC5, 'p', 'r', 'i', 'c', 'e', 0xE3, 't', 'e', 'n',
+        0xC6, 'n', 'u', 'm', 'b', 'e', 'r', 0xB1};
+    bzero(&p, sizeof(p));
+    assert_int_equal(wire_schema_decode(&price_schema, nested, sizeof(nested), &p), 0);
+    assert_true(WIRE_HAS(p, price, num));
+    assert_int_equal(p.num, 7);
+    assert_false(WIRE_HAS(p, price, price));
+    assert_true(WIRE_HAS(p, price, number));
+    assert_int_equal(p.number, 1);
+
+    // keys sharing size and first 8 bytes, out of declaration order
+    wirepad_clear(pad);
+    wirepad_field_varint(pad, "chronicle.write.last", 9);
+    wirepad_field_varint(pad, "num", 300);
+    wirepad_field_varint(pad, "price", 12);
+    bzero(&p, sizeof(p));
+    assert_int_equal(wire_schema_decode(&price_schema, wirepad_base(pad), wirepad_sizeof(pad), &p), 0);
+    assert_true(WIRE_HAS(p, price, last));
+    assert_int_equal(p.last, 9);
+    assert_false(WIRE_HAS(p, price, lock));
+    assert_int_equal(p.num, 300);
+    assert_true(p.price == 12.0);
+
+    wirepad_free(pad);
+}
+
+static void test_wirecursor(void **state) {
+    // a nested event payload touching most codes, then a truncated INT64
+    unsigned char msg[] =
+        "\xb9\x02\x65\x76\x82\x76\x00\x00\x00\xc1\x61\xa4\xfb\xc1\x62\xae"
+        "\x80\x00\xc1\x42\xae\xac\x02\xc1\x63\x91\x00\x00\x00\x00\x00\x00"
+        "\x0a\x40\xc1\x64\x92\xb9\x60\xc1\x65\xb1\xc1\x66\xbb\xc3\x73\x65"
+        "\x71\x80\x04\x01\x02\xe1\x78\xc1\x75\x9f\x00\x01\x02\x03\x04\x05"
+        "\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f\xba\x07\xa5\xff\xff\xc1"
+        "\x74\xb3\x0a\x32\x30\x32\x31\x2d\x31\x31\x2d\x31\x38\xc5\x62\x79"
+        "\x74\x65\x73\x80\x04\x8a\x01\x02\x03\xbe\x02\x63\x63\xc1\x67\xb6"
+        "\x03\x46\x6f\x6f\xe2\x68\x69\xb7\x05\x6e\xc3\xa9\x6f\x6e\x01\x8f"
+        "\x8f\xc1\x7a\x7f\xa7\x01\x02\x03";
+    wirecursor_t c;
+    wireitem_t it;
+    wirecursor_init(&c, msg, sizeof(msg)-1);
+
+    assert_int_equal(wirecursor_next(&c, &it), WK_NEST_BEGIN);
+    assert_true(it.event);
+    assert_memory_equal(it.name, "ev", 2);
+    assert_int_equal(it.v.bytes.sz, 0x76);
+
+    assert_int_equal(wirecursor_next(&c, &it), WK_INT);
+    assert_int_equal(it.depth, 1);
+    assert_memory_equal(it.name, "a", 1);
+    assert_int_equal(it.v.i64, -5);
+    assert_int_equal(wirecursor_next(&c, &it), WK_INT);
+    assert_int_equal(it.v.i64, -1); // stop bit, negative
+    assert_int_equal(wirecursor_next(&c, &it), WK_INT);
+    assert_int_equal(it.v.i64, 300);
+    assert_int_equal(wirecursor_next(&c, &it), WK_FLOAT);
+    assert_true(it.v.f64 == 3.25);
+    assert_int_equal(wirecursor_next(&c, &it), WK_FLOAT);
+    assert_true(it.v.f64 > 123.449 && it.v.f64 < 123.451);
+    assert_int_equal(wirecursor_next(&c, &it), WK_BOOL);
+    assert_int_equal(it.v.i64, 1);
+    assert_int_equal(wirecursor_next(&c, &it), WK_NULL);
+    assert_memory_equal(it.name, "f", 1);
+
+    // sequence items have no key
+    assert_int_equal(wirecursor_next(&c, &it), WK_NEST_BEGIN);
+    assert_memory_equal(it.name, "seq", 3);
+    assert_int_equal(wirecursor_next(&c, &it), WK_INT);
+    assert_null(it.name);
+    assert_int_equal(it.depth, 2);
+    assert_int_equal(wirecursor_next(&c, &it), WK_INT);
+    assert_int_equal(it.v.i64, 2);
+    assert_int_equal(wirecursor_next(&c, &it), WK_TEXT);
+    assert_null(it.name);
+    assert_memory_equal(it.v.text.text, "x", 1);
+    assert_int_equal(wirecursor_next(&c, &it), WK_NEST_END);
+    assert_int_equal(it.depth, 1);
+
+    assert_int_equal(wirecursor_next(&c, &it), WK_UUID);
+    assert_int_equal(it.v.bytes.data[15], 15);
+    assert_int_equal(wirecursor_next(&c, &it), WK_INT);
+    assert_null(it.name);
+    assert_int_equal(it.field_number, 7);
+    assert_int_equal(it.v.i64, -1);
+    assert_int_equal(wirecursor_next(&c, &it), WK_DATE);
+    assert_int_equal(it.v.text.sz, 10);
+    assert_memory_equal(it.v.text.text, "2021-11-18", 10);
+    assert_int_equal(wirecursor_next(&c, &it), WK_BYTES);
+    assert_memory_equal(it.name, "bytes", 5);
+    assert_int_equal(it.v.bytes.sz, 3);
+    assert_int_equal(it.v.bytes.data[2], 3);
+    // comment skipped, type prefix carried with the value
+    assert_int_equal(wirecursor_next(&c, &it), WK_TEXT);
+    assert_memory_equal(it.name, "g", 1);
+    assert_int_equal(it.type_sz, 3);
+    assert_memory_equal(it.type, "Foo", 3);
+    assert_memory_equal(it.v.text.text, "hi", 2);
+    assert_int_equal(wirecursor_next(&c, &it), WK_INT);
+    assert_int_equal(it.name_sz, 5);
+    assert_memory_equal(it.name, "n\xc3\xa9on", 5);
+    assert_int_equal(wirecursor_next(&c, &it), WK_NEST_END);
+
+    assert_int_equal(wirecursor_next(&c, &it), WK_INT);
+    assert_int_equal(it.depth, 0);
+    assert_memory_equal(it.name, "z", 1);
+    assert_int_equal(it.v.i64, 0x7F);
+    assert_int_equal(wirecursor_next(&c, &it), WK_ERROR);
+    assert_int_equal(wirecursor_next(&c, &it), WK_ERROR);
+
+    // skip a nested block whole
+    wirecursor_init(&c, msg, sizeof(msg)-5);
+    assert_int_equal(wirecursor_next(&c, &it), WK_NEST_BEGIN);
+    wirecursor_skip(&c);
+    assert_int_equal(wirecursor_next(&c, &it), WK_INT);
+    assert_memory_equal(it.name, "z", 1);
+    assert_int_equal(wirecursor_next(&c, &it), WK_END);
+}
+
+#define TRADE_FIELDS(X, s) \
+    X(s, sym,   "sym",   WF_TEXT)    \
+    X(s, size,  "size",  WF_INT64)   \
+    X(s, price, "price", WF_FLOAT64)
+WIRE_SCHEMA(trade, TRADE_FIELDS)
+
+typedef struct {
+    int     batches;
+    int     rows;
+    int64_t size_sum;
+    double  price_sum;
+    int     nulls;
+    char    syms[64];
+} trade_totals_t;
+
+void sum_trades(wirebatch_t* batch, void* ctx) {
+    trade_totals_t* t = (trade_totals_t*)ctx;
+    int64_t* size = wirebatch_column(batch, trade_size);
+    double* price = wirebatch_column(batch, trade_price);
+    int32_t* sym = wirebatch_column(batch, trade_sym);
+    t->batches++;
+    for (int i = 0; i < wirebatch_rows(batch); i++) {
+        assert_int_equal(wirebatch_index(batch)[i], 100 + t->rows);
+        t->rows++;
+        if (size[i] == INT64_MIN) {
+            t->nulls++;
+            assert_true(isnan(price[i]));
+            assert_int_equal(sym[i], 0);
+            continue;
+        }
+        t->size_sum += size[i];
+        t->price_sum += price[i];
+        strcat(t->syms, wirebatch_symbol(batch, sym[i], NULL));
+    }
+}
+
+void handle_text_sz(char* buf, int sz, char* data, int dsz, wirecallbacks_t* cbs) {
+    *(int*)cbs->userdata = dsz;
+}
+
+static void test_wire_stopbit(void **state) {
+    // each value decoded from a short buffer (byte loop) and a padded one (word path)
+    struct { unsigned char enc[10]; int n; int64_t v; } cases[] = {
+        {{0x00}, 1, 0},
+        {{0x7F}, 1, 127},
+        {{0x80, 0x01}, 2, 128},
+        {{0xFF, 0x7F}, 2, 16383},
+        {{0xFF, 0xFF, 0xFF, 0xFF, 0x07}, 5, 0x7FFFFFFF},
+        {{0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x7F}, 8, 0xFFFFFFFFFFFFFFLL},
+        {{0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01}, 9, 1LL << 56},
+        {{0x81, 0x00}, 2, ~1LL},
+    };
+    unsigned char buf[32];
+    for (int i = 0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+        int64_t v = -42;
+        memset(buf, 0xEE, sizeof(buf));
+        memcpy(buf, cases[i].enc, cases[i].n);
+        assert_int_equal(wire_read_stopbit(buf, buf + cases[i].n, &v), cases[i].n);
+        assert_true(v == cases[i].v);
+        assert_int_equal(wire_read_stopbit(buf, buf + sizeof(buf), &v), cases[i].n);
+        assert_true(v == cases[i].v);
+        assert_int_equal(wire_read_stopbit(buf, buf + cases[i].n - 1, &v), -1);
+    }
+
+    // long field names and text take a stop-bit length, read back by both parsers
+    char* name = malloc(200);
+    memset(name, 'n', 199);
+    name[199] = 0;
+    char* text = malloc(20000);
+    memset(text, 't', 19999);
+    text[19999] = 0;
+    wirepad_t* pad = wirepad_init(64);
+    wirepad_field_text(pad, name, text);
+    assert_int_equal(wirepad_sizeof(pad), 1+2+199 + 1+3+19999);
+
+    wirecursor_t c;
+    wireitem_t it;
+    wirecursor_init(&c, wirepad_base(pad), wirepad_sizeof(pad));
+    assert_int_equal(wirecursor_next(&c, &it), WK_TEXT);
+    assert_int_equal(it.name_sz, 199);
+    assert_int_equal(it.v.text.sz, 19999);
+    assert_int_equal(it.v.text.text[19998], 't');
+    assert_int_equal(wirecursor_next(&c, &it), WK_END);
+
+    int result = 0;
+    wirecallbacks_t hcbs;
+    bzero(&hcbs, sizeof(hcbs));
+    hcbs.field_char = &handle_text_sz;
+    hcbs.userdata = &result;
+    wirepad_parse(pad, &hcbs);
+    assert_int_equal(result, 19999);
+
+    wirepad_free(pad);
+    free(text);
+    free(name);
+}
+
+#define QUOTE_FIELDS(X, s) \
+    X(s, sym, "sym", WF_TEXT,    8) \
+    X(s, bid, "bid", WF_FLOAT64, 0) \
+    X(s, qty, "qty", WF_INT64,   0)
+WIRE_LAYOUT(quote, QUOTE_FIELDS)
+
+static void test_wire_layout(void **state) {
+    unsigned char buf[64];
+    quote_t q = { 0, {"VOD.L", 5}, 101.25, -3 };
+    assert_int_equal(quote_encode(buf, &q), sizeof(quote_wire_t));
+    assert_int_equal(sizeof(quote_wire_t), 4+1+1+8 + 4+1+8 + 4+1+8);
+
+    char* dump = formatbuf((char*)buf, sizeof(quote_wire_t));
+    assert_string_equal(dump,
+        "00000000 c3 73 79 6d b8 05 56 4f  44 2e 4c 8f 8f 8f c3 62 .sym..VO D.L....b\n"
+        "00000010 69 64 91 00 00 00 00 00  50 59 40 c3 71 74 79 a7 id...... PY@.qty.\n"
+        "00000020 fd ff ff ff ff ff ff ff                          ........         \n"
+    );
+    free(dump);
+
+    // the generic parsers read it as plain fields
+    wirecursor_t c;
+    wireitem_t it;
+    wirecursor_init(&c, buf, sizeof(quote_wire_t));
+    assert_int_equal(wirecursor_next(&c, &it), WK_TEXT);
+    assert_int_equal(it.v.text.sz, 5);
+    assert_int_equal(wirecursor_next(&c, &it), WK_FLOAT);
+    assert_true(it.v.f64 == 101.25);
+    assert_int_equal(wirecursor_next(&c, &it), WK_INT);
+    assert_int_equal(it.v.i64, -3);
+    assert_int_equal(wirecursor_next(&c, &it), WK_END);
+
+    quote_t d;
+    bzero(&d, sizeof(d));
+    assert_int_equal(quote_decode(buf, sizeof(quote_wire_t), &d), 0);
+    assert_int_equal(d.present, 7);
+    assert_int_equal(d.sym.sz, 5);
+    assert_memory_equal(d.sym.text, "VOD.L", 5);
+    assert_true(d.bid == 101.25);
+    assert_int_equal(d.qty, -3);
+
+    // a message in another shape falls back to the schema decoder
+    wirepad_t* pad = wirepad_init(64);
+    wirepad_field_varint(pad, "qty", 7);
+    wirepad_field_text(pad, "sym", "BT.L");
+    bzero(&d, sizeof(d));
+    assert_int_equal(quote_decode(wirepad_base(pad), wirepad_sizeof(pad), &d), 0);
+    assert_true(WIRE_HAS(d, quote, qty) && WIRE_HAS(d, quote, sym) && !WIRE_HAS(d, quote, bid));
+    assert_int_equal(d.qty, 7);
+    assert_int_equal(d.sym.sz, 4);
+    wirepad_free(pad);
+
+    q.sym.text = "TOO.LONG.";
+    q.sym.sz = 9;
+    assert_int_equal(quote_encode(buf, &q), -1);
+}
+
+static void test_wire_i64_array(void **state) {
+    // an index page: ascending positions, then zeros
+    uint64_t capacity = 4096;
+    uint64_t* values = calloc(capacity, sizeof(uint64_t));
+    unsigned char* base = (unsigned char*)values;
+    assert_int_equal(wire_i64_used(base, capacity), 0);
+    for (uint64_t used = 1; used <= capacity; used += 37) {
+        memset(values, 0, capacity * sizeof(uint64_t));
+        for (uint64_t i = 0; i < used; i++) values[i] = 1000 + 64*i;
+        assert_int_equal(wire_i64_used(base, capacity), used);
+        assert_int_equal(wire_i64_used(base, used), used);
+
+        assert_int_equal(wire_i64_upper_bound(base, used, 999), 0);
+        assert_int_equal(wire_i64_upper_bound(base, used, 1000), 1);
+        assert_int_equal(wire_i64_upper_bound(base, used, 1063), 1);
+        assert_int_equal(wire_i64_upper_bound(base, used, 1000 + 64*(used-1)), used);
+        assert_int_equal(wire_i64_upper_bound(base, used, UINT64_MAX), used);
+        uint64_t mid = used / 2;
+        assert_int_equal(wire_i64_upper_bound(base, used, 1000 + 64*mid + 1), mid + 1);
+    }
+    // a zero before the last entry does not end the scan
+    memset(values, 0, capacity * sizeof(uint64_t));
+    values[100] = 1;
+    assert_int_equal(wire_i64_used(base, capacity), 101);
+    assert_int_equal(wire_i64_used(base + 8, 13), 0);
+    free(values);
+}
+
+typedef struct {
+    int     orders;
+    int64_t qty;
+    int     cancels;
+    int64_t cancelled;
+    int     other;
+} routed_t;
+
+int on_new_order(void* ctx, uint64_t index, wireitem_t* item, wirecursor_t* c) {
+    routed_t* r = (routed_t*)ctx;
+    assert_int_equal(item->kind, WK_NEST_BEGIN);
+    // read one field and leave the rest for the router to skip
+    wireitem_t f;
+    assert_int_equal(wirecursor_next(c, &f), WK_INT);
+    assert_int_equal(f.name_sz, 3);
+    r->qty += f.v.i64;
+    r->orders++;
+    return 0;
+}
+
+int on_cancel(void* ctx, uint64_t index, wireitem_t* item, wirecursor_t* c) {
+    routed_t* r = (routed_t*)ctx;
+    assert_int_equal(item->kind, WK_INT);
+    r->cancelled += item->v.i64;
+    r->cancels++;
+    return index == 99 ? 7 : 0;
+}
+
+int on_other(void* ctx, uint64_t index, wireitem_t* item, wirecursor_t* c) {
+    ((routed_t*)ctx)->other++;
+    return 0;
+}
+
+static void test_wirerouter(void **state) {
+    routed_t r;
+    bzero(&r, sizeof(r));
+    wirerouter_t* router = wirerouter_init();
+    assert_int_equal(wirerouter_add(router, "newOrder", &on_new_order, &r), 0);
+    assert_int_equal(wirerouter_add(router, "cancel", &on_cancel, &r), 0);
+    // plenty of other names, all placed without collisions
+    char name[32];
+    for (int i = 0; i < 300; i++) {
+        sprintf(name, "event%d", i);
+        assert_int_equal(wirerouter_add(router, name, &on_other, &r), 0);
+    }
+
+    // two calls in one message: newOrder({qty: 100, sym: VOD.L}) then cancel(12)
+    wirepad_t* pad = wirepad_init(128);
+    wirepad_event_name(pad, "newOrder");
+    wirepad_nest_enter(pad);
+    wirepad_field_varint(pad, "qty", 100);
+    wirepad_field_text(pad, "sym", "VOD.L");
+    wirepad_nest_exit(pad);
+    wirepad_event_name(pad, "cancel");
+    wirepad_varint(pad, 12);
+    wirepad_event_name(pad, "event250");
+    wirepad_varint(pad, 1);
+    wirepad_event_name(pad, "unknown");
+    wirepad_varint(pad, 1);
+
+    assert_int_equal(wirerouter_route(router, wirepad_base(pad), wirepad_sizeof(pad), 1), 0);
+    assert_int_equal(r.orders, 1);
+    assert_int_equal(r.qty, 100);
+    assert_int_equal(r.cancels, 1);
+    assert_int_equal(r.cancelled, 12);
+    assert_int_equal(r.other, 1);
+    assert_int_equal(wirerouter_unrouted(router), 1);
+
+    // unrouted events go to the fallback, and a handler can stop routing
+    wirerouter_set_fallback(router, &on_other, &r);
+    assert_int_equal(wirerouter_route(router, wirepad_base(pad), wirepad_sizeof(pad), 99), 7);
+    assert_int_equal(r.orders, 2);
+    assert_int_equal(r.cancels, 2);
+    assert_int_equal(r.other, 1);
+    assert_int_equal(wirerouter_route(router, wirepad_base(pad), wirepad_sizeof(pad), 2), 0);
+    assert_int_equal(r.other, 3);
+    assert_int_equal(wirerouter_unrouted(router), 2);
+
+    wirepad_free(pad);
+    wirerouter_free(router);
+}
+
+static void test_wirebatch(void **state) {
+    trade_totals_t totals;
+    bzero(&totals, sizeof(totals));
+    wirebatch_t* batch = wirebatch_init(&trade_schema, 2, &sum_trades, &totals);
+    assert_non_null(batch);
+
+    char* syms[] = {"AB", "CD", "AB", "EF", "CD"};
+    wirepad_t* pad = wirepad_init(64);
+    for (int i = 0; i < 5; i++) {
+        wirepad_clear(pad);
+        wirepad_field_text(pad, "sym", syms[i]);
+        wirepad_field_varint(pad, "size", 100 * (i + 1));
+        wirepad_field_float64(pad, "price", 10.5 + i);
+        // through the tailer integration: view parser then dispatcher
+        wirebatch_dispatch(batch, 100 + i, wire_parse_view(wirepad_base(pad), wirepad_sizeof(pad)));
+    }
+    // a message without our fields becomes a row of nulls
+    wirepad_clear(pad);
+    wirepad_text(pad, "hello");
+    assert_int_equal(wirebatch_add(batch, wirepad_base(pad), wirepad_sizeof(pad), 105), 1);
+    wirepad_free(pad);
+
+    assert_int_equal(totals.batches, 3);
+    assert_int_equal(totals.rows, 6);
+    assert_int_equal(totals.nulls, 1);
+    assert_int_equal(totals.size_sum, 1500);
+    assert_true(totals.price_sum == 62.5);
+    assert_string_equal(totals.syms, "ABCDABEFCD");
+    // interned once each, plus the null symbol
+    assert_int_equal(wirebatch_symbols(batch), 4);
+    assert_int_equal(wirebatch_rows(batch), 0);
+    wirebatch_free(batch);
+
+    // symbol table growth, ids stay stable
+    batch = wirebatch_init(&trade_schema, 4096, NULL, NULL);
+    pad = wirepad_init(64);
+    for (int i = 0; i < 3000; i++) {
+        char sym[16];
+        sprintf(sym, "S%d", i % 1500);
+        wirepad_clear(pad);
+        wirepad_field_text(pad, "sym", sym);
+        assert_int_equal(wirebatch_add(batch, wirepad_base(pad), wirepad_sizeof(pad), i), 0);
+    }
+    wirepad_free(pad);
+    assert_int_equal(wirebatch_symbols(batch), 1501);
+    int32_t* sym = wirebatch_column(batch, trade_sym);
+    for (int i = 0; i < 1500; i++) {
+        assert_int_equal(sym[i], sym[i + 1500]);
+        char expect[16];
+        sprintf(expect, "S%d", i);
+        assert_string_equal(wirebatch_symbol(batch, sym[i], NULL), expect);
+    }
+    wirebatch_free(batch);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_wirepad_text),
         cmocka_unit_test(test_wirepad_fields),
+        cmocka_unit_test(test_wirepad_wrap),
         cmocka_unit_test(test_wirepad_metadata),
+        cmocka_unit_test(test_wire_schema),
+        cmocka_unit_test(test_wirecursor),
+        cmocka_unit_test(test_wire_stopbit),
+        cmocka_unit_test(test_wire_i64_array),
+        cmocka_unit_test(test_wire_layout),
+        cmocka_unit_test(test_wirerouter),
+        cmocka_unit_test(test_wirebatch),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
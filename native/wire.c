@@ -18,22 +18,71 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
 
 #include <wire.h>
 #include <buffer.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 // enables full printf tracing during parsing of wire data (slow)
 int wire_trace = 0;
 
 
-int read_stop_uint(unsigned char* p, int *stopsz) {
-    *stopsz = 0;
+// Java's stop-bit encoding: 7 bits per byte, low group first, high bit to continue.
+// A zero byte ending a multi-byte value marks a negative value, stored complemented.
+// Returns bytes read, or -1 if the value runs past end.
+//
+// Lengths under 128 take the first branch. Longer values are read as one 64-bit word
+// where the buffer allows: the first clear high bit gives the length, and the 7-bit
+// groups are packed together in three shift-and-mask steps rather than a loop.
+static inline int wire_stopbit(unsigned char* p, unsigned char* end, int64_t* v) {
+    if (p < end && p[0] < 0x80) {
+        *v = p[0];
+        return 1;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (end - p >= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        uint64_t stops = ~w & 0x8080808080808080ULL;
+        if (stops) {
+            int n = __builtin_ctzll(stops) / 8 + 1;
+            uint64_t x = w & 0x7F7F7F7F7F7F7F7FULL;
+            if (n < 8) x &= (1ULL << (8*n)) - 1;
+            x = (x & 0x007F007F007F007FULL) | ((x & 0x7F007F007F007F00ULL) >> 1);
+            x = (x & 0x00003FFF00003FFFULL) | ((x & 0x3FFF00003FFF0000ULL) >> 2);
+            x = (x & 0x000000000FFFFFFFULL) | ((x & 0x0FFFFFFF00000000ULL) >> 4);
+            *v = (p[n-1] == 0) ? (int64_t)~x : (int64_t)x;
+            return n;
+        }
+    }
+#endif
+    uint64_t l = 0;
     int n = 0;
+    uint8_t b;
     do {
+        if (p + n >= end || n == 10) return -1;
+        b = p[n];
+        l |= (uint64_t)(b & 0x7F) << (7*n);
         n++;
-        *stopsz = (*stopsz << 7) + (p[n-1] & 0x7F);
-    } while ((p[n-1] & 0x80) != 0x00);
-    // printf("stopsz %d bytes %d\n", *stopsz, n);
+    } while (b & 0x80);
+    *v = (b == 0 && n > 1) ? (int64_t)~l : (int64_t)l;
+    return n;
+}
+
+int wire_read_stopbit(unsigned char* p, unsigned char* end, int64_t* v) {
+    return wire_stopbit(p, end, v);
+}
+
+// a stop-bit length prefix that must fit before end, -1 if not
+static int read_stop_uint(unsigned char* p, unsigned char* end, int *stopsz) {
+    int64_t l;
+    int n = wire_stopbit(p, end, &l);
+    if (n < 0 || l < 0 || l > end - (p + n)) return -1;
+    *stopsz = l;
     return n;
 }
 
@@ -60,6 +109,7 @@ void wire_parse(unsigned char* base, int lim, wirecallbacks_t* cbs) {
     uint64_t padding64 = 0;
     uint64_t jlong2 = 0;
     float float32 = 0;
+    int n;
 
     // track nesting stack
     int nest = 0;
@@ -76,7 +126,12 @@ void wire_parse(unsigned char* base, int lim, wirecallbacks_t* cbs) {
                 if (cbs->field_uint64) cbs->field_uint64(field_name, field_name_sz, (uint64_t)control, cbs);
                 break;
             case 0xB9: // EVENT_NAME
-                p+= read_stop_uint(p, &ev_name_sz);
+                if ((n = read_stop_uint(p, base + lim, &ev_name_sz)) < 0) {
+                    printf("Aborted at %p (+%04lx) bad length\n", p-1, p-1-base);
+                    p = base + lim;
+                    break;
+                }
+                p += n;
                 ev_name = (char*)p;
                 field_name = (char*)p;
                 field_name_sz = ev_name_sz;
@@ -111,8 +166,10 @@ void wire_parse(unsigned char* base, int lim, wirecallbacks_t* cbs) {
                 // if (cbs->field_float) cbs->field_float(field_name, field_name_sz, float32, cbs);
                 p += 4;
                 break;
-            //case 0x91: // FLOAT64
-            //    break;
+            case 0x91: // FLOAT64
+                if (wire_trace) printf(" Field %.*s = (FLOAT64)\n", field_name_sz, field_name);
+                p += 8;
+                break;
             case 0xA5: // INT16
                 memcpy(&padding16, p, sizeof(padding16));
                 if (wire_trace) printf(" Field %.*s = %hu (uint16)\n", (int)field_name_sz, field_name, padding16);
@@ -133,7 +190,12 @@ void wire_parse(unsigned char* base, int lim, wirecallbacks_t* cbs) {
                 p += 8;
                 break;
             case 0xB6: // TYPE_PREFIX
-                p+= read_stop_uint(p, &type_name_sz);
+                if ((n = read_stop_uint(p, base + lim, &type_name_sz)) < 0) {
+                    printf("Aborted at %p (+%04lx) bad length\n", p-1, p-1-base);
+                    p = base + lim;
+                    break;
+                }
+                p += n;
                 type_name = (char*)p;
                 p += type_name_sz;
                 if (wire_trace) printf("Type prefix !%.*s\n", type_name_sz, type_name);
@@ -147,6 +209,15 @@ void wire_parse(unsigned char* base, int lim, wirecallbacks_t* cbs) {
                 // printf(" Field %.*s \n", field_name_sz, field_name);
                 p += field_name_sz;
                 break;
+            case 0xB7: // Field name any length
+                if ((n = read_stop_uint(p, base + lim, &field_name_sz)) < 0) {
+                    printf("Aborted at %p (+%04lx) bad length\n", p-1, p-1-base);
+                    p = base + lim;
+                    break;
+                }
+                field_name = (char*)p + n;
+                p += n + field_name_sz;
+                break;
             case 0xE0 ... 0xFF: // Text field value
                 field_text = (char*)p;
                 field_text_sz = control - 0xE0;
@@ -155,7 +226,12 @@ void wire_parse(unsigned char* base, int lim, wirecallbacks_t* cbs) {
                 p += field_text_sz;
                 break;
             case 0xB8: // Text any length
-                p+= read_stop_uint(p, &field_text_sz);
+                if ((n = read_stop_uint(p, base + lim, &field_text_sz)) < 0) {
+                    printf("Aborted at %p (+%04lx) bad length\n", p-1, p-1-base);
+                    p = base + lim;
+                    break;
+                }
+                p += n;
                 field_text = (char*)p;
                 if (wire_trace) printf(" Field %.*s = %.*s (text)\n", (int)field_name_sz, field_name, field_text_sz, field_text);
                 if (cbs->field_char) cbs->field_char(field_name, field_name_sz, field_text, field_text_sz, cbs);
@@ -174,6 +250,936 @@ void wire_parse(unsigned char* base, int lim, wirecallbacks_t* cbs) {
     }
 }
 
+static inline uint32_t wire_hash(const char* name, int sz) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (int i = 0; i < sz; i++) h = (h ^ (uint8_t)name[i]) * 16777619u;
+    return h;
+}
+
+// the key of a name as WIRE_KEY8 packs it, one load where the buffer allows
+static inline uint64_t wire_key8(const char* name, int sz, unsigned char* end) {
+    uint64_t key = 0;
+    if ((unsigned char*)name + 8 <= end) {
+        memcpy(&key, name, 8);
+        if (sz < 8) key &= (1ULL << (8*sz)) - 1;
+    } else {
+        memcpy(&key, name, sz < 8 ? sz : 8);
+    }
+    return key;
+}
+
+// field of a name, -1 if not in the schema. The hint, a field expected next, is tried
+// first, and sizes no field has are rejected by mask, so most keys cost one test.
+static inline int wire_schema_lookup(wireschema_t* schema, int hint, char* name, int sz, unsigned char* end) {
+    if (!(schema->sizes & WIRE_SIZE_BIT(sz))) return -1;
+    uint64_t key = wire_key8(name, sz, end);
+    if (hint < schema->nfields) {
+        const wirefield_t* field = &schema->fields[hint];
+        if (field->key == key && field->name_sz == sz && (sz <= 8 || memcmp(name + 8, field->name + 8, sz - 8) == 0))
+            return hint;
+    }
+    return schema->dispatch(name, sz, key);
+}
+
+void wirecursor_init(wirecursor_t* c, unsigned char* base, int lim) {
+    c->p = base;
+    c->end = base + lim;
+    c->depth = 0;
+    c->error = 0;
+}
+
+void wirecursor_skip(wirecursor_t* c) {
+    if (c->depth > 0) c->p = c->ends[--c->depth];
+}
+
+static inline uint64_t i64_at(unsigned char* values, uint64_t i) {
+    uint64_t v;
+    memcpy(&v, values + 8*i, sizeof(v));
+    return v;
+}
+
+// Index pages are zero-filled past the entries written. Scans back from the end a
+// block of eight values at a time, OR-ing them together to skip zero blocks.
+uint64_t wire_i64_used(unsigned char* values, uint64_t capacity) {
+    uint64_t n = capacity;
+    while (n & 7) {
+        if (i64_at(values, n-1) != 0) return n;
+        n--;
+    }
+    while (n > 0) {
+        unsigned char* b = values + 8*(n-8);
+#ifdef __SSE2__
+        __m128i x = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((__m128i*)b),      _mm_loadu_si128((__m128i*)(b+16))),
+            _mm_or_si128(_mm_loadu_si128((__m128i*)(b+32)), _mm_loadu_si128((__m128i*)(b+48))));
+        int zero = _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) == 0xFFFF;
+#else
+        uint64_t x = 0;
+        for (int i = 0; i < 8; i++) x |= i64_at(b, i);
+        int zero = x == 0;
+#endif
+        if (!zero) break;
+        n -= 8;
+    }
+    while (n > 0 && i64_at(values, n-1) == 0) n--;
+    return n;
+}
+
+unsigned char* wire_i64_array(unsigned char* base, int lim, uint64_t* capacity) {
+    wirecursor_t c;
+    wireitem_t it;
+    wirecursor_init(&c, base, lim);
+    while (wirecursor_next(&c, &it) > WK_ERROR) {
+        if (it.kind == WK_I64_ARRAY) {
+            *capacity = it.v.arr.capacity;
+            return it.v.arr.values;
+        }
+    }
+    return NULL;
+}
+
+// Branch-free binary search, halving the range with a conditional move rather than
+// a branch the predictor cannot learn, then counting the last few entries directly.
+uint64_t wire_i64_upper_bound(unsigned char* values, uint64_t n, uint64_t key) {
+    uint64_t lo = 0;
+    while (n > 8) {
+        uint64_t half = n / 2;
+        lo = (i64_at(values, lo + half - 1) <= key) ? lo + half : lo;
+        n -= half;
+    }
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < n; i++) count += i64_at(values, lo + i) <= key;
+    return lo + count;
+}
+
+// read a stop-bit length and that many bytes
+#define CURSOR_SIZED(ptr, sz) do { \
+        int64_t l_; int n_ = wire_stopbit(p, lim, &l_); \
+        if (n_ < 0 || l_ < 0 || l_ > lim - (p + n_)) goto error; \
+        ptr = (char*)p + n_; sz = l_; p += n_ + l_; \
+    } while (0)
+
+#define CURSOR_NEED(n) do { if (lim - p < (n)) goto error; } while (0)
+
+// codes from
+// https://github.com/OpenHFT/Chronicle-Wire/blob/ea/src/main/java/net/openhft/chronicle/wire/BinaryWireCode.java
+wirekind_t wirecursor_next(wirecursor_t* c, wireitem_t* it) {
+    if (c->error) return WK_ERROR;
+    it->name = NULL;
+    it->name_sz = 0;
+    it->field_number = -1;
+    it->event = 0;
+    it->type = NULL;
+    it->type_sz = 0;
+
+    while (1) {
+        unsigned char* lim = c->depth ? c->ends[c->depth-1] : c->end;
+        if (c->p >= lim) {
+            if (c->depth == 0) return it->kind = WK_END;
+            c->depth--;
+            it->depth = c->depth;
+            it->name = NULL; // a key or type left pending at the end of the block is dropped
+            it->name_sz = 0;
+            it->type = NULL;
+            it->type_sz = 0;
+            return it->kind = WK_NEST_END;
+        }
+        unsigned char* p = c->p;
+        uint8_t control = *p++;
+        it->at = p;
+        it->depth = c->depth;
+        int64_t l;
+        int n;
+
+        switch (control) {
+            case 0x00 ... 0x7F: // NUM
+                it->at = p-1;
+                it->v.i64 = control;
+                it->kind = WK_INT;
+                break;
+            case 0x80: // BYTES_LENGTH8
+            case 0x81: // BYTES_LENGTH16
+            case 0x82: { // BYTES_LENGTH32
+                int w = control == 0x80 ? 1 : control == 0x81 ? 2 : 4;
+                CURSOR_NEED(w);
+                uint32_t len = 0;
+                memcpy(&len, p, w); // little endian
+                p += w;
+                if (len > lim - p) goto error;
+                if (len > 0 && p[0] == 0x8A) { // U8_ARRAY, raw bytes to the end of the block
+                    it->v.bytes.data = p + 1;
+                    it->v.bytes.sz = len - 1;
+                    it->kind = WK_BYTES;
+                    p += len;
+                    break;
+                }
+                if (c->depth == WIRE_MAX_DEPTH) goto error;
+                it->v.bytes.data = p;
+                it->v.bytes.sz = len;
+                it->kind = WK_NEST_BEGIN;
+                c->ends[c->depth++] = p + len;
+                break;
+            }
+            case 0x8D: { // I64_ARRAY: capacity, used, then capacity values
+                CURSOR_NEED(16);
+                memcpy(&it->v.arr.capacity, p, 8);
+                memcpy(&it->v.arr.used, p+8, 8);
+                p += 16;
+                if (it->v.arr.capacity > (uint64_t)(lim - p) / 8) goto error;
+                it->v.arr.values = p;
+                p += 8*it->v.arr.capacity;
+                it->kind = WK_I64_ARRAY;
+                break;
+            }
+            case 0x8E: { // PADDING_32, a count of further bytes to skip
+                uint32_t skip;
+                CURSOR_NEED(4);
+                memcpy(&skip, p, 4);
+                if (skip > lim - p - 4) goto error;
+                c->p = p + 4 + skip;
+                continue;
+            }
+            case 0x8F: // PADDING
+                c->p = p;
+                continue;
+            case 0x90: { // FLOAT32
+                float f;
+                CURSOR_NEED(4);
+                memcpy(&f, p, 4);
+                it->v.f64 = f;
+                it->kind = WK_FLOAT;
+                p += 4;
+                break;
+            }
+            case 0x91: // FLOAT64
+                CURSOR_NEED(8);
+                memcpy(&it->v.f64, p, 8);
+                it->kind = WK_FLOAT;
+                p += 8;
+                break;
+            case 0x92: // FLOAT_STOP_2, stop-bit scaled by 10^2
+            case 0x94: // FLOAT_STOP_4
+            case 0x96: // FLOAT_STOP_6
+                if ((n = wire_stopbit(p, lim, &l)) < 0) goto error;
+                it->v.f64 = l / (control == 0x92 ? 1e2 : control == 0x94 ? 1e4 : 1e6);
+                it->kind = WK_FLOAT;
+                p += n;
+                break;
+            case 0x9A: // FLOAT_SET_LOW_0, unsigned byte scaled by 10^0
+            case 0x9B: // FLOAT_SET_LOW_2
+            case 0x9C: // FLOAT_SET_LOW_4
+                CURSOR_NEED(1);
+                it->v.f64 = p[0] / (control == 0x9A ? 1.0 : control == 0x9B ? 1e2 : 1e4);
+                it->kind = WK_FLOAT;
+                p += 1;
+                break;
+            case 0x9F: // UUID, two longs
+                CURSOR_NEED(16);
+                it->v.bytes.data = p;
+                it->v.bytes.sz = 16;
+                it->kind = WK_UUID;
+                p += 16;
+                break;
+            case 0xA1: // UINT8
+            case 0xA2: // UINT16
+            case 0xA3: { // UINT32
+                int w = control == 0xA1 ? 1 : control == 0xA2 ? 2 : 4;
+                CURSOR_NEED(w);
+                uint32_t u = 0;
+                memcpy(&u, p, w);
+                it->v.i64 = u;
+                it->kind = WK_INT;
+                p += w;
+                break;
+            }
+            case 0xA4: // INT8
+            case 0xA8: // SET_LOW_INT8
+                CURSOR_NEED(1);
+                it->v.i64 = (int8_t)p[0];
+                it->kind = WK_INT;
+                p += 1;
+                break;
+            case 0xA5: // INT16
+            case 0xA9: { // SET_LOW_INT16
+                int16_t i;
+                CURSOR_NEED(2);
+                memcpy(&i, p, 2);
+                it->v.i64 = i;
+                it->kind = WK_INT;
+                p += 2;
+                break;
+            }
+            case 0xA6: { // INT32
+                int32_t i;
+                CURSOR_NEED(4);
+                memcpy(&i, p, 4);
+                it->v.i64 = i;
+                it->kind = WK_INT;
+                p += 4;
+                break;
+            }
+            case 0xA7: // INT64
+            case 0xAF: // INT64_0x, hex hint
+                CURSOR_NEED(8);
+                memcpy(&it->v.i64, p, 8);
+                it->kind = WK_INT;
+                p += 8;
+                break;
+            case 0xAE: // STOP_BIT
+                if ((n = wire_stopbit(p, lim, &it->v.i64)) < 0) goto error;
+                it->kind = WK_INT;
+                p += n;
+                break;
+            case 0xB0: // FALSE
+            case 0xB1: // TRUE
+                it->v.i64 = control == 0xB1;
+                it->kind = WK_BOOL;
+                break;
+            case 0xB2: // TIME
+            case 0xB3: // DATE
+            case 0xB4: // DATE_TIME
+            case 0xB5: // ZONED_DATE_TIME
+            case 0xBC: // TYPE_LITERAL
+            case 0xB8: // STRING_ANY
+                CURSOR_SIZED(it->v.text.text, it->v.text.sz);
+                it->kind = control == 0xB2 ? WK_TIME : control == 0xB3 ? WK_DATE :
+                           control == 0xB4 ? WK_DATETIME : control == 0xB5 ? WK_ZONED_DATETIME :
+                           control == 0xBC ? WK_TYPE_LITERAL : WK_TEXT;
+                it->at = (unsigned char*)it->v.text.text;
+                break;
+            case 0xB6: // TYPE_PREFIX, applies to the value that follows
+                CURSOR_SIZED(it->type, it->type_sz);
+                c->p = p;
+                continue;
+            case 0xB7: // FIELD_NAME_ANY
+            case 0xB9: // EVENT_NAME
+                CURSOR_SIZED(it->name, it->name_sz);
+                it->event = control == 0xB9;
+                it->field_number = -1;
+                c->p = p;
+                continue;
+            case 0xBA: // FIELD_NUMBER
+                if ((n = wire_stopbit(p, lim, &it->field_number)) < 0) goto error;
+                it->name = NULL;
+                it->name_sz = 0;
+                it->event = 0;
+                c->p = p + n;
+                continue;
+            case 0xBB: // NULL
+                it->kind = WK_NULL;
+                break;
+            case 0xBD: // EVENT_OBJECT, the next value is the key of the one after
+                it->kind = WK_EVENT_OBJECT;
+                break;
+            case 0xBE: // COMMENT
+            case 0xBF: // HINT
+                if ((n = wire_stopbit(p, lim, &l)) < 0 || l < 0 || l > lim - (p + n)) goto error;
+                c->p = p + n + l;
+                continue;
+            case 0xC0 ... 0xDF: // small field name, length in control
+                n = control - 0xC0;
+                CURSOR_NEED(n);
+                it->name = (char*)p;
+                it->name_sz = n;
+                it->event = 0;
+                it->field_number = -1;
+                c->p = p + n;
+                continue;
+            case 0xE0 ... 0xFF: // small text, length in control
+                n = control - 0xE0;
+                CURSOR_NEED(n);
+                it->v.text.text = (char*)p;
+                it->v.text.sz = n;
+                it->kind = WK_TEXT;
+                p += n;
+                break;
+            default: // anchors, aliases and unassigned codes
+                goto error;
+        }
+        c->p = p;
+        return it->kind;
+    }
+error:
+    c->error = 1;
+    return it->kind = WK_ERROR;
+}
+
+#undef CURSOR_SIZED
+#undef CURSOR_NEED
+
+// store a cursor item in field, if its kind suits the field type
+static inline int wire_schema_store(const wirefield_t* field, void* obj, wirekind_t k, wireitem_t* it) {
+    unsigned char* dst = (unsigned char*)obj + field->offset;
+    if (field->type == WF_INT64 && (k == WK_INT || k == WK_BOOL)) {
+        memcpy(dst, &it->v.i64, sizeof(int64_t));
+    } else if (field->type == WF_FLOAT64 && (k == WK_FLOAT || k == WK_INT)) {
+        double d = k == WK_INT ? it->v.i64 : it->v.f64;
+        memcpy(dst, &d, sizeof(d));
+    } else if (field->type == WF_TEXT && (k == WK_TEXT || (k >= WK_TIME && k <= WK_TYPE_LITERAL))) {
+        wiretext_t text = {it->v.text.text, it->v.text.sz};
+        memcpy(dst, &text, sizeof(text));
+    } else if (field->type == WF_PTR && k != WK_NEST_END && k != WK_EVENT_OBJECT) {
+        memcpy(dst, &it->at, sizeof(it->at));
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+#define SCHEMA_NEED(n) do { if (end - p < (n)) return 0; } while (0)
+
+// Step over the common value at p: ints of a fixed width, FLOAT64, booleans and short
+// texts. Stores it at dst if type, that of the field keyed (-1 for none), takes its
+// code, so values of other codes and fields are never decoded. Returns the encoded
+// size, 0 for other codes or a value running past end, which the cursor handles.
+static inline int wire_schema_value(int type, unsigned char* dst, unsigned char* p, unsigned char* end, int* stored) {
+    uint8_t control = *p;
+    int64_t i;
+    wiretext_t text;
+    int n;
+    *stored = 0;
+    switch (control) {
+        case 0x00 ... 0x7F: i = control; n = 1; goto integer;
+        case 0xA1: SCHEMA_NEED(2); i = p[1]; n = 2; goto integer;
+        case 0xA2: { uint16_t u; SCHEMA_NEED(3); memcpy(&u, p + 1, 2); i = u; n = 3; goto integer; }
+        case 0xA3: { uint32_t u; SCHEMA_NEED(5); memcpy(&u, p + 1, 4); i = u; n = 5; goto integer; }
+        case 0xA4: SCHEMA_NEED(2); i = (int8_t)p[1]; n = 2; goto integer;
+        case 0xA5: { int16_t v; SCHEMA_NEED(3); memcpy(&v, p + 1, 2); i = v; n = 3; goto integer; }
+        case 0xA6: { int32_t v; SCHEMA_NEED(5); memcpy(&v, p + 1, 4); i = v; n = 5; goto integer; }
+        case 0xA7: case 0xAF: SCHEMA_NEED(9); memcpy(&i, p + 1, 8); n = 9; goto integer;
+        case 0x91: // FLOAT64
+            SCHEMA_NEED(9);
+            n = 9;
+            if (type != WF_FLOAT64) goto pointer;
+            memcpy(dst, p + 1, 8);
+            break;
+        case 0xB0: case 0xB1: // FALSE, TRUE
+            n = 1;
+            if (type != WF_INT64) goto pointer;
+            i = control == 0xB1;
+            memcpy(dst, &i, sizeof(i));
+            break;
+        case 0xE0 ... 0xFF: // small text
+            n = 1 + (control & 0x1F);
+            SCHEMA_NEED(n);
+            text = (wiretext_t){(char*)p + 1, control & 0x1F};
+            goto text;
+        case 0xB8: // STRING_ANY, with a one byte length
+            if (end - p < 2 || p[1] >= 0x80) return 0;
+            n = 2 + p[1];
+            SCHEMA_NEED(n);
+            text = (wiretext_t){(char*)p + 2, p[1]};
+            goto text;
+        default:
+            return 0;
+    }
+    *stored = 1;
+    return n;
+
+integer:
+    if (type == WF_INT64) {
+        memcpy(dst, &i, sizeof(i));
+    } else if (type == WF_FLOAT64) {
+        double d = i;
+        memcpy(dst, &d, sizeof(d));
+    } else {
+        goto pointer;
+    }
+    *stored = 1;
+    return n;
+text:
+    if (type != WF_TEXT) goto pointer;
+    memcpy(dst, &text, sizeof(text));
+    *stored = 1;
+    return n;
+pointer:
+    if (type == WF_PTR) {
+        unsigned char* at = control < 0x80 ? p : p + 1; // small ints are their code
+        memcpy(dst, &at, sizeof(at));
+        *stored = 1;
+    }
+    return n;
+}
+
+#undef SCHEMA_NEED
+
+static inline int wire_schema_name_code(wireschema_t* schema, uint8_t b) {
+    return b == 0xB7 || b == 0xB9 || ((b & 0xE0) == 0xC0 && ((schema->sizes >> (b & 0x1F)) & 1));
+}
+
+// A nested block can only hold schema fields if it has the small name code of a field
+// size, or a long or event name, so blocks with none are skipped whole. Bytes of values
+// can look like name codes, which costs a visit, never a field. Sixteen bytes at a time
+// are screened for any name code, checking the size of those found.
+static int wire_schema_nest_wanted(wireschema_t* schema, unsigned char* p, int sz) {
+    unsigned char* end = p + sz;
+#ifdef __SSE2__
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((__m128i*)p);
+        __m128i names = _mm_or_si128(
+            _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)0xE0)), _mm_set1_epi8((char)0xC0)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)0xB7)), _mm_cmpeq_epi8(v, _mm_set1_epi8((char)0xB9))));
+        for (int m = _mm_movemask_epi8(names); m; m &= m - 1) {
+            if (wire_schema_name_code(schema, p[__builtin_ctz(m)])) return 1;
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        if (wire_schema_name_code(schema, *p)) return 1;
+    }
+    return 0;
+}
+
+// Small names, padding and the common values are read in place, in a run until some
+// other code, which with nesting goes through the cursor. f is the field keyed by the
+// name read last, until its value is seen, and next the field after the last matched.
+int wire_schema_decode(wireschema_t* schema, unsigned char* base, int lim, void* obj) {
+    const wirefield_t* fields = schema->fields;
+    uint64_t found = 0;
+    wirecursor_t c;
+    wireitem_t it;
+    wirekind_t k;
+    wirecursor_init(&c, base, lim);
+    int f = -1;
+    int next = 0;
+    int r = 0;
+
+    while (1) {
+        unsigned char* p = c.p;
+        unsigned char* end = c.depth ? c.ends[c.depth-1] : c.end;
+        int n, stored;
+        while (p < end) {
+            uint8_t control = *p;
+            if ((control & 0xE0) == 0xC0) { // small field name
+                n = control & 0x1F;
+                if (n > end - p - 1) {
+                    r = -1;
+                    goto done;
+                }
+                f = wire_schema_lookup(schema, next, (char*)p + 1, n, c.end);
+                if (f >= 0) next = f + 1;
+                p += 1 + n;
+            } else if (control == 0x8F) { // PADDING, often a run after a text
+                while (++p < end && *p == 0x8F);
+            } else if ((n = f >= 0 ? wire_schema_value(fields[f].type, (unsigned char*)obj + fields[f].offset, p, end, &stored)
+                                   : wire_schema_value(-1, NULL, p, end, &stored))) {
+                if (stored) found |= 1ULL << f;
+                p += n;
+                f = -1;
+            } else {
+                if (control == 0xB7 || control == 0xB9 || control == 0xBA) f = -1; // the cursor reads the key
+                break;
+            }
+        }
+        c.p = p;
+
+        if ((k = wirecursor_next(&c, &it)) == WK_END) break;
+        if (k == WK_ERROR) {
+            r = -1;
+            break;
+        }
+        if (it.name && (f = wire_schema_lookup(schema, next, it.name, it.name_sz, c.end)) >= 0) next = f + 1;
+        if (k == WK_NEST_BEGIN) {
+            if (!wire_schema_nest_wanted(schema, it.v.bytes.data, it.v.bytes.sz)) wirecursor_skip(&c);
+        } else if (f >= 0 && wire_schema_store(&fields[f], obj, k, &it)) {
+            found |= 1ULL << f;
+        }
+        f = -1;
+    }
+done:
+    *(uint64_t*)obj |= found;
+    return r;
+}
+
+struct wirebatch {
+    wireschema_t*     schema;
+    int               capacity;
+    int               rows;
+    uint64_t*         index;
+    void*             columns[64];
+    wirebatch_flush_f flush;
+    void*             flush_ctx;
+
+    // interned symbols: text in an arena, hash table of id + 1
+    char*             arena;
+    size_t            arena_sz;
+    size_t            arena_cap;
+    uint32_t*         sym_off;
+    int32_t*          sym_len;
+    uint32_t*         sym_hash;
+    int               nsyms;
+    int               sym_cap;
+    int32_t*          sym_table;
+    uint32_t          sym_mask;
+};
+
+// Symbols are capped so that arena offsets fit sym_off and table sizes fit sym_mask. On
+// reaching a cap or failing to allocate, intern returns -1 and the batch is unchanged
+#define WIREBATCH_ARENA_MAX (1UL << 31)
+#define WIREBATCH_SYMS_MAX  (1 << 24)
+
+static int wirebatch_grow_syms(wirebatch_t* b) {
+    if (b->sym_cap >= WIREBATCH_SYMS_MAX) return -1;
+    int cap = b->sym_cap * 2;
+    uint32_t* off = realloc(b->sym_off, cap * sizeof(uint32_t));
+    if (off == NULL) return -1;
+    b->sym_off = off;
+    int32_t* len = realloc(b->sym_len, cap * sizeof(int32_t));
+    if (len == NULL) return -1;
+    b->sym_len = len;
+    uint32_t* hash = realloc(b->sym_hash, cap * sizeof(uint32_t));
+    if (hash == NULL) return -1;
+    b->sym_hash = hash;
+    b->sym_cap = cap;
+    return 0;
+}
+
+static int wirebatch_grow_arena(wirebatch_t* b, size_t sz) {
+    size_t cap = b->arena_cap;
+    while (b->arena_sz + sz > cap) cap *= 2;
+    if (cap > WIREBATCH_ARENA_MAX) return -1;
+    char* arena = realloc(b->arena, cap);
+    if (arena == NULL) return -1;
+    b->arena = arena;
+    b->arena_cap = cap;
+    return 0;
+}
+
+static int wirebatch_rehash(wirebatch_t* b) {
+    uint32_t mask = (b->sym_mask << 1) | 1;
+    int32_t* table = calloc(mask + 1, sizeof(int32_t));
+    if (table == NULL) return -1;
+    for (int32_t s = 0; s < b->nsyms; s++) {
+        uint32_t i;
+        for (i = b->sym_hash[s] & mask; table[i]; i = (i + 1) & mask);
+        table[i] = s + 1;
+    }
+    free(b->sym_table);
+    b->sym_table = table;
+    b->sym_mask = mask;
+    return 0;
+}
+
+static int32_t wirebatch_intern(wirebatch_t* b, char* text, int sz) {
+    uint32_t h = wire_hash(text, sz);
+    uint32_t i;
+    for (i = h & b->sym_mask; b->sym_table[i]; i = (i + 1) & b->sym_mask) {
+        int32_t id = b->sym_table[i] - 1;
+        if (b->sym_hash[id] == h && b->sym_len[id] == sz && memcmp(b->arena + b->sym_off[id], text, sz) == 0)
+            return id;
+    }
+    // make room for a new symbol, or fail leaving the batch as it was
+    if (b->nsyms == b->sym_cap && wirebatch_grow_syms(b) != 0) return -1;
+    if (b->arena_sz + sz + 1 > b->arena_cap && wirebatch_grow_arena(b, sz + 1) != 0) return -1;
+    // keep the table at most half full
+    if ((uint32_t)(b->nsyms + 1) * 2 > b->sym_mask) {
+        if (wirebatch_rehash(b) != 0) return -1;
+        for (i = h & b->sym_mask; b->sym_table[i]; i = (i + 1) & b->sym_mask);
+    }
+    int32_t id = b->nsyms++;
+    b->sym_off[id] = b->arena_sz;
+    b->sym_len[id] = sz;
+    b->sym_hash[id] = h;
+    memcpy(b->arena + b->arena_sz, text, sz);
+    b->arena[b->arena_sz + sz] = 0; // terminated for convenience
+    b->arena_sz += sz + 1;
+    b->sym_table[i] = id + 1;
+    return id;
+}
+
+wirebatch_t* wirebatch_init(wireschema_t* schema, int rows, wirebatch_flush_f flush, void* flush_ctx) {
+    if (rows <= 0 || schema->nfields > 64) return NULL;
+    wirebatch_t* b = calloc(1, sizeof(wirebatch_t));
+    if (b == NULL) return NULL;
+    b->schema = schema;
+    b->capacity = rows;
+    b->flush = flush;
+    b->flush_ctx = flush_ctx;
+    int ok = (b->index = malloc(rows * sizeof(uint64_t))) != NULL;
+    for (int f = 0; f < schema->nfields; f++) {
+        wirefieldtype_t type = schema->fields[f].type;
+        if (type == WF_INT64 || type == WF_FLOAT64) ok &= (b->columns[f] = malloc(rows * 8)) != NULL;
+        if (type == WF_TEXT) ok &= (b->columns[f] = malloc(rows * sizeof(int32_t))) != NULL;
+    }
+    b->arena_cap = 4096;
+    ok &= (b->arena = malloc(b->arena_cap)) != NULL;
+    b->sym_cap = 256;
+    ok &= (b->sym_off = malloc(b->sym_cap * sizeof(uint32_t))) != NULL;
+    ok &= (b->sym_len = malloc(b->sym_cap * sizeof(int32_t))) != NULL;
+    ok &= (b->sym_hash = malloc(b->sym_cap * sizeof(uint32_t))) != NULL;
+    b->sym_mask = 511;
+    ok &= (b->sym_table = calloc(b->sym_mask + 1, sizeof(int32_t))) != NULL;
+    if (!ok || wirebatch_intern(b, "", 0) != 0) { // null symbol
+        wirebatch_free(b);
+        return NULL;
+    }
+    return b;
+}
+
+// returns -1 if the message could not be decoded completely (the row is kept with the
+// fields before the error) or a text could not be interned (the field is left null),
+// 1 if the row filled the batch, which has been flushed, else 0
+int wirebatch_add(wirebatch_t* b, unsigned char* base, int lim, uint64_t index) {
+    wireschema_t* schema = b->schema;
+    int row = b->rows;
+    for (int f = 0; f < schema->nfields; f++) {
+        if (b->columns[f] == NULL) continue;
+        switch (schema->fields[f].type) {
+            case WF_INT64:   ((int64_t*)b->columns[f])[row] = INT64_MIN; break;
+            case WF_FLOAT64: ((double*)b->columns[f])[row] = NAN; break;
+            case WF_TEXT:    ((int32_t*)b->columns[f])[row] = 0; break;
+            default: break;
+        }
+    }
+    b->index[row] = index;
+
+    wirecursor_t c;
+    wireitem_t it;
+    wirekind_t k;
+    int r = 0;
+    int next = 0;
+    wirecursor_init(&c, base, lim);
+    while ((k = wirecursor_next(&c, &it)) != WK_END) {
+        if (k == WK_ERROR) {
+            r = -1;
+            break;
+        }
+        if (it.name == NULL || k == WK_NEST_BEGIN) continue;
+        int f = wire_schema_lookup(schema, next, it.name, it.name_sz, c.end);
+        if (f < 0) continue;
+        next = f + 1;
+        if (b->columns[f] == NULL) continue;
+        wirefieldtype_t type = schema->fields[f].type;
+        if (type == WF_INT64 && (k == WK_INT || k == WK_BOOL)) {
+            ((int64_t*)b->columns[f])[row] = it.v.i64;
+        } else if (type == WF_FLOAT64 && (k == WK_FLOAT || k == WK_INT)) {
+            ((double*)b->columns[f])[row] = k == WK_INT ? it.v.i64 : it.v.f64;
+        } else if (type == WF_TEXT && (k == WK_TEXT || (k >= WK_TIME && k <= WK_TYPE_LITERAL))) {
+            int32_t id = wirebatch_intern(b, it.v.text.text, it.v.text.sz);
+            if (id < 0) r = -1; // left null
+            else ((int32_t*)b->columns[f])[row] = id;
+        }
+    }
+
+    if (++b->rows < b->capacity) return r;
+    wirebatch_flush(b);
+    return r < 0 ? r : 1;
+}
+
+void wirebatch_flush(wirebatch_t* b) {
+    if (b->rows == 0) return;
+    if (b->flush) b->flush(b, b->flush_ctx);
+    wirebatch_clear(b);
+}
+
+void wirebatch_clear(wirebatch_t* b) {
+    b->rows = 0;
+}
+
+void wirebatch_free(wirebatch_t* b) {
+    for (int f = 0; f < b->schema->nfields; f++) free(b->columns[f]);
+    free(b->index);
+    free(b->arena);
+    free(b->sym_off);
+    free(b->sym_len);
+    free(b->sym_hash);
+    free(b->sym_table);
+    free(b);
+}
+
+int wirebatch_rows(wirebatch_t* b) {
+    return b->rows;
+}
+
+uint64_t* wirebatch_index(wirebatch_t* b) {
+    return b->index;
+}
+
+void* wirebatch_column(wirebatch_t* b, int field) {
+    if (field < 0 || field >= b->schema->nfields) return NULL;
+    return b->columns[field];
+}
+
+int wirebatch_symbols(wirebatch_t* b) {
+    return b->nsyms;
+}
+
+const char* wirebatch_symbol(wirebatch_t* b, int32_t id, int* sz) {
+    if (id < 0 || id >= b->nsyms) return NULL;
+    if (sz) *sz = b->sym_len[id];
+    return b->arena + b->sym_off[id];
+}
+
+static __thread wireview_t wire_view;
+
+void* wire_parse_view(unsigned char* base, int lim) {
+    wire_view.base = base;
+    wire_view.lim = lim;
+    return &wire_view;
+}
+
+int wirebatch_dispatch(void* batch, uint64_t index, void* view) {
+    wireview_t* v = (wireview_t*)view;
+    wirebatch_add((wirebatch_t*)batch, v->base, v->lim, index);
+    return 0;
+}
+
+struct wireroute {
+    uint64_t       hash;
+    int            name_sz;
+    char*          name;
+    wireroute_f    handler;
+    void*          ctx;
+};
+
+struct wirerouter {
+    struct wireroute* routes;
+    int               nroutes;
+    // perfect hash: slot (hash * seed) >> shift holds route+1, or 0 for none
+    uint64_t          seed;
+    int               shift;
+    uint16_t*         slots;
+
+    wireroute_f       fallback;
+    void*             fallback_ctx;
+    uint64_t          unrouted;
+};
+
+static inline uint64_t wire_hash64(const char* name, int sz) {
+    uint64_t h = 14695981039346656037ULL; // FNV-1a
+    for (int i = 0; i < sz; i++) h = (h ^ (uint8_t)name[i]) * 1099511628211ULL;
+    return h;
+}
+
+static int wirerouter_build(wirerouter_t* router);
+
+static inline uint32_t wirerouter_slot(uint64_t hash, uint64_t seed, int shift) {
+    return (hash * seed) >> shift;
+}
+
+wirerouter_t* wirerouter_init() {
+    wirerouter_t* router = calloc(1, sizeof(wirerouter_t));
+    if (router == NULL) return NULL;
+    if (wirerouter_build(router) != 0) {
+        free(router);
+        return NULL;
+    }
+    return router;
+}
+
+// search for a multiplier that places every name in its own slot, in a table at
+// least twice the number of names, doubling the table if none is found
+static int wirerouter_build(wirerouter_t* router) {
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    for (int bits = 1; bits <= 16; bits++) {
+        uint32_t n = 1u << bits;
+        if (n < 2 * (uint32_t)router->nroutes) continue;
+        uint16_t* slots = calloc(n, sizeof(uint16_t));
+        if (slots == NULL) return -1;
+        for (int attempt = 0; attempt < 256; attempt++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            uint64_t odd = seed | 1;
+            memset(slots, 0, n * sizeof(uint16_t));
+            int r;
+            for (r = 0; r < router->nroutes; r++) {
+                uint32_t i = wirerouter_slot(router->routes[r].hash, odd, 64 - bits);
+                if (slots[i]) break;
+                slots[i] = r + 1;
+            }
+            if (r == router->nroutes) {
+                free(router->slots);
+                router->slots = slots;
+                router->seed = odd;
+                router->shift = 64 - bits;
+                return 0;
+            }
+        }
+        free(slots);
+    }
+    return -1;
+}
+
+int wirerouter_add(wirerouter_t* router, const char* event, wireroute_f handler, void* ctx) {
+    int sz = strlen(event);
+    uint64_t hash = wire_hash64(event, sz);
+    for (int r = 0; r < router->nroutes; r++) {
+        if (router->routes[r].hash == hash && router->routes[r].name_sz == sz) {
+            // names sharing a hash cannot be told apart by a slot
+            if (strcmp(router->routes[r].name, event) != 0) return -1;
+            // re-registering a name replaces its handler
+            router->routes[r].handler = handler;
+            router->routes[r].ctx = ctx;
+            return 0;
+        }
+    }
+    if (router->nroutes == 0xFFFF) return -1;
+    struct wireroute* routes = realloc(router->routes, (router->nroutes + 1) * sizeof(struct wireroute));
+    if (routes == NULL) return -1;
+    router->routes = routes;
+    char* name = strdup(event);
+    if (name == NULL) return -1;
+    struct wireroute* route = &router->routes[router->nroutes++];
+    route->hash = hash;
+    route->name_sz = sz;
+    route->name = name;
+    route->handler = handler;
+    route->ctx = ctx;
+    if (wirerouter_build(router) != 0) {
+        free(route->name);
+        router->nroutes--;
+        return -1;
+    }
+    return 0;
+}
+
+void wirerouter_set_fallback(wirerouter_t* router, wireroute_f handler, void* ctx) {
+    router->fallback = handler;
+    router->fallback_ctx = ctx;
+}
+
+int wirerouter_route(wirerouter_t* router, unsigned char* base, int lim, uint64_t index) {
+    wirecursor_t c;
+    wireitem_t it;
+    wirecursor_init(&c, base, lim);
+    wirekind_t kind;
+    while ((kind = wirecursor_next(&c, &it)) > WK_ERROR) {
+        struct wireroute* route = NULL;
+        if (it.event) {
+            uint64_t h = wire_hash64(it.name, it.name_sz);
+            uint16_t r = router->slots[wirerouter_slot(h, router->seed, router->shift)];
+            if (r && router->routes[r-1].hash == h && router->routes[r-1].name_sz == it.name_sz &&
+                memcmp(router->routes[r-1].name, it.name, it.name_sz) == 0)
+                route = &router->routes[r-1];
+        }
+        wireroute_f handler = route ? route->handler : router->fallback;
+        void* ctx = route ? route->ctx : router->fallback_ctx;
+        if (route == NULL) router->unrouted++;
+        if (handler) {
+            int rc = handler(ctx, index, &it, &c);
+            if (rc != 0) return rc;
+        }
+        // past whatever the handler left of the argument
+        while (c.depth > 0) wirecursor_skip(&c);
+    }
+    return kind == WK_ERROR ? -1 : 0;
+}
+
+uint64_t wirerouter_unrouted(wirerouter_t* router) {
+    return router->unrouted;
+}
+
+void wirerouter_free(wirerouter_t* router) {
+    for (int r = 0; r < router->nroutes; r++) free(router->routes[r].name);
+    free(router->routes);
+    free(router->slots);
+    free(router);
+}
+
+int wirerouter_dispatch(void* router, uint64_t index, void* view) {
+    wireview_t* v = (wireview_t*)view;
+    return wirerouter_route((wirerouter_t*)router, v->base, v->lim, index);
+}
+
 struct wirepad {
     int      sz;
     unsigned char*    pos;
@@ -181,6 +1187,11 @@ struct wirepad {
 
     int               nest;
     unsigned char*    nest_enter_pos[10];
+
+    // wrapped pads write into caller memory that cannot grow, writes that do not
+    // fit are dropped and flagged
+    int               external;
+    int               overflow;
 };
 
 wirepad_t*  wirepad_init(int initial_sz) {
@@ -191,69 +1202,119 @@ wirepad_t*  wirepad_init(int initial_sz) {
     if (wire_trace) printf("wire pad created at %p sz %d\n", pad->base, pad->sz);
     pad->pos = pad->base;
     pad->nest = 0;
+    pad->external = 0;
+    pad->overflow = 0;
+    return pad;
+}
+
+// point a pad at sz bytes of caller memory, such as a chronicle_reserve'd entry,
+// to encode without copying. Pass NULL to allocate the pad, or an existing pad
+// to retarget it
+wirepad_t*  wirepad_wrap(wirepad_t* pad, unsigned char* buf, int sz) {
+    if (pad == NULL) {
+        pad = malloc(sizeof(wirepad_t));
+    } else if (!pad->external) {
+        free(pad->base);
+    }
+    pad->sz = sz;
+    pad->base = buf;
+    pad->pos = pad->base;
+    pad->nest = 0;
+    pad->external = 1;
+    pad->overflow = 0;
     return pad;
 }
 
 void wirepad_free(wirepad_t* pad) {
-    free(pad->base);
+    if (!pad->external) free(pad->base);
     free(pad);
 }
 
 void wirepad_clear(wirepad_t* pad) {
     pad->pos = pad->base;
     pad->nest = 0;
+    pad->overflow = 0;
+}
+
+int wirepad_overflow(wirepad_t* pad) {
+    return pad->overflow;
 }
 
-void wirepad_extent(wirepad_t* pad, int sz) {
+int wirepad_extent(wirepad_t* pad, int sz) {
     int used = pad->pos - pad->base;
     int remain = pad->sz - used - sz;
     if (wire_trace) printf(" wirepad_extent base=%p used=%d need=+%d remain=%d\n", pad->base, used, sz, remain);
+    if (pad->overflow) return -1;
+    if (remain < 0 && pad->external) {
+        pad->overflow = 1;
+        return -1;
+    }
+    if (remain >= 0) return 0;
     while (remain < 0) {
         pad->sz = pad->sz * 2;
-        pad->base = realloc(pad->base, pad->sz);
         remain = pad->sz - used - sz;
     }
+    // the write position and open nests move with the buffer
+    int entered[10];
+    for (int i = 0; i < pad->nest; i++) entered[i] = pad->nest_enter_pos[i] - pad->base;
+    pad->base = realloc(pad->base, pad->sz);
+    pad->pos = pad->base + used;
+    for (int i = 0; i < pad->nest; i++) pad->nest_enter_pos[i] = pad->base + entered[i];
+    return 0;
 }
 
-void wirepad_text(wirepad_t* pad, char* text) {
-    int d = strlen(text);
-    int overhead = d < 0x1F ? 1 : 4;
-    if (wire_trace) printf("wirepad_text pos=%p writing d=%d overhead=%d\n", pad->pos, d, overhead);
-    wirepad_extent(pad, d+overhead);
-    if (d < 0x1F) {
-        pad->pos[0] = 0xE0 + d;
-    } else {
-        pad->pos[0] = 0xB8;
-        // put stop bit encoded length
-        printf("long text encoding?");
-        abort();
+// bytes for d as a stop-bit length
+static int stopbit_sz(uint32_t d) {
+    int n = 1;
+    while (d >= 0x80) {
+        d >>= 7;
+        n++;
     }
-    memcpy(pad->pos+overhead, text, d);
-    pad->pos = pad->pos + d + overhead;
+    return n;
 }
 
-void wirepad_field(wirepad_t* pad, char* text) {
+static unsigned char* put_stopbit(unsigned char* p, uint32_t d) {
+    while (d >= 0x80) {
+        *p++ = 0x80 | (d & 0x7F);
+        d >>= 7;
+    }
+    *p++ = d;
+    return p;
+}
+
+// short codes carry the length in the control byte, longer strings use the
+// any-length code and a stop-bit length
+static void wirepad_string(wirepad_t* pad, char* text, uint8_t small, uint8_t any) {
     int d = strlen(text);
-    int overhead = d < 0x1F ? 1 : 4;
-    if (wire_trace) printf("wirepad_field pos=%p writing text=%s d=%d overhead=%d\n", pad->pos, text, d, overhead);
-    wirepad_extent(pad, d+overhead);
+    int overhead = d < 0x1F ? 1 : 1 + stopbit_sz(d);
+    if (wire_trace) printf("wirepad_string pos=%p writing d=%d overhead=%d\n", pad->pos, d, overhead);
+    if (wirepad_extent(pad, d+overhead) != 0) return;
     if (d < 0x1F) {
-        pad->pos[0] = 0xC0 + d;
+        pad->pos[0] = small + d;
     } else {
-        printf("long field encoding?");
-        abort();
+        pad->pos[0] = any;
+        put_stopbit(pad->pos+1, d);
     }
     memcpy(pad->pos+overhead, text, d);
     pad->pos = pad->pos + overhead + d;
 }
 
+void wirepad_text(wirepad_t* pad, char* text) {
+    wirepad_string(pad, text, 0xE0, 0xB8); // STRING_ANY
+}
+
+void wirepad_field(wirepad_t* pad, char* text) {
+    wirepad_string(pad, text, 0xC0, 0xB7); // FIELD_NAME_ANY
+}
+
 void wirepad_uint64_aligned(wirepad_t* pad, uint64_t v) {
     if (wire_trace) printf("wirepad_uint64 pos=%p writing uint64=%" PRIu64 "\n", pad->pos, v);
-    wirepad_extent(pad, 16);
 
     // align the 8 data bytes to a multiple of 8 bytes, which
     // requires aligning the A7 prefix before it to the last byte of 8
     int padding = -((pad->pos + 1) - pad->base) & 0x7; // current (position+1), align to 8
+    // padding < 5 writes 4 0x8F bytes regardless
+    if (wirepad_extent(pad, (padding > 0 && padding < 4 ? 4 : padding) + 9) != 0) return;
 
     // optimise padding between 0x8F (single bytes) and 0x8E (var bytes)
     if (padding == 0) {
@@ -281,17 +1342,17 @@ void wirepad_varint(wirepad_t* pad, uint64_t v) {
     // compacted value representation, unaligned
 
     if (wire_trace) printf("wirepad_varint pos=%p writing varint=%" PRIu64 "\n", pad->pos, v);
-    wirepad_extent(pad, 9);
+    if (wirepad_extent(pad, v <= 0x7F ? 1 : v <= 0x7FFF ? 3 : v <= 0x7FFFFFFF ? 5 : 9) != 0) return;
 
     if (v <= 0x7F) {
         pad->pos[0] = v & 0x7F;
         pad->pos = pad->pos + 1;
-    } else if (v <= 0xFFFF) {
+    } else if (v <= 0x7FFF) {
         pad->pos[0] = 0xa5; // INT16
         pad->pos[1] = (v >>  0) & 0xff;
         pad->pos[2] = (v >>  8) & 0xff;
         pad->pos = pad->pos + 3;
-    } else if (v <= 0xFFFFFFFF) {
+    } else if (v <= 0x7FFFFFFF) {
         // 1234567890L => 49 96 02 D2
         // a6 d2 02 96 49
         pad->pos[0] = 0xa6; // INT32
@@ -331,13 +1392,15 @@ void wirepad_field_uint64(wirepad_t* pad, char* field, uint64_t v) {
 void wirepad_field_float64(wirepad_t* pad, char* field, double v) {
     wirepad_field(pad, field);
     float f = v;
+    if (wirepad_extent(pad, f == v ? 5 : 9) != 0) return;
     if (f == v) {
         pad->pos[0] = 0x90; // FLOAT32
         memcpy(pad->pos+1, &f, sizeof(f));
         pad->pos = pad->pos + 5;
     } else {
-        printf("float64 large encoding?");
-        abort();
+        pad->pos[0] = 0x91; // FLOAT64
+        memcpy(pad->pos+1, &v, sizeof(v));
+        pad->pos = pad->pos + 9;
     }
 
 }
@@ -349,6 +1412,7 @@ void wirepad_field_varint(wirepad_t* pad, char* field, int v) {
 
 void wirepad_pad_to_x8(wirepad_t* pad) {
     int padding = -(pad->pos - pad->base) & 0x07;
+    if (wirepad_extent(pad, padding) != 0) return;
     for (int i = 0; i < padding; i++) {
         pad->pos[i] = 0x8F;
     }
@@ -357,6 +1421,7 @@ void wirepad_pad_to_x8(wirepad_t* pad) {
 
 void wirepad_pad_to_x8_00(wirepad_t* pad) {
     int padding = -(pad->pos - pad->base) & 0x07;
+    if (wirepad_extent(pad, padding) != 0) return;
     for (int i = 0; i < padding; i++) {
         pad->pos[i] = 0x00;
     }
@@ -370,6 +1435,7 @@ void wirepad_event_name(wirepad_t* pad, char* event_name) {
         printf("event_name large encoding?");
         abort();
     }
+    if (wirepad_extent(pad, 2+d) != 0) return;
     pad->pos[0] = 0xB9;
     pad->pos[1] = d & 0xFF;
     memcpy(pad->pos+2, event_name, d);
@@ -383,6 +1449,7 @@ void wirepad_type_prefix(wirepad_t* pad, char* type_prefix) {
         printf("type_prefix large encoding?");
         abort();
     }
+    if (wirepad_extent(pad, 2+d) != 0) return;
     pad->pos[0] = 0xB6;
     pad->pos[1] = d & 0xFF;
     memcpy(pad->pos+2, type_prefix, d);
@@ -395,13 +1462,14 @@ const uint32_t QC_HD_METADATA = 0x40000000;
 void wirepad_qc_start(wirepad_t* pad, int metadata) {
     uint32_t header = QC_HD_WORKING | (metadata==0 ? 0 : QC_HD_METADATA);
     if (wire_trace) printf("wirepad_qc_start pos=%p meta=%d nest=%d header=0x%x\n", pad->pos, metadata, pad->nest, header);
-    wirepad_extent(pad, 9);
+    if (wirepad_extent(pad, 4) != 0) return;
     memcpy(pad->pos, &header, sizeof(header));
     pad->nest_enter_pos[pad->nest++] = pad->pos;
     pad->pos = pad->pos + 4;
 }
 
 void wirepad_qc_finish(wirepad_t* pad) {
+    if (pad->overflow) return;
     pad->nest--;
     unsigned char* entered = pad->nest_enter_pos[pad->nest];
     int len = pad->pos - entered - 4;
@@ -417,7 +1485,7 @@ void wirepad_qc_finish(wirepad_t* pad) {
 
 void wirepad_nest_enter(wirepad_t* pad) {
     if (wire_trace) printf("wirepad_nest_start pos=%p nest=%d\n", pad->pos, pad->nest);
-    wirepad_extent(pad, 5);
+    if (wirepad_extent(pad, 5) != 0) return;
     uint32_t header = 0;
     pad->pos[0] = 0x82;
     memcpy(pad->pos+1, &header, sizeof(header));
@@ -426,6 +1494,7 @@ void wirepad_nest_enter(wirepad_t* pad) {
 }
 
 void wirepad_nest_exit(wirepad_t* pad) {
+    if (pad->overflow) return;
     pad->nest--;
     unsigned char* entered = pad->nest_enter_pos[pad->nest];
     int len = pad->pos - entered - 4;
@@ -17,6 +17,8 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
 
 // this library implements the "BinaryWire" self-describing wire protocol
 // used for chronicle-queue metadata messages.
@@ -44,13 +46,306 @@ typedef struct wirecallbacks {
 
 void wire_parse(unsigned char* base, int lim, wirecallbacks_t* cbs);
 
+// streaming decoder - a cursor over one message, yielding one value per call with the
+// key it belongs to. Covers the BinaryWire codes Java writes apart from anchors and
+// aliases, which are errors. Nothing is allocated: names and text point into the
+// buffer, and small-coded names and text (under 32 bytes) are Latin-1 rather than
+// UTF-8. Nested marshallables and sequences open with WK_NEST_BEGIN and close with
+// WK_NEST_END. Sequence items have no key.
+typedef enum {
+    WK_END, WK_ERROR,
+    WK_NULL, WK_BOOL, WK_INT, WK_FLOAT, WK_TEXT, WK_BYTES, WK_UUID, WK_I64_ARRAY,
+    WK_TIME, WK_DATE, WK_DATETIME, WK_ZONED_DATETIME, WK_TYPE_LITERAL,
+    WK_NEST_BEGIN, WK_NEST_END, WK_EVENT_OBJECT
+} wirekind_t;
+
+typedef struct {
+    wirekind_t     kind;
+    int            depth; // nesting depth, 0 at the top level
+    char*          name; // field or event name, NULL for numbered fields and sequence items
+    int            name_sz;
+    int64_t        field_number; // -1 unless a numbered field
+    int            event; // name is an event name
+    char*          type; // type prefix, NULL if none
+    int            type_sz;
+    unsigned char* at; // encoded value, after its control code
+    union {
+        int64_t    i64; // WK_INT, WK_BOOL
+        double     f64; // WK_FLOAT
+        struct { char* text; int sz; } text; // WK_TEXT, dates and times, WK_TYPE_LITERAL
+        struct { unsigned char* data; int sz; } bytes; // WK_BYTES, WK_UUID, WK_NEST_BEGIN extent
+        struct { unsigned char* values; uint64_t capacity; uint64_t used; } arr; // WK_I64_ARRAY
+    } v;
+} wireitem_t;
+
+#define WIRE_MAX_DEPTH 64
+
+typedef struct {
+    unsigned char* p;
+    unsigned char* end;
+    int            depth;
+    int            error;
+    unsigned char* ends[WIRE_MAX_DEPTH];
+} wirecursor_t;
+
+void        wirecursor_init(wirecursor_t* c, unsigned char* base, int lim);
+wirekind_t  wirecursor_next(wirecursor_t* c, wireitem_t* item);
+// after WK_NEST_BEGIN, move past the nested block without visiting it
+void        wirecursor_skip(wirecursor_t* c);
+
+// a stop-bit encoded value at p, returning bytes read or -1 if it runs past end
+int         wire_read_stopbit(unsigned char* p, unsigned char* end, int64_t* v);
+
+// I64_ARRAY values, such as index pages, as exposed by WK_I64_ARRAY and
+// ptr_uint64arr. wire_i64_used counts entries up to the last non-zero one, and
+// wire_i64_upper_bound counts entries <= key among n ascending values, so the
+// entry at or before a position is at wire_i64_upper_bound(...) - 1. wire_i64_array
+// finds the values of the first I64_ARRAY in a message, NULL if it has none.
+unsigned char* wire_i64_array(unsigned char* base, int lim, uint64_t* capacity);
+uint64_t    wire_i64_used(unsigned char* values, uint64_t capacity);
+uint64_t    wire_i64_upper_bound(unsigned char* values, uint64_t n, uint64_t key);
+
+// schema decoders - declare the fields of interest as an X-macro list and decode
+// straight into a struct, in place of callbacks that compare field names. Names are
+// matched by a dispatch generated from the list, comparing the size and first 8 bytes
+// of each key as integers, after trying the field declared next, so messages written
+// in declaration order match each key in one compare. Only values of a code the field
+// type takes are decoded. At most 64 fields.
+//
+//   #define ROLL_FIELDS(X, s)  X(s, length, "length", WF_INT64)  X(s, format, "format", WF_TEXT)
+//   WIRE_SCHEMA(roll, ROLL_FIELDS)
+//
+// declares struct roll_t { present; length; format }, its schema roll_schema, and
+// enum values roll_length, roll_format for WIRE_HAS(obj, roll, length). Keys match
+// at any nesting depth, though nested blocks with no name of a field size are skipped
+// unread, and an event name is a key for the value that follows it.
+typedef enum {WF_INT64, WF_FLOAT64, WF_TEXT, WF_PTR} wirefieldtype_t;
+
+typedef struct {
+    char*           text; // within the decoded buffer, not terminated
+    int             sz;
+} wiretext_t;
+
+typedef struct {
+    const char*     name;
+    int             name_sz;
+    wirefieldtype_t type;
+    size_t          offset;
+    uint64_t        key; // WIRE_KEY8 of name
+} wirefield_t;
+
+typedef struct {
+    const char*          name;
+    const wirefield_t*   fields; // at most 64
+    int                  nfields;
+    int                  (*dispatch)(const char* name, int sz, uint64_t key); // field or -1
+    uint64_t             sizes; // WIRE_SIZE_BIT of each name size
+} wireschema_t;
+
+#define WIRE_CTYPE_WF_INT64   int64_t
+#define WIRE_CTYPE_WF_FLOAT64 double
+#define WIRE_CTYPE_WF_TEXT    wiretext_t
+#define WIRE_CTYPE_WF_PTR     unsigned char* // address of the value, for in-place update
+
+// a key is the first 8 bytes of a name, little endian and zero filled, as the wire
+// holds it, so names up to 8 bytes match in one compare
+#define WIRE_KEY_BYTE(name, i) \
+    (sizeof(name) > (i)+1 ? (uint64_t)(uint8_t)(name)[sizeof(name) > (i)+1 ? (i) : 0] << (8*(i)) : 0)
+#define WIRE_KEY8(name) (WIRE_KEY_BYTE(name, 0) | WIRE_KEY_BYTE(name, 1) | WIRE_KEY_BYTE(name, 2) | \
+    WIRE_KEY_BYTE(name, 3) | WIRE_KEY_BYTE(name, 4) | WIRE_KEY_BYTE(name, 5) | WIRE_KEY_BYTE(name, 6) | \
+    WIRE_KEY_BYTE(name, 7))
+#define WIRE_SIZE_BIT(sz) (1ULL << ((sz) < 63 ? (sz) : 63))
+
+#define WIRE_SCHEMA_ENUM(s, member, name, type)   s##_##member,
+#define WIRE_SCHEMA_MEMBER(s, member, name, type) WIRE_CTYPE_##type member;
+#define WIRE_SCHEMA_FIELD(s, member, name, type)  {name, sizeof(name)-1, type, offsetof(s##_t, member), WIRE_KEY8(name)},
+
+#define WIRE_SCHEMA_MATCH(s, member, name, type) \
+    if (sz == (int)sizeof(name)-1 && key == WIRE_KEY8(name) && \
+        (sizeof(name) <= 9 || memcmp(n + 8, (name) + (sizeof(name) > 9 ? 8 : 0), sizeof(name)-9) == 0)) \
+        return s##_##member;
+#define WIRE_SCHEMA_SIZE(s, member, name, type) | WIRE_SIZE_BIT(sizeof(name)-1)
+
+// the field table, its dispatch and the schema, for a list declared by MATCH and SIZE
+#define WIRE_SCHEMA_DECLARE(s, FIELDS, FIELD, MATCH, SIZE) \
+    static const wirefield_t s##_fields[] = { FIELDS(FIELD, s) }; \
+    _Static_assert(sizeof(s##_fields)/sizeof(wirefield_t) <= 64, "schema " #s " has more than 64 fields"); \
+    static int s##_dispatch(const char* n, int sz, uint64_t key) { FIELDS(MATCH, s) return -1; } \
+    static wireschema_t s##_schema = \
+        { #s, s##_fields, sizeof(s##_fields)/sizeof(wirefield_t), &s##_dispatch, 0 FIELDS(SIZE, s) };
+
+#define WIRE_SCHEMA(s, FIELDS) \
+    enum { FIELDS(WIRE_SCHEMA_ENUM, s) }; \
+    typedef struct { uint64_t present; FIELDS(WIRE_SCHEMA_MEMBER, s) } s##_t; \
+    WIRE_SCHEMA_DECLARE(s, FIELDS, WIRE_SCHEMA_FIELD, WIRE_SCHEMA_MATCH, WIRE_SCHEMA_SIZE)
+
+#define WIRE_HAS(obj, s, member) (((obj).present >> s##_##member) & 1)
+
+// decode one message into obj, a struct declared by WIRE_SCHEMA, setting the present
+// bit of each field found. Earlier values are kept, so one struct can gather fields
+// across several messages. Returns 0, or -1 at a control code that cannot be skipped
+// (fields before it are decoded).
+int wire_schema_decode(wireschema_t* schema, unsigned char* base, int lim, void* obj);
+
+// fixed layouts - an encoder and decoder pair generated from a field list that also
+// carries a capacity for text fields (ignored otherwise). Every field is written at
+// the same offset in every message, so the field names, control codes and padding
+// are precomputed in a template: encoding is one memcpy of the template and a store
+// per value. The encoding is ordinary BinaryWire fields (INT64, FLOAT64, and text
+// followed by PADDING up to its capacity), readable by wire_parse, the cursor and
+// Java Marshallables.
+//
+//   #define QUOTE_FIELDS(X, s)  X(s, bid, "bid", WF_FLOAT64, 0)  X(s, sym, "sym", WF_TEXT, 8)
+//   WIRE_LAYOUT(quote, QUOTE_FIELDS)
+//
+// declares quote_t and quote_schema as WIRE_SCHEMA would, the encoded image struct
+// quote_wire_t and:
+//   int quote_encode(unsigned char* buf, const quote_t* obj)
+//     writes sizeof(quote_wire_t) bytes, all fields whatever obj->present says, and
+//     returns that size, or -1 if a text is over its capacity
+//   int quote_decode(unsigned char* base, int lim, quote_t* obj)
+//     loads values at fixed offsets from a message in this layout, otherwise falls
+//     back to wire_schema_decode
+// Names must be under 31 bytes and text capacities under 128. Values are unaligned.
+#define WIRE_LAYOUT_ENUM(s, member, name, type, cap)   WIRE_SCHEMA_ENUM(s, member, name, type)
+#define WIRE_LAYOUT_MEMBER(s, member, name, type, cap) WIRE_SCHEMA_MEMBER(s, member, name, type)
+#define WIRE_LAYOUT_FIELD(s, member, name, type, cap)  WIRE_SCHEMA_FIELD(s, member, name, type)
+#define WIRE_LAYOUT_DISPATCH(s, member, name, type, cap) WIRE_SCHEMA_MATCH(s, member, name, type)
+#define WIRE_LAYOUT_SIZE(s, member, name, type, cap)   WIRE_SCHEMA_SIZE(s, member, name, type)
+#define WIRE_LAYOUT_CHECK(s, member, name, type, cap) \
+    _Static_assert(sizeof(name)-1 < 0x1F && (cap) < 0x80, #s "." #member " name or capacity too long for a fixed layout");
+
+// each field is its name as a small field code, then a value control code and the value
+#define WIRE_LAYOUT_IMAGE(s, member, name, type, cap) \
+    uint8_t member##_field; char member##_name[sizeof(name)-1]; uint8_t member##_code; WIRE_IMAGE_##type(member, cap)
+#define WIRE_IMAGE_WF_INT64(member, cap)   int64_t member;
+#define WIRE_IMAGE_WF_FLOAT64(member, cap) double member;
+#define WIRE_IMAGE_WF_TEXT(member, cap)    uint8_t member##_len; char member[cap];
+
+#define WIRE_LAYOUT_INIT(s, member, name, type, cap) \
+    .member##_field = 0xC0 + sizeof(name)-1, .member##_name = name, WIRE_INIT_##type(member, cap)
+#define WIRE_INIT_WF_INT64(member, cap)   .member##_code = 0xA7,
+#define WIRE_INIT_WF_FLOAT64(member, cap) .member##_code = 0x91,
+#define WIRE_INIT_WF_TEXT(member, cap)    .member##_code = 0xB8, .member = { [0 ... (cap)-1] = (char)0x8F },
+
+#define WIRE_LAYOUT_STORE(s, member, name, type, cap) WIRE_STORE_##type(member, cap)
+#define WIRE_STORE_WF_INT64(member, cap)   w->member = obj->member;
+#define WIRE_STORE_WF_FLOAT64(member, cap) w->member = obj->member;
+#define WIRE_STORE_WF_TEXT(member, cap) \
+    if (obj->member.sz < 0 || obj->member.sz > (cap)) return -1; \
+    w->member##_len = obj->member.sz; \
+    if (obj->member.sz > 0) memcpy(w->member, obj->member.text, obj->member.sz);
+
+// the name and control code bytes of a field are contiguous, so one compare each
+#define WIRE_LAYOUT_MATCH(s, member, name, type, cap) \
+    && memcmp(&w->member##_field, &s##_wire_template.member##_field, sizeof(name)+1) == 0 WIRE_MATCH_##type(member, cap)
+#define WIRE_MATCH_WF_INT64(member, cap)
+#define WIRE_MATCH_WF_FLOAT64(member, cap)
+#define WIRE_MATCH_WF_TEXT(member, cap)    && w->member##_len <= (cap)
+
+#define WIRE_LAYOUT_LOAD(s, member, name, type, cap) WIRE_LOAD_##type(member, cap) obj->present |= 1ULL << s##_##member;
+#define WIRE_LOAD_WF_INT64(member, cap)   obj->member = w->member;
+#define WIRE_LOAD_WF_FLOAT64(member, cap) obj->member = w->member;
+#define WIRE_LOAD_WF_TEXT(member, cap)    obj->member.text = w->member; obj->member.sz = w->member##_len;
+
+#define WIRE_LAYOUT(s, FIELDS) \
+    FIELDS(WIRE_LAYOUT_CHECK, s) \
+    enum { FIELDS(WIRE_LAYOUT_ENUM, s) }; \
+    typedef struct { uint64_t present; FIELDS(WIRE_LAYOUT_MEMBER, s) } s##_t; \
+    WIRE_SCHEMA_DECLARE(s, FIELDS, WIRE_LAYOUT_FIELD, WIRE_LAYOUT_DISPATCH, WIRE_LAYOUT_SIZE) \
+    typedef struct __attribute__((packed)) { FIELDS(WIRE_LAYOUT_IMAGE, s) } s##_wire_t; \
+    static const s##_wire_t s##_wire_template = { FIELDS(WIRE_LAYOUT_INIT, s) }; \
+    static inline int s##_encode(unsigned char* buf, const s##_t* obj) { \
+        memcpy(buf, &s##_wire_template, sizeof(s##_wire_t)); \
+        s##_wire_t* w = (s##_wire_t*)buf; \
+        FIELDS(WIRE_LAYOUT_STORE, s) \
+        return sizeof(s##_wire_t); \
+    } \
+    static inline int s##_decode(unsigned char* base, int lim, s##_t* obj) { \
+        s##_wire_t* w = (s##_wire_t*)base; \
+        if (lim == sizeof(s##_wire_t) FIELDS(WIRE_LAYOUT_MATCH, s)) { \
+            FIELDS(WIRE_LAYOUT_LOAD, s) \
+            return 0; \
+        } \
+        return wire_schema_decode(&s##_schema, base, lim, obj); \
+    }
+
+// columnar batches - decode a run of messages straight into one typed array per schema
+// field, for building tables (e.g. kdb) or vectorised aggregation with no per-row
+// objects. WF_INT64 columns hold int64_t, WF_FLOAT64 double and WF_TEXT int32_t
+// symbol ids, interned for the life of the batch, up to 16M symbols and 2GB of text.
+// WF_PTR fields are not collected.
+// A field missing from a message is null: INT64_MIN, NaN or symbol 0 ("").
+//
+// To feed a batch from a tailer, use wire_parse_view as the queue decoder (with no
+// parsefree) and wirebatch_dispatch as the dispatcher, with the batch as its context.
+// Each full batch is passed to flush and then cleared.
+typedef struct wirebatch wirebatch_t;
+typedef void (*wirebatch_flush_f)(wirebatch_t*, void* ctx);
+
+wirebatch_t* wirebatch_init(wireschema_t* schema, int rows, wirebatch_flush_f flush, void* flush_ctx);
+int          wirebatch_add(wirebatch_t* batch, unsigned char* base, int lim, uint64_t index);
+void         wirebatch_flush(wirebatch_t* batch);
+void         wirebatch_clear(wirebatch_t* batch);
+void         wirebatch_free(wirebatch_t* batch);
+
+int          wirebatch_rows(wirebatch_t* batch);
+uint64_t*    wirebatch_index(wirebatch_t* batch);
+void*        wirebatch_column(wirebatch_t* batch, int field);
+int          wirebatch_symbols(wirebatch_t* batch);
+const char*  wirebatch_symbol(wirebatch_t* batch, int32_t id, int* sz);
+
+// cparse_f returning a view of the message bytes, valid until the dispatcher returns
+// on the same thread (so not for pools), and the matching cdispatch_f
+typedef struct {
+    unsigned char* base;
+    int            lim;
+} wireview_t;
+
+void*        wire_parse_view(unsigned char* base, int lim);
+int          wirebatch_dispatch(void* batch, uint64_t index, void* view);
+
+// event routers - dispatch messages written by a Java MethodWriter, an EVENT_NAME
+// followed by the call's argument, to a handler registered for that name. Names are
+// placed in a collision-free (perfect) hash table as handlers are added, so routing
+// a message costs one hash of its event name, one probe and one compare of the name
+// found there. Nothing is allocated per message.
+//
+// The handler gets the argument as item, with the cursor positioned after it: inside
+// the nested fields for a marshallable argument (WK_NEST_BEGIN). It may read as much
+// as it likes; the router then moves past the argument to any further events in the
+// message. A non-zero return stops routing and is returned to the caller.
+// Events with no handler, and leading values that are not events, go to the
+// fallback if one is set and are otherwise counted and skipped.
+//
+// Handlers are added during setup: wirerouter_add must not race routing, and returns
+// -1 if out of memory or if the name's hash collides with another's. To feed a
+// router from a tailer, use wire_parse_view as the queue decoder and
+// wirerouter_dispatch as the dispatcher, with the router as its context.
+typedef struct wirerouter wirerouter_t;
+typedef int (*wireroute_f)(void* ctx, uint64_t index, wireitem_t* item, wirecursor_t* c);
+
+wirerouter_t* wirerouter_init();
+int          wirerouter_add(wirerouter_t* router, const char* event, wireroute_f handler, void* ctx);
+void         wirerouter_set_fallback(wirerouter_t* router, wireroute_f handler, void* ctx);
+int          wirerouter_route(wirerouter_t* router, unsigned char* base, int lim, uint64_t index);
+uint64_t     wirerouter_unrouted(wirerouter_t* router);
+void         wirerouter_free(wirerouter_t* router);
+int          wirerouter_dispatch(void* router, uint64_t index, void* view);
+
 // wire writer
 // create a wirepad using wirepad_init, then write headers and fields
 // print bytes wirepad_dump, write out with wirepad_write or run parse_wire
 // over content with wirepad_parse
+//
+// wirepad_wrap writes into fixed memory, for example straight into a queue
+// entry from chronicle_reserve. A wrapped pad never reallocates; writes that
+// do not fit are dropped and wirepad_overflow reports true until cleared
 typedef struct wirepad wirepad_t;
 
 wirepad_t*  wirepad_init(int initial_sz);
+wirepad_t*  wirepad_wrap(wirepad_t* pad, unsigned char* buf, int sz);
+int         wirepad_overflow(wirepad_t* pad);
 void        wirepad_clear(wirepad_t* pad);
 void        wirepad_dump(wirepad_t* pad);
 char*       wirepad_hexformat(wirepad_t* pad);
@@ -63,6 +358,7 @@ void        wirepad_type_prefix(wirepad_t* pad, char* type_prefix);
 
 void        wirepad_text(wirepad_t* pad, char* text);
 void        wirepad_uint64_aligned(wirepad_t* pad, uint64_t v);
+void        wirepad_varint(wirepad_t* pad, uint64_t v);
 
 void        wirepad_qc_start(wirepad_t* pad, int metadata);
 void        wirepad_qc_finish(wirepad_t* pad);